@@ -0,0 +1,69 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <string>
+
+#include "mland/common.h"
+
+namespace mland::bench {
+
+// Runs a benchmark once per kernel path and checks that every path computes what the first one
+// did. Results are compared in the order the path reports them
+template <class Result>
+class Harness {
+public:
+	// The first argument overrides the iteration count
+	Harness(const int argc, char** argv, const uint32_t iterations) :
+	iters(argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : iterations) {}
+
+	constexpr uint32_t iterations() const { return iters; }
+
+	// Calls run for every name use switches to, the CPU lacks the others
+	template <class Use, class Run>
+	void forEachPath(const std::initializer_list<cstr> names, Use&& use, Run&& run) {
+		for (const auto* name : names) {
+			if (!use(name)) {
+				std::printf("%-8s not supported by this CPU\n", name);
+				continue;
+			}
+			if (first == nullptr)
+				first = name;
+			path = name;
+			next = 0;
+			run(name);
+		}
+	}
+
+	// Seconds one iteration of body takes
+	template <class Body>
+	double time(Body&& body) const {
+		const auto start = std::chrono::steady_clock::now();
+		for (uint32_t i = 0; i < iters; i++)
+			body();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / iters;
+	}
+
+	void check(const Result& result, const std::string& label) {
+		if (next >= expected.size()) {
+			expected.push_back(result);
+		} else if (!(expected[next] == result)) {
+			std::printf("%-8s %s differs from %s\n", path, label.c_str(), first);
+			mismatch = true;
+		}
+		next++;
+	}
+
+	int exitCode() const { return mismatch ? EXIT_FAILURE : EXIT_SUCCESS; }
+
+private:
+	const uint32_t iters;
+	cstr first{nullptr};
+	cstr path{nullptr};
+	vec<Result> expected{};
+	size_t next{0};
+	bool mismatch{false};
+};
+
+}
@@ -0,0 +1,92 @@
+#include <array>
+#include <cstdio>
+#include <random>
+#include <string>
+
+#include "bench.h"
+#include "mland/region.h"
+
+using namespace mland;
+
+namespace {
+struct Workload {
+	cstr name;
+	BandedRegion a;
+	BandedRegion b;
+};
+
+// count boxes of up to maxSize somewhere on a 4K output
+BandedRegion randomRegion(std::mt19937& rng, const uint32_t count, const int32_t maxSize) {
+	std::uniform_int_distribution<int32_t> x(0, 3840 - 1);
+	std::uniform_int_distribution<int32_t> y(0, 2160 - 1);
+	std::uniform_int_distribution<int32_t> size(1, maxSize);
+	BandedRegion ret;
+	for (uint32_t i = 0; i < count; i++)
+		ret.unite(Box::fromSize(x(rng), y(rng), size(rng), size(rng)));
+	return ret;
+}
+
+// A terminal redrawing every other line, long thin bands against a few windows
+BandedRegion lines(const int32_t width, const int32_t height, const int32_t lineHeight) {
+	BandedRegion ret;
+	for (int32_t y = 0; y < height; y += 2 * lineHeight)
+		ret.unite(Box::fromSize(0, y, width, lineHeight));
+	return ret;
+}
+
+vec<Workload> workloads() {
+	std::mt19937 rng(0x6d6c616e);
+	vec<Workload> ret;
+	ret.push_back({"windows", randomRegion(rng, 16, 1200), randomRegion(rng, 16, 1200)});
+	ret.push_back({"damage", randomRegion(rng, 256, 64), randomRegion(rng, 256, 64)});
+	ret.push_back({"lines", lines(3840, 2160, 16), randomRegion(rng, 16, 1200)});
+	return ret;
+}
+
+enum class Op {
+	eUnion,
+	eIntersect,
+	eSubtract
+};
+
+void apply(BandedRegion& region, const BandedRegion& other, const Op op) {
+	switch (op) {
+	case Op::eUnion:
+		region.unite(other);
+		break;
+	case Op::eIntersect:
+		region.intersect(other);
+		break;
+	case Op::eSubtract:
+		region.subtract(other);
+		break;
+	}
+}
+}
+
+// How long union, intersect and subtract take on window sized, damage sized and line shaped regions
+int main(const int argc, char** argv) {
+	bench::Harness<BandedRegion> harness(argc, argv, 20000);
+	constexpr std::array ops{
+		std::pair{Op::eUnion, "union"},
+		std::pair{Op::eIntersect, "intersect"},
+		std::pair{Op::eSubtract, "subtract"}
+	};
+	const auto loads = workloads();
+	std::printf("%-8s %-10s %-10s %8s %12s\n", "kernels", "workload", "op", "boxes", "ns/op");
+	harness.forEachPath({"scalar", "sse2", "avx2"}, BandedRegion::useKernels, [&](const cstr kernels) {
+		for (const auto& load : loads) {
+			for (const auto& [op, opName] : ops) {
+				BandedRegion region;
+				// The copy keeps its capacity, so the loop times the operation and not the allocator
+				const auto seconds = harness.time([&] {
+					region = load.a;
+					apply(region, load.b, op);
+				});
+				std::printf("%-8s %-10s %-10s %8u %12.1f\n", kernels, load.name, opName, region.size(), seconds * 1e9);
+				harness.check(region, std::string(load.name) + " " + opName);
+			}
+		}
+	});
+	return harness.exitCode();
+}
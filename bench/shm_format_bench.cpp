@@ -0,0 +1,59 @@
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+
+#include "bench.h"
+#include "mland/shm_format.h"
+
+using namespace mland;
+
+namespace {
+constexpr uint32_t WIDTH = 1920;
+constexpr uint32_t HEIGHT = 1080;
+// What staging turns every texel into when the device can't sample the format
+constexpr uint32_t DST_BYTES = 4;
+
+// wl_shm uses fourcc codes except for the two formats every compositor has
+std::string formatName(const uint32_t shm) {
+	if (shm == 0)
+		return "AR24";
+	if (shm == 1)
+		return "XR24";
+	return {static_cast<char>(shm & 0xFF), static_cast<char>(shm >> 8 & 0xFF), static_cast<char>(shm >> 16 & 0xFF),
+		static_cast<char>(shm >> 24 & 0xFF)};
+}
+}
+
+// Throughput of staging a full HD frame of each wl_shm format row by row, like VSurfaceDevice::upload.
+// Formats devices sample as they are only get copied
+int main(const int argc, char** argv) {
+	bench::Harness<vec<uint8_t>> harness(argc, argv, 50);
+	std::mt19937 rng(0x6d6c616e);
+	vec<uint8_t> src(static_cast<size_t>(WIDTH) * HEIGHT * 4);
+	for (auto& byte : src)
+		byte = static_cast<uint8_t>(rng());
+	vec<uint8_t> dst(static_cast<size_t>(WIDTH) * HEIGHT * DST_BYTES);
+	std::printf("%-8s %-6s %-10s %12s %12s\n", "kernels", "format", "to", "ms/frame", "GB/s");
+	harness.forEachPath({"scalar", "ssse3", "avx2"}, ShmFormat::useKernels, [&](const cstr kernels) {
+		for (const auto& info : ShmFormat::all()) {
+			const auto convert = ShmFormat::converter(info);
+			const auto srcStride = static_cast<size_t>(WIDTH) * info.bytes;
+			const auto dstStride = static_cast<size_t>(WIDTH) * (convert != nullptr ? DST_BYTES : info.bytes);
+			const auto seconds = harness.time([&] {
+				for (uint32_t y = 0; y < HEIGHT; y++) {
+					if (convert != nullptr)
+						convert(src.data() + y * srcStride, dst.data() + y * dstStride, WIDTH);
+					else
+						std::memcpy(dst.data() + y * dstStride, src.data() + y * srcStride, srcStride);
+				}
+			});
+			const auto frameBytes = static_cast<double>(srcStride + dstStride) * HEIGHT;
+			const auto name = formatName(info.shm);
+			std::printf("%-8s %-6s %-10s %12.3f %12.2f\n", kernels, name.c_str(),
+				convert != nullptr ? "B8G8R8A8" : "copy", 1000.0 * seconds, frameBytes / seconds / 1e9);
+			harness.check(vec<uint8_t>(dst.begin(), dst.begin() + static_cast<ptrdiff_t>(dstStride * HEIGHT)), name);
+		}
+	});
+	return harness.exitCode();
+}
@@ -4,7 +4,12 @@
 #include "mland/vinstance.h"
 #include "mland/vdisplay.h"
 #include "mland/wayland_server.h"
+#include "mland/vdmabuf.h"
 #include "mland/interfaces/compositor.h"
+#include "mland/interfaces/linux_dmabuf.h"
+#include "mland/interfaces/presentation.h"
+#include "mland/interfaces/subcompositor.h"
+#include "mland/interfaces/viewporter.h"
 using namespace mland;
 
 namespace {
@@ -12,6 +17,21 @@ std::atomic_flag stopped = ATOMIC_FLAG_INIT;
 vec<s_ptr<VDisplay>> displays{};
 u_ptr<WLServer> server{};
 u_ptr<VInstance> instance;
+
+// What zwp_linux_dmabuf_v1 advertises, one tranche per device that can import
+vec<interfaces::LinuxDmabuf::Tranche> dmabufTranches() {
+	vec<interfaces::LinuxDmabuf::Tranche> tranches;
+	for (const auto& [id, device] : instance->getDevices()) {
+		const auto* importer = device->good ? device->getDmabuf() : nullptr;
+		if (importer == nullptr || importer->getFormats().empty())
+			continue;
+		auto& tranche = tranches.emplace_back();
+		tranche.device = importer->getDevice();
+		for (const auto& format : importer->getFormats())
+			tranche.formats.push_back({format.fourcc, format.modifier, format.planes});
+	}
+	return tranches;
+}
 }
 
 void Controller::create(u_ptr<VInstance>&& instance_) {
@@ -67,8 +87,16 @@ void Controller::run() {
 	signal(SIGTERM, signalHandler);
 
 	interfaces::Compositor compositor(server->getDisplay());
+	interfaces::Subcompositor subcompositor(server->getDisplay());
+	interfaces::Viewporter viewporter(server->getDisplay());
+	interfaces::Presentation presentation(server->getDisplay());
 
 	refreshMonitors();
+	// Devices showing up later are not advertised
+	u_ptr<interfaces::LinuxDmabuf> dmabuf{};
+	if (auto tranches = dmabufTranches(); !tranches.empty())
+		dmabuf = u_ptr<interfaces::LinuxDmabuf>(new interfaces::LinuxDmabuf(server->getDisplay(),
+			std::move(tranches)));
 	VDisplay::setMaxTimeBetweenFrames(std::chrono::milliseconds(50));
 	MDEBUG << "Starting server" << endl;
 	while (!server->stopped_.test()) {
@@ -10,6 +10,11 @@ public:
 static NullBuffer nullBuffer{};
 
 std::atomic<uint32_t> globals::bufferCount = 3;
+std::atomic<uint64_t> globals::textureCacheBudget = 256 * 1024 * 1024;
+std::atomic<uint64_t> globals::shmCopiers = 0;
+std::atomic<int> globals::shmCopiedFd = -1;
+std::atomic<int> globals::presentedFd = -1;
+std::string globals::wallpaperPath{};
 
 std::atomic_flag _details::msgMutex = ATOMIC_FLAG_INIT;
 
@@ -1,14 +1,477 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <drm_fourcc.h>
+#include <iterator>
+#include <ranges>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
 #include "mland/interfaces/compositor.h"
+#include "mland/interfaces/subcompositor.h"
+#include "mland/mstate.h"
+#include "mland/controller.h"
+#include "mland/shm_format.h"
 using namespace mland;
 using namespace mland::interfaces;
 
+namespace {
+constexpr int FRAME_INTERVAL_MS = 16;
+// Displays answer frame callbacks of the surfaces they show, the timer takes over after this
+constexpr auto UNSHOWN_AFTER = std::chrono::milliseconds(100);
+constexpr auto THROTTLED_INTERVAL = std::chrono::seconds(1);
+constexpr auto STATS_INTERVAL = std::chrono::seconds(10);
+}
+
 Compositor::Compositor(wl_display* wlDisplay) :
-WLInterface(wlDisplay, &WLCompositorImplementation, &wl_compositor_interface, 6) {}
+WLInterface(wlDisplay, &WLCompositorImplementation, &wl_compositor_interface, 6) {
+	wl_list_init(&surfaceList);
+	wl_list_init(&regionList);
+	wl_list_init(&subsurfaceList);
+	MDEBUG << "Region kernels: " << BandedRegion::kernels() << endl;
+	surfaces.reserve(64);
+	states.reserve(128);
+	loop = wl_display_get_event_loop(wlDisplay);
+	statsLogged = std::chrono::steady_clock::now();
+	timer = wl_event_loop_add_timer(loop, frameTimer, this);
+	wl_event_source_timer_update(timer, FRAME_INTERVAL_MS);
+	// Without it buffers still go back, just on the next commit or frame timer
+	shmCopied = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (shmCopied >= 0) {
+		shmCopiedSource = wl_event_loop_add_fd(loop, shmCopied, WL_EVENT_READABLE, onShmCopied, this);
+		globals::shmCopiedFd.store(shmCopied);
+	} else {
+		MWARN << "Failed to create an eventfd, wl_shm buffers and dmabufs are released late" << endl;
+	}
+	presentTimer = wl_event_loop_add_timer(loop, firePresented, this);
+	presentedFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (presentedFd >= 0) {
+		presentedSource = wl_event_loop_add_fd(loop, presentedFd, WL_EVENT_READABLE, onPresented, this);
+		globals::presentedFd.store(presentedFd);
+	} else {
+		MWARN << "Failed to create an eventfd, frame callbacks fall back to the timer" << endl;
+	}
+}
+
+Compositor::~Compositor() {
+	// Client resources outlive us, so everything we handed out goes now. Subsurfaces first, they
+	// point at their surfaces and our state pool
+	Subsurface* subsurface;
+	Subsurface* tmpSubsurface;
+	wl_list_for_each_safe(subsurface, tmpSubsurface, &subsurfaceList, link)
+		wl_resource_destroy(subsurface->resource);
+	Surface* surface;
+	Surface* tmpSurface;
+	wl_list_for_each_safe(surface, tmpSurface, &surfaceList, link)
+		wl_resource_destroy(surface->resource);
+	Region* region;
+	Region* tmpRegion;
+	wl_list_for_each_safe(region, tmpRegion, &regionList, link)
+		wl_resource_destroy(region->resource);
+	// Render threads are gone, nothing reads anymore
+	releaseRetired();
+	for (auto& stats : callbackStats | std::views::values)
+		wl_list_remove(&stats.destroyed.link);
+	if (timer != nullptr)
+		wl_event_source_remove(timer);
+	if (publishIdle != nullptr)
+		wl_event_source_remove(publishIdle);
+	globals::shmCopiedFd.store(-1);
+	if (shmCopiedSource != nullptr)
+		wl_event_source_remove(shmCopiedSource);
+	if (shmCopied >= 0)
+		close(shmCopied);
+	globals::presentedFd.store(-1);
+	if (presentedSource != nullptr)
+		wl_event_source_remove(presentedSource);
+	if (presentTimer != nullptr)
+		wl_event_source_remove(presentTimer);
+	if (presentedFd >= 0)
+		close(presentedFd);
+}
+
+Compositor& Compositor::from(wl_resource* resource) {
+	const auto* client = static_cast<Client*>(wl_resource_get_user_data(resource));
+	return *static_cast<Compositor*>(client->parent);
+}
 
-void Compositor::bind(wl_client* client, uint32_t version, uint32_t id) {
+void Compositor::bind(wl_client* client, const uint32_t version, const uint32_t id) {
 	MDEBUG << "Binding compositor" << endl;
+	createClient(client, version, id);
 }
 
 void Compositor::destroy(wl_resource* resource) {
 	MDEBUG << "Destroying compositor" << endl;
-}
\ No newline at end of file
+}
+
+void Compositor::createSurface(wl_client* client, wl_resource* resource, const uint32_t id) {
+	auto& self = from(resource);
+	auto* surfaceResource = wl_resource_create(client, &wl_surface_interface, wl_resource_get_version(resource), id);
+	if (surfaceResource == nullptr) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	auto* surface = self.surfaces.create(&self, surfaceResource, self.states.create(), self.states.create());
+	surface->handle = self.scene.create();
+	if (self.handles.size() <= surface->handle.index())
+		self.handles.resize(surface->handle.index() + 1);
+	self.handles[surface->handle.index()] = surface;
+	wl_list_insert(&self.surfaceList, &surface->link);
+	wl_resource_set_implementation(surfaceResource, &Surface::WLSurfaceImplementation, surface, destroySurface);
+}
+
+void Compositor::createRegion(wl_client* client, wl_resource* resource, const uint32_t id) {
+	auto& self = from(resource);
+	auto* regionResource = wl_resource_create(client, &wl_region_interface, 1, id);
+	if (regionResource == nullptr) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	auto* region = self.regions.create(&self, regionResource);
+	wl_list_insert(&self.regionList, &region->link);
+	wl_resource_set_implementation(regionResource, &Region::WLRegionImplementation, region, destroyRegion);
+}
+
+void Compositor::destroySurface(wl_resource* resource) {
+	auto* surface = Surface::from(resource);
+	auto& self = *surface->compositor;
+	wl_list_remove(&surface->link);
+	// Requests on the viewport are errors from here on
+	if (surface->viewport != nullptr)
+		wl_resource_set_user_data(surface->viewport, nullptr);
+	// Subsurface objects outlive their surfaces, the children are unmapped with their parent
+	if (auto* subsurface = surface->subsurface) {
+		if (auto* parent = subsurface->parent) {
+			std::erase(parent->stack, surface);
+			std::erase(parent->pendingStack, surface);
+			self.treeChanged(*parent);
+		}
+		subsurface->surface = nullptr;
+	}
+	for (auto* child : surface->stack)
+		if (child != surface)
+			child->subsurface->parent = nullptr;
+	if (surface->treeDirty)
+		std::erase(self.dirtyTrees, surface);
+	surface->discardPresentations();
+	if (surface->contents)
+		self.retire(std::move(surface->contents));
+	self.handles[surface->handle.index()] = nullptr;
+	self.scene.destroy(surface->handle);
+	self.states.destroy(surface->pending);
+	self.states.destroy(surface->current);
+	self.surfaces.destroy(surface);
+	self.schedulePublish();
+}
+
+void Compositor::destroyRegion(wl_resource* resource) {
+	auto* region = static_cast<Region*>(wl_resource_get_user_data(resource));
+	wl_list_remove(&region->link);
+	region->compositor->regions.destroy(region);
+}
+
+int Compositor::frameTimer(void* data) {
+	auto* self = static_cast<Compositor*>(data);
+	const auto now = std::chrono::steady_clock::now();
+	if (now >= self->nextThrottled) {
+		self->nextThrottled = now + THROTTLED_INTERVAL;
+		const auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+		Surface* surface;
+		wl_list_for_each(surface, &self->surfaceList, link)
+			if (now - surface->lastPresented > UNSHOWN_AFTER)
+				if (const auto sent = surface->frameDone(static_cast<uint32_t>(msec)))
+					self->getCallbackStats(wl_resource_get_client(surface->resource)).throttled += sent;
+	}
+	if (now - self->statsLogged >= STATS_INTERVAL)
+		self->logCallbackRates(now);
+	// Picks up wakeups lost to racing copies
+	self->releaseCopied();
+	// Retries a publish that found every snapshot pinned
+	if (self->sceneDirty)
+		self->schedulePublish();
+	wl_event_source_timer_update(self->timer, FRAME_INTERVAL_MS);
+	return 0;
+}
+
+int Compositor::onPresented(const int fd, const uint32_t mask, void* data) {
+	uint64_t count;
+	[[maybe_unused]] const auto read = ::read(fd, &count, sizeof(count));
+	auto* self = static_cast<Compositor*>(data);
+	auto& state = globals::CompositorState;
+	{
+		std::lock_guard lock(state.presentedMutex);
+		std::ranges::move(state.presented, std::back_inserter(self->presented));
+		state.presented.clear();
+	}
+	return firePresented(data);
+}
+
+int Compositor::firePresented(void* data) {
+	auto* self = static_cast<Compositor*>(data);
+	const auto now = std::chrono::steady_clock::now();
+	auto next = std::chrono::steady_clock::time_point::max();
+	std::erase_if(self->presented, [&](const Presented& frame) {
+		if (frame.time > now) {
+			next = std::min(next, frame.time);
+			return false;
+		}
+		for (const auto& [handle, serial] : frame.surfaces) {
+			// The index may have been reused since the frame was built
+			if (handle.index() >= self->handles.size())
+				continue;
+			if (auto* surface = self->handles[handle.index()]; surface != nullptr && surface->handle == handle)
+				if (const auto sent = surface->presented(frame, serial))
+					self->getCallbackStats(wl_resource_get_client(surface->resource)).presented += sent;
+		}
+		return true;
+	});
+	if (next != std::chrono::steady_clock::time_point::max()) {
+		const auto wait = std::chrono::ceil<std::chrono::milliseconds>(next - now).count();
+		wl_event_source_timer_update(self->presentTimer, static_cast<int>(std::max<int64_t>(1, wait)));
+	}
+	return 0;
+}
+
+Compositor::CallbackStats& Compositor::getCallbackStats(wl_client* client) {
+	if (const auto it = callbackStats.find(client); it != callbackStats.end())
+		return it->second;
+	// The map is node based, the listener keeps its address
+	auto& stats = callbackStats.try_emplace(client, this, client).first->second;
+	stats.since = std::chrono::steady_clock::now();
+	stats.destroyed.notify = onClientDestroyed;
+	wl_client_add_destroy_listener(client, &stats.destroyed);
+	return stats;
+}
+
+void Compositor::onClientDestroyed(wl_listener* listener, void* data) {
+	CallbackStats* stats;
+	stats = wl_container_of(listener, stats, destroyed);
+	wl_list_remove(&listener->link);
+	const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats->since).count();
+	pid_t pid = 0;
+	wl_client_get_credentials(stats->client, &pid, nullptr, nullptr);
+	MDEBUG << "Client " << pid << " got " << stats->presented << " presented and " << stats->throttled
+		<< " throttled frame callbacks in " << seconds << "s" << endl;
+	stats->compositor->callbackStats.erase(stats->client);
+}
+
+void Compositor::logCallbackRates(const std::chrono::steady_clock::time_point now) {
+	const auto seconds = std::chrono::duration<double>(now - statsLogged).count();
+	statsLogged = now;
+	for (auto& stats : callbackStats | std::views::values) {
+		pid_t pid = 0;
+		wl_client_get_credentials(stats.client, &pid, nullptr, nullptr);
+		MDEBUG << "Client " << pid << " frame callbacks: " << (stats.presented - stats.loggedPresented) / seconds
+			<< "/s presented, " << (stats.throttled - stats.loggedThrottled) / seconds << "/s throttled" << endl;
+		stats.loggedPresented = stats.presented;
+		stats.loggedThrottled = stats.throttled;
+	}
+}
+
+void Compositor::schedulePublish() {
+	sceneDirty = true;
+	if (publishIdle == nullptr)
+		publishIdle = wl_event_loop_add_idle(loop, publishScene, this);
+}
+
+void Compositor::updateScene(Surface& surface, const uint32_t changed) {
+	const auto& state = surface.getCurrent();
+	const auto handle = surface.handle;
+	auto* shm = state.buffer != nullptr ? wl_shm_buffer_get(state.buffer) : nullptr;
+	const auto dmabuf = DmabufAttributes::get(state.buffer);
+	scene.setMapped(handle, state.buffer != nullptr);
+	if (changed & (SurfaceState::eBuffer | SurfaceState::eDamage)) {
+		scene.contentChanged(handle);
+		updateContents(surface);
+		scene.setDmabuf(handle, dmabuf);
+	}
+	if (shm != nullptr) {
+		const auto* format = ShmFormat::find(wl_shm_buffer_get_format(shm));
+		scene.setAlpha(handle, format == nullptr || format->alpha);
+	} else if (dmabuf != nullptr) {
+		// The X formats and video have no alpha
+		scene.setAlpha(handle, dmabuf->format == DRM_FORMAT_ARGB8888 || dmabuf->format == DRM_FORMAT_ABGR8888);
+	}
+	if (const auto [bufferWidth, bufferHeight] = state.bufferSize(); bufferWidth > 0 && bufferHeight > 0) {
+		const auto [width, height] = state.surfaceSize();
+		const auto [x, y, sourceWidth, sourceHeight] = state.viewportSource();
+		// Placed by flatten, subsurfaces depend on their parents
+		scene.setSize(handle, {static_cast<uint32_t>(width), static_cast<uint32_t>(height)});
+		scene.setTransform(handle, state.transform);
+		// The sampler scales the crop to the geometry, the client never renders more than it sends.
+		// The source is in the transformed buffer, the crop in the buffer as the client rendered it
+		scene.setCrop(handle, Scene::toBuffer({
+			static_cast<float>(x / bufferWidth),
+			static_cast<float>(y / bufferHeight),
+			static_cast<float>(sourceWidth / bufferWidth),
+			static_cast<float>(sourceHeight / bufferHeight)
+		}, state.transform));
+	}
+	if (changed & SurfaceState::eOpaque) {
+		// Culling only needs one rectangle, the largest one keeps most of the benefit
+		Box largest{};
+		for (const auto& box : state.opaque.boxes())
+			if (box.area() > largest.area())
+				largest = box;
+		scene.setOpaque(handle, {{largest.x1, largest.y1},
+			{static_cast<uint32_t>(largest.width()), static_cast<uint32_t>(largest.height())}});
+	}
+}
+
+void Compositor::treeChanged(Surface& surface) {
+	auto* root = &surface;
+	while (root->subsurface != nullptr) {
+		root = root->subsurface->parent;
+		if (root == nullptr)
+			return;
+	}
+	if (root->treeDirty)
+		return;
+	root->treeDirty = true;
+	dirtyTrees.push_back(root);
+}
+
+void Compositor::flatten(Surface& root) {
+	flattened.clear();
+	flattenInto(root, {0, 0});
+	scene.setTree(root.handle, flattened);
+}
+
+void Compositor::flattenInto(Surface& surface, const vk::Offset2D origin) {
+	const auto& state = *surface.current;
+	const vk::Offset2D offset{origin.x + state.dx, origin.y + state.dy};
+	scene.setOffset(surface.handle, offset);
+	// Subsurfaces only show with their parent
+	if (state.buffer == nullptr)
+		return;
+	for (auto* member : surface.stack) {
+		if (member == &surface)
+			flattened.push_back(surface.handle);
+		else
+			flattenInto(*member, {offset.x + member->subsurface->x, offset.y + member->subsurface->y});
+	}
+}
+
+void Compositor::updateContents(Surface& surface) {
+	auto& state = *surface.current;
+	auto* shm = state.buffer != nullptr ? wl_shm_buffer_get(state.buffer) : nullptr;
+	if (shm != nullptr) {
+		const Box full{0, 0, wl_shm_buffer_get_width(shm), wl_shm_buffer_get_height(shm)};
+		bufferDamage = state.bufferDamage;
+		if (!state.damage.empty()) {
+			// Not worth transforming for rotated and flipped buffers, they take the whole buffer
+			if (state.transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+				bufferDamage.reset(full);
+			} else {
+				// Through the viewport, rounded outwards so partly covered pixels are copied too
+				const auto [x, y, sourceWidth, sourceHeight] = state.viewportSource();
+				const auto [width, height] = state.surfaceSize();
+				const auto scaleX = width > 0 ? sourceWidth / width : 1.0;
+				const auto scaleY = height > 0 ? sourceHeight / height : 1.0;
+				const auto scale = static_cast<double>(state.scale);
+				const auto lower = [&](const double v, const int32_t max) {
+					return static_cast<int32_t>(std::clamp(std::floor(v * scale), 0.0, static_cast<double>(max)));
+				};
+				const auto upper = [&](const double v, const int32_t max) {
+					return static_cast<int32_t>(std::clamp(std::ceil(v * scale), 0.0, static_cast<double>(max)));
+				};
+				for (const auto& box : state.damage.boxes())
+					bufferDamage.unite({lower(x + box.x1 * scaleX, full.x2), lower(y + box.y1 * scaleY, full.y2),
+						upper(x + box.x2 * scaleX, full.x2), upper(y + box.y2 * scaleY, full.y2)});
+			}
+		}
+		auto contents = ShmContents::create(state.buffer, scene.getSerial(surface.handle), surface.contents.get(),
+			bufferDamage);
+		scene.setContents(surface.handle, contents);
+		if (surface.contents)
+			retire(std::move(surface.contents));
+		surface.contents = std::move(contents);
+	} else {
+		scene.setContents(surface.handle, nullptr);
+		if (surface.contents)
+			retire(std::move(surface.contents));
+	}
+	// Consumed, the next commit only carries what changed since
+	state.damage.clear();
+	state.bufferDamage.clear();
+	releaseRetired();
+}
+
+void Compositor::retire(s_ptr<ShmContents>&& contents) {
+	contents->retire();
+	retired.push_back(std::move(contents));
+}
+
+void Compositor::retireBuffer(wl_resource* buffer) {
+	auto dmabuf = DmabufAttributes::get(buffer);
+	if (dmabuf == nullptr) {
+		wl_buffer_send_release(buffer);
+		return;
+	}
+	dmabuf->retire();
+	// Nothing pins it after retiring, a device that never sampled it doesn't hold it up
+	if (!dmabuf->pinned()) {
+		wl_buffer_send_release(buffer);
+		return;
+	}
+	retiredDmabufs.emplace_back(buffer, std::move(dmabuf));
+}
+
+void Compositor::keepBuffer(wl_resource* buffer) {
+	const auto dmabuf = DmabufAttributes::get(buffer);
+	if (dmabuf == nullptr || !dmabuf->retired())
+		return;
+	dmabuf->unretire();
+	std::erase_if(retiredDmabufs, [&](const auto& entry) { return entry.first == buffer; });
+}
+
+void Compositor::releaseRetired() {
+	std::erase_if(retired, [](const s_ptr<ShmContents>& contents) { return contents->tryRelease(); });
+	std::erase_if(retiredDmabufs, [](const auto& entry) {
+		const auto& [buffer, dmabuf] = entry;
+		// A destroyed wl_buffer needs no release, the resource is gone with it
+		if (dmabuf->destroyed.load(std::memory_order_relaxed))
+			return true;
+		if (dmabuf->pinned())
+			return false;
+		wl_buffer_send_release(buffer);
+		return true;
+	});
+}
+
+void Compositor::releaseCopied() {
+	// The contents stay current for their damage history after the buffer went back
+	Surface* surface;
+	wl_list_for_each(surface, &surfaceList, link)
+		if (surface->contents)
+			surface->contents->tryRelease();
+	releaseRetired();
+}
+
+int Compositor::onShmCopied(const int fd, const uint32_t mask, void* data) {
+	uint64_t count;
+	[[maybe_unused]] const auto read = ::read(fd, &count, sizeof(count));
+	static_cast<Compositor*>(data)->releaseCopied();
+	return 0;
+}
+
+void Compositor::publishScene(void* data) {
+	auto* self = static_cast<Compositor*>(data);
+	// Idle sources are gone once dispatched
+	self->publishIdle = nullptr;
+	self->releaseRetired();
+	for (auto* root : self->dirtyTrees) {
+		root->treeDirty = false;
+		// Became a subsurface since, the tree it joined is queued too
+		if (root->subsurface == nullptr)
+			self->flatten(*root);
+	}
+	self->dirtyTrees.clear();
+	const auto count = self->scene.publish(globals::CompositorState.scene);
+	if (!count.has_value())
+		return;
+	globals::CompositorState.windowCount.store(count.value());
+	self->sceneDirty = false;
+	// Presenting is what answers the frame callbacks of the commit
+	Controller::requestRender();
+}
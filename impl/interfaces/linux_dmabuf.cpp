@@ -0,0 +1,347 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wayland-server-protocol.h>
+
+#include "mland/interfaces/linux_dmabuf.h"
+#include "mland/globals.h"
+
+using namespace mland;
+using namespace mland::interfaces;
+
+namespace {
+// User data of the wl_buffers we create
+struct DmabufBuffer {
+	s_ptr<DmabufAttributes> attributes;
+};
+
+uint64_t nextId = 1;
+
+void destroyBuffer(wl_client* client, wl_resource* resource) {
+	wl_resource_destroy(resource);
+}
+
+void onBufferDestroy(wl_resource* resource) {
+	auto* buffer = static_cast<DmabufBuffer*>(wl_resource_get_user_data(resource));
+	buffer->attributes->destroyed.store(true, std::memory_order_release);
+	delete buffer;
+}
+
+constexpr struct wl_buffer_interface WLBufferImplementation {
+	.destroy = destroyBuffer
+};
+
+void destroyFeedback(wl_client* client, wl_resource* resource) {
+	wl_resource_destroy(resource);
+}
+
+constexpr struct zwp_linux_dmabuf_feedback_v1_interface WLFeedbackImplementation {
+	.destroy = destroyFeedback
+};
+
+// The events only read the array, it doesn't need its own storage
+wl_array arrayOf(const void* data, const size_t size) {
+	return {size, size, const_cast<void*>(data)};
+}
+
+// Feedback needs a device for every tranche, without one clients only get modifier events
+uint32_t versionFor(const vec<LinuxDmabuf::Tranche>& tranches) {
+	const bool devices = std::ranges::all_of(tranches, [](const auto& tranche) { return tranche.device != 0; });
+	return devices ? ZWP_LINUX_DMABUF_V1_GET_DEFAULT_FEEDBACK_SINCE_VERSION : ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION;
+}
+}
+
+// DmabufAttributes
+
+s_ptr<const DmabufAttributes> DmabufAttributes::get(wl_resource* buffer) {
+	if (buffer == nullptr || !wl_resource_instance_of(buffer, &wl_buffer_interface, &WLBufferImplementation))
+		return nullptr;
+	return static_cast<DmabufBuffer*>(wl_resource_get_user_data(buffer))->attributes;
+}
+
+DmabufAttributes::~DmabufAttributes() {
+	for (const auto& plane : planes)
+		if (plane.fd >= 0)
+			close(plane.fd);
+}
+
+bool DmabufAttributes::pin() const {
+	auto current = access.load(std::memory_order_relaxed);
+	do {
+		if (current & RETIRED)
+			return false;
+	} while (!access.compare_exchange_weak(current, current + 1, std::memory_order_acquire));
+	return true;
+}
+
+void DmabufAttributes::unpin() const {
+	if (access.fetch_sub(1, std::memory_order_release) != (RETIRED | 1))
+		return;
+	// The last pin of a retired buffer, the compositor can release it
+	const auto fd = globals::shmCopiedFd.load(std::memory_order_relaxed);
+	if (fd < 0)
+		return;
+	const uint64_t one = 1;
+	// Only fails with a full counter, which wakes the loop just the same
+	[[maybe_unused]] const auto written = write(fd, &one, sizeof(one));
+}
+
+void DmabufAttributes::retire() const {
+	access.fetch_or(RETIRED, std::memory_order_relaxed);
+}
+
+void DmabufAttributes::unretire() const {
+	access.fetch_and(~RETIRED, std::memory_order_relaxed);
+}
+
+// LinuxDmabuf
+
+LinuxDmabuf::LinuxDmabuf(wl_display* wlDisplay, vec<Tranche>&& tranches) :
+WLInterface(wlDisplay, &WLDmabufImplementation, &zwp_linux_dmabuf_v1_interface, versionFor(tranches)),
+tranches(std::move(tranches)) {
+	wl_list_init(&paramsList);
+	if (!createTable())
+		MERROR << "Failed to create the dmabuf format table" << endl;
+	MDEBUG << "Advertising " << table.size() << " dmabuf formats" << endl;
+}
+
+LinuxDmabuf::~LinuxDmabuf() {
+	Params* params;
+	Params* tmp;
+	wl_list_for_each_safe(params, tmp, &paramsList, link)
+		wl_resource_destroy(params->resource);
+	if (tableFd >= 0)
+		close(tableFd);
+}
+
+LinuxDmabuf& LinuxDmabuf::from(wl_resource* resource) {
+	const auto* client = static_cast<Client*>(wl_resource_get_user_data(resource));
+	return *static_cast<LinuxDmabuf*>(client->parent);
+}
+
+LinuxDmabuf::Params* LinuxDmabuf::paramsFrom(wl_resource* resource) {
+	return static_cast<Params*>(wl_resource_get_user_data(resource));
+}
+
+void LinuxDmabuf::bind(wl_client* client, const uint32_t version, const uint32_t id) {
+	MDEBUG << "Binding linux dmabuf version " << version << endl;
+	const auto& bound = createClient(client, version, id);
+	// Later versions ask for feedback instead. Before modifiers existed the format event meant the
+	// implicit modifier, which we can't import
+	if (version >= ZWP_LINUX_DMABUF_V1_GET_DEFAULT_FEEDBACK_SINCE_VERSION ||
+		version < ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION)
+		return;
+	for (const auto& [format, padding, modifier] : table)
+		zwp_linux_dmabuf_v1_send_modifier(bound.resource, format, static_cast<uint32_t>(modifier >> 32),
+			static_cast<uint32_t>(modifier));
+}
+
+bool LinuxDmabuf::createTable() {
+	tableIndices.resize(tranches.size());
+	for (size_t t = 0; t < tranches.size(); t++) {
+		for (const auto& [format, modifier, planes] : tranches[t].formats) {
+			// A few dozen entries, searching is cheaper than hashing pairs
+			const auto it = std::ranges::find_if(table, [&](const TableEntry& entry) {
+				return entry.format == format && entry.modifier == modifier;
+			});
+			const auto index = static_cast<size_t>(it - table.begin());
+			if (index > std::numeric_limits<uint16_t>::max())
+				continue;
+			if (it == table.end())
+				table.push_back({format, 0, modifier});
+			tableIndices[t].push_back(static_cast<uint16_t>(index));
+		}
+	}
+	const auto size = table.size() * sizeof(TableEntry);
+	tableFd = memfd_create("mephland-dmabuf-formats", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (tableFd < 0)
+		return false;
+	// Every client maps the same file, sealed so none of them can change it for the others
+	if (write(tableFd, table.data(), size) != static_cast<ssize_t>(size) ||
+		fcntl(tableFd, F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) != 0) {
+		close(tableFd);
+		tableFd = -1;
+		return false;
+	}
+	return true;
+}
+
+bool LinuxDmabuf::supported(const uint32_t format, const uint64_t modifier) const {
+	return std::ranges::any_of(table, [&](const TableEntry& entry) {
+		return entry.format == format && entry.modifier == modifier;
+	});
+}
+
+bool LinuxDmabuf::matchesPlanes(const uint32_t format, const uint64_t modifier, const uint32_t planes) const {
+	for (const auto& tranche : tranches)
+		for (const auto& entry : tranche.formats)
+			if (entry.fourcc == format && entry.modifier == modifier && entry.planes == planes)
+				return true;
+	return false;
+}
+
+void LinuxDmabuf::destroyDmabuf(wl_client* client, wl_resource* resource) {
+	wl_resource_destroy(resource);
+}
+
+void LinuxDmabuf::createParams(wl_client* client, wl_resource* resource, const uint32_t id) {
+	auto& self = from(resource);
+	auto* paramsResource = wl_resource_create(client, &zwp_linux_buffer_params_v1_interface,
+		wl_resource_get_version(resource), id);
+	if (paramsResource == nullptr) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	auto* params = new Params{&self, paramsResource, u_ptr<DmabufAttributes>(new DmabufAttributes())};
+	wl_list_insert(&self.paramsList, &params->link);
+	wl_resource_set_implementation(paramsResource, &WLParamsImplementation, params, onParamsDestroy);
+}
+
+void LinuxDmabuf::getDefaultFeedback(wl_client* client, wl_resource* resource, const uint32_t id) {
+	from(resource).createFeedback(client, resource, id);
+}
+
+// Every surface can be shown on every device, so it gets the same feedback as everything else
+void LinuxDmabuf::getSurfaceFeedback(wl_client* client, wl_resource* resource, const uint32_t id,
+	wl_resource* surface) {
+	from(resource).createFeedback(client, resource, id);
+}
+
+void LinuxDmabuf::createFeedback(wl_client* client, wl_resource* resource, const uint32_t id) const {
+	auto* feedback = wl_resource_create(client, &zwp_linux_dmabuf_feedback_v1_interface,
+		wl_resource_get_version(resource), id);
+	if (feedback == nullptr) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(feedback, &WLFeedbackImplementation, nullptr, nullptr);
+	zwp_linux_dmabuf_feedback_v1_send_format_table(feedback, tableFd, table.size32() * sizeof(TableEntry));
+	auto mainDevice = arrayOf(&tranches.front().device, sizeof(dev_t));
+	zwp_linux_dmabuf_feedback_v1_send_main_device(feedback, &mainDevice);
+	for (size_t t = 0; t < tranches.size(); t++) {
+		auto device = arrayOf(&tranches[t].device, sizeof(dev_t));
+		auto indices = arrayOf(tableIndices[t].data(), tableIndices[t].size() * sizeof(uint16_t));
+		zwp_linux_dmabuf_feedback_v1_send_tranche_target_device(feedback, &device);
+		zwp_linux_dmabuf_feedback_v1_send_tranche_formats(feedback, &indices);
+		zwp_linux_dmabuf_feedback_v1_send_tranche_flags(feedback, 0);
+		zwp_linux_dmabuf_feedback_v1_send_tranche_done(feedback);
+	}
+	zwp_linux_dmabuf_feedback_v1_send_done(feedback);
+}
+
+// Params
+
+void LinuxDmabuf::onParamsDestroy(wl_resource* resource) {
+	auto* params = paramsFrom(resource);
+	wl_list_remove(&params->link);
+	delete params;
+}
+
+void LinuxDmabuf::destroyParams(wl_client* client, wl_resource* resource) {
+	wl_resource_destroy(resource);
+}
+
+void LinuxDmabuf::addPlane(wl_client* client, wl_resource* resource, const int32_t fd, const uint32_t planeIdx,
+	const uint32_t offset, const uint32_t stride, const uint32_t modifierHi, const uint32_t modifierLo) {
+	auto& params = *paramsFrom(resource);
+	const auto error = [&](const uint32_t code, const char* message) {
+		close(fd);
+		wl_resource_post_error(resource, code, "%s", message);
+	};
+	if (params.used)
+		return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED, "params were already used");
+	if (planeIdx >= DmabufAttributes::MAX_PLANES)
+		return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_IDX, "plane index out of range");
+	auto& attributes = *params.attributes;
+	auto& plane = attributes.planes[planeIdx];
+	if (plane.fd >= 0)
+		return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_SET, "plane was already set");
+	const auto modifier = uint64_t{modifierHi} << 32 | modifierLo;
+	if (attributes.planeCount > 0 && attributes.modifier != modifier)
+		return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_FORMAT, "planes have different modifiers");
+	plane = {fd, offset, stride};
+	attributes.modifier = modifier;
+	attributes.planeCount++;
+}
+
+void LinuxDmabuf::create(wl_client* client, wl_resource* resource, const int32_t width, const int32_t height,
+	const uint32_t format, const uint32_t flags) {
+	if (auto* buffer = createBuffer(client, *paramsFrom(resource), 0, width, height, format, flags))
+		zwp_linux_buffer_params_v1_send_created(resource, buffer);
+}
+
+void LinuxDmabuf::createImmed(wl_client* client, wl_resource* resource, const uint32_t bufferId,
+	const int32_t width, const int32_t height, const uint32_t format, const uint32_t flags) {
+	createBuffer(client, *paramsFrom(resource), bufferId, width, height, format, flags);
+}
+
+wl_resource* LinuxDmabuf::createBuffer(wl_client* client, Params& params, const uint32_t bufferId,
+	const int32_t width, const int32_t height, const uint32_t format, const uint32_t flags) {
+	auto* resource = params.resource;
+	// Malformed params are protocol errors, ones we just can't import get failed. create_immed has
+	// no failed event, so those are errors too
+	const auto error = [&](const uint32_t code, const char* message) -> wl_resource* {
+		wl_resource_post_error(resource, code, "%s", message);
+		return nullptr;
+	};
+	const auto fail = [&](const char* message) -> wl_resource* {
+		MDEBUG << "Rejected dmabuf: " << message << endl;
+		if (bufferId == 0)
+			zwp_linux_buffer_params_v1_send_failed(resource);
+		else
+			wl_resource_post_error(resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_WL_BUFFER, "%s", message);
+		return nullptr;
+	};
+	if (params.used)
+		return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED, "params were already used");
+	params.used = true;
+	auto& attributes = *params.attributes;
+	if (attributes.planeCount == 0)
+		return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE, "no planes");
+	for (uint32_t i = 0; i < attributes.planeCount; i++)
+		if (attributes.planes[i].fd < 0)
+			return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE, "planes are not contiguous");
+	if (width <= 0 || height <= 0)
+		return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_DIMENSIONS, "invalid dimensions");
+	if (!params.parent->supported(format, attributes.modifier))
+		return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_FORMAT, "format and modifier were not advertised");
+	// Missing planes, or more than the format has
+	if (!params.parent->matchesPlanes(format, attributes.modifier, attributes.planeCount))
+		return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE, "wrong number of planes for the format");
+	// Interlaced and y inverted buffers would need their own pipelines
+	if (flags != 0)
+		return fail("unsupported flags");
+
+	struct stat first{};
+	for (uint32_t i = 0; i < attributes.planeCount; i++) {
+		const auto& plane = attributes.planes[i];
+		// Only the first plane is known to have height rows, the others may be subsampled
+		const auto end = uint64_t{plane.offset} + uint64_t{plane.stride} * (i == 0 ? height : 1);
+		// Exporters that can't seek have an unknown size
+		if (const auto size = lseek(plane.fd, 0, SEEK_END); size >= 0 && end > static_cast<uint64_t>(size))
+			return error(ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_OUT_OF_BOUNDS, "plane is out of bounds");
+		struct stat st{};
+		if (fstat(plane.fd, &st) != 0)
+			return fail("plane fd can't be inspected");
+		// The device imports one allocation, disjoint planes would each need their own
+		if (i == 0)
+			first = st;
+		else if (st.st_dev != first.st_dev || st.st_ino != first.st_ino)
+			return fail("planes in different dmabufs");
+	}
+
+	auto* buffer = wl_resource_create(client, &wl_buffer_interface, 1, bufferId);
+	if (buffer == nullptr) {
+		wl_client_post_no_memory(client);
+		return nullptr;
+	}
+	attributes.id = nextId++;
+	attributes.width = width;
+	attributes.height = height;
+	attributes.format = format;
+	auto* data = new DmabufBuffer{s_ptr<DmabufAttributes>(params.attributes.release())};
+	wl_resource_set_implementation(buffer, &WLBufferImplementation, data, onBufferDestroy);
+	return buffer;
+}
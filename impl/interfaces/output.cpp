@@ -28,6 +28,13 @@ Output::Output(wl_display* wlDisplay, VDisplay& display) :
 
 }
 
+wl_resource* Output::getResource(wl_client* client) const {
+	for (const auto* bound : clients | std::views::keys)
+		if (wl_resource_get_client(bound->resource) == client)
+			return bound->resource;
+	return nullptr;
+}
+
 void Output::release(wl_client* client, wl_resource* resource) {
 	wlDestroy(resource);
 }
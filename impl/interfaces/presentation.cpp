@@ -0,0 +1,36 @@
+#include <ctime>
+
+#include "mland/interfaces/presentation.h"
+
+using namespace mland;
+using namespace mland::interfaces;
+
+Presentation::Presentation(wl_display* wlDisplay) :
+WLInterface(wlDisplay, &WLPresentationImplementation, &wp_presentation_interface, 1) {}
+
+void Presentation::bind(wl_client* client, const uint32_t version, const uint32_t id) {
+	MDEBUG << "Binding presentation" << endl;
+	const auto& bound = createClient(client, version, id);
+	// Displays timestamp with steady_clock
+	wp_presentation_send_clock_id(bound.resource, CLOCK_MONOTONIC);
+}
+
+void Presentation::destroyPresentation(wl_client* client, wl_resource* resource) {
+	// Feedback already requested still arrives
+	wl_resource_destroy(resource);
+}
+
+void Presentation::feedback(wl_client* client, wl_resource* resource, wl_resource* surface, const uint32_t callback) {
+	auto& pending = *Surface::from(surface)->pending;
+	auto* feedbackResource = wl_resource_create(client, &wp_presentation_feedback_interface, 1, callback);
+	if (feedbackResource == nullptr) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	// Unlinked from whichever state or content update holds it
+	wl_resource_set_implementation(feedbackResource, nullptr, nullptr, [](wl_resource* feedback) {
+		wl_list_remove(wl_resource_get_link(feedback));
+	});
+	wl_list_insert(pending.feedback.prev, wl_resource_get_link(feedbackResource));
+	pending.changed |= SurfaceState::ePresentation;
+}
@@ -0,0 +1,193 @@
+#include <bit>
+#include <thread>
+#include <unistd.h>
+#include <wayland-server-protocol.h>
+
+#include "mland/shm_contents.h"
+#include "mland/globals.h"
+#include "mland/shm_format.h"
+
+using namespace mland;
+
+s_ptr<ShmContents> ShmContents::create(wl_resource* buffer, const uint64_t serial, ShmContents* previous,
+	const BandedRegion& damage) {
+	auto* shm = buffer != nullptr ? wl_shm_buffer_get(buffer) : nullptr;
+	if (shm == nullptr)
+		return nullptr;
+	// libwayland only checks the rows fit the pool, not that a row fits the stride
+	const auto* format = ShmFormat::find(wl_shm_buffer_get_format(shm));
+	if (format == nullptr || static_cast<uint32_t>(wl_shm_buffer_get_stride(shm)) / format->bytes <
+		static_cast<uint32_t>(wl_shm_buffer_get_width(shm))) {
+		wl_client_post_implementation_error(wl_resource_get_client(buffer), "wl_shm buffer rows overlap");
+		return nullptr;
+	}
+	auto contents = s_ptr<ShmContents>(new ShmContents(buffer, shm, serial));
+	const Box full{0, 0, contents->width, contents->height};
+	if (previous != nullptr) {
+		// Re-committing the same buffer, only the newest commit may release it
+		if (previous->buffer == buffer)
+			previous->owner = false;
+		if (previous->width == contents->width && previous->height == contents->height &&
+			previous->format == contents->format) {
+			const auto keep = std::min<size_t>(previous->history.size(), HISTORY - 1);
+			contents->history.assign(previous->history.end() - keep, previous->history.end());
+		}
+	}
+	auto& region = contents->history.emplace_back(serial, damage).second;
+	if (contents->history.size() == 1)
+		region.reset(full);
+	else
+		region.intersect(full);
+	return contents;
+}
+
+ShmContents::ShmContents(wl_resource* buffer, wl_shm_buffer* shm, const uint64_t serial) :
+data(static_cast<const uint8_t*>(wl_shm_buffer_get_data(shm))),
+format(wl_shm_buffer_get_format(shm)),
+width(wl_shm_buffer_get_width(shm)),
+height(wl_shm_buffer_get_height(shm)),
+stride(wl_shm_buffer_get_stride(shm)),
+serial(serial),
+buffer(buffer),
+shm(shm),
+pool(wl_shm_buffer_ref_pool(shm)) {
+	bufferDestroy.notify = onBufferDestroy;
+	wl_resource_add_destroy_listener(buffer, &bufferDestroy);
+}
+
+ShmContents::~ShmContents() {
+	detach(false);
+}
+
+bool ShmContents::acquire(const uint32_t count) const {
+	auto current = access.load(std::memory_order_relaxed);
+	do {
+		if (current & RETIRED)
+			return false;
+	} while (!access.compare_exchange_weak(current, current + count, std::memory_order_acquire));
+	return true;
+}
+
+bool ShmContents::beginRead() const {
+	if (!acquire(PIN + CPU_READ))
+		return false;
+	// Turns a client truncating its pool under us into zeroes instead of SIGBUS
+	wl_shm_buffer_begin_access(shm);
+	return true;
+}
+
+void ShmContents::endRead() const {
+	wl_shm_buffer_end_access(shm);
+	access.fetch_sub(PIN + CPU_READ, std::memory_order_release);
+}
+
+bool ShmContents::pin() const {
+	return acquire(PIN);
+}
+
+void ShmContents::unpin() const {
+	// Read while our pin keeps us alive. Losing the race to a concurrent copy only delays the
+	// release until the compositor looks again on its own
+	const bool wake = copiedEverywhere();
+	if ((access.fetch_sub(PIN) & ~RETIRED) == PIN && wake)
+		notify();
+}
+
+uint32_t ShmContents::addCopier() {
+	auto current = globals::shmCopiers.load();
+	uint32_t copier;
+	do {
+		copier = std::countr_one(current);
+		if (copier >= NO_COPIER)
+			return NO_COPIER;
+	} while (!globals::shmCopiers.compare_exchange_weak(current, current | uint64_t{1} << copier));
+	return copier;
+}
+
+void ShmContents::removeCopier(const uint32_t copier) {
+	if (copier == NO_COPIER)
+		return;
+	globals::shmCopiers.fetch_and(~(uint64_t{1} << copier));
+	// Contents only that copier was missing are releasable now
+	notify();
+}
+
+void ShmContents::copied(const uint32_t copier) const {
+	if (copier == NO_COPIER)
+		return;
+	copiedBy.fetch_or(uint64_t{1} << copier);
+	if (copiedEverywhere() && (access.load() & ~RETIRED) == 0)
+		notify();
+}
+
+bool ShmContents::copiedEverywhere() const {
+	const auto copiers = globals::shmCopiers.load();
+	return copiers != 0 && (copiedBy.load() & copiers) == copiers;
+}
+
+void ShmContents::notify() {
+	const auto fd = globals::shmCopiedFd.load(std::memory_order_relaxed);
+	if (fd < 0)
+		return;
+	const uint64_t one = 1;
+	// Only fails with a full counter, which wakes the loop just the same
+	[[maybe_unused]] const auto written = write(fd, &one, sizeof(one));
+}
+
+bool ShmContents::damageSince(const uint64_t serial, BandedRegion& damage) const {
+	if (history.empty() || serial + 1 < history.front().first || serial > this->serial)
+		return false;
+	damage.clear();
+	for (const auto& [commit, region] : history)
+		if (commit > serial)
+			damage.unite(region);
+	return true;
+}
+
+void ShmContents::retire() {
+	access.fetch_or(RETIRED, std::memory_order_relaxed);
+}
+
+bool ShmContents::tryRelease() {
+	if (buffer == nullptr && pool == nullptr)
+		return true;
+	// Every device has its own copy, nothing reads the client memory again
+	if (copiedEverywhere())
+		retire();
+	const auto current = access.load(std::memory_order_acquire);
+	if (!(current & RETIRED) || (current & ~RETIRED) != 0)
+		return false;
+	detach(owner);
+	return true;
+}
+
+void ShmContents::onBufferDestroy(wl_listener* listener, void* data) {
+	ShmContents* self;
+	self = wl_container_of(listener, self, bufferDestroy);
+	// The wl_shm_buffer is freed right after this, a copy in progress has to finish first. That
+	// only takes as long as copying one surface's damage
+	self->retire();
+	while ((self->access.load(std::memory_order_acquire) & CPU_MASK) != 0)
+		std::this_thread::yield();
+	self->shm = nullptr;
+	wl_list_remove(&self->bufferDestroy.link);
+	wl_list_init(&self->bufferDestroy.link);
+	self->buffer = nullptr;
+	// Pinned reads keep the pool until tryRelease finds them done
+	self->tryRelease();
+}
+
+void ShmContents::detach(const bool release) {
+	if (buffer != nullptr) {
+		if (release)
+			wl_buffer_send_release(buffer);
+		wl_list_remove(&bufferDestroy.link);
+		wl_list_init(&bufferDestroy.link);
+		buffer = nullptr;
+	}
+	if (pool != nullptr) {
+		wl_shm_pool_unref(pool);
+		pool = nullptr;
+	}
+	shm = nullptr;
+}
@@ -0,0 +1,140 @@
+#include <algorithm>
+
+#include "mland/interfaces/subcompositor.h"
+#include "mland/interfaces/compositor.h"
+
+using namespace mland;
+using namespace mland::interfaces;
+
+// Subsurface
+
+bool Subsurface::synchronized() const {
+	for (const auto* sub = this; sub != nullptr; sub = sub->parent != nullptr ? sub->parent->subsurface : nullptr)
+		if (sub->sync)
+			return true;
+	return false;
+}
+
+// Subcompositor
+
+Subcompositor::Subcompositor(wl_display* wlDisplay) :
+WLInterface(wlDisplay, &WLSubcompositorImplementation, &wl_subcompositor_interface, 1) {}
+
+void Subcompositor::bind(wl_client* client, const uint32_t version, const uint32_t id) {
+	MDEBUG << "Binding subcompositor" << endl;
+	createClient(client, version, id);
+}
+
+void Subcompositor::destroySubcompositor(wl_client* client, wl_resource* resource) {
+	// Subsurfaces already handed out keep working
+	wl_resource_destroy(resource);
+}
+
+void Subcompositor::getSubsurface(wl_client* client, wl_resource* resource, const uint32_t id,
+	wl_resource* surfaceResource, wl_resource* parentResource) {
+	auto* surface = Surface::from(surfaceResource);
+	auto* parent = Surface::from(parentResource);
+	if (surface->subsurface != nullptr) {
+		wl_resource_post_error(resource, WL_SUBCOMPOSITOR_ERROR_BAD_SURFACE, "surface already is a subsurface");
+		return;
+	}
+	for (auto* ancestor = parent; ancestor != nullptr;
+		ancestor = ancestor->subsurface != nullptr ? ancestor->subsurface->parent : nullptr) {
+		if (ancestor == surface) {
+			wl_resource_post_error(resource, WL_SUBCOMPOSITOR_ERROR_BAD_PARENT,
+				"parent is the surface or one of its subsurfaces");
+			return;
+		}
+	}
+	auto* subsurfaceResource = wl_resource_create(client, &wl_subsurface_interface, 1, id);
+	if (subsurfaceResource == nullptr) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	auto& compositor = *surface->compositor;
+	auto* subsurface = new Subsurface(&compositor, surface, parent, subsurfaceResource, compositor.states.create());
+	wl_resource_set_implementation(subsurfaceResource, &WLSubsurfaceImplementation, subsurface, onSubsurfaceDestroy);
+	wl_list_insert(&compositor.subsurfaceList, &subsurface->link);
+	surface->subsurface = subsurface;
+	// On top of its siblings, right away rather than with the next parent commit
+	parent->stack.push_back(surface);
+	parent->pendingStack.push_back(surface);
+	compositor.scene.setToplevel(surface->handle, false);
+	compositor.treeChanged(*parent);
+	compositor.schedulePublish();
+}
+
+Subsurface* Subcompositor::from(wl_resource* resource) {
+	return static_cast<Subsurface*>(wl_resource_get_user_data(resource));
+}
+
+void Subcompositor::onSubsurfaceDestroy(wl_resource* resource) {
+	auto* subsurface = from(resource);
+	auto& compositor = *subsurface->compositor;
+	if (auto* surface = subsurface->surface) {
+		if (auto* parent = subsurface->parent) {
+			std::erase(parent->stack, surface);
+			std::erase(parent->pendingStack, surface);
+			compositor.treeChanged(*parent);
+		}
+		surface->subsurface = nullptr;
+		// Unmapped until it commits a buffer of its own again
+		compositor.scene.setMapped(surface->handle, false);
+		compositor.scene.setToplevel(surface->handle, true);
+		compositor.treeChanged(*surface);
+		compositor.schedulePublish();
+	}
+	wl_list_remove(&subsurface->link);
+	compositor.states.destroy(subsurface->cached);
+	delete subsurface;
+}
+
+void Subcompositor::destroySubsurface(wl_client* client, wl_resource* resource) {
+	wl_resource_destroy(resource);
+}
+
+void Subcompositor::setPosition(wl_client* client, wl_resource* resource, const int32_t x, const int32_t y) {
+	auto* subsurface = from(resource);
+	subsurface->pendingX = x;
+	subsurface->pendingY = y;
+}
+
+void Subcompositor::place(wl_resource* resource, wl_resource* siblingResource, const bool above) {
+	auto* subsurface = from(resource);
+	// Inert once either surface is gone
+	if (subsurface->surface == nullptr || subsurface->parent == nullptr)
+		return;
+	auto* sibling = Surface::from(siblingResource);
+	auto& stack = subsurface->parent->pendingStack;
+	if (sibling == subsurface->surface || std::ranges::find(stack, sibling) == stack.end()) {
+		wl_resource_post_error(resource, WL_SUBSURFACE_ERROR_BAD_SURFACE, "not a sibling or the parent");
+		return;
+	}
+	std::erase(stack, subsurface->surface);
+	const auto at = std::ranges::find(stack, sibling);
+	stack.insert(above ? at + 1 : at, subsurface->surface);
+	subsurface->parent->stackChanged = true;
+}
+
+void Subcompositor::placeAbove(wl_client* client, wl_resource* resource, wl_resource* sibling) {
+	place(resource, sibling, true);
+}
+
+void Subcompositor::placeBelow(wl_client* client, wl_resource* resource, wl_resource* sibling) {
+	place(resource, sibling, false);
+}
+
+void Subcompositor::setSync(wl_client* client, wl_resource* resource) {
+	from(resource)->sync = true;
+}
+
+void Subcompositor::setDesync(wl_client* client, wl_resource* resource) {
+	auto* subsurface = from(resource);
+	subsurface->sync = false;
+	// A synchronized parent still holds it back, otherwise the cache goes out as if committed now
+	if (subsurface->surface == nullptr || !subsurface->hasCache || subsurface->synchronized())
+		return;
+	subsurface->hasCache = false;
+	subsurface->surface->applyState(*subsurface->cached);
+	subsurface->compositor->schedulePublish();
+}
@@ -0,0 +1,431 @@
+#include <cmath>
+#include <viewporter-server-protocol.h>
+#include <presentation-time-server-protocol.h>
+
+#include "mland/interfaces/surface.h"
+#include "mland/interfaces/compositor.h"
+#include "mland/interfaces/subcompositor.h"
+#include "mland/interfaces/output.h"
+
+using namespace mland;
+using namespace mland::interfaces;
+
+// Region
+
+void Region::destroy(wl_client* client, wl_resource* resource) {
+	wl_resource_destroy(resource);
+}
+
+void Region::add(wl_client* client, wl_resource* resource, const int32_t x, const int32_t y, const int32_t width,
+	const int32_t height) {
+	static_cast<Region*>(wl_resource_get_user_data(resource))->region.unite(Box::fromSize(x, y, width, height));
+}
+
+void Region::subtract(wl_client* client, wl_resource* resource, const int32_t x, const int32_t y, const int32_t width,
+	const int32_t height) {
+	static_cast<Region*>(wl_resource_get_user_data(resource))->region.subtract(Box::fromSize(x, y, width, height));
+}
+
+// SurfaceState
+
+namespace {
+uint32_t sendDone(wl_list& callbacks, const uint32_t msec) {
+	uint32_t sent = 0;
+	wl_resource* callback;
+	wl_resource* tmp;
+	wl_resource_for_each_safe(callback, tmp, &callbacks) {
+		wl_callback_send_done(callback, msec);
+		wl_resource_destroy(callback);
+		sent++;
+	}
+	return sent;
+}
+
+void sendDiscarded(wl_list& feedback) {
+	wl_resource* resource;
+	wl_resource* tmp;
+	wl_resource_for_each_safe(resource, tmp, &feedback) {
+		wp_presentation_feedback_send_discarded(resource);
+		wl_resource_destroy(resource);
+	}
+}
+
+void limitDamage(BandedRegion& damage) {
+	if (damage.size() > SurfaceState::MAX_DAMAGE)
+		damage.reset(damage.extents());
+}
+}
+
+SurfaceState::SurfaceState() {
+	wl_list_init(&frameCallbacks);
+	wl_list_init(&feedback);
+	wl_list_init(&bufferDestroy.link);
+	bufferDestroy.notify = onBufferDestroy;
+}
+
+SurfaceState::~SurfaceState() {
+	setBuffer(nullptr);
+	wl_resource* callback;
+	wl_resource* tmp;
+	wl_resource_for_each_safe(callback, tmp, &frameCallbacks)
+		wl_resource_destroy(callback);
+	sendDiscarded(feedback);
+}
+
+void SurfaceState::setBuffer(wl_resource* newBuffer) {
+	if (buffer == newBuffer)
+		return;
+	if (buffer != nullptr) {
+		wl_list_remove(&bufferDestroy.link);
+		wl_list_init(&bufferDestroy.link);
+	}
+	buffer = newBuffer;
+	if (buffer != nullptr)
+		wl_resource_add_destroy_listener(buffer, &bufferDestroy);
+}
+
+void SurfaceState::onBufferDestroy(wl_listener* listener, void* data) {
+	SurfaceState* state;
+	state = wl_container_of(listener, state, bufferDestroy);
+	wl_list_remove(&listener->link);
+	wl_list_init(&listener->link);
+	state->buffer = nullptr;
+}
+
+std::pair<int32_t, int32_t> SurfaceState::bufferSize() const {
+	int32_t width = 0;
+	int32_t height = 0;
+	if (auto* shm = buffer != nullptr ? wl_shm_buffer_get(buffer) : nullptr) {
+		width = wl_shm_buffer_get_width(shm);
+		height = wl_shm_buffer_get_height(shm);
+	} else if (const auto dmabuf = DmabufAttributes::get(buffer)) {
+		width = dmabuf->width;
+		height = dmabuf->height;
+	}
+	// The odd transforms rotate by 90 or 270 degrees
+	if (transform & 1)
+		std::swap(width, height);
+	return {width / scale, height / scale};
+}
+
+std::array<double, 4> SurfaceState::viewportSource() const {
+	if (hasSource())
+		return source;
+	const auto [width, height] = bufferSize();
+	return {0.0, 0.0, static_cast<double>(width), static_cast<double>(height)};
+}
+
+std::pair<int32_t, int32_t> SurfaceState::surfaceSize() const {
+	if (hasDestination())
+		return {destinationWidth, destinationHeight};
+	// checkViewport made sure it is whole without a destination
+	if (hasSource())
+		return {static_cast<int32_t>(source[2]), static_cast<int32_t>(source[3])};
+	return bufferSize();
+}
+
+// Surface
+
+Surface::Surface(Compositor* compositor, wl_resource* resource, SurfaceState* pending, SurfaceState* current) :
+compositor(compositor),
+resource(resource),
+pending(pending),
+current(current),
+stack{this},
+pendingStack{this} {
+	wl_list_init(&link);
+}
+
+Surface* Surface::from(wl_resource* resource) {
+	return static_cast<Surface*>(wl_resource_get_user_data(resource));
+}
+
+void Surface::destroy(wl_client* client, wl_resource* resource) {
+	wl_resource_destroy(resource);
+}
+
+void Surface::attach(wl_client* client, wl_resource* resource, wl_resource* buffer, const int32_t x, const int32_t y) {
+	auto& pending = *from(resource)->pending;
+	if (wl_resource_get_version(resource) >= WL_SURFACE_OFFSET_SINCE_VERSION) {
+		if (x != 0 || y != 0) {
+			wl_resource_post_error(resource, WL_SURFACE_ERROR_INVALID_OFFSET,
+				"attach with an offset, use wl_surface.offset");
+			return;
+		}
+	} else {
+		pending.dx = x;
+		pending.dy = y;
+		pending.changed |= SurfaceState::eOffset;
+	}
+	pending.setBuffer(buffer);
+	pending.changed |= SurfaceState::eBuffer;
+}
+
+void Surface::damage(wl_client* client, wl_resource* resource, const int32_t x, const int32_t y,
+	const int32_t width, const int32_t height) {
+	auto& pending = *from(resource)->pending;
+	pending.damage.unite(Box::fromSize(x, y, width, height));
+	limitDamage(pending.damage);
+	pending.changed |= SurfaceState::eDamage;
+}
+
+void Surface::damageBuffer(wl_client* client, wl_resource* resource, const int32_t x, const int32_t y,
+	const int32_t width, const int32_t height) {
+	auto& pending = *from(resource)->pending;
+	pending.bufferDamage.unite(Box::fromSize(x, y, width, height));
+	limitDamage(pending.bufferDamage);
+	pending.changed |= SurfaceState::eDamage;
+}
+
+void Surface::frame(wl_client* client, wl_resource* resource, const uint32_t callback) {
+	auto& pending = *from(resource)->pending;
+	auto* callbackResource = wl_resource_create(client, &wl_callback_interface, 1, callback);
+	if (callbackResource == nullptr) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	// The destroy handler unlinks it from whichever state holds it
+	wl_resource_set_implementation(callbackResource, nullptr, nullptr, [](wl_resource* cb) {
+		wl_list_remove(wl_resource_get_link(cb));
+	});
+	wl_list_insert(pending.frameCallbacks.prev, wl_resource_get_link(callbackResource));
+	pending.changed |= SurfaceState::eFrame;
+}
+
+void Surface::setOpaqueRegion(wl_client* client, wl_resource* resource, wl_resource* region) {
+	auto& pending = *from(resource)->pending;
+	pending.changed |= SurfaceState::eOpaque;
+	if (region == nullptr)
+		pending.opaque.clear();
+	else
+		pending.opaque = static_cast<Region*>(wl_resource_get_user_data(region))->get();
+}
+
+void Surface::setInputRegion(wl_client* client, wl_resource* resource, wl_resource* region) {
+	auto& pending = *from(resource)->pending;
+	pending.infiniteInput = region == nullptr;
+	pending.changed |= SurfaceState::eInput;
+	if (region == nullptr)
+		pending.input.clear();
+	else
+		pending.input = static_cast<Region*>(wl_resource_get_user_data(region))->get();
+}
+
+void Surface::setBufferTransform(wl_client* client, wl_resource* resource, const int32_t transform) {
+	if (transform < WL_OUTPUT_TRANSFORM_NORMAL || transform > WL_OUTPUT_TRANSFORM_FLIPPED_270) {
+		wl_resource_post_error(resource, WL_SURFACE_ERROR_INVALID_TRANSFORM, "invalid transform %d", transform);
+		return;
+	}
+	auto& pending = *from(resource)->pending;
+	pending.transform = static_cast<wl_output_transform>(transform);
+	pending.changed |= SurfaceState::eTransform;
+}
+
+void Surface::setBufferScale(wl_client* client, wl_resource* resource, const int32_t scale) {
+	if (scale < 1) {
+		wl_resource_post_error(resource, WL_SURFACE_ERROR_INVALID_SCALE, "invalid scale %d", scale);
+		return;
+	}
+	auto& pending = *from(resource)->pending;
+	pending.scale = scale;
+	pending.changed |= SurfaceState::eScale;
+}
+
+void Surface::offset(wl_client* client, wl_resource* resource, const int32_t x, const int32_t y) {
+	auto& pending = *from(resource)->pending;
+	pending.dx = x;
+	pending.dy = y;
+	pending.changed |= SurfaceState::eOffset;
+}
+
+void Surface::commit(wl_client* client, wl_resource* resource) {
+	auto* self = from(resource);
+	// Held back until the parent applies its own state
+	if (self->subsurface != nullptr && self->subsurface->synchronized()) {
+		auto& cached = *self->subsurface->cached;
+		// A cached wl_shm buffer never got contents that would release it
+		if ((self->pending->changed & SurfaceState::eBuffer) && cached.buffer != nullptr
+			&& cached.buffer != self->pending->buffer && wl_shm_buffer_get(cached.buffer) != nullptr)
+			wl_buffer_send_release(cached.buffer);
+		apply(*self->pending, cached);
+		self->subsurface->hasCache = true;
+		return;
+	}
+	self->applyState(*self->pending);
+	self->compositor->schedulePublish();
+}
+
+void Surface::applyState(SurfaceState& state) {
+	const auto changed = state.changed;
+	const bool mapped = current->buffer != nullptr;
+	apply(state, *current);
+	if (!checkViewport())
+		return;
+	compositor->updateScene(*this, changed);
+	// Updates replaced twice can't be on their way to a display anymore, their feedback is discarded
+	// now. Otherwise a surface nothing shows would pile them up until it is destroyed
+	for (size_t i = 0; i + 1 < presentations.size(); i++)
+		sendDiscarded(presentations[i].feedback);
+	while (!presentations.empty() && wl_list_empty(&presentations.front().callbacks) &&
+		wl_list_empty(&presentations.front().feedback))
+		presentations.pop_front();
+	// Answered by the first frame showing this serial or a later one, see presented
+	if (!wl_list_empty(&current->frameCallbacks) || !wl_list_empty(&current->feedback)) {
+		auto& update = presentations.emplace_back(compositor->scene.getSerial(handle));
+		wl_list_init(&update.callbacks);
+		wl_list_insert_list(&update.callbacks, &current->frameCallbacks);
+		wl_list_init(&current->frameCallbacks);
+		wl_list_init(&update.feedback);
+		wl_list_insert_list(&update.feedback, &current->feedback);
+		wl_list_init(&current->feedback);
+	}
+	// Only what moves or maps something invalidates the flattened tree, plain content updates keep it
+	bool moved = (changed & SurfaceState::eOffset) || mapped != (current->buffer != nullptr) || stackChanged;
+	if (stackChanged) {
+		stack = pendingStack;
+		stackChanged = false;
+	}
+	for (auto* child : stack) {
+		if (child == this)
+			continue;
+		auto& sub = *child->subsurface;
+		moved |= sub.x != sub.pendingX || sub.y != sub.pendingY;
+		sub.x = sub.pendingX;
+		sub.y = sub.pendingY;
+		if (sub.hasCache) {
+			sub.hasCache = false;
+			child->applyState(*sub.cached);
+		}
+	}
+	if (moved)
+		compositor->treeChanged(*this);
+}
+
+// Copies only what the client touched, the regions reuse their storage once warm
+void Surface::apply(SurfaceState& from, SurfaceState& to) {
+	auto& p = from;
+	auto& c = to;
+	if (p.changed & SurfaceState::eBuffer) {
+		// wl_shm buffers are released by their ShmContents once the renderer is done copying, dmabufs
+		// once no device samples them anymore
+		if (c.buffer != nullptr && c.buffer != p.buffer && wl_shm_buffer_get(c.buffer) == nullptr)
+			compositor->retireBuffer(c.buffer);
+		if (p.buffer != nullptr && p.buffer != c.buffer)
+			compositor->keepBuffer(p.buffer);
+		c.setBuffer(p.buffer);
+		p.setBuffer(nullptr);
+	}
+	if (p.changed & SurfaceState::eOffset) {
+		c.dx += p.dx;
+		c.dy += p.dy;
+		p.dx = 0;
+		p.dy = 0;
+	}
+	// Damage accumulates until the compositor hands it to the renderer
+	if (p.changed & SurfaceState::eDamage) {
+		c.damage.unite(p.damage);
+		c.bufferDamage.unite(p.bufferDamage);
+		limitDamage(c.damage);
+		limitDamage(c.bufferDamage);
+		p.damage.clear();
+		p.bufferDamage.clear();
+	}
+	if (p.changed & SurfaceState::eScale)
+		c.scale = p.scale;
+	if (p.changed & SurfaceState::eTransform)
+		c.transform = p.transform;
+	if (p.changed & SurfaceState::eOpaque)
+		c.opaque = p.opaque;
+	if (p.changed & SurfaceState::eInput) {
+		c.input = p.input;
+		c.infiniteInput = p.infiniteInput;
+	}
+	if (p.changed & SurfaceState::eFrame) {
+		wl_list_insert_list(c.frameCallbacks.prev, &p.frameCallbacks);
+		wl_list_init(&p.frameCallbacks);
+	}
+	if (p.changed & SurfaceState::ePresentation) {
+		wl_list_insert_list(c.feedback.prev, &p.feedback);
+		wl_list_init(&p.feedback);
+	}
+	if (p.changed & SurfaceState::eViewport) {
+		c.source = p.source;
+		c.destinationWidth = p.destinationWidth;
+		c.destinationHeight = p.destinationHeight;
+	}
+	c.changed |= p.changed;
+	p.changed = 0;
+}
+
+bool Surface::checkViewport() const {
+	const auto& state = *current;
+	if (viewport == nullptr || !state.hasSource())
+		return true;
+	const auto [x, y, width, height] = state.source;
+	if (!state.hasDestination() && (width != std::floor(width) || height != std::floor(height))) {
+		wl_resource_post_error(viewport, WP_VIEWPORT_ERROR_BAD_SIZE,
+			"source size %f x %f is not whole and there is no destination", width, height);
+		return false;
+	}
+	const auto [bufferWidth, bufferHeight] = state.bufferSize();
+	if (bufferWidth > 0 && (x + width > bufferWidth || y + height > bufferHeight)) {
+		wl_resource_post_error(viewport, WP_VIEWPORT_ERROR_OUT_OF_BUFFER,
+			"source %f,%f %f x %f is outside the %d x %d buffer", x, y, width, height, bufferWidth, bufferHeight);
+		return false;
+	}
+	return true;
+}
+
+uint32_t Surface::frameDone(const uint32_t msec) {
+	uint32_t sent = 0;
+	for (auto& update : presentations)
+		sent += sendDone(update.callbacks, msec);
+	// Only the ends of the deque can go, the rest is pointed at
+	while (!presentations.empty() && wl_list_empty(&presentations.front().feedback))
+		presentations.pop_front();
+	return sent;
+}
+
+uint32_t Surface::presented(const Presented& frame, const uint64_t serial) {
+	const auto since = frame.time.time_since_epoch();
+	lastPresented = frame.time;
+	const auto msec = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(since).count());
+	const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since);
+	const auto nanoseconds = static_cast<uint32_t>((since - seconds).count());
+	const auto tvSec = static_cast<uint64_t>(seconds.count());
+	uint32_t sent = 0;
+	// Updates after the serial the frame sampled wait for a frame that shows them. Those replaced
+	// before any display showed them were never presented, their callbacks are still due
+	while (!presentations.empty() && presentations.front().serial <= serial) {
+		auto& update = presentations.front();
+		sent += sendDone(update.callbacks, msec);
+		wl_resource* feedback;
+		wl_resource* tmp;
+		wl_resource_for_each_safe(feedback, tmp, &update.feedback) {
+			if (update.serial != serial) {
+				wp_presentation_feedback_send_discarded(feedback);
+			} else {
+				if (frame.output != nullptr)
+					if (auto* output = frame.output->getResource(wl_resource_get_client(feedback)))
+						wp_presentation_feedback_send_sync_output(feedback, output);
+				wp_presentation_feedback_send_presented(feedback, tvSec >> 32, tvSec & 0xffffffff, nanoseconds,
+					static_cast<uint32_t>(frame.refresh.count()), frame.sequence >> 32, frame.sequence & 0xffffffff,
+					frame.kind);
+			}
+			wl_resource_destroy(feedback);
+		}
+		presentations.pop_front();
+	}
+	return sent;
+}
+
+void Surface::discardPresentations() {
+	for (auto& update : presentations) {
+		wl_resource* resource;
+		wl_resource* tmp;
+		wl_resource_for_each_safe(resource, tmp, &update.callbacks)
+			wl_resource_destroy(resource);
+		sendDiscarded(update.feedback);
+	}
+	presentations.clear();
+}
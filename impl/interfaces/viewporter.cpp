@@ -0,0 +1,90 @@
+#include <algorithm>
+
+#include "mland/interfaces/viewporter.h"
+
+using namespace mland;
+using namespace mland::interfaces;
+
+Viewporter::Viewporter(wl_display* wlDisplay) :
+WLInterface(wlDisplay, &WLViewporterImplementation, &wp_viewporter_interface, 1) {}
+
+void Viewporter::bind(wl_client* client, const uint32_t version, const uint32_t id) {
+	MDEBUG << "Binding viewporter" << endl;
+	createClient(client, version, id);
+}
+
+void Viewporter::destroyViewporter(wl_client* client, wl_resource* resource) {
+	// Viewports already handed out keep working
+	wl_resource_destroy(resource);
+}
+
+void Viewporter::getViewport(wl_client* client, wl_resource* resource, const uint32_t id, wl_resource* surface) {
+	auto* target = Surface::from(surface);
+	if (target->viewport != nullptr) {
+		wl_resource_post_error(resource, WP_VIEWPORTER_ERROR_VIEWPORT_EXISTS, "surface already has a viewport");
+		return;
+	}
+	auto* viewport = wl_resource_create(client, &wp_viewport_interface, wl_resource_get_version(resource), id);
+	if (viewport == nullptr) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(viewport, &WLViewportImplementation, target, onViewportDestroy);
+	target->viewport = viewport;
+}
+
+Surface* Viewporter::surfaceFrom(wl_resource* viewport) {
+	auto* surface = static_cast<Surface*>(wl_resource_get_user_data(viewport));
+	if (surface == nullptr)
+		wl_resource_post_error(viewport, WP_VIEWPORT_ERROR_NO_SURFACE, "the surface is gone");
+	return surface;
+}
+
+void Viewporter::onViewportDestroy(wl_resource* resource) {
+	auto* surface = static_cast<Surface*>(wl_resource_get_user_data(resource));
+	if (surface == nullptr)
+		return;
+	auto& pending = *surface->pending;
+	pending.source = {-1.0, -1.0, -1.0, -1.0};
+	pending.destinationWidth = -1;
+	pending.destinationHeight = -1;
+	pending.changed |= SurfaceState::eViewport;
+	surface->viewport = nullptr;
+}
+
+void Viewporter::destroyViewport(wl_client* client, wl_resource* resource) {
+	wl_resource_destroy(resource);
+}
+
+void Viewporter::setSource(wl_client* client, wl_resource* resource, const wl_fixed_t x, const wl_fixed_t y,
+	const wl_fixed_t width, const wl_fixed_t height) {
+	auto* surface = surfaceFrom(resource);
+	if (surface == nullptr)
+		return;
+	const std::array source{wl_fixed_to_double(x), wl_fixed_to_double(y), wl_fixed_to_double(width),
+		wl_fixed_to_double(height)};
+	const bool unset = std::ranges::all_of(source, [](const double v) { return v == -1.0; });
+	if (!unset && (source[0] < 0.0 || source[1] < 0.0 || source[2] <= 0.0 || source[3] <= 0.0)) {
+		wl_resource_post_error(resource, WP_VIEWPORT_ERROR_BAD_VALUE, "invalid source %f,%f %f x %f",
+			source[0], source[1], source[2], source[3]);
+		return;
+	}
+	auto& pending = *surface->pending;
+	pending.source = source;
+	pending.changed |= SurfaceState::eViewport;
+}
+
+void Viewporter::setDestination(wl_client* client, wl_resource* resource, const int32_t width, const int32_t height) {
+	auto* surface = surfaceFrom(resource);
+	if (surface == nullptr)
+		return;
+	const bool unset = width == -1 && height == -1;
+	if (!unset && (width <= 0 || height <= 0)) {
+		wl_resource_post_error(resource, WP_VIEWPORT_ERROR_BAD_VALUE, "invalid destination %d x %d", width, height);
+		return;
+	}
+	auto& pending = *surface->pending;
+	pending.destinationWidth = width;
+	pending.destinationHeight = height;
+	pending.changed |= SurfaceState::eViewport;
+}
@@ -16,10 +16,14 @@ static void set_log_level();
 static DrmBackend::DrmPaths get_drm_paths();
 static bool get_validation_layers();
 static int get_max_windows();
+static void set_texture_cache_budget();
+static void set_wallpaper();
 
 
 int main() {
 	set_log_level();
+	set_texture_cache_budget();
+	set_wallpaper();
 	MINFO << "Starting MephLand Compositor" << endl;
 	u_ptr<Backend> backend;
 
@@ -93,4 +97,17 @@ static int get_max_windows() {
 		return std::strtoul(max_env, nullptr, 10);
 	}
 	return 1;
+}
+
+static void set_texture_cache_budget() {
+	if (const auto cache_env = std::getenv(TEXTURE_CACHE_MB)) {
+		globals::textureCacheBudget = std::strtoull(cache_env, nullptr, 10) * 1024 * 1024;
+	}
+}
+
+static void set_wallpaper() {
+	if (const auto wallpaper_env = std::getenv(WALLPAPER)) {
+		MDEBUG << "Using wallpaper " << wallpaper_env << endl;
+		globals::wallpaperPath = wallpaper_env;
+	}
 }
\ No newline at end of file
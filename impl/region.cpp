@@ -0,0 +1,517 @@
+#include "mland/region.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MLAND_REGION_X86
+#endif
+
+using namespace mland;
+
+namespace {
+static_assert(sizeof(Box) == 4 * sizeof(int32_t) && alignof(Box) == alignof(int32_t),
+	"The kernels load a box as four packed int32");
+
+// The loops every region operation spends its time in
+struct Kernels {
+	cstr name;
+	// Whether two bands of n boxes have the same spans
+	bool (*bandsEqual)(const Box* a, const Box* b, size_t n);
+	// Number of boxes sharing the first box's band
+	size_t (*bandEnd)(const Box* boxes, size_t n);
+	void (*translate)(Box* boxes, size_t n, int32_t dx, int32_t dy);
+	// Smallest x1 and largest x2
+	void (*span)(const Box* boxes, size_t n, int32_t& x1, int32_t& x2);
+	// Copies the x of n spans into out with the band's y1 and y2
+	void (*emitBand)(Box* out, const Box* spans, size_t n, int32_t y1, int32_t y2);
+};
+
+bool bandsEqualScalar(const Box* a, const Box* b, const size_t n) {
+	for (size_t i = 0; i < n; i++)
+		if (a[i].x1 != b[i].x1 || a[i].x2 != b[i].x2)
+			return false;
+	return true;
+}
+
+size_t bandEndScalar(const Box* boxes, const size_t n) {
+	size_t i = 1;
+	while (i < n && boxes[i].y1 == boxes[0].y1)
+		i++;
+	return i;
+}
+
+void translateScalar(Box* boxes, const size_t n, const int32_t dx, const int32_t dy) {
+	for (size_t i = 0; i < n; i++)
+		boxes[i] = {boxes[i].x1 + dx, boxes[i].y1 + dy, boxes[i].x2 + dx, boxes[i].y2 + dy};
+}
+
+void spanScalar(const Box* boxes, const size_t n, int32_t& x1, int32_t& x2) {
+	x1 = std::numeric_limits<int32_t>::max();
+	x2 = std::numeric_limits<int32_t>::min();
+	for (size_t i = 0; i < n; i++) {
+		x1 = std::min(x1, boxes[i].x1);
+		x2 = std::max(x2, boxes[i].x2);
+	}
+}
+
+void emitBandScalar(Box* out, const Box* spans, const size_t n, const int32_t y1, const int32_t y2) {
+	for (size_t i = 0; i < n; i++)
+		out[i] = {spans[i].x1, y1, spans[i].x2, y2};
+}
+
+constexpr Kernels SCALAR{"scalar", bandsEqualScalar, bandEndScalar, translateScalar, spanScalar, emitBandScalar};
+
+#ifdef MLAND_REGION_X86
+// A box is one 128 bit lane: x1 y1 x2 y2. Byte masks of the x1 and x2 lanes after movemask
+constexpr int X_LANES_128 = 0x0F0F;
+constexpr int X_LANES_256 = 0x0F0F0F0F;
+constexpr int Y1_LANES_256 = 0x00F000F0;
+
+__attribute__((target("sse2")))
+__m128i loadBox(const Box* box) {
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(box));
+}
+
+__attribute__((target("sse2")))
+bool bandsEqualSse2(const Box* a, const Box* b, const size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		const auto eq = _mm_cmpeq_epi32(loadBox(a + i), loadBox(b + i));
+		if ((_mm_movemask_epi8(eq) & X_LANES_128) != X_LANES_128)
+			return false;
+	}
+	return true;
+}
+
+// Transposes four boxes at a time so their y1 land in one register
+__attribute__((target("sse2")))
+size_t bandEndSse2(const Box* boxes, const size_t n) {
+	const auto y = _mm_set1_epi32(boxes[0].y1);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const auto xy01 = _mm_unpacklo_epi32(loadBox(boxes + i), loadBox(boxes + i + 1));
+		const auto xy23 = _mm_unpacklo_epi32(loadBox(boxes + i + 2), loadBox(boxes + i + 3));
+		const auto mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_unpackhi_epi64(xy01, xy23), y)));
+		if (mask != 0xF)
+			return i + static_cast<size_t>(__builtin_ctz(~mask));
+	}
+	while (i < n && boxes[i].y1 == boxes[0].y1)
+		i++;
+	return i;
+}
+
+__attribute__((target("sse2")))
+void translateSse2(Box* boxes, const size_t n, const int32_t dx, const int32_t dy) {
+	const auto delta = _mm_set_epi32(dy, dx, dy, dx);
+	for (size_t i = 0; i < n; i++)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(boxes + i), _mm_add_epi32(loadBox(boxes + i), delta));
+}
+
+// SSE2 has no 32 bit min and max, so they go through a compare
+__attribute__((target("sse2")))
+void spanSse2(const Box* boxes, const size_t n, int32_t& x1, int32_t& x2) {
+	auto lo = loadBox(boxes);
+	auto hi = lo;
+	for (size_t i = 1; i < n; i++) {
+		const auto box = loadBox(boxes + i);
+		const auto less = _mm_cmplt_epi32(box, lo);
+		lo = _mm_or_si128(_mm_and_si128(less, box), _mm_andnot_si128(less, lo));
+		const auto greater = _mm_cmpgt_epi32(box, hi);
+		hi = _mm_or_si128(_mm_and_si128(greater, box), _mm_andnot_si128(greater, hi));
+	}
+	x1 = _mm_cvtsi128_si32(lo);
+	x2 = _mm_cvtsi128_si32(_mm_shuffle_epi32(hi, 2));
+}
+
+__attribute__((target("sse2")))
+void emitBandSse2(Box* out, const Box* spans, const size_t n, const int32_t y1, const int32_t y2) {
+	const auto xs = _mm_set_epi32(0, -1, 0, -1);
+	const auto ys = _mm_set_epi32(y2, 0, y1, 0);
+	for (size_t i = 0; i < n; i++) {
+		const auto box = _mm_or_si128(_mm_and_si128(loadBox(spans + i), xs), ys);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), box);
+	}
+}
+
+constexpr Kernels SSE2{"sse2", bandsEqualSse2, bandEndSse2, translateSse2, spanSse2, emitBandSse2};
+
+__attribute__((target("avx2")))
+__m256i loadBoxes(const Box* boxes) {
+	return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(boxes));
+}
+
+__attribute__((target("avx2")))
+bool bandsEqualAvx2(const Box* a, const Box* b, const size_t n) {
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		const auto eq = _mm256_cmpeq_epi32(loadBoxes(a + i), loadBoxes(b + i));
+		if ((_mm256_movemask_epi8(eq) & X_LANES_256) != X_LANES_256)
+			return false;
+	}
+	return i == n || bandsEqualSse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+size_t bandEndAvx2(const Box* boxes, const size_t n) {
+	const auto y = _mm256_set1_epi32(boxes[0].y1);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		const auto mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(loadBoxes(boxes + i), y)) & Y1_LANES_256;
+		if (mask != Y1_LANES_256)
+			return i + ((mask & 0xF0) ? 1 : 0);
+	}
+	return i < n && boxes[i].y1 == boxes[0].y1 ? n : i;
+}
+
+__attribute__((target("avx2")))
+void translateAvx2(Box* boxes, const size_t n, const int32_t dx, const int32_t dy) {
+	const auto delta = _mm256_set_epi32(dy, dx, dy, dx, dy, dx, dy, dx);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2)
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(boxes + i), _mm256_add_epi32(loadBoxes(boxes + i), delta));
+	if (i < n)
+		translateSse2(boxes + i, n - i, dx, dy);
+}
+
+__attribute__((target("avx2")))
+void spanAvx2(const Box* boxes, const size_t n, int32_t& x1, int32_t& x2) {
+	if (n < 2) {
+		spanSse2(boxes, n, x1, x2);
+		return;
+	}
+	auto lo = loadBoxes(boxes);
+	auto hi = lo;
+	size_t i = 2;
+	for (; i + 2 <= n; i += 2) {
+		const auto two = loadBoxes(boxes + i);
+		lo = _mm256_min_epi32(lo, two);
+		hi = _mm256_max_epi32(hi, two);
+	}
+	auto lo128 = _mm_min_epi32(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1));
+	auto hi128 = _mm_max_epi32(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1));
+	if (i < n) {
+		lo128 = _mm_min_epi32(lo128, loadBox(boxes + i));
+		hi128 = _mm_max_epi32(hi128, loadBox(boxes + i));
+	}
+	x1 = _mm_cvtsi128_si32(lo128);
+	x2 = _mm_cvtsi128_si32(_mm_shuffle_epi32(hi128, 2));
+}
+
+__attribute__((target("avx2")))
+void emitBandAvx2(Box* out, const Box* spans, const size_t n, const int32_t y1, const int32_t y2) {
+	const auto ys = _mm256_set_epi32(y2, 0, y1, 0, y2, 0, y1, 0);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2)
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_blend_epi32(loadBoxes(spans + i), ys, 0xAA));
+	if (i < n)
+		emitBandSse2(out + i, spans + i, n - i, y1, y2);
+}
+
+constexpr Kernels AVX2{"avx2", bandsEqualAvx2, bandEndAvx2, translateAvx2, spanAvx2, emitBandAvx2};
+#endif
+
+// Slowest first
+vec<const Kernels*> supportedKernels() {
+	vec<const Kernels*> ret{&SCALAR};
+#ifdef MLAND_REGION_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		ret.push_back(&SSE2);
+	if (__builtin_cpu_supports("avx2"))
+		ret.push_back(&AVX2);
+#endif
+	return ret;
+}
+
+const Kernels*& current() {
+	static const Kernels* picked = supportedKernels().back();
+	return picked;
+}
+
+const Kernels& active() {
+	return *current();
+}
+
+bool overlap(const Box& a, const Box& b) {
+	return a.x1 < b.x2 && b.x1 < a.x2 && a.y1 < b.y2 && b.y1 < a.y2;
+}
+}
+
+BandedRegion& BandedRegion::operator=(const BandedRegion& other) {
+	if (this != &other) {
+		rects = other.rects;
+		ext = other.ext;
+	}
+	return *this;
+}
+
+cstr BandedRegion::kernels() {
+	return active().name;
+}
+
+bool BandedRegion::useKernels(const std::string_view name) {
+	for (const auto* kernels : supportedKernels()) {
+		if (kernels->name != name)
+			continue;
+		current() = kernels;
+		return true;
+	}
+	return false;
+}
+
+void BandedRegion::clear() {
+	rects.clear();
+	ext = {};
+}
+
+void BandedRegion::reset(const Box& box) {
+	// box may be our own extents
+	const auto copy = box;
+	rects.clear();
+	ext = {};
+	if (copy.empty())
+		return;
+	rects.push_back(copy);
+	ext = copy;
+}
+
+uint64_t BandedRegion::area() const {
+	uint64_t ret = 0;
+	for (const auto& box : rects)
+		ret += box.area();
+	return ret;
+}
+
+void BandedRegion::unite(const BandedRegion& other) {
+	if (other.empty() || this == &other)
+		return;
+	if (empty()) {
+		*this = other;
+		return;
+	}
+	combine(rects, other.rects, Op::eUnion);
+}
+
+void BandedRegion::unite(const Box& box) {
+	if (box.empty())
+		return;
+	if (empty() || (box.x1 <= ext.x1 && box.y1 <= ext.y1 && box.x2 >= ext.x2 && box.y2 >= ext.y2)) {
+		reset(box);
+		return;
+	}
+	combine(rects, {&box, 1}, Op::eUnion);
+}
+
+void BandedRegion::intersect(const BandedRegion& other) {
+	if (this == &other)
+		return;
+	if (empty() || other.empty() || !overlap(ext, other.ext)) {
+		clear();
+		return;
+	}
+	combine(rects, other.rects, Op::eIntersect);
+}
+
+void BandedRegion::intersect(const Box& box) {
+	if (empty() || box.empty() || !overlap(ext, box)) {
+		clear();
+		return;
+	}
+	// Already inside
+	if (box.x1 <= ext.x1 && box.y1 <= ext.y1 && box.x2 >= ext.x2 && box.y2 >= ext.y2)
+		return;
+	combine(rects, {&box, 1}, Op::eIntersect);
+}
+
+void BandedRegion::subtract(const BandedRegion& other) {
+	if (this == &other) {
+		clear();
+		return;
+	}
+	if (empty() || other.empty() || !overlap(ext, other.ext))
+		return;
+	combine(rects, other.rects, Op::eSubtract);
+}
+
+void BandedRegion::subtract(const Box& box) {
+	if (empty() || box.empty() || !overlap(ext, box))
+		return;
+	combine(rects, {&box, 1}, Op::eSubtract);
+}
+
+void BandedRegion::translate(const int32_t dx, const int32_t dy) {
+	if (empty() || (dx == 0 && dy == 0))
+		return;
+	active().translate(rects.data(), rects.size(), dx, dy);
+	ext = {ext.x1 + dx, ext.y1 + dy, ext.x2 + dx, ext.y2 + dy};
+}
+
+bool BandedRegion::contains(const int32_t x, const int32_t y) const {
+	if (x < ext.x1 || x >= ext.x2 || y < ext.y1 || y >= ext.y2)
+		return false;
+	for (const auto& box : rects) {
+		if (box.y1 > y)
+			break;
+		if (y < box.y2 && x >= box.x1 && x < box.x2)
+			return true;
+	}
+	return false;
+}
+
+BandedRegion::Overlap BandedRegion::overlaps(const Box& box) const {
+	if (box.empty() || empty() || !overlap(ext, box))
+		return Overlap::eOut;
+	// The boxes are disjoint, so box is inside exactly when they cover all of it
+	uint64_t covered = 0;
+	for (const auto& r : rects) {
+		if (r.y1 >= box.y2)
+			break;
+		covered += Box{std::max(r.x1, box.x1), std::max(r.y1, box.y1),
+			std::min(r.x2, box.x2), std::min(r.y2, box.y2)}.area();
+	}
+	if (covered == 0)
+		return Overlap::eOut;
+	return covered == box.area() ? Overlap::eIn : Overlap::ePart;
+}
+
+bool BandedRegion::operator==(const BandedRegion& other) const {
+	return std::ranges::equal(rects, other.rects);
+}
+
+// Sweeps both regions band by band from the top, the way pixman's region_op does. Parts of a
+// band only one side covers are copied for the ops that keep them, overlapping parts get their
+// spans merged
+void BandedRegion::combine(const std::span<const Box> a, const std::span<const Box> b, const Op op) {
+	const bool keepA = op != Op::eIntersect;
+	const bool keepB = op == Op::eUnion;
+	scratch.clear();
+	size_t prevBand = 0;
+	size_t ia = 0;
+	size_t ib = 0;
+	int32_t ybot = std::numeric_limits<int32_t>::min();
+	if (!a.empty() && !b.empty())
+		ybot = std::min(a[0].y1, b[0].y1);
+	while (ia < a.size() && ib < b.size()) {
+		const auto aEnd = ia + active().bandEnd(&a[ia], a.size() - ia);
+		const auto bEnd = ib + active().bandEnd(&b[ib], b.size() - ib);
+		const auto& ra = a[ia];
+		const auto& rb = b[ib];
+		int32_t ytop;
+		if (ra.y1 < rb.y1) {
+			if (keepA) {
+				const auto top = std::max(ra.y1, ybot);
+				const auto bot = std::min(ra.y2, rb.y1);
+				if (top < bot)
+					appendBand(a.subspan(ia, aEnd - ia), top, bot, prevBand);
+			}
+			ytop = rb.y1;
+		} else if (rb.y1 < ra.y1) {
+			if (keepB) {
+				const auto top = std::max(rb.y1, ybot);
+				const auto bot = std::min(rb.y2, ra.y1);
+				if (top < bot)
+					appendBand(b.subspan(ib, bEnd - ib), top, bot, prevBand);
+			}
+			ytop = ra.y1;
+		} else
+			ytop = ra.y1;
+		ybot = std::min(ra.y2, rb.y2);
+		if (ybot > ytop) {
+			mergeSpans(a.subspan(ia, aEnd - ia), b.subspan(ib, bEnd - ib), op);
+			appendBand(spans, ytop, ybot, prevBand);
+		}
+		if (ra.y2 == ybot)
+			ia = aEnd;
+		if (rb.y2 == ybot)
+			ib = bEnd;
+	}
+	// Whatever is left of one side lies below everything of the other
+	const auto appendRest = [&](const std::span<const Box> rest, size_t i) {
+		while (i < rest.size()) {
+			const auto end = i + active().bandEnd(&rest[i], rest.size() - i);
+			const auto top = std::max(rest[i].y1, ybot);
+			if (top < rest[i].y2)
+				appendBand(rest.subspan(i, end - i), top, rest[i].y2, prevBand);
+			i = end;
+		}
+	};
+	if (keepA)
+		appendRest(a, ia);
+	if (keepB)
+		appendRest(b, ib);
+	std::swap(rects, scratch);
+	updateExtents();
+}
+
+// Spans of one band are sorted and never touch, so all three ops are a single merge pass
+void BandedRegion::mergeSpans(const std::span<const Box> a, const std::span<const Box> b, const Op op) {
+	spans.clear();
+	size_t i = 0;
+	size_t j = 0;
+	switch (op) {
+	case Op::eUnion:
+		while (i < a.size() || j < b.size()) {
+			const auto& next = j == b.size() || (i < a.size() && a[i].x1 <= b[j].x1) ? a[i++] : b[j++];
+			if (!spans.empty() && next.x1 <= spans.back().x2)
+				spans.back().x2 = std::max(spans.back().x2, next.x2);
+			else
+				spans.push_back({next.x1, 0, next.x2, 0});
+		}
+		break;
+	case Op::eIntersect:
+		while (i < a.size() && j < b.size()) {
+			const auto x1 = std::max(a[i].x1, b[j].x1);
+			const auto x2 = std::min(a[i].x2, b[j].x2);
+			if (x1 < x2)
+				spans.push_back({x1, 0, x2, 0});
+			if (a[i].x2 < b[j].x2)
+				i++;
+			else
+				j++;
+		}
+		break;
+	case Op::eSubtract:
+		for (; i < a.size(); i++) {
+			auto x1 = a[i].x1;
+			const auto x2 = a[i].x2;
+			// Spans of b that end before this one also end before the following ones
+			while (j < b.size() && b[j].x2 <= x1)
+				j++;
+			for (auto k = j; k < b.size() && b[k].x1 < x2 && x1 < x2; k++) {
+				if (b[k].x1 > x1)
+					spans.push_back({x1, 0, b[k].x1, 0});
+				x1 = std::max(x1, b[k].x2);
+			}
+			if (x1 < x2)
+				spans.push_back({x1, 0, x2, 0});
+		}
+		break;
+	}
+}
+
+// Appends a band and merges it into the band above when that one ends where this one starts
+// and covers the same spans
+void BandedRegion::appendBand(const std::span<const Box> band, const int32_t y1, const int32_t y2, size_t& prevBand) {
+	if (band.empty())
+		return;
+	const auto start = scratch.size();
+	const auto prevCount = start - prevBand;
+	if (start > 0 && prevCount == band.size() && scratch[prevBand].y2 == y1 &&
+		active().bandsEqual(&scratch[prevBand], band.data(), band.size())) {
+		for (auto i = prevBand; i < start; i++)
+			scratch[i].y2 = y2;
+		return;
+	}
+	// band may be spans or part of a region, never scratch itself
+	scratch.resize(start + band.size());
+	active().emitBand(&scratch[start], band.data(), band.size(), y1, y2);
+	prevBand = start;
+}
+
+void BandedRegion::updateExtents() {
+	if (rects.empty()) {
+		ext = {};
+		return;
+	}
+	ext.y1 = rects.front().y1;
+	ext.y2 = rects.back().y2;
+	active().span(rects.data(), rects.size(), ext.x1, ext.x2);
+}
@@ -19,4 +19,13 @@ static constexpr uint8_t bytes_frag[] = {
 const VShader mland::FRAG_SHADER = {
 	.len = sizeof(bytes_frag),
 	.bytes = bytes_frag
-};
\ No newline at end of file
+};
+
+static constexpr uint8_t bytes_ycbcr[] = {
+#embed "ycbcr.frag.spv"
+};
+
+const VShader mland::YCBCR_FRAG_SHADER = {
+	.len = sizeof(bytes_ycbcr),
+	.bytes = bytes_ycbcr
+};
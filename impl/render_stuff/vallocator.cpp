@@ -0,0 +1,340 @@
+#include <algorithm>
+#include "mland/vallocator.h"
+
+using namespace mland;
+
+VAllocation::VAllocation(VAllocation&& other) noexcept {
+	adopt(std::move(other));
+}
+
+VAllocation& VAllocation::operator=(VAllocation&& other) noexcept {
+	if (this == &other)
+		return *this;
+	reset();
+	adopt(std::move(other));
+	return *this;
+}
+
+VAllocation::~VAllocation() {
+	reset();
+}
+
+void VAllocation::adopt(VAllocation&& other) noexcept {
+	allocator = std::exchange(other.allocator, nullptr);
+	block = std::exchange(other.block, nullptr);
+	slot = other.slot;
+	memoryType = other.memoryType;
+	memory = std::exchange(other.memory, nullptr);
+	offset = std::exchange(other.offset, 0);
+	size = std::exchange(other.size, 0);
+	mapped = std::exchange(other.mapped, nullptr);
+}
+
+void VAllocation::reset() {
+	if (!allocator)
+		return;
+	allocator->free(*this);
+	allocator = nullptr;
+	block = nullptr;
+	memory = nullptr;
+	offset = 0;
+	size = 0;
+	mapped = nullptr;
+}
+
+bool VAllocation::isDedicated() const {
+	return block && block->dedicated;
+}
+
+VAllocator::VAllocator(const vkr::Device& dev, const vkr::PhysicalDevice& pDev, const str& name) :
+dev(dev), name(name) {
+	memProps = pDev.getMemoryProperties();
+	maxAllocations = pDev.getProperties().limits.maxMemoryAllocationCount;
+	vk::DeviceSize smallestHeap = std::numeric_limits<vk::DeviceSize>::max();
+	for (uint32_t i = 0; i < memProps.memoryHeapCount; i++) {
+		if (memProps.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal)
+			smallestHeap = std::min(smallestHeap, memProps.memoryHeaps[i].size);
+	}
+	// Integrated GPUs can have a tiny device local carve out, don't let a single pool eat it
+	while (blockSize > MAX_CLASS_SIZE && blockSize * 8 > smallestHeap)
+		blockSize /= 2;
+	pools.resize(memProps.memoryTypeCount * 2 * CLASS_COUNT);
+	MDEBUG << name << " Created allocator with " << memProps.memoryTypeCount << " memory types and "
+		<< blockSize / 1024 << "KiB blocks" << endl;
+}
+
+VAllocator::~VAllocator() {
+	const auto stats = getStats();
+	if (stats.allocationCount != 0)
+		MWARN << name << " Allocator destroyed with " << stats.allocationCount << " live allocations" << endl;
+	MDEBUG << name << " Destroying allocator: " << stats.blockCount << " blocks, " << stats.dedicatedCount
+		<< " dedicated, " << stats.reservedBytes() / 1024 << "KiB reserved" << endl;
+	dedicatedBlocks.clear();
+	pools.clear();
+}
+
+constexpr uint32_t VAllocator::sizeClass(const vk::DeviceSize size) {
+	uint32_t cls = 0;
+	while (cls < CLASS_COUNT - 1 && (MIN_CLASS_SIZE << cls) < size)
+		cls++;
+	return cls;
+}
+
+opt<uint32_t> VAllocator::findMemoryType(const uint32_t typeBits, const vk::MemoryPropertyFlags required,
+	const vk::MemoryPropertyFlags preferred, const vk::MemoryPropertyFlags excluded) const {
+	for (const auto flags : {required | preferred, required}) {
+		for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) {
+			if (!(typeBits & (1u << i)))
+				continue;
+			const auto typeFlags = memProps.memoryTypes[i].propertyFlags;
+			if ((typeFlags & flags) == flags && !(typeFlags & excluded))
+				return i;
+		}
+	}
+	return std::nullopt;
+}
+
+opt<VAllocation> VAllocator::allocate(const Request& request) {
+	const auto memoryType = findMemoryType(request.requirements.memoryTypeBits, request.required, request.preferred,
+		request.excluded);
+	if (!memoryType.has_value()) {
+		MERROR << name << " No memory type matches " << request.requirements.memoryTypeBits << endl;
+		return std::nullopt;
+	}
+	const bool dedicated = request.dedicated ||
+		request.requirements.size > MAX_CLASS_SIZE ||
+		request.requirements.alignment > MAX_CLASS_SIZE;
+	auto ret = dedicated ?
+		allocateDedicated(request, memoryType.value()) :
+		allocateFromPool(request, memoryType.value());
+	if (ret.has_value() || !request.preferred)
+		return ret;
+
+	// The preferred memory type might just be full, try again with the bare requirements
+	const auto fallback = findMemoryType(request.requirements.memoryTypeBits, request.required, {}, request.excluded);
+	if (!fallback.has_value() || fallback.value() == memoryType.value())
+		return std::nullopt;
+	MDEBUG << name << " Falling back from memory type " << memoryType.value() << " to " << fallback.value() << endl;
+	return dedicated ?
+		allocateDedicated(request, fallback.value()) :
+		allocateFromPool(request, fallback.value());
+}
+
+opt<VAllocation> VAllocator::allocate(const vkr::Image& image, const vk::MemoryPropertyFlags required,
+	const vk::MemoryPropertyFlags preferred, const bool linear, const vk::MemoryPropertyFlags excluded) {
+	const vk::ImageMemoryRequirementsInfo2 info{
+		.image = image
+	};
+	const auto reqs = dev.getImageMemoryRequirements2<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>(info);
+	const auto& dedicatedReqs = reqs.get<vk::MemoryDedicatedRequirements>();
+	const Request request{
+		.requirements = reqs.get<vk::MemoryRequirements2>().memoryRequirements,
+		.required = required,
+		.preferred = preferred,
+		.excluded = excluded,
+		.linear = linear,
+		.dedicated = dedicatedReqs.prefersDedicatedAllocation || dedicatedReqs.requiresDedicatedAllocation,
+		.dedicatedImage = image
+	};
+	auto ret = allocate(request);
+	if (!ret.has_value())
+		return std::nullopt;
+	image.bindMemory(ret->getMemory(), ret->getOffset());
+	return ret;
+}
+
+opt<VAllocation> VAllocator::allocate(const vkr::Buffer& buffer, const vk::MemoryPropertyFlags required,
+	const vk::MemoryPropertyFlags preferred) {
+	const vk::BufferMemoryRequirementsInfo2 info{
+		.buffer = buffer
+	};
+	const auto reqs = dev.getBufferMemoryRequirements2<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>(info);
+	const auto& dedicatedReqs = reqs.get<vk::MemoryDedicatedRequirements>();
+	const Request request{
+		.requirements = reqs.get<vk::MemoryRequirements2>().memoryRequirements,
+		.required = required,
+		.preferred = preferred,
+		.linear = true,
+		.dedicated = dedicatedReqs.prefersDedicatedAllocation || dedicatedReqs.requiresDedicatedAllocation,
+		.dedicatedBuffer = buffer
+	};
+	auto ret = allocate(request);
+	if (!ret.has_value())
+		return std::nullopt;
+	buffer.bindMemory(ret->getMemory(), ret->getOffset());
+	return ret;
+}
+
+opt<u_ptr<VAllocator::Block>> VAllocator::createBlock(const uint32_t memoryType, const vk::DeviceSize size, const void* pNext) {
+	if (maxAllocations != 0 && totalStats.blockCount + totalStats.dedicatedCount >= maxAllocations) {
+		MERROR << name << " Reached maxMemoryAllocationCount (" << maxAllocations << ")" << endl;
+		return std::nullopt;
+	}
+	const vk::MemoryAllocateInfo allocInfo{
+		.pNext = pNext,
+		.allocationSize = size,
+		.memoryTypeIndex = memoryType
+	};
+	auto res = dev.allocateMemory(allocInfo);
+	if (!res.has_value()) {
+		MWARN << name << " Failed to allocate " << size / 1024 << "KiB from memory type " << memoryType
+			<< ": " << to_str(res.error()) << endl;
+		return std::nullopt;
+	}
+	u_ptr<Block> block(new Block{});
+	block->memory = std::move(res.value());
+	block->memoryType = memoryType;
+	block->size = size;
+	// Host visible memory stays mapped for its whole life, mapping is not free
+	if (memProps.memoryTypes[memoryType].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible) {
+		void* ptr = nullptr;
+		const auto mapRes = static_cast<vk::Result>(vkMapMemory(*dev, *block->memory, 0, VK_WHOLE_SIZE, 0, &ptr));
+		if (mapRes != vk::Result::eSuccess) {
+			MWARN << name << " Failed to map memory: " << to_str(mapRes) << endl;
+			return std::nullopt;
+		}
+		block->mapped = ptr;
+	}
+	return opt<u_ptr<Block>>(std::move(block));
+}
+
+opt<VAllocation> VAllocator::allocateDedicated(const Request& request, const uint32_t memoryType) {
+	const vk::MemoryDedicatedAllocateInfo dedicatedInfo{
+		.image = request.dedicatedImage,
+		.buffer = request.dedicatedBuffer
+	};
+	const bool hasResource = request.dedicatedImage || request.dedicatedBuffer;
+	const auto size = request.requirements.size;
+	Block* raw;
+	{
+		std::lock_guard lock(mutex);
+		auto block = createBlock(memoryType, size, hasResource ? &dedicatedInfo : nullptr);
+		if (!block.has_value())
+			return std::nullopt;
+		raw = block.value().get();
+		raw->dedicated = true;
+		raw->slotSize = size;
+		raw->used = 1;
+		dedicatedBlocks.emplace(raw, std::move(block.value()));
+		account(memoryType, 0, 1, 1, 0, size, size);
+	}
+	MDEBUG << name << " Dedicated allocation of " << size / 1024 << "KiB" << endl;
+	VAllocation ret;
+	ret.allocator = this;
+	ret.block = raw;
+	ret.slot = 0;
+	ret.memoryType = memoryType;
+	ret.memory = *raw->memory;
+	ret.offset = 0;
+	ret.size = size;
+	ret.mapped = raw->mapped;
+	return ret;
+}
+
+opt<VAllocation> VAllocator::allocateFromPool(const Request& request, const uint32_t memoryType) {
+	const auto cls = sizeClass(std::max(request.requirements.size, request.requirements.alignment));
+	const vk::DeviceSize slotSize = MIN_CLASS_SIZE << cls;
+	const auto index = poolIndex(memoryType, request.linear, cls);
+	Block* target = nullptr;
+	uint32_t slot;
+	{
+		std::lock_guard lock(mutex);
+		auto& [blocks] = pools[index];
+		for (const auto& block : blocks) {
+			if (!block->freeSlots.empty()) {
+				target = block.get();
+				break;
+			}
+		}
+		if (target == nullptr) {
+			auto block = createBlock(memoryType, blockSize, nullptr);
+			if (!block.has_value())
+				return std::nullopt;
+			target = block.value().get();
+			const auto slots = static_cast<uint32_t>(blockSize / slotSize);
+			target->pool = index;
+			target->slotSize = slotSize;
+			target->freeSlots.reserve(slots);
+			// Reversed so the lowest offsets get handed out first
+			for (uint32_t i = slots; i > 0; i--)
+				target->freeSlots.push_back(i - 1);
+			blocks.push_back(std::move(block.value()));
+			account(memoryType, 1, 0, 0, blockSize, 0, 0);
+			MDEBUG << name << " New block for memory type " << memoryType << " with " << slots
+				<< " slots of " << slotSize / 1024 << "KiB" << endl;
+		}
+		slot = target->freeSlots.back();
+		target->freeSlots.pop_back();
+		target->used++;
+		account(memoryType, 0, 0, 1, 0, 0, request.requirements.size);
+	}
+	VAllocation ret;
+	ret.allocator = this;
+	ret.block = target;
+	ret.slot = slot;
+	ret.memoryType = memoryType;
+	ret.memory = *target->memory;
+	ret.offset = slot * slotSize;
+	ret.size = request.requirements.size;
+	ret.mapped = target->mapped ? static_cast<char*>(target->mapped) + ret.offset : nullptr;
+	return ret;
+}
+
+void VAllocator::free(VAllocation& allocation) {
+	std::lock_guard lock(mutex);
+	Block* block = allocation.block;
+	const auto size = static_cast<int64_t>(allocation.size);
+	if (block->dedicated) {
+		account(allocation.memoryType, 0, -1, -1, 0, -size, -size);
+		dedicatedBlocks.erase(block);
+		return;
+	}
+	block->freeSlots.push_back(allocation.slot);
+	block->used--;
+	account(allocation.memoryType, 0, 0, -1, 0, 0, -size);
+	if (block->used != 0)
+		return;
+	// Keep one empty block per pool so a client resizing in a loop doesn't thrash vkAllocateMemory
+	auto& blocks = pools[block->pool].blocks;
+	const auto empty = std::ranges::count_if(blocks, [](const auto& b) { return b->used == 0; });
+	if (empty <= 1)
+		return;
+	account(block->memoryType, -1, 0, 0, -static_cast<int64_t>(block->size), 0, 0);
+	std::erase_if(blocks, [block](const auto& b) { return b.get() == block; });
+}
+
+void VAllocator::account(const uint32_t memoryType, const int64_t blocks, const int64_t dedicated,
+	const int64_t allocations, const int64_t blockBytes, const int64_t dedicatedBytes, const int64_t usedBytes) {
+	const auto apply = [&](Stats& stats) {
+		stats.blockCount += blocks;
+		stats.dedicatedCount += dedicated;
+		stats.allocationCount += allocations;
+		stats.blockBytes += blockBytes;
+		stats.dedicatedBytes += dedicatedBytes;
+		stats.usedBytes += usedBytes;
+	};
+	apply(heapStats[memProps.memoryTypes[memoryType].heapIndex]);
+	apply(totalStats);
+}
+
+VAllocator::Stats VAllocator::getStats() const {
+	std::lock_guard lock(mutex);
+	return totalStats;
+}
+
+VAllocator::Stats VAllocator::getHeapStats(const uint32_t heapIndex) const {
+	std::lock_guard lock(mutex);
+	return heapStats.at(heapIndex);
+}
+
+void VAllocator::trim() {
+	std::lock_guard lock(mutex);
+	for (auto& [blocks] : pools) {
+		std::erase_if(blocks, [this](const auto& b) {
+			if (b->used != 0)
+				return false;
+			account(b->memoryType, -1, 0, 0, -static_cast<int64_t>(b->size), 0, 0);
+			return true;
+		});
+	}
+}
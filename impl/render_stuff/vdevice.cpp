@@ -1,6 +1,12 @@
 #include "mland/vdevice.h"
 #include "mland/vdisplay.h"
 #include "mland/vshaders.h"
+#include "mland/vtexture_pool.h"
+#include "mland/vresidency.h"
+#include "mland/vsurface.h"
+#include "mland/vtexture_table.h"
+#include "mland/vdmabuf.h"
+#include "mland/globals.h"
 using namespace mland;
 
 template <typename T>
@@ -15,10 +21,10 @@ static constexpr uint8_t countBits(T bits) {
 	return count;
 }
 
-vkr::CommandBuffer VDevice::createCommandBuffer(const vkr::CommandPool& pool) {
+vkr::CommandBuffer VDevice::createCommandBuffer(const vkr::CommandPool& pool, const vk::CommandBufferLevel level) {
 	const vk::CommandBufferAllocateInfo cmdBufferAllocInfo{
 		.commandPool = pool,
-		.level = vk::CommandBufferLevel::ePrimary,
+		.level = level,
 		.commandBufferCount = 1
 	};
 
@@ -58,21 +64,209 @@ vkr::CommandPool VDevice::createCommandPool(const uint32_t queueFamilyIndex) {
 	return std::move(cmdRes.value());
 }
 
-void VDevice::submit(const uint32_t queueFamilyIndex, const vk::SubmitInfo& submitInfo, const vk::Fence& fence) {
-	auto& [mutex, queue] = queues.at(queueFamilyIndex);
-	std::lock_guard lock(mutex);
-	queue.submit(submitInfo, fence);
+VDevice::Ticket VDevice::submit(const uint32_t queueFamilyIndex, const vk::SubmitInfo& submitInfo, const vk::Fence& fence,
+	const std::span<const uint64_t> waitValues) {
+	auto& q = queues.at(queueFamilyIndex);
+	// Every submission also signals the queue timeline so resources can be retired without fences
+	assert(submitInfo.signalSemaphoreCount < MAX_SIGNAL_SEMAPHORES);
+	assert(waitValues.empty() || waitValues.size() == submitInfo.waitSemaphoreCount);
+	std::array<vk::Semaphore, MAX_SIGNAL_SEMAPHORES> signals{};
+	std::array<uint64_t, MAX_SIGNAL_SEMAPHORES> signalValues{};
+	const auto signalCount = submitInfo.signalSemaphoreCount;
+	std::copy_n(submitInfo.pSignalSemaphores, signalCount, signals.begin());
+	signals[signalCount] = *q.timeline;
+
+	std::lock_guard lock(q.mutex);
+	const auto value = q.submitted.load() + 1;
+	signalValues[signalCount] = value;
+	const vk::TimelineSemaphoreSubmitInfo timelineInfo{
+		.pNext = submitInfo.pNext,
+		.waitSemaphoreValueCount = static_cast<uint32_t>(waitValues.size()),
+		.pWaitSemaphoreValues = waitValues.data(),
+		.signalSemaphoreValueCount = signalCount + 1,
+		.pSignalSemaphoreValues = signalValues.data()
+	};
+	vk::SubmitInfo info = submitInfo;
+	info.pNext = &timelineInfo;
+	info.signalSemaphoreCount = signalCount + 1;
+	info.pSignalSemaphores = signals.data();
+	q.queue.submit(info, fence);
+	q.submitted.store(value);
+
+	Ticket ticket{};
+	if (queueFamilyIndex == graphicsIndex)
+		ticket.graphics = value;
+	if (queueFamilyIndex == transferIndex)
+		ticket.transfer = value;
+	return ticket;
 }
 
 vk::Result VDevice::present(const uint32_t queueFamilyIndex, const vk::PresentInfoKHR& presentInfo) {
-	auto& [mutex, queue] = queues.at(queueFamilyIndex);
-	std::lock_guard lock(mutex);
-	return queue.presentKHR(presentInfo);
+	auto& q = queues.at(queueFamilyIndex);
+	std::lock_guard lock(q.mutex);
+	return q.queue.presentKHR(presentInfo);
 }
 
 void VDevice::waitIdle(const uint32_t queueFamilyIndex) {
-	auto& [mutex, queue] = queues.at(queueFamilyIndex);
-	queue.waitIdle();
+	queues.at(queueFamilyIndex).queue.waitIdle();
+}
+
+VDevice::Ticket VDevice::lastSubmitted() const {
+	return {
+		queues.at(graphicsIndex).submitted.load(),
+		queues.at(transferIndex).submitted.load()
+	};
+}
+
+uint64_t VDevice::completed(const uint32_t queueFamilyIndex) const {
+	uint64_t counter = 0;
+	const auto res = static_cast<vk::Result>(
+		vkGetSemaphoreCounterValue(*dev, *queues.at(queueFamilyIndex).timeline, &counter));
+	if (res == vk::Result::eSuccess)
+		return counter;
+	// Nothing submitted is going to finish, the GPU doesn't use anything anymore either
+	markLost(res);
+	return std::numeric_limits<uint64_t>::max();
+}
+
+void VDevice::markLost(const vk::Result res) const {
+	if (!lost.exchange(true))
+		MERROR << name << " Lost the device: " << to_str(res) << endl;
+}
+
+bool VDevice::reached(const Ticket& ticket) const {
+	const auto done = [this](const uint32_t index, const uint64_t value) {
+		return value == 0 || completed(index) >= value;
+	};
+	return done(graphicsIndex, ticket.graphics) && done(transferIndex, ticket.transfer);
+}
+
+bool VDevice::wait(const Ticket& ticket, const uint64_t timeout) const {
+	std::array<vk::Semaphore, 2> semaphores{};
+	std::array<uint64_t, 2> values{};
+	uint32_t count = 0;
+	if (ticket.graphics != 0) {
+		semaphores[count] = *queues.at(graphicsIndex).timeline;
+		values[count++] = ticket.graphics;
+	}
+	if (ticket.transfer != 0) {
+		semaphores[count] = *queues.at(transferIndex).timeline;
+		values[count++] = ticket.transfer;
+	}
+	if (count == 0)
+		return true;
+	const vk::SemaphoreWaitInfo waitInfo{
+		.semaphoreCount = count,
+		.pSemaphores = semaphores.data(),
+		.pValues = values.data()
+	};
+	const auto res = dev.waitSemaphores(waitInfo, timeout);
+	if (res == vk::Result::eErrorDeviceLost)
+		markLost(res);
+	else if (res != vk::Result::eSuccess && res != vk::Result::eTimeout)
+		MERROR << name << " Failed to wait for timeline: " << to_str(res) << endl;
+	return res == vk::Result::eSuccess;
+}
+
+VDevice::Ticket VDevice::oneShot(const uint32_t queueFamilyIndex, const Recorder& record, const Ticket& after,
+	const std::span<const vk::Semaphore> binaryWaits) {
+	auto& q = queues.at(queueFamilyIndex);
+	std::lock_guard lock(q.poolMutex);
+	if (!*q.pool)
+		q.pool = createCommandPool(queueFamilyIndex);
+	const auto done = completed(queueFamilyIndex);
+	vkr::CommandBuffer cmd{nullptr};
+	if (!q.recorded.empty() && q.recorded.front().second <= done) {
+		cmd = std::move(q.recorded.front().first);
+		q.recorded.pop_front();
+		cmd.reset();
+	} else {
+		cmd = createCommandBuffer(q.pool);
+	}
+	static constexpr vk::CommandBufferBeginInfo beginInfo{
+		.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit
+	};
+	cmd.begin(beginInfo);
+	record(cmd);
+	cmd.end();
+
+	// Both timelines, then the binary semaphores
+	vec<vk::Semaphore> waits(2 + binaryWaits.size());
+	vec<uint64_t> waitValues(waits.size());
+	vec<vk::PipelineStageFlags> waitStages(waits.size());
+	uint32_t waitCount = 0;
+	const auto addWait = [&](const uint32_t index, const uint64_t value) {
+		if (value == 0)
+			return;
+		const auto sem = *queues.at(index).timeline;
+		for (uint32_t i = 0; i < waitCount; i++) {
+			if (waits[i] == sem) {
+				waitValues[i] = std::max(waitValues[i], value);
+				return;
+			}
+		}
+		waits[waitCount] = sem;
+		waitValues[waitCount] = value;
+		waitStages[waitCount++] = vk::PipelineStageFlagBits::eAllCommands;
+	};
+	addWait(graphicsIndex, after.graphics);
+	addWait(transferIndex, after.transfer);
+	// Their values are ignored
+	for (const auto sem : binaryWaits) {
+		waits[waitCount] = sem;
+		waitStages[waitCount++] = vk::PipelineStageFlagBits::eAllCommands;
+	}
+	const vk::SubmitInfo submitInfo{
+		.waitSemaphoreCount = waitCount,
+		.pWaitSemaphores = waits.data(),
+		.pWaitDstStageMask = waitStages.data(),
+		.commandBufferCount = 1,
+		.pCommandBuffers = &*cmd
+	};
+	const auto ticket = submit(queueFamilyIndex, submitInfo, nullFence, std::span(waitValues.data(), waitCount));
+	q.recorded.emplace_back(std::move(cmd), queueFamilyIndex == graphicsIndex ? ticket.graphics : ticket.transfer);
+	return ticket;
+}
+
+bool VDevice::hasExtension(const str_view extension) const {
+	return std::ranges::any_of(enabledExtensions, [&](const str& ext) {
+		return static_cast<const std::string&>(ext) == static_cast<const std::string_view&>(extension);
+	});
+}
+
+vec<VDevice::HeapBudget> VDevice::getMemoryBudget() const {
+	const auto& memProps = allocator->getMemoryProperties();
+	vec<HeapBudget> ret(memProps.memoryHeapCount);
+	opt<vk::PhysicalDeviceMemoryBudgetPropertiesEXT> budgetProps{};
+	if (hasExtension(vk::EXTMemoryBudgetExtensionName)) {
+		const auto props = pDev.getMemoryProperties2<vk::PhysicalDeviceMemoryProperties2,
+			vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+		budgetProps = props.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+	}
+	for (uint32_t i = 0; i < memProps.memoryHeapCount; i++) {
+		const auto& heap = memProps.memoryHeaps[i];
+		ret[i].deviceLocal = static_cast<bool>(heap.flags & vk::MemoryHeapFlagBits::eDeviceLocal);
+		if (budgetProps.has_value()) {
+			ret[i].budget = budgetProps->heapBudget[i];
+			ret[i].usage = budgetProps->heapUsage[i];
+			continue;
+		}
+		ret[i].budget = heap.size / 100 * 80;
+		ret[i].usage = allocator->getHeapStats(i).reservedBytes();
+	}
+	return ret;
+}
+
+VDevice::~VDevice() {
+	if (!*dev)
+		return;
+	dev.waitIdle();
+	// Hands its textures back to the pool
+	surfaces.reset();
+	dmabuf.reset();
+	textureTable.reset();
+	residency.reset();
+	texturePool.reset();
 }
 
 VDevice::VDevice(vkr::PhysicalDevice&& physicalDevice, const vec<cstr>& extensions, VInstance* parent) :
@@ -80,6 +274,8 @@ parent(parent),
 pDev(std::move(physicalDevice)),
 good(false) {
 	const_cast<str&> (name) = pDev.getProperties().deviceName.data();
+	for (const auto& ext : extensions)
+		enabledExtensions.emplace_back(ext);
 	static constexpr auto max = std::numeric_limits<uint32_t>::max();
 	auto graphicsFamilyQueueIndex{max};
 	auto transferFamilyQueueIndex{max};
@@ -119,9 +315,37 @@ good(false) {
 		});
 	}
 
-	static constexpr  vk::PhysicalDeviceVulkan12Features deviceFeatures{
+	const auto features = pDev.getFeatures2<vk::PhysicalDeviceFeatures2,
+		vk::PhysicalDeviceVulkan11Features, vk::PhysicalDeviceVulkan12Features>();
+	const auto& supported = features.get<vk::PhysicalDeviceVulkan12Features>();
+	if (!supported.timelineSemaphore || !VTextureTable::supported(supported)) {
+		MWARN << name << " Does not support timeline semaphores or descriptor indexing" << endl;
+		return;
+	}
+	vk::PhysicalDeviceVulkan12Features deviceFeatures{
 		.timelineSemaphore = vk::True
 	};
+	VTextureTable::enable(deviceFeatures);
+	// Optional, multi-planar dmabufs aren't offered without it, see VDmabufImporter
+	vk::PhysicalDeviceVulkan11Features vulkan11Features{
+		.samplerYcbcrConversion = features.get<vk::PhysicalDeviceVulkan11Features>().samplerYcbcrConversion
+	};
+	deviceFeatures.pNext = &vulkan11Features;
+	// Optional, displays report predicted vblanks to wp_presentation without it
+	vk::PhysicalDevicePresentIdFeaturesKHR presentIdFeatures{};
+	vk::PhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures{};
+	if (hasExtension(vk::KHRPresentIdExtensionName) && hasExtension(vk::KHRPresentWaitExtensionName)) {
+		const auto present = pDev.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDevicePresentIdFeaturesKHR,
+			vk::PhysicalDevicePresentWaitFeaturesKHR>();
+		presentWait = present.get<vk::PhysicalDevicePresentIdFeaturesKHR>().presentId &&
+			present.get<vk::PhysicalDevicePresentWaitFeaturesKHR>().presentWait;
+	}
+	if (presentWait) {
+		presentIdFeatures.presentId = vk::True;
+		presentIdFeatures.pNext = &presentWaitFeatures;
+		presentWaitFeatures.presentWait = vk::True;
+		vulkan11Features.pNext = &presentIdFeatures;
+	}
 
 	const vk::DeviceCreateInfo deviceCreateInfo{
 		.pNext = &deviceFeatures,
@@ -138,6 +362,7 @@ good(false) {
 	}
 	const_cast<Id_t&>(id) = static_cast<Id_t>(pDev.getProperties().deviceID);
 	dev = std::move(result.value());
+	allocator = u_ptr<VAllocator>(new VAllocator(dev, pDev, name));
 
 	for (const auto& j : graphicsIndex) {
 		auto queue = dev.getQueue(j, 0);
@@ -145,17 +370,42 @@ good(false) {
 			MERROR << name << " Could not get queue " << to_str(queue.error()) << endl;
 			return;
 		}
+		static constexpr vk::SemaphoreTypeCreateInfo timelineType{
+			.semaphoreType = vk::SemaphoreType::eTimeline,
+			.initialValue = 0
+		};
+		static constexpr vk::SemaphoreCreateInfo timelineInfo{
+			.pNext = &timelineType
+		};
+		auto timeline = dev.createSemaphore(timelineInfo);
+		if (!timeline.has_value()) {
+			MERROR << name << " Could not create timeline semaphore " << to_str(timeline.error()) << endl;
+			return;
+		}
 		MDEBUG << name << " Got queue " << j << endl;
-		queues.emplace(j, std::move(queue.value()));
+		queues.emplace(std::piecewise_construct, std::forward_as_tuple(j),
+			std::forward_as_tuple(std::move(queue.value()), std::move(timeline.value())));
 	}
 	auto vertShader = createShaderModule(VERT_SHADER);
 	auto fragShader = createShaderModule(FRAG_SHADER);
-	if (!vertShader.has_value() || !fragShader.has_value()) {
+	auto ycbcrShader = createShaderModule(YCBCR_FRAG_SHADER);
+	if (!vertShader.has_value() || !fragShader.has_value() || !ycbcrShader.has_value()) {
 		MERROR << name << " Could not create shader modules" << endl;
 		return;
 	}
 	this->vertShader = std::move(vertShader.value());
 	this->fragShader = std::move(fragShader.value());
+	this->ycbcrShader = std::move(ycbcrShader.value());
+	texturePool = u_ptr<VTexturePool>(new VTexturePool(*this, globals::textureCacheBudget));
+	residency = u_ptr<VResidency>(new VResidency(*this));
+	textureTable = u_ptr<VTextureTable>(new VTextureTable(*this));
+	if (!textureTable->good) {
+		MERROR << name << " Could not create texture table" << endl;
+		return;
+	}
+	if (VDmabufImporter::supported(*this))
+		dmabuf = u_ptr<VDmabufImporter>(new VDmabufImporter(*this));
+	surfaces = u_ptr<VSurfaceDevice>(new VSurfaceDevice(*this));
 	const_cast<bool&>(good) = true;
 	MDEBUG << name << " Created device " << endl;
 }
@@ -1,9 +1,21 @@
+#include <bit>
+#include <cmath>
 #include <iomanip>
+#include <unistd.h>
 #include "mland/vdisplay.h"
 #include "mland/vdevice.h"
+#include "mland/vsurface.h"
+#include "mland/vresidency.h"
+#include "mland/vtexture_table.h"
+#include "mland/globals.h"
 
 using namespace mland;
 
+namespace {
+// Longest the render thread and the present waiter keep the swapchain from each other
+constexpr std::chrono::milliseconds SWAPCHAIN_SLICE{1};
+}
+
 void VDisplay::workerMain() {
 	try {
 		createEverything();
@@ -24,6 +36,9 @@ void VDisplay::workerMain() {
 	const auto fps = static_cast<double>(framesRendered) / (elapsed / 1000.0);
 	MINFO << name << " Rendered " << framesRendered << " frames in "  << elapsed
 		  << "ms (" << std::setprecision(2) << std::fixed << fps << " fps)" << endl;
+	if (const auto total = drawnPixels + culledPixels; total > 0)
+		MINFO << name << " Culled " << culledPixels << " of " << total << " surface pixels ("
+			  << std::setprecision(2) << std::fixed << 100.0 * culledPixels / total << "%)" << endl;
 
 	cleanup();
 	std::unique_lock lock(stateMutex);
@@ -32,14 +47,178 @@ void VDisplay::workerMain() {
 	stateCond.notify_all();
 }
 
-constexpr vk::CommandBufferBeginInfo begInf {
-	.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit
-};
+void VDisplay::buildFrame(const SyncObjs& sync, const Image& img) {
+	scene = globals::CompositorState.scene.acquire();
+	drawList.clear();
+	VDevice::Ticket uploaded{};
+	if (scene) {
+		vDev->getSurfaces().sync(*scene, scene.version());
+		uploaded = vDev->getSurfaces().upload(*scene);
+		drawList.build(*scene, {displayRegion.offset, extent});
+	}
+	shown.clear();
+	surfaceFrame = 0;
+	writeInstances();
+	drawnPixels += drawList.getStats().drawnPixels;
+	culledPixels += drawList.getStats().culledPixels;
+	// Opaque surfaces hide the wallpaper entirely
+	const bool copyBackground = background && !drawList.coversOutput();
+	graph->reset();
+	graph->waitFor(uploaded, vk::PipelineStageFlagBits::eFragmentShader);
+	const auto target = graph->import({
+		.image = img.image,
+		.initialLayout = vk::ImageLayout::eUndefined,
+		.finalLayout = vk::ImageLayout::ePresentSrcKHR,
+		.acquire = *sync.imageAvailable,
+		.release = *sync.renderFinished
+	});
+	if (copyBackground) {
+		const auto source = graph->import({
+			.image = *background->image,
+			.initialLayout = vk::ImageLayout::eTransferSrcOptimal,
+			.concurrent = true
+		});
+		graph->addPass("background", VRenderGraph::QueueType::eTransfer, {
+			{source, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead,
+				vk::ImageLayout::eTransferSrcOptimal},
+			{target, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite,
+				vk::ImageLayout::eTransferDstOptimal}
+		}, [this, &img](const vkr::CommandBuffer& cmd) { transferBackground(cmd, img); });
+	}
+	// The render pass loads the background or clears, and transitions to present itself
+	graph->addPass("composition", VRenderGraph::QueueType::eGraphics, {
+		{target, vk::PipelineStageFlagBits::eColorAttachmentOutput,
+			vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite,
+			background ? vk::ImageLayout::eTransferDstOptimal : vk::ImageLayout::eUndefined,
+			vk::ImageLayout::ePresentSrcKHR}
+	}, [this, &img](const vkr::CommandBuffer& cmd) { drawFrame(cmd, img); });
+	const auto ticket = graph->execute(*renderFinishedFence);
+	if (surfaceFrame != 0)
+		vDev->getSurfaces().endFrame(surfaceFrame, ticket);
+	// Everything that read the scene has been recorded
+	scene.reset();
+}
 
-void VDisplay::transferBackground(const SyncObjs& sync, const Image& img) {
-	const auto& cmd = img.backgroundCmd;
-	cmd.reset();
-	cmd.begin(begInf);
+// Every box of the draw list becomes one instance, so the whole scene is a handful of draws
+void VDisplay::writeInstances() {
+	batches.clear();
+	uint32_t count = 0;
+	for (uint32_t n = 0; n < drawList.size(); n++)
+		count += drawList.getClips(n).size();
+	instanceCount = 0;
+	if (count == 0)
+		return;
+	// The previous frame is done with the buffer once renderFinishedFence was waited on
+	if (!instances || instances->size < count * sizeof(Instance)) {
+		const auto capacity = std::max<vk::DeviceSize>(MIN_INSTANCES, std::bit_ceil(count));
+		instances.reset();
+		auto res = vDev->createBuffer(capacity * sizeof(Instance), vk::BufferUsageFlagBits::eVertexBuffer,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+		if (!res.has_value()) {
+			MERROR << name << " Failed to create instance buffer for " << count << " boxes" << endl;
+			return;
+		}
+		instances = std::move(res.value());
+	}
+	instanceCount = count;
+	auto* const first = static_cast<Instance*>(instances->getMapped());
+	auto* out = first;
+	const auto width = static_cast<float>(extent.width);
+	const auto height = static_cast<float>(extent.height);
+	// Each surface gets its own depth, ordered like the list
+	const auto step = 1.0f / static_cast<float>(drawList.size() + 1);
+	auto& surfaces = vDev->getSurfaces();
+	std::lock_guard lock(surfaces.getMutex());
+	surfaceFrame = surfaces.beginFrame();
+	// The contents the frame samples, a texture can lag behind the scene. The placeholder of a
+	// surface without one stands for whatever is committed
+	const auto now = std::chrono::steady_clock::now();
+	for (uint32_t n = 0; n < drawList.size(); n++) {
+		const auto sceneIndex = drawList.getSceneIndex(n);
+		const auto surface = scene->surfaces[sceneIndex];
+		surfaces.markVisible(surface, now);
+		shown.emplace_back(surface, surfaces.getTexture(surface) ? surfaces.getSerial(surface) : scene->serial[sceneIndex]);
+	}
+	const auto write = [&](const uint32_t n, const uint32_t slot, const Variant variant,
+		const opt<VSurfaceDevice::Ycbcr>& ycbcr) {
+		const auto& bounds = drawList.getBounds(n);
+		const auto sceneIndex = drawList.getSceneIndex(n);
+		const auto index = scene->surfaces[sceneIndex].index();
+		// wp_viewport, the sampler scales whatever part of the texture this is
+		const auto& crop = scene->crop[sceneIndex];
+		const auto transform = scene->transform[sceneIndex];
+		// Flat colors for surfaces without uploaded contents
+		const std::array color{
+			static_cast<float>(index * 97 % 255) / 255.0f,
+			static_cast<float>(index * 57 % 255) / 255.0f,
+			static_cast<float>(index * 23 % 255) / 255.0f,
+			1.0f
+		};
+		const auto clips = drawList.getClips(n);
+		for (const auto& clip : clips) {
+			// The box within the surface, turned into the crop of the buffer
+			const auto part = Scene::toBuffer({
+				static_cast<float>(clip.offset.x - bounds.offset.x) / bounds.extent.width,
+				static_cast<float>(clip.offset.y - bounds.offset.y) / bounds.extent.height,
+				static_cast<float>(clip.extent.width) / bounds.extent.width,
+				static_cast<float>(clip.extent.height) / bounds.extent.height
+			}, transform);
+			*out++ = {
+				.rect = {
+					2.0f * clip.offset.x / width - 1.0f,
+					2.0f * clip.offset.y / height - 1.0f,
+					2.0f * clip.extent.width / width,
+					2.0f * clip.extent.height / height
+				},
+				.uv = {crop[0] + crop[2] * part[0], crop[1] + crop[3] * part[1], crop[2] * part[2], crop[3] * part[3]},
+				.color = color,
+				.depth = static_cast<float>(n + 1) * step,
+				.texture = slot,
+				.transform = transform
+			};
+		}
+		const auto set = ycbcr.has_value() ? ycbcr->set : vk::DescriptorSet{};
+		if (!batches.empty() && batches.back().variant == variant && batches.back().set == set)
+			batches.back().count += clips.size();
+		else
+			batches.push_back({variant, static_cast<uint32_t>(out - first) - static_cast<uint32_t>(clips.size()),
+				static_cast<uint32_t>(clips.size()), ycbcr.has_value() ? ycbcr->conversion : 0, set});
+	};
+	// Front to back is what early depth tests want for the opaque variants, the order between
+	// surfaces doesn't matter otherwise, so each variant is one batch. Video breaks them per
+	// surface, every import is bound on its own
+	for (const auto variant : {eOpaque, eYcbcr, eSolid})
+		for (uint32_t n = 0; n < drawList.size(); n++) {
+			const auto surface = scene->surfaces[drawList.getSceneIndex(n)];
+			const auto slot = surfaces.getSlot(surface);
+			const auto ycbcr = surfaces.getYcbcr(surface);
+			if (getVariant(n, slot, ycbcr.has_value()) == variant)
+				write(n, slot, variant, ycbcr);
+		}
+	// Blending needs the other way around and has to keep the order, batches break on every switch
+	for (auto n = drawList.size(); n-- > 0;) {
+		const auto surface = scene->surfaces[drawList.getSceneIndex(n)];
+		const auto slot = surfaces.getSlot(surface);
+		if (const auto variant = getVariant(n, slot, surfaces.getYcbcr(surface).has_value());
+			variant == ePremultiplied || variant == eStraight)
+			write(n, slot, variant, std::nullopt);
+	}
+}
+
+VDisplay::Variant VDisplay::getVariant(const uint32_t n, const uint32_t slot, const bool ycbcr) const {
+	// Has no alpha, always hides what is below
+	if (ycbcr)
+		return eYcbcr;
+	// Nothing to sample, the placeholder hides whatever is below like an opaque surface would
+	if (slot == NO_TEXTURE)
+		return eSolid;
+	if (drawList.isOpaque(n))
+		return eOpaque;
+	// Every buffer Wayland hands us is premultiplied, eStraight is for our own contents
+	return ePremultiplied;
+}
+
+void VDisplay::transferBackground(const vkr::CommandBuffer& cmd, const Image& img) const {
 	constexpr vk::ImageSubresourceLayers imgSub {
 		.aspectMask = vk::ImageAspectFlagBits::eColor,
 		.mipLevel = 0,
@@ -59,33 +238,143 @@ void VDisplay::transferBackground(const SyncObjs& sync, const Image& img) {
 		.extent = extent
 	};
 	cmd.copyImage(
-		background,
+		background->image,
 		vk::ImageLayout::eTransferSrcOptimal,
 		img.image,
 		vk::ImageLayout::eTransferDstOptimal,
 		imgCopy
 	);
-	cmd.end();
-	constexpr vk::PipelineStageFlags waitStages = {vk::PipelineStageFlagBits::eTransfer};
-	const std::array semaphores = {
-		*sync.imageAvailable
+}
+
+void VDisplay::drawFrame(const vkr::CommandBuffer& cmd, const Image& img) {
+	constexpr std::array<vk::ClearValue, 2> clearValues {
+		vk::ClearValue{},
+		vk::ClearValue{.depthStencil = vk::ClearDepthStencilValue{.depth = 1.0f, .stencil = 0}}
 	};
-	const vk::SubmitInfo submit {
-		.waitSemaphoreCount = static_cast<uint32_t>(semaphores.size()),
-		.pWaitSemaphores = semaphores.data(),
-		.pWaitDstStageMask = &waitStages,
-		.commandBufferCount = 1,
-		.pCommandBuffers = &*cmd,
-		.signalSemaphoreCount = 1,
-		.pSignalSemaphores = &*sync.backgroundFinished
+	const vk::RenderPassBeginInfo render_pass {
+		.renderPass = renderPass,
+		.framebuffer = img.framebuffer,
+		.renderArea = {
+			.offset = {},
+			.extent = extent
+		},
+		.clearValueCount = clearValues.size(),
+		.pClearValues = clearValues.data(),
+	};
+	const auto recorderCount = getRecorderCount();
+	if (recorderCount < 2) {
+		cmd.beginRenderPass(render_pass, vk::SubpassContents::eInline);
+		recordBatches(cmd, batches);
+		cmd.endRenderPass();
+		return;
+	}
+
+	// Threads only ever look at their own recorder, the vector must not move under them
+	recorders.reserve(MAX_RECORDERS);
+	while (recorders.size() < recorderCount) {
+		auto pool = vDev->createCommandPool(vDev->graphicsIndex);
+		auto secondary = vDev->createCommandBuffer(pool, vk::CommandBufferLevel::eSecondary);
+		recorders.push_back({std::move(pool), std::move(secondary)});
+		// The first one is recorded by the render thread itself
+		if (const auto r = recorders.size32() - 1; r != 0)
+			recorders.back().thread = std::thread(&VDisplay::recorderMain, this, r, recordGeneration);
+	}
+	// Batches are split where the instances are, every chunk keeps the order of its batches and
+	// the chunks run in order, so blending is unaffected
+	const auto share = (instanceCount + recorderCount - 1) / recorderCount;
+	for (auto& recorder : recorders)
+		recorder.batches.clear();
+	uint32_t r = 0;
+	uint32_t taken = 0;
+	for (auto batch : batches) {
+		while (batch.count > 0) {
+			const auto count = r + 1 < recorderCount ? std::min(batch.count, share - taken) : batch.count;
+			recorders[r].batches.push_back({batch.variant, batch.first, count, batch.conversion, batch.set});
+			batch.first += count;
+			batch.count -= count;
+			taken += count;
+			if (taken == share && r + 1 < recorderCount) {
+				r++;
+				taken = 0;
+			}
+		}
+	}
+	recordInheritance = {
+		.renderPass = renderPass,
+		.subpass = 0,
+		.framebuffer = img.framebuffer
+	};
+	std::latch done(recorderCount - 1);
+	{
+		std::lock_guard lock(recordMutex);
+		recordCount = recorderCount;
+		recordDone = &done;
+		recordGeneration++;
+	}
+	recordCond.notify_all();
+	recordChunk(0);
+	done.wait();
+	std::array<vk::CommandBuffer, MAX_RECORDERS> secondaries{};
+	for (r = 0; r < recorderCount; r++)
+		secondaries[r] = recorders[r].cmd;
+	cmd.beginRenderPass(render_pass, vk::SubpassContents::eSecondaryCommandBuffers);
+	cmd.executeCommands(std::span(secondaries.data(), recorderCount));
+	cmd.endRenderPass();
+}
+
+uint32_t VDisplay::getRecorderCount() const {
+	const auto threads = std::max(1u, std::thread::hardware_concurrency());
+	return std::min({MAX_RECORDERS, threads, instanceCount / PARALLEL_INSTANCES});
+}
+
+void VDisplay::recordChunk(const uint32_t r) {
+	const auto& recorder = recorders[r];
+	const vk::CommandBufferBeginInfo beginInfo{
+		.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit | vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+		.pInheritanceInfo = &recordInheritance
 	};
-	vDev->submit(vDev->transferIndex, submit);
+	// The previous frame using it is done, renderFinishedFence was waited on
+	recorder.pool.reset();
+	recorder.cmd.begin(beginInfo);
+	recordBatches(recorder.cmd, recorder.batches);
+	recorder.cmd.end();
 }
 
-void VDisplay::drawFrame(const SyncObjs& sync, const Image& img) {
-	const auto& cmd = img.graphicsCmd;
-	cmd.reset();
-	cmd.begin(begInf);
+// Sleeps between frames, so splitting a frame costs a wake up instead of a thread
+void VDisplay::recorderMain(const uint32_t r, uint64_t generation) {
+	while (true) {
+		std::latch* done;
+		{
+			std::unique_lock lock(recordMutex);
+			recordCond.wait(lock, [&] { return recordStop || recordGeneration != generation; });
+			if (recordStop)
+				return;
+			generation = recordGeneration;
+			// Not needed for this frame
+			if (r >= recordCount)
+				continue;
+			done = recordDone;
+		}
+		recordChunk(r);
+		done->count_down();
+	}
+}
+
+void VDisplay::stopRecorders() {
+	{
+		std::lock_guard lock(recordMutex);
+		recordStop = true;
+	}
+	recordCond.notify_all();
+	for (auto& recorder : recorders)
+		if (recorder.thread.joinable())
+			recorder.thread.join();
+}
+
+// State isn't inherited by secondary command buffers, so every range sets up everything it needs
+void VDisplay::recordBatches(const vkr::CommandBuffer& cmd, const std::span<const Batch> range) const {
+	if (range.empty())
+		return;
 	const vk::Viewport viewport{
 		.x = 0,
 		.y = 0,
@@ -95,55 +384,36 @@ void VDisplay::drawFrame(const SyncObjs& sync, const Image& img) {
 		.maxDepth = 1.0f
 	};
 	const vk::Rect2D scissor{
-		.offset ={},
+		.offset = {},
 		.extent = extent
 	};
-	constexpr vk::ClearValue clearColor {
-
-	};
-	const vk::RenderPassBeginInfo render_pass {
-		.renderPass = renderPass,
-		.framebuffer = img.framebuffer,
-		.renderArea = {
-			.offset = {},
-			.extent = extent
-		},
-		.clearValueCount = 1,
-		.pClearValues = &clearColor,
-	};
-	cmd.beginRenderPass(render_pass, vk::SubpassContents::eInline);
-	cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
 	cmd.setViewport(0, viewport);
 	cmd.setScissor(0, scissor);
-	cmd.draw(3, 1, 0, 0);
-	cmd.endRenderPass();
-	cmd.end();
-	const std::array waitSemaphores = {
-		//*sync.backgroundFinished,
-		*sync.imageAvailable, // Temporary until background image is implemented
-	};
-	const std::array signalSemaphores = {
-		*sync.renderFinished,
-	};
-	constexpr std::array waitStages = {
-		static_cast<vk::PipelineStageFlags>(vk::PipelineStageFlagBits::eColorAttachmentOutput)
-	};
-
-	const vk::SubmitInfo submit {
-		.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size()),
-		.pWaitSemaphores = waitSemaphores.data(),
-		.pWaitDstStageMask = waitStages.data(),
-		.commandBufferCount = 1,
-		.pCommandBuffers = &*cmd,
-		.signalSemaphoreCount = static_cast<uint32_t>(signalSemaphores.size()),
-		.pSignalSemaphores = signalSemaphores.data()
-	};
-
-	vDev->submit(vDev->graphicsIndex,submit, renderFinishedFence);
+	constexpr vk::DeviceSize offset = 0;
+	cmd.bindVertexBuffers(0, *instances->buffer, offset);
+	// Update after bind, textures added while the frame is in flight don't invalidate it
+	cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipelineLayout, 0,
+		vDev->getTextureTable().getSet(), {});
+	for (const auto& batch : range) {
+		if (batch.variant == eYcbcr) {
+			// Set 0 stays bound, the layouts only differ past it
+			cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, ycbcrPipelines[batch.conversion]);
+			cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, ycbcrLayouts[batch.conversion], 1,
+				batch.set, {});
+		} else
+			cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, pipelines[batch.variant]);
+		cmd.draw(6, batch.count, 0, batch.first);
+	}
 }
 
 bool VDisplay::present(const SyncObjs& sync, const uint32_t& imageIndex) {
+	presentId++;
+	const vk::PresentIdKHR presentIds {
+		.swapchainCount = 1,
+		.pPresentIds = &presentId
+	};
 	const vk::SwapchainPresentFenceInfoEXT presentFence {
+		.pNext = vDev->presentWait ? &presentIds : nullptr,
 		.swapchainCount = 1,
 		.pFences = &*sync.presented
 	};
@@ -155,7 +425,11 @@ bool VDisplay::present(const SyncObjs& sync, const uint32_t& imageIndex) {
 		.pSwapchains = &*swapchain,
 		.pImageIndices = &imageIndex
 	};
-	switch (const auto presentRes = vDev->present(vDev->graphicsIndex, present)) {
+	const auto presentRes = [&] {
+		std::lock_guard lock(swapchainMutex);
+		return vDev->present(vDev->graphicsIndex, present);
+	}();
+	switch (presentRes) {
 	case vk::Result::eSuccess:
 		return true;
 	case vk::Result::eErrorOutOfDateKHR: {
@@ -171,6 +445,7 @@ bool VDisplay::present(const SyncObjs& sync, const uint32_t& imageIndex) {
 				.imageIndexCount = 1,
 				.pImageIndices = &imageIndex
 		};
+		std::lock_guard swapchainLock(swapchainMutex);
 		vDev->dev.releaseSwapchainImagesEXT(releaseInfo);
 		return false;
 	} case vk::Result::eSuboptimalKHR: {
@@ -195,10 +470,25 @@ bool VDisplay::present(const SyncObjs& sync, const uint32_t& imageIndex) {
 
 
 void VDisplay::renderLoop() {
+	if (vDev->isLost()) {
+		std::lock_guard lock(stateMutex);
+		if (state < eError) {
+			state = eError;
+			stateCond.notify_all();
+		}
+		return;
+	}
 	const auto syncIndex = getSyncObj();
 	const auto& sync = syncObjs[syncIndex];
-	constexpr uint64_t timeout = std::numeric_limits<uint64_t>::max();
-	auto [result, imageIndex] = swapchain.acquireNextImage(timeout, sync.imageAvailable, nullptr);
+	// In slices when the present waiter may be waiting on the swapchain meanwhile
+	const uint64_t timeout = vDev->presentWait ? std::chrono::nanoseconds(SWAPCHAIN_SLICE).count()
+		: std::numeric_limits<uint64_t>::max();
+	auto result = vk::Result::eTimeout;
+	uint32_t imageIndex = 0;
+	while (result == vk::Result::eTimeout) {
+		std::lock_guard lock(swapchainMutex);
+		std::tie(result, imageIndex) = swapchain.acquireNextImage(timeout, sync.imageAvailable, nullptr);
+	}
 	switch (result) {
 	case vk::Result::eSuccess:
 		break;
@@ -227,6 +517,7 @@ void VDisplay::renderLoop() {
 		};
 		if (!waitImage(imageIndex))
 			return;
+		std::lock_guard swapchainLock(swapchainMutex);
 		vDev->dev.releaseSwapchainImagesEXT(releaseInfo);
 		return;
 		}
@@ -244,13 +535,14 @@ void VDisplay::renderLoop() {
 	if (!waitImage(imageIndex))
 		return;
 	const auto& img = images[imageIndex];
-	//transferBackground(sync, img);
 	waitFence(renderFinishedFence);
 	if (renderedNormally)
 		readyDisplays++;
 	renderedNormally = renderSemaphore.try_acquire_until(nextFrameTime);
 	nextFrameTime = std::chrono::steady_clock::now() + maxTimeBetweenFrames.load();
-	drawFrame(sync, img);
+	// Makes room for this frame's uploads before they allocate
+	vDev->getResidency().update();
+	buildFrame(sync, img);
 	if (!present(sync, imageIndex)){
 		renderedNormally = false;
 		renderSemaphore.release();
@@ -258,6 +550,113 @@ void VDisplay::renderLoop() {
 	}
 	busySyncObjs[imageIndex] = syncIndex;
 	framesRendered++;
+	reportPresented();
+}
+
+// With VK_KHR_present_wait the present waiter reports the frame once it hit the screen, the render
+// thread goes on with the next one. Otherwise the vblank is predicted from the last one and the
+// refresh rate, and the compositor holds the frame callbacks until then
+void VDisplay::reportPresented() {
+	if (!vDev->presentWait) {
+		postPresented({}, vec(shown));
+		return;
+	}
+	{
+		std::lock_guard lock(presentMutex);
+		if (!presentWaiter.joinable())
+			presentWaiter = std::thread(&VDisplay::presentWaiterMain, this);
+		pendingPresents.push_back({presentId, shown});
+	}
+	presentCond.notify_all();
+}
+
+// Frames are presented in order, so each wait returns no earlier than the one before. The time is
+// when the waiter woke up, within a slice of the flip, so it isn't flagged as a hardware timestamp
+void VDisplay::presentWaiterMain() {
+	std::unique_lock lock(presentMutex);
+	while (true) {
+		presentCond.wait(lock, [this] { return presentStop || !pendingPresents.empty(); });
+		if (pendingPresents.empty())
+			return;
+		auto frame = std::move(pendingPresents.front());
+		pendingPresents.pop_front();
+		presentBusy = true;
+		lock.unlock();
+		const auto refresh = refreshPeriod();
+		// A display that stopped flipping must not hold back the frames after it for long
+		const auto deadline = std::chrono::steady_clock::now() +
+			(refresh.count() > 0 ? 4 * refresh : std::chrono::nanoseconds(maxTimeBetweenFrames.load()));
+		auto result = vk::Result::eTimeout;
+		while (result == vk::Result::eTimeout && std::chrono::steady_clock::now() < deadline) {
+			std::lock_guard swapchainLock(swapchainMutex);
+			result = swapchain.waitForPresent(frame.id, std::chrono::nanoseconds(SWAPCHAIN_SLICE).count());
+		}
+		if (result == vk::Result::eSuccess)
+			postPresented(std::chrono::steady_clock::now(), std::move(frame.shown));
+		else
+			postPresented({}, std::move(frame.shown));
+		lock.lock();
+		presentBusy = false;
+		presentCond.notify_all();
+	}
+}
+
+void VDisplay::drainPresents() {
+	std::unique_lock lock(presentMutex);
+	presentCond.wait(lock, [this] { return pendingPresents.empty() && !presentBusy; });
+}
+
+void VDisplay::stopPresentWaiter() {
+	{
+		std::lock_guard lock(presentMutex);
+		presentStop = true;
+	}
+	presentCond.notify_all();
+	if (presentWaiter.joinable())
+		presentWaiter.join();
+}
+
+std::chrono::nanoseconds VDisplay::refreshPeriod() const {
+	// refreshRate is in mHz
+	return std::chrono::nanoseconds{refreshRate > 0 ? 1'000'000'000'000 / refreshRate : 0};
+}
+
+std::chrono::time_point<std::chrono::steady_clock> VDisplay::predictVblank(
+	const std::chrono::time_point<std::chrono::steady_clock> time) const {
+	const auto refresh = refreshPeriod();
+	if (refresh.count() == 0 || lastVblank == decltype(lastVblank){})
+		return time;
+	// Never the vblank of the previous frame
+	return lastVblank + std::max<int64_t>(1, (time - lastVblank + refresh - std::chrono::nanoseconds(1)) / refresh)
+		* refresh;
+}
+
+void VDisplay::postPresented(const opt<std::chrono::time_point<std::chrono::steady_clock>> onScreen,
+	vec<std::pair<VSurface, uint64_t>>&& surfaces) {
+	const auto fd = globals::presentedFd.load(std::memory_order_relaxed);
+	const auto refresh = refreshPeriod();
+	std::chrono::time_point<std::chrono::steady_clock> time;
+	uint64_t sequence;
+	{
+		std::lock_guard lock(presentMutex);
+		time = onScreen.value_or(predictVblank(std::chrono::steady_clock::now()));
+		const bool known = refresh.count() > 0 && lastVblank != decltype(lastVblank){};
+		vblankSequence += known ? std::max<int64_t>(1, std::llround(static_cast<double>((time - lastVblank).count())
+			/ static_cast<double>(refresh.count()))) : 1;
+		lastVblank = time;
+		sequence = vblankSequence;
+	}
+	if (fd < 0)
+		return;
+	auto& compositorState = globals::CompositorState;
+	{
+		std::lock_guard lock(compositorState.presentedMutex);
+		compositorState.presented.push_back({output.get(), time, refresh, sequence, Presented::eVsync,
+			std::move(surfaces)});
+	}
+	const uint64_t one = 1;
+	// Only fails with a full counter, which wakes the loop just the same
+	[[maybe_unused]] const auto written = write(fd, &one, sizeof(one));
 }
 
 bool VDisplay::step() {
@@ -269,13 +668,25 @@ bool VDisplay::step() {
 		renderLoop();
 		return true;
 	case eSwapOutOfDate:
+		// Present ids belong to the old swapchain
+		drainPresents();
 		for (const auto& val : busySyncObjs | std::views::values) {
 			waitFence(syncObjs[val].presented);
 			freeSyncObjs.push(val);
 		}
 		busySyncObjs.clear();
 		createSwapchain();
-			createFrameBuffers();
+		if (loadBackground()) {
+			// Load op and initial layout depend on the background
+			for (auto& pipeline : pipelines)
+				pipeline.clear();
+			ycbcrPipelines.clear();
+			renderPass.clear();
+			createRenderPass();
+			createRenderPipeline();
+		}
+		createDepthBuffer();
+		createFrameBuffers();
 		{
 			std::lock_guard lock(stateMutex);
 			if (state < eError) {
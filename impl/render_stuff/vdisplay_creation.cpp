@@ -3,6 +3,7 @@
 #include "mland/vdisplay.h"
 #include "mland/vinstance.h"
 #include "mland/globals.h"
+#include "mland/wallpaper.h"
 
 // Here are non render function
 
@@ -82,12 +83,14 @@ vk::SurfaceFormatKHR VDisplay::bestFormat(const vec<vk::SurfaceFormatKHR> &forma
 
 void VDisplay::createEverything() {
 	renderFinishedFence = createFence<true>();
-	createCommandPools();
+	createRenderGraph();
 	createSurface();
 	createSwapchain();
+	loadBackground();
 	createPipelineLayout();
 	createRenderPass();
 	createRenderPipeline();
+	createDepthBuffer();
 	createFrameBuffers();
 }
 
@@ -150,15 +153,44 @@ void VDisplay::createSwapchain(const vk::PresentModeKHR presentMode, const vk::S
 	this->format = format.format;
 }
 
+bool VDisplay::loadBackground() {
+	const bool had = background != nullptr;
+	if (had && background->info.extent == extent && background->info.format == format)
+		return false;
+	background.reset();
+	if (auto res = Wallpaper::load(*vDev, extent, format); res.has_value())
+		background = std::move(res.value());
+	return had != (background != nullptr);
+}
+
 void VDisplay::createPipelineLayout() {
 	MDEBUG << name << " Creating pipeline layout" << endl;
-	// TODO: Use uniform buffers
-	constexpr vk::PipelineLayoutCreateInfo layout {
+	// Surface textures come from the device texture table, instances carry everything else
+	const vk::DescriptorSetLayout setLayout = vDev->getTextureTable().getLayout();
+	const vk::PipelineLayoutCreateInfo layout {
+		.setLayoutCount = 1,
+		.pSetLayouts = &setLayout
 	};
 	auto res = vDev->dev.createPipelineLayout(layout);
 	if (!res.has_value()) [[unlikely]]
 		throw std::runtime_error(name + " Failed to create pipeline layout: " + to_str(res.error()));
 	pipelineLayout = std::move(res.value());
+
+	// Video adds the set of its import, set 0 stays compatible so the table is bound once
+	ycbcrLayouts.clear();
+	if (const auto* dmabuf = vDev->getDmabuf()) {
+		for (const auto& conversion : dmabuf->getConversions()) {
+			const std::array setLayouts{setLayout, *conversion.layout};
+			const vk::PipelineLayoutCreateInfo ycbcrLayout {
+				.setLayoutCount = setLayouts.size(),
+				.pSetLayouts = setLayouts.data()
+			};
+			auto ycbcrRes = vDev->dev.createPipelineLayout(ycbcrLayout);
+			if (!ycbcrRes.has_value()) [[unlikely]]
+				throw std::runtime_error(name + " Failed to create Y'CbCr pipeline layout: " + to_str(ycbcrRes.error()));
+			ycbcrLayouts.push_back(std::move(ycbcrRes.value()));
+		}
+	}
 }
 void VDisplay::createRenderPass() {
 	MDEBUG << name << " Creating render pass" << endl;
@@ -169,32 +201,69 @@ void VDisplay::createRenderPass() {
 	attachments.push_back({
 		.format = format,
 		.samples = vk::SampleCountFlagBits::e1, // TODO: Implement anti-aliasing
-		//.loadOp = vk::AttachmentLoadOp::eLoad,
-		.loadOp = vk::AttachmentLoadOp::eClear,
+		// The background is copied in before the pass
+		.loadOp = background ? vk::AttachmentLoadOp::eLoad : vk::AttachmentLoadOp::eClear,
 		.storeOp = vk::AttachmentStoreOp::eStore,
 		.stencilLoadOp = vk::AttachmentLoadOp::eDontCare, // Maybe implement stencil buffer if depth buffer is implemented
 		.stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
-		//.initialLayout = vk::ImageLayout::eTransferDstOptimal, // TODO: Implement background image
-		.initialLayout = vk::ImageLayout::eUndefined,
+		.initialLayout = background ? vk::ImageLayout::eTransferDstOptimal : vk::ImageLayout::eUndefined,
 		.finalLayout = vk::ImageLayout::ePresentSrcKHR
 	});
+	// Only lives within the pass
+	attachments.push_back({
+		.format = DEPTH_FORMAT,
+		.samples = vk::SampleCountFlagBits::e1,
+		.loadOp = vk::AttachmentLoadOp::eClear,
+		.storeOp = vk::AttachmentStoreOp::eDontCare,
+		.stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
+		.stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
+		.initialLayout = vk::ImageLayout::eUndefined,
+		.finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal
+	});
 	attachmentRefs.push_back({
 		.attachment = 0,
 		.layout = vk::ImageLayout::eColorAttachmentOptimal
 	});
+	attachmentRefs.push_back({
+		.attachment = 1,
+		.layout = vk::ImageLayout::eDepthStencilAttachmentOptimal
+	});
 	subpasses.push_back({
 		.pipelineBindPoint = vk::PipelineBindPoint::eGraphics,
 		.colorAttachmentCount = 1,
-		.pColorAttachments = &attachmentRefs[0]
+		.pColorAttachments = &attachmentRefs[0],
+		.pDepthStencilAttachment = &attachmentRefs[1]
 	});
+	// The previous frame's depth tests are done before this one clears
 	dependencies.push_back({
 		.srcSubpass = VK_SUBPASS_EXTERNAL,
 		.dstSubpass = 0,
-		.srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
-		.dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
-		.srcAccessMask = {},
-		.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite
+		.srcStageMask = vk::PipelineStageFlagBits::eLateFragmentTests,
+		.dstStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests,
+		.srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+		.dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead |
+			vk::AccessFlagBits::eDepthStencilAttachmentWrite
 	});
+	if (background) {
+		// Wait for the copy before loading
+		dependencies.push_back({
+			.srcSubpass = VK_SUBPASS_EXTERNAL,
+			.dstSubpass = 0,
+			.srcStageMask = vk::PipelineStageFlagBits::eTransfer,
+			.dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+			.srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+			.dstAccessMask = vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite
+		});
+	} else {
+		dependencies.push_back({
+			.srcSubpass = VK_SUBPASS_EXTERNAL,
+			.dstSubpass = 0,
+			.srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+			.dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
+			.srcAccessMask = {},
+			.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite
+		});
+	}
 	const vk::RenderPassCreateInfo renderPassInfo{
 		.attachmentCount = attachments.size32(),
 		.pAttachments = attachments.data(),
@@ -210,19 +279,72 @@ void VDisplay::createRenderPass() {
 }
 
 void VDisplay::createRenderPipeline() {
-	MDEBUG << name << " Creating render pipeline" << endl;
-	vec<vk::PipelineShaderStageCreateInfo> shaderStages{};
-	shaderStages.push_back({
-		.stage = vk::ShaderStageFlagBits::eVertex,
-		.module = vDev->getVert(),
-		.pName = "main"
-	});
-	shaderStages.push_back({
-		.stage = vk::ShaderStageFlagBits::eFragment,
-		.module = vDev->getFrag(),
-		.pName = "main"
-	});
-	vk::PipelineVertexInputStateCreateInfo vertexInputInfo{};
+	MDEBUG << name << " Creating render pipelines" << endl;
+	// Drivers compile on the calling thread, the variants don't depend on each other
+	ycbcrPipelines.clear();
+	ycbcrPipelines.resize(ycbcrLayouts.size());
+	vec<std::thread> workers{};
+	for (uint32_t v = 0; v < VARIANTS; v++)
+		workers.emplace_back([this, v] { pipelines[v] = createPipeline(static_cast<Variant>(v)); });
+	for (uint32_t c = 0; c < ycbcrLayouts.size32(); c++)
+		workers.emplace_back([this, c] { ycbcrPipelines[c] = createPipeline(eYcbcr, c); });
+	for (auto& worker : workers)
+		worker.join();
+	for (const auto& pipeline : pipelines)
+		if (!*pipeline) [[unlikely]]
+			throw std::runtime_error(name + " Failed to create graphics pipelines");
+	for (const auto& pipeline : ycbcrPipelines)
+		if (!*pipeline) [[unlikely]]
+			throw std::runtime_error(name + " Failed to create Y'CbCr pipelines");
+}
+
+vkr::Pipeline VDisplay::createPipeline(const Variant variant, const uint32_t conversion) const {
+	const bool ycbcr = variant == eYcbcr;
+	// Folds the shading mode branches of fragment.frag away
+	constexpr vk::SpecializationMapEntry modeEntry{
+		.constantID = 0,
+		.offset = 0,
+		.size = sizeof(Variant)
+	};
+	const vk::SpecializationInfo specialization{
+		.mapEntryCount = 1,
+		.pMapEntries = &modeEntry,
+		.dataSize = sizeof(Variant),
+		.pData = &variant
+	};
+	const std::array shaderStages{
+		vk::PipelineShaderStageCreateInfo{
+			.stage = vk::ShaderStageFlagBits::eVertex,
+			.module = vDev->getVert(),
+			.pName = "main"
+		},
+		vk::PipelineShaderStageCreateInfo{
+			.stage = vk::ShaderStageFlagBits::eFragment,
+			.module = ycbcr ? vDev->getYcbcrFrag() : vDev->getFrag(),
+			.pName = "main",
+			.pSpecializationInfo = ycbcr ? nullptr : &specialization
+		}
+	};
+	// Nothing per vertex, the corners come from gl_VertexIndex
+	constexpr vk::VertexInputBindingDescription instanceBinding {
+		.binding = 0,
+		.stride = sizeof(Instance),
+		.inputRate = vk::VertexInputRate::eInstance
+	};
+	constexpr std::array instanceAttributes {
+		vk::VertexInputAttributeDescription{0, 0, vk::Format::eR32G32B32A32Sfloat, offsetof(Instance, rect)},
+		vk::VertexInputAttributeDescription{1, 0, vk::Format::eR32G32B32A32Sfloat, offsetof(Instance, uv)},
+		vk::VertexInputAttributeDescription{2, 0, vk::Format::eR32G32B32A32Sfloat, offsetof(Instance, color)},
+		vk::VertexInputAttributeDescription{3, 0, vk::Format::eR32Sfloat, offsetof(Instance, depth)},
+		vk::VertexInputAttributeDescription{4, 0, vk::Format::eR32Uint, offsetof(Instance, texture)},
+		vk::VertexInputAttributeDescription{5, 0, vk::Format::eR32Uint, offsetof(Instance, transform)}
+	};
+	vk::PipelineVertexInputStateCreateInfo vertexInputInfo{
+		.vertexBindingDescriptionCount = 1,
+		.pVertexBindingDescriptions = &instanceBinding,
+		.vertexAttributeDescriptionCount = instanceAttributes.size(),
+		.pVertexAttributeDescriptions = instanceAttributes.data()
+	};
 	vk::PipelineInputAssemblyStateCreateInfo inputAssembly{
 		.topology = vk::PrimitiveTopology::eTriangleList,
 		.primitiveRestartEnable = vk::False
@@ -236,7 +358,8 @@ void VDisplay::createRenderPipeline() {
 		.depthClampEnable = vk::False,
 		.rasterizerDiscardEnable = vk::False,
 		.polygonMode = vk::PolygonMode::eFill,
-		.cullMode = vk::CullModeFlagBits::eBack,
+		// Quads are always seen from the front
+		.cullMode = vk::CullModeFlagBits::eNone,
 		.frontFace = vk::FrontFace::eClockwise,
 		.depthBiasEnable = vk::False,
 		.lineWidth = 1.0f
@@ -246,14 +369,24 @@ void VDisplay::createRenderPipeline() {
 		.rasterizationSamples = vk::SampleCountFlagBits::e1,
 		.sampleShadingEnable = vk::False
 	};
-	// TODO: Add depth buffer
-	vk::PipelineColorBlendAttachmentState colorBlendAttachment {
-		.blendEnable = vk::True,
-		.srcColorBlendFactor = vk::BlendFactor::eSrcAlpha,
+	const bool blend = variant == ePremultiplied || variant == eStraight;
+	// Opaque surfaces go first and front to back, so early depth tests reject what they hide.
+	// Translucent surfaces are tested against them but don't hide anything themselves
+	const vk::PipelineDepthStencilStateCreateInfo depthStencil {
+		.depthTestEnable = vk::True,
+		.depthWriteEnable = blend ? vk::False : vk::True,
+		.depthCompareOp = vk::CompareOp::eLess,
+		.depthBoundsTestEnable = vk::False,
+		.stencilTestEnable = vk::False
+	};
+	// Opaque variants skip blending and with it reading back the framebuffer
+	const vk::PipelineColorBlendAttachmentState colorBlendAttachment {
+		.blendEnable = blend ? vk::True : vk::False,
+		.srcColorBlendFactor = variant == eStraight ? vk::BlendFactor::eSrcAlpha : vk::BlendFactor::eOne,
 		.dstColorBlendFactor = vk::BlendFactor::eOneMinusSrcAlpha,
 		.colorBlendOp = vk::BlendOp::eAdd,
 		.srcAlphaBlendFactor = vk::BlendFactor::eOne,
-		.dstAlphaBlendFactor = vk::BlendFactor::eZero,
+		.dstAlphaBlendFactor = vk::BlendFactor::eOneMinusSrcAlpha,
 		.alphaBlendOp = vk::BlendOp::eAdd,
 		.colorWriteMask = vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA
 	};
@@ -270,28 +403,42 @@ void VDisplay::createRenderPipeline() {
 		.dynamicStateCount = dynamicStates.size(),
 		.pDynamicStates = dynamicStates.data()
 	};
-	vk::GraphicsPipelineCreateInfo pipelineInfo{
-		.flags = vk::PipelineCreateFlagBits::eAllowDerivatives,
-		.stageCount = shaderStages.size32(),
+	const vk::GraphicsPipelineCreateInfo pipelineInfo{
+		.stageCount = shaderStages.size(),
 		.pStages = shaderStages.data(),
 		.pVertexInputState = &vertexInputInfo,
 		.pInputAssemblyState = &inputAssembly,
 		.pViewportState = &viewportState,
 		.pRasterizationState = &rasterizer,
 		.pMultisampleState = &multisampling,
+		.pDepthStencilState = &depthStencil,
 		.pColorBlendState = &colorBlend,
 		.pDynamicState = &dynamicState,
-		.layout = pipelineLayout,
+		.layout = ycbcr ? ycbcrLayouts[conversion] : pipelineLayout,
 		.renderPass = renderPass,
-		.subpass = 0,
-		.basePipelineHandle = pipeline,
-		.basePipelineIndex = -1
+		.subpass = 0
 	};
 	// TODO: Implement pipeline cache
 	auto res = vDev->dev.createGraphicsPipeline(nullptr, pipelineInfo);
+	if (!res.has_value()) [[unlikely]] {
+		MERROR << name << " Failed to create graphics pipeline " << variant << ": " << to_str(res.error()) << endl;
+		return nullptr;
+	}
+	return std::move(res.value());
+}
+
+void VDisplay::createDepthBuffer() {
+	MDEBUG << name << " Creating depth buffer" << endl;
+	depth.reset();
+	auto res = vDev->createTexture({
+		.format = DEPTH_FORMAT,
+		.extent = extent,
+		.usage = vk::ImageUsageFlagBits::eDepthStencilAttachment,
+		.aspect = vk::ImageAspectFlagBits::eDepth
+	});
 	if (!res.has_value()) [[unlikely]]
-		throw std::runtime_error(name + " Failed to create graphics pipeline: " + to_str(res.error()));
-	pipeline = std::move(res.value());
+		throw std::runtime_error(name + " Failed to create depth buffer");
+	depth = std::move(res.value());
 }
 
 void VDisplay::createFrameBuffers() {
@@ -302,10 +449,9 @@ void VDisplay::createFrameBuffers() {
 	}
 }
 
-void VDisplay::createCommandPools() {
-	MDEBUG << name << " Creating command pools" << endl;
-	graphicsPool = vDev->createCommandPool(vDev->graphicsIndex);
-	transferPool = vDev->createCommandPool(vDev->transferIndex);
+void VDisplay::createRenderGraph() {
+	MDEBUG << name << " Creating render graph" << endl;
+	graph = u_ptr<VRenderGraph>(new VRenderGraph(*vDev));
 }
 
 bool VDisplay::isGood() {
@@ -316,20 +462,30 @@ bool VDisplay::isGood() {
 }
 
 void VDisplay::cleanup() {
+	// Reports frames to the output
+	stopPresentWaiter();
 	output.reset();
 	for (const auto& val : busySyncObjs | std::views::values) {
 		const auto& sync = syncObjs[val];
 		waitFence(sync.presented);
 	}
+	// Waits for the last frame's command buffers
+	graph.reset();
 
 	syncObjs.clear();
 	images.clear();
-	pipeline.clear();
+	depth.reset();
+	instances.reset();
+	stopRecorders();
+	recorders.clear();
+	background.reset();
+	for (auto& pipeline : pipelines)
+		pipeline.clear();
+	ycbcrPipelines.clear();
 	renderPass.clear();
+	ycbcrLayouts.clear();
 	pipelineLayout.clear();
 	swapchain.clear();
-	transferPool.clear();
-	graphicsPool.clear();
 	deleteSurface();
 }
 
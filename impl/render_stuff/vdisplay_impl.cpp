@@ -5,9 +5,8 @@
 
 using namespace mland;
 
-// We use graphics pool for the background transfer because its GPU to GPU
 VDisplay::Image::Image(const VDisplay& us, const vk::Image& img) :
-image(img), graphicsCmd(us.vDev->createCommandBuffer(us.graphicsPool)), backgroundCmd(us.vDev->createCommandBuffer(us.graphicsPool)) {
+image(img) {
 	static constexpr vk::ComponentMapping mapping {
 		.r = vk::ComponentSwizzle::eIdentity,
 		.g = vk::ComponentSwizzle::eIdentity,
@@ -32,10 +31,11 @@ image(img), graphicsCmd(us.vDev->createCommandBuffer(us.graphicsPool)), backgrou
 	if (!viewRet.has_value()) [[unlikely]]
 		throw std::runtime_error(us.name + " Failed to create image view: " + to_str(viewRet.error()));
 	view = std::move(viewRet.value());
+	const std::array attachments{*view, *us.depth->view};
 	const vk::FramebufferCreateInfo framebuffer {
 		.renderPass = us.renderPass,
-		.attachmentCount = 1,
-		.pAttachments = &*view, // Abhorrent but necessary
+		.attachmentCount = attachments.size(),
+		.pAttachments = attachments.data(),
 		.width = us.extent.width,
 		.height = us.extent.height,
 		.layers = 1
@@ -83,12 +83,10 @@ bool VDisplay::waitImage(const uint32_t imageIndex) {
 
 VDisplay::SyncObjs::SyncObjs(const VDisplay& us) :
 imageAvailable(us.createSem()),
-backgroundFinished(us.createSem()),
 renderFinished(us.createSem()),
 presented(us.createFence()) {}
 
 VDisplay::Image::~Image() {
-	graphicsCmd.clear();
 	framebuffer.clear();
 	view.clear();
 }
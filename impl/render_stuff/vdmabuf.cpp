@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <unistd.h>
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <drm_fourcc.h>
+
+#include "mland/vdmabuf.h"
+
+using namespace mland;
+
+namespace {
+// DRM formats we hand to clients and what they are sampled as. Little endian, ARGB8888 is B, G,
+// R, A in memory. The X formats rely on the opaque pipelines ignoring alpha. NV12 and YUV420 keep
+// luma in the first plane and Cb before Cr, which is what G, B, R means for the Vulkan formats
+constexpr std::array<std::pair<uint32_t, vk::Format>, 6> FORMATS{{
+	{DRM_FORMAT_ARGB8888, vk::Format::eB8G8R8A8Unorm},
+	{DRM_FORMAT_XRGB8888, vk::Format::eB8G8R8A8Unorm},
+	{DRM_FORMAT_ABGR8888, vk::Format::eR8G8B8A8Unorm},
+	{DRM_FORMAT_XBGR8888, vk::Format::eR8G8B8A8Unorm},
+	{DRM_FORMAT_NV12, vk::Format::eG8B8R82Plane420Unorm},
+	{DRM_FORMAT_YUV420, vk::Format::eG8B8R83Plane420Unorm}
+}};
+constexpr auto HANDLE_TYPE = vk::ExternalMemoryHandleTypeFlagBits::eDmaBufEXT;
+
+constexpr bool multiPlanar(const vk::Format format) {
+	return format == vk::Format::eG8B8R82Plane420Unorm || format == vk::Format::eG8B8R83Plane420Unorm;
+}
+}
+
+const vec<cstr>& VDmabufImporter::extensions() {
+	static const vec<cstr> extensions{
+		vk::KHRExternalMemoryFdExtensionName,
+		vk::EXTExternalMemoryDmaBufExtensionName,
+		vk::EXTImageDrmFormatModifierExtensionName
+	};
+	return extensions;
+}
+
+bool VDmabufImporter::supported(const VDevice& vDev) {
+	return std::ranges::all_of(extensions(), [&](const cstr ext) { return vDev.hasExtension(ext); });
+}
+
+VDmabufImporter::VDmabufImporter(VDevice& vDev) : vDev(vDev) {
+	if (vDev.hasExtension(vk::EXTQueueFamilyForeignExtensionName))
+		foreignFamily = VK_QUEUE_FAMILY_FOREIGN_EXT;
+	if (vDev.hasExtension(vk::EXTPhysicalDeviceDrmExtensionName)) {
+		const auto drm = vDev.pDev.getProperties2<vk::PhysicalDeviceProperties2,
+			vk::PhysicalDeviceDrmPropertiesEXT>().get<vk::PhysicalDeviceDrmPropertiesEXT>();
+		// Clients allocate on the render node, the primary one may need privileges they don't have
+		if (drm.hasRender)
+			device = makedev(drm.renderMajor, drm.renderMinor);
+		else if (drm.hasPrimary)
+			device = makedev(drm.primaryMajor, drm.primaryMinor);
+	}
+	if (vDev.hasExtension(vk::KHRExternalSemaphoreFdExtensionName)) {
+		const auto props = vDev.pDev.getExternalSemaphoreProperties({
+			.handleType = vk::ExternalSemaphoreHandleTypeFlagBits::eSyncFd
+		});
+		syncFiles = static_cast<bool>(props.externalSemaphoreFeatures & vk::ExternalSemaphoreFeatureFlagBits::eImportable);
+	}
+	ycbcr = vDev.pDev.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceVulkan11Features>()
+		.get<vk::PhysicalDeviceVulkan11Features>().samplerYcbcrConversion;
+	for (const auto& [fourcc, format] : FORMATS)
+		queryFormat(fourcc, format);
+	if (!conversions.empty() && !createPool()) {
+		std::erase_if(formats, [](const Format& format) { return format.conversion != NO_CONVERSION; });
+		conversions.clear();
+	}
+	MDEBUG << vDev.name << " Can import " << formats.size() << " dmabuf formats and modifiers, "
+		<< conversions.size() << " Y'CbCr conversions" << endl;
+}
+
+void VDmabufImporter::queryFormat(const uint32_t fourcc, const vk::Format format) {
+	if (multiPlanar(format) && !ycbcr)
+		return;
+	// Count first, then the modifiers themselves
+	vk::DrmFormatModifierPropertiesListEXT list{};
+	vk::FormatProperties2 props{.pNext = &list};
+	vkGetPhysicalDeviceFormatProperties2(*vDev.pDev, static_cast<VkFormat>(format),
+		reinterpret_cast<VkFormatProperties2*>(&props));
+	vec<vk::DrmFormatModifierPropertiesEXT> modifiers(list.drmFormatModifierCount);
+	list.pDrmFormatModifierProperties = modifiers.data();
+	vkGetPhysicalDeviceFormatProperties2(*vDev.pDev, static_cast<VkFormat>(format),
+		reinterpret_cast<VkFormatProperties2*>(&props));
+
+	// Importable modifiers, Y'CbCr formats take whatever chroma siting all of them share
+	vec<vk::DrmFormatModifierPropertiesEXT> usable{};
+	for (const auto& modifier : modifiers) {
+		if (!(modifier.drmFormatModifierTilingFeatures & vk::FormatFeatureFlagBits::eSampledImage))
+			continue;
+		// Sampling support says nothing about importing, that is asked per handle type
+		const vk::PhysicalDeviceImageDrmFormatModifierInfoEXT modifierInfo{
+			.drmFormatModifier = modifier.drmFormatModifier,
+			.sharingMode = vk::SharingMode::eExclusive
+		};
+		const vk::PhysicalDeviceExternalImageFormatInfo externalInfo{
+			.pNext = &modifierInfo,
+			.handleType = HANDLE_TYPE
+		};
+		const vk::PhysicalDeviceImageFormatInfo2 imageInfo{
+			.pNext = &externalInfo,
+			.format = format,
+			.type = vk::ImageType::e2D,
+			.tiling = vk::ImageTiling::eDrmFormatModifierEXT,
+			.usage = vk::ImageUsageFlagBits::eSampled
+		};
+		vk::SamplerYcbcrConversionImageFormatProperties ycbcrProps{};
+		vk::ExternalImageFormatProperties externalProps{.pNext = multiPlanar(format) ? &ycbcrProps : nullptr};
+		vk::ImageFormatProperties2 imageProps{.pNext = &externalProps};
+		const auto res = static_cast<vk::Result>(vkGetPhysicalDeviceImageFormatProperties2(*vDev.pDev,
+			reinterpret_cast<const VkPhysicalDeviceImageFormatInfo2*>(&imageInfo),
+			reinterpret_cast<VkImageFormatProperties2*>(&imageProps)));
+		if (res != vk::Result::eSuccess || !(externalProps.externalMemoryProperties.externalMemoryFeatures &
+			vk::ExternalMemoryFeatureFlagBits::eImportable))
+			continue;
+		ycbcrDescriptors = std::max(ycbcrDescriptors, ycbcrProps.combinedImageSamplerDescriptorCount);
+		usable.push_back(modifier);
+	}
+	if (usable.empty())
+		return;
+
+	auto conversion = NO_CONVERSION;
+	if (multiPlanar(format)) {
+		using enum vk::FormatFeatureFlagBits;
+		const auto common = [&] {
+			auto features = usable.front().drmFormatModifierTilingFeatures;
+			for (const auto& modifier : usable)
+				features &= modifier.drmFormatModifierTilingFeatures;
+			return features;
+		};
+		// Every modifier supports one of the sitings per axis, those without the shared one are dropped
+		const auto shared = common();
+		const auto x = shared & eCositedChromaSamples ? eCositedChromaSamples : eMidpointChromaSamples;
+		const auto y = shared & eMidpointChromaSamples ? eMidpointChromaSamples : eCositedChromaSamples;
+		std::erase_if(usable, [&](const vk::DrmFormatModifierPropertiesEXT& modifier) {
+			return !(modifier.drmFormatModifierTilingFeatures & x) || !(modifier.drmFormatModifierTilingFeatures & y);
+		});
+		if (usable.empty())
+			return;
+		conversion = createConversion(format, common());
+		if (conversion == NO_CONVERSION)
+			return;
+	}
+	for (const auto& modifier : usable)
+		formats.push_back({fourcc, modifier.drmFormatModifier, format, modifier.drmFormatModifierPlaneCount, conversion});
+}
+
+uint32_t VDmabufImporter::createConversion(const vk::Format format, const vk::FormatFeatureFlags features) {
+	using enum vk::FormatFeatureFlagBits;
+	const auto filter = features & eSampledImageYcbcrConversionLinearFilter ? vk::Filter::eLinear : vk::Filter::eNearest;
+	// Clients can't tell us the color space without a color management protocol, most video is HD.
+	// H.264 and HEVC site 4:2:0 chroma on the left column, between the rows
+	const vk::SamplerYcbcrConversionCreateInfo conversionInfo{
+		.format = format,
+		.ycbcrModel = vk::SamplerYcbcrModelConversion::eYcbcr709,
+		.ycbcrRange = vk::SamplerYcbcrRange::eItuNarrow,
+		.components = {},
+		.xChromaOffset = features & eCositedChromaSamples ? vk::ChromaLocation::eCositedEven : vk::ChromaLocation::eMidpoint,
+		.yChromaOffset = features & eMidpointChromaSamples ? vk::ChromaLocation::eMidpoint : vk::ChromaLocation::eCositedEven,
+		.chromaFilter = filter,
+		.forceExplicitReconstruction = vk::False
+	};
+	auto conversionRes = vDev.dev.createSamplerYcbcrConversion(conversionInfo);
+	if (!conversionRes.has_value()) {
+		MWARN << vDev.name << " Failed to create Y'CbCr conversion for " << to_str(format) << ": "
+			<< to_str(conversionRes.error()) << endl;
+		return NO_CONVERSION;
+	}
+	const vk::SamplerYcbcrConversionInfo samplerConversion{.conversion = *conversionRes.value()};
+	// Without separate reconstruction filters both have to match the chroma filter
+	const vk::SamplerCreateInfo samplerInfo{
+		.pNext = &samplerConversion,
+		.magFilter = filter,
+		.minFilter = filter,
+		.mipmapMode = vk::SamplerMipmapMode::eNearest,
+		.addressModeU = vk::SamplerAddressMode::eClampToEdge,
+		.addressModeV = vk::SamplerAddressMode::eClampToEdge,
+		.addressModeW = vk::SamplerAddressMode::eClampToEdge,
+		.maxLod = 0.0f
+	};
+	auto samplerRes = vDev.dev.createSampler(samplerInfo);
+	if (!samplerRes.has_value()) {
+		MWARN << vDev.name << " Failed to create Y'CbCr sampler for " << to_str(format) << ": "
+			<< to_str(samplerRes.error()) << endl;
+		return NO_CONVERSION;
+	}
+	const vk::DescriptorSetLayoutBinding binding{
+		.binding = 0,
+		.descriptorType = vk::DescriptorType::eCombinedImageSampler,
+		.descriptorCount = 1,
+		.stageFlags = vk::ShaderStageFlagBits::eFragment,
+		.pImmutableSamplers = &*samplerRes.value()
+	};
+	const vk::DescriptorSetLayoutCreateInfo layoutInfo{
+		.bindingCount = 1,
+		.pBindings = &binding
+	};
+	auto layoutRes = vDev.dev.createDescriptorSetLayout(layoutInfo);
+	if (!layoutRes.has_value()) {
+		MWARN << vDev.name << " Failed to create Y'CbCr set layout for " << to_str(format) << ": "
+			<< to_str(layoutRes.error()) << endl;
+		return NO_CONVERSION;
+	}
+	conversions.push_back({format, std::move(conversionRes.value()), std::move(samplerRes.value()),
+		std::move(layoutRes.value())});
+	return conversions.size32() - 1;
+}
+
+bool VDmabufImporter::createPool() {
+	const vk::DescriptorPoolSize poolSize{
+		.type = vk::DescriptorType::eCombinedImageSampler,
+		.descriptorCount = MAX_YCBCR * ycbcrDescriptors
+	};
+	// Sets are freed with the textures they belong to
+	const vk::DescriptorPoolCreateInfo poolInfo{
+		.flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+		.maxSets = MAX_YCBCR,
+		.poolSizeCount = 1,
+		.pPoolSizes = &poolSize
+	};
+	auto poolRes = vDev.dev.createDescriptorPool(poolInfo);
+	if (!poolRes.has_value()) {
+		MWARN << vDev.name << " Failed to create Y'CbCr descriptor pool: " << to_str(poolRes.error()) << endl;
+		return false;
+	}
+	pool = std::move(poolRes.value());
+	return true;
+}
+
+const VDmabufImporter::Format* VDmabufImporter::find(const uint32_t fourcc, const uint64_t modifier) const {
+	const auto it = std::ranges::find_if(formats, [&](const Format& format) {
+		return format.fourcc == fourcc && format.modifier == modifier;
+	});
+	return it != formats.end() ? &*it : nullptr;
+}
+
+opt<u_ptr<VTexture>> VDmabufImporter::import(const DmabufAttributes& attributes) const {
+	const auto* format = find(attributes.format, attributes.modifier);
+	if (format == nullptr || format->planes != attributes.planeCount) {
+		MWARN << vDev.name << " Can't import dmabuf " << attributes.id << " with " << attributes.planeCount
+			<< " planes" << endl;
+		return std::nullopt;
+	}
+	// 4:2:0 images have to cover whole chroma samples
+	if (format->conversion != NO_CONVERSION && (attributes.width % 2 != 0 || attributes.height % 2 != 0)) {
+		MWARN << vDev.name << " Can't import dmabuf " << attributes.id << " with odd size " << attributes.width
+			<< "x" << attributes.height << endl;
+		return std::nullopt;
+	}
+	std::array<vk::SubresourceLayout, DmabufAttributes::MAX_PLANES> layouts{};
+	for (uint32_t i = 0; i < attributes.planeCount; i++)
+		layouts[i] = {.offset = attributes.planes[i].offset, .rowPitch = attributes.planes[i].stride};
+	const vk::ImageDrmFormatModifierExplicitCreateInfoEXT modifierInfo{
+		.drmFormatModifier = attributes.modifier,
+		.drmFormatModifierPlaneCount = attributes.planeCount,
+		.pPlaneLayouts = layouts.data()
+	};
+	const vk::ExternalMemoryImageCreateInfo externalInfo{
+		.pNext = &modifierInfo,
+		.handleTypes = HANDLE_TYPE
+	};
+	const VTexture::Info info{
+		.format = format->format,
+		.extent = {static_cast<uint32_t>(attributes.width), static_cast<uint32_t>(attributes.height)},
+		.usage = vk::ImageUsageFlagBits::eSampled,
+		.tiling = vk::ImageTiling::eDrmFormatModifierEXT,
+		.memory = {}
+	};
+	const vk::ImageCreateInfo imageInfo{
+		.pNext = &externalInfo,
+		.imageType = vk::ImageType::e2D,
+		.format = info.format,
+		.extent = {info.extent.width, info.extent.height, 1},
+		.mipLevels = 1,
+		.arrayLayers = 1,
+		.samples = vk::SampleCountFlagBits::e1,
+		.tiling = info.tiling,
+		.usage = info.usage,
+		.sharingMode = vk::SharingMode::eExclusive,
+		.initialLayout = vk::ImageLayout::eUndefined
+	};
+	auto imageRes = vDev.dev.createImage(imageInfo);
+	if (!imageRes.has_value()) {
+		MWARN << vDev.name << " Failed to create an image for dmabuf " << attributes.id << ": "
+			<< to_str(imageRes.error()) << endl;
+		return std::nullopt;
+	}
+	auto texture = u_ptr<VTexture>(new VTexture());
+	texture->info = info;
+	texture->image = std::move(imageRes.value());
+
+	// Every plane is in the same dmabuf, LinuxDmabuf rejects anything else
+	const auto fd = attributes.planes[0].fd;
+	const auto fdProps = vDev.dev.getMemoryFdPropertiesKHR(HANDLE_TYPE, fd);
+	const auto reqs = texture->image.getMemoryRequirements();
+	const auto types = fdProps.memoryTypeBits & reqs.memoryTypeBits;
+	if (types == 0) {
+		MWARN << vDev.name << " No memory type can hold dmabuf " << attributes.id << endl;
+		return std::nullopt;
+	}
+	// A successful import takes ownership of the fd, the attributes keep theirs
+	const auto importFd = dup(fd);
+	if (importFd < 0)
+		return std::nullopt;
+	const vk::ImportMemoryFdInfoKHR importInfo{
+		.handleType = HANDLE_TYPE,
+		.fd = importFd
+	};
+	const vk::MemoryDedicatedAllocateInfo dedicatedInfo{
+		.pNext = &importInfo,
+		.image = *texture->image
+	};
+	const vk::MemoryAllocateInfo allocInfo{
+		.pNext = &dedicatedInfo,
+		.allocationSize = reqs.size,
+		.memoryTypeIndex = static_cast<uint32_t>(std::countr_zero(types))
+	};
+	auto memoryRes = vDev.dev.allocateMemory(allocInfo);
+	if (!memoryRes.has_value()) {
+		close(importFd);
+		MWARN << vDev.name << " Failed to import dmabuf " << attributes.id << ": " << to_str(memoryRes.error()) << endl;
+		return std::nullopt;
+	}
+	texture->imported = std::move(memoryRes.value());
+	texture->image.bindMemory(*texture->imported, 0);
+
+	const auto* conversion = format->conversion != NO_CONVERSION ? &conversions[format->conversion] : nullptr;
+	const vk::SamplerYcbcrConversionInfo conversionInfo{
+		.conversion = conversion != nullptr ? *conversion->conversion : vk::SamplerYcbcrConversion{}
+	};
+	const vk::ImageViewCreateInfo viewInfo{
+		.pNext = conversion != nullptr ? &conversionInfo : nullptr,
+		.image = texture->image,
+		.viewType = vk::ImageViewType::e2D,
+		.format = info.format,
+		.components = {},
+		.subresourceRange = {
+			.aspectMask = info.aspect,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		}
+	};
+	auto viewRes = vDev.dev.createImageView(viewInfo);
+	if (!viewRes.has_value()) {
+		MWARN << vDev.name << " Failed to create a view for dmabuf " << attributes.id << ": "
+			<< to_str(viewRes.error()) << endl;
+		return std::nullopt;
+	}
+	texture->view = std::move(viewRes.value());
+	if (conversion == nullptr)
+		return texture;
+
+	const vk::DescriptorSetAllocateInfo setInfo{
+		.descriptorPool = pool,
+		.descriptorSetCount = 1,
+		.pSetLayouts = &*conversion->layout
+	};
+	auto setRes = vDev.dev.allocateDescriptorSets(setInfo);
+	if (!setRes.has_value()) {
+		MWARN << vDev.name << " No descriptor set left for dmabuf " << attributes.id << ": "
+			<< to_str(setRes.error()) << endl;
+		return std::nullopt;
+	}
+	texture->ycbcr = std::move(setRes.value().front());
+	// The sampler is immutable, only the view goes in
+	const vk::DescriptorImageInfo imageInfo{
+		.imageView = texture->view,
+		.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal
+	};
+	const vk::WriteDescriptorSet write{
+		.dstSet = texture->ycbcr,
+		.dstBinding = 0,
+		.descriptorCount = 1,
+		.descriptorType = vk::DescriptorType::eCombinedImageSampler,
+		.pImageInfo = &imageInfo
+	};
+	vDev.dev.updateDescriptorSets(write, {});
+	return texture;
+}
+
+opt<vkr::Semaphore> VDmabufImporter::importFence(const DmabufAttributes& attributes) const {
+	if (!syncFiles)
+		return std::nullopt;
+	// Read access only waits for the writers. Every plane is in the same dmabuf
+	dma_buf_export_sync_file exported{.flags = DMA_BUF_SYNC_READ, .fd = -1};
+	if (ioctl(attributes.planes[0].fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &exported) != 0) {
+		if (errno == ENOTTY) {
+			MINFO << vDev.name << " The kernel can't export dmabuf fences, clients have to wait for their writes" << endl;
+			syncFiles = false;
+		}
+		return std::nullopt;
+	}
+	static constexpr vk::SemaphoreCreateInfo semInfo{};
+	auto semRes = vDev.dev.createSemaphore(semInfo);
+	if (!semRes.has_value()) {
+		close(exported.fd);
+		return std::nullopt;
+	}
+	// A successful import takes ownership of the fd, the wait consumes the payload
+	const vk::ImportSemaphoreFdInfoKHR importInfo{
+		.semaphore = *semRes.value(),
+		.flags = vk::SemaphoreImportFlagBits::eTemporary,
+		.handleType = vk::ExternalSemaphoreHandleTypeFlagBits::eSyncFd,
+		.fd = exported.fd
+	};
+	const auto res = static_cast<vk::Result>(vDev.dev.getDispatcher()->vkImportSemaphoreFdKHR(*vDev.dev,
+		reinterpret_cast<const VkImportSemaphoreFdInfoKHR*>(&importInfo)));
+	if (res != vk::Result::eSuccess) {
+		close(exported.fd);
+		MWARN << vDev.name << " Failed to import the fence of dmabuf " << attributes.id << ": " << to_str(res) << endl;
+		return std::nullopt;
+	}
+	return std::move(semRes.value());
+}
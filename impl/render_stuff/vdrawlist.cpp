@@ -0,0 +1,77 @@
+#include "mland/vdrawlist.h"
+
+using namespace mland;
+
+namespace {
+Box toBox(const vk::Rect2D& rect) {
+	return Box::fromSize(rect.offset.x, rect.offset.y,
+		static_cast<int32_t>(std::min<uint32_t>(rect.extent.width, std::numeric_limits<int32_t>::max())),
+		static_cast<int32_t>(std::min<uint32_t>(rect.extent.height, std::numeric_limits<int32_t>::max())));
+}
+
+Box clamp(const Box& box, const Box& to) {
+	return {std::max(box.x1, to.x1), std::max(box.y1, to.y1), std::min(box.x2, to.x2), std::min(box.y2, to.y2)};
+}
+
+vk::Rect2D toRect(const Box& box, const Box& origin) {
+	return {{box.x1 - origin.x1, box.y1 - origin.y1},
+		{static_cast<uint32_t>(box.width()), static_cast<uint32_t>(box.height())}};
+}
+}
+
+void VDrawList::build(const Scene& scene, const vk::Rect2D& output) {
+	clear();
+	const auto out = toBox(output);
+	covered.clear();
+	for (auto i = scene.size(); i-- > 0;) {
+		const auto geometry = clamp(toBox(scene.geometry[i]), out);
+		if (geometry.empty())
+			continue;
+		stats.surfaces++;
+		visible.reset(geometry);
+		visible.subtract(covered);
+		if (visible.empty()) {
+			stats.culled++;
+			stats.culledPixels += geometry.area();
+			continue;
+		}
+		const auto visibleArea = visible.area();
+		if (visibleArea != geometry.area())
+			stats.clipped++;
+		stats.drawn++;
+		stats.drawnPixels += visibleArea;
+		stats.culledPixels += geometry.area() - visibleArea;
+
+		sceneIndex.push_back(i);
+		opaque.push_back(scene.flags[i] & Scene::eOpaque);
+		bounds.push_back(toRect(geometry, out));
+		firstClip.push_back(clips.size32());
+		if (visible.size() > MAX_CLIPS)
+			clips.push_back(toRect(visible.extents(), out));
+		else
+			for (const auto& box : visible.boxes())
+				clips.push_back(toRect(box, out));
+		clipCount.push_back(clips.size32() - firstClip.back());
+
+		// Opaque area outside the surface is ignored, see wl_surface.set_opaque_region
+		const auto opaqueBox = clamp(toBox(scene.opaque[i]), geometry);
+		if (!opaqueBox.empty())
+			covered.unite(opaqueBox);
+	}
+	covers = covered.overlaps(out) == BandedRegion::Overlap::eIn;
+}
+
+void VDrawList::clear() {
+	sceneIndex.clear();
+	opaque.clear();
+	bounds.clear();
+	firstClip.clear();
+	clipCount.clear();
+	clips.clear();
+	covers = false;
+	stats = {};
+}
+
+std::span<const vk::Rect2D> VDrawList::getClips(const uint32_t n) const {
+	return {clips.data() + firstClip[n], clipCount[n]};
+}
@@ -114,6 +114,19 @@ vec<VDevice::Id_t> VInstance::refreshDevices() {
 	for (const auto& ext : backend->requiredDeviceExtensions()) {
 		deviceExtensions.push_back(ext);
 	}
+	// Enabled when the device has them
+	static const vec<cstr> optionalDeviceExtensions {
+		vk::EXTMemoryBudgetExtensionName,
+		vk::EXTExternalMemoryHostExtensionName,
+		vk::KHRExternalMemoryFdExtensionName,
+		vk::KHRExternalSemaphoreFdExtensionName,
+		vk::EXTExternalMemoryDmaBufExtensionName,
+		vk::EXTImageDrmFormatModifierExtensionName,
+		vk::EXTQueueFamilyForeignExtensionName,
+		vk::EXTPhysicalDeviceDrmExtensionName,
+		vk::KHRPresentIdExtensionName,
+		vk::KHRPresentWaitExtensionName
+	};
 
 	auto res = instance.enumeratePhysicalDevices();
 	if (!res.has_value()) {
@@ -155,7 +168,15 @@ vec<VDevice::Id_t> VInstance::refreshDevices() {
 			continue;
 		}
 
-		auto devCreate = createDevice(std::move(pDev), deviceExtensions);
+		auto enabledExtensions = deviceExtensions;
+		for (const auto& ext : optionalDeviceExtensions) {
+			if (std::ranges::find(availableExtensions, str(ext)) != availableExtensions.end()) {
+				MDEBUG << "Device " << name << " supports optional extension " << ext << endl;
+				enabledExtensions.push_back(ext);
+			}
+		}
+
+		auto devCreate = createDevice(std::move(pDev), enabledExtensions);
 		if (!devCreate.has_value()) {
 			MERROR << "Failed to create device " << name << endl;
 			continue;
@@ -0,0 +1,374 @@
+#include "mland/vrendergraph.h"
+
+using namespace mland;
+
+void VRenderGraph::Barriers::clear() {
+	srcStages = {};
+	dstStages = {};
+	memory = vk::MemoryBarrier{};
+	images.clear();
+}
+
+bool VRenderGraph::Barriers::empty() const {
+	return !memory.srcAccessMask && !memory.dstAccessMask && images.empty() && !srcStages;
+}
+
+void VRenderGraph::Barriers::record(const vkr::CommandBuffer& cmd) const {
+	if (empty())
+		return;
+	const bool hasMemory = memory.srcAccessMask || memory.dstAccessMask;
+	cmd.pipelineBarrier(srcStages, dstStages, {},
+		hasMemory ? vk::ArrayProxy<const vk::MemoryBarrier>(memory) : vk::ArrayProxy<const vk::MemoryBarrier>(),
+		{}, images);
+}
+
+VRenderGraph::VRenderGraph(VDevice& vDev) : vDev(vDev) {
+	slots[0].family = vDev.graphicsIndex;
+	slots[1].family = vDev.transferIndex;
+	if (vDev.transferIndex != vDev.graphicsIndex)
+		slotCount = 2;
+}
+
+VRenderGraph::~VRenderGraph() {
+	// The command buffers can't be freed while the GPU still runs them
+	vDev.wait(lastTicket);
+	for (auto& slot : slots) {
+		slot.recorded.clear();
+		slot.pool.clear();
+	}
+}
+
+void VRenderGraph::reset() {
+	passCount = 0;
+	resourceCount = 0;
+	batches.clear();
+	external = {};
+	externalStages = {};
+}
+
+void VRenderGraph::waitFor(const VDevice::Ticket& ticket, const vk::PipelineStageFlags stage) {
+	external = external.merge(ticket);
+	externalStages |= stage;
+}
+
+VRenderGraph::ResourceId VRenderGraph::import(const ImageDesc& desc) {
+	if (resourceCount == resources.size()) {
+		resources.emplace_back();
+		states.emplace_back();
+	}
+	resources[resourceCount] = desc;
+	auto& state = states[resourceCount];
+	state = State{};
+	state.layout = desc.initialLayout;
+	state.owner = desc.concurrent ? VK_QUEUE_FAMILY_IGNORED : vDev.graphicsIndex;
+	return resourceCount++;
+}
+
+// Work that only needs a transfer queue goes to the dedicated one if it touches nothing exclusive
+// and nothing the graphics queue used earlier this frame, otherwise it would only add semaphores
+uint32_t VRenderGraph::place(const QueueType type, const std::initializer_list<Access> accesses) const {
+	if (type == QueueType::eGraphics || slotCount == 1)
+		return 0;
+	for (const auto& access : accesses) {
+		const auto& state = states[access.resource];
+		if (!resources[access.resource].concurrent)
+			return 0;
+		if (state.lastRead[0] >= 0 || (state.lastWrite >= 0 && passes[state.lastWrite].slot == 0))
+			return 0;
+	}
+	return 1;
+}
+
+VRenderGraph::PassId VRenderGraph::addPass(const cstr name, const QueueType type,
+	const std::initializer_list<Access> accesses, VDevice::Recorder&& record) {
+	if (passCount == passes.size())
+		passes.emplace_back();
+	auto& pass = passes[passCount];
+	pass.name = name;
+	pass.slot = place(type, accesses);
+	pass.accesses.assign(accesses.begin(), accesses.end());
+	pass.record = std::move(record);
+	pass.pre.clear();
+	pass.post.clear();
+	pass.dependencies.clear();
+	pass.waits.clear();
+	pass.signals.clear();
+	compile(passCount);
+	return passCount++;
+}
+
+void VRenderGraph::compile(const PassId id) {
+	auto& pass = passes[id];
+	const uint32_t slot = pass.slot;
+	const uint32_t family = slots[slot].family;
+	for (const auto& access : pass.accesses) {
+		const auto& desc = resources[access.resource];
+		auto& state = states[access.resource];
+		const bool write = static_cast<bool>(access.access & WRITE_ACCESS);
+		const bool transition = access.layout != vk::ImageLayout::eUndefined && access.layout != state.layout;
+		const bool modifies = write || transition;
+
+		vk::PipelineStageFlags srcStages{};
+		vk::AccessFlags srcAccess{};
+		bool barrier = transition;
+		bool crossQueue = false;
+		// Same queue dependencies become barriers, the others semaphore waits
+		const auto dependOn = [&](const int64_t other) {
+			if (other < 0 || other == id)
+				return false;
+			if (passes[other].slot == slot)
+				return true;
+			pass.dependencies.emplace_back(static_cast<PassId>(other), access.stage);
+			crossQueue = true;
+			return false;
+		};
+
+		if (desc.acquire && !state.acquired) {
+			pass.waits.emplace_back(desc.acquire, access.stage);
+			state.acquired = true;
+			// Chains the layout transition to the semaphore wait
+			srcStages |= access.stage;
+		}
+		if (state.lastWrite >= 0) {
+			const bool visible = !modifies && passes[state.lastWrite].slot == slot &&
+				!(access.access & ~state.visibleAccess) && !(access.stage & ~state.visibleStages);
+			if (!visible && dependOn(state.lastWrite)) {
+				srcStages |= state.writeStages;
+				srcAccess |= state.writeAccess;
+				barrier = true;
+			}
+		}
+		if (modifies) {
+			// Write after read only needs an execution dependency
+			for (uint32_t r = 0; r < slotCount; r++) {
+				if (dependOn(state.lastRead[r])) {
+					srcStages |= state.readStages[r];
+					barrier = true;
+				}
+			}
+		}
+
+		const auto newLayout = access.layout == vk::ImageLayout::eUndefined ? state.layout : access.layout;
+		if (state.owner != VK_QUEUE_FAMILY_IGNORED && state.owner != family) {
+			if (state.layout != vk::ImageLayout::eUndefined) {
+				// Released by the last pass that used it on the owning queue
+				const uint32_t ownerSlot = state.owner == slots[0].family ? 0 : 1;
+				int64_t releaser = state.lastRead[ownerSlot];
+				if (state.lastWrite >= 0 && passes[state.lastWrite].slot == ownerSlot)
+					releaser = std::max(releaser, state.lastWrite);
+				if (releaser < 0) {
+					MERROR << "Pass " << pass.name << " uses an exclusive image the graphics queue never released" << endl;
+				} else {
+					vk::ImageMemoryBarrier transfer{
+						.srcAccessMask = state.lastWrite >= 0 && passes[state.lastWrite].slot == ownerSlot ?
+							state.writeAccess : vk::AccessFlags{},
+						.dstAccessMask = {},
+						.oldLayout = state.layout,
+						.newLayout = newLayout,
+						.srcQueueFamilyIndex = state.owner,
+						.dstQueueFamilyIndex = family,
+						.image = desc.image,
+						.subresourceRange = desc.range
+					};
+					auto& release = passes[releaser].post;
+					release.srcStages |= state.writeStages | state.readStages[ownerSlot];
+					release.dstStages |= vk::PipelineStageFlagBits::eBottomOfPipe;
+					release.images.push_back(transfer);
+					transfer.srcAccessMask = {};
+					transfer.dstAccessMask = access.access;
+					pass.pre.srcStages |= access.stage;
+					pass.pre.dstStages |= access.stage;
+					pass.pre.images.push_back(transfer);
+					pass.dependencies.emplace_back(static_cast<PassId>(releaser), access.stage);
+					stats.barriers += 2;
+				}
+			}
+			state.owner = family;
+			barrier = false;
+		}
+
+		if (barrier) {
+			// Nothing to wait for on this queue, the semaphore wait (or nothing) comes first
+			if (!srcStages)
+				srcStages = crossQueue ? access.stage : vk::PipelineStageFlagBits::eTopOfPipe;
+			pass.pre.srcStages |= srcStages;
+			pass.pre.dstStages |= access.stage;
+			if (transition) {
+				pass.pre.images.push_back({
+					.srcAccessMask = srcAccess,
+					.dstAccessMask = access.access,
+					.oldLayout = state.layout,
+					.newLayout = access.layout,
+					.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+					.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+					.image = desc.image,
+					.subresourceRange = desc.range
+				});
+			} else {
+				pass.pre.memory.srcAccessMask |= srcAccess;
+				pass.pre.memory.dstAccessMask |= access.access;
+			}
+			stats.barriers++;
+		}
+
+		state.layout = newLayout;
+		if (modifies) {
+			state.lastWrite = id;
+			state.writeStages = access.stage;
+			state.writeAccess = access.access & WRITE_ACCESS;
+			state.visibleStages = {};
+			state.visibleAccess = {};
+			state.lastRead = {-1, -1};
+			state.readStages = {};
+		} else {
+			state.lastRead[slot] = id;
+			state.readStages[slot] |= access.stage;
+			if (barrier && state.lastWrite >= 0 && passes[state.lastWrite].slot == slot) {
+				state.visibleStages |= access.stage;
+				state.visibleAccess |= access.access;
+			}
+		}
+		if (access.finalLayout != vk::ImageLayout::eUndefined)
+			state.layout = access.finalLayout;
+	}
+}
+
+// Final layouts and the external semaphores of every imported image
+void VRenderGraph::finish() {
+	for (uint32_t i = 0; i < resourceCount; i++) {
+		const auto& desc = resources[i];
+		auto& state = states[i];
+		int64_t last = std::max({state.lastWrite, state.lastRead[0], state.lastRead[1]});
+		if (last < 0) {
+			if (!desc.acquire && !desc.release)
+				continue;
+			last = passCount - 1;
+		}
+		auto& pass = passes[last];
+		if (desc.acquire && !state.acquired) {
+			pass.waits.emplace_back(desc.acquire, vk::PipelineStageFlagBits::eBottomOfPipe);
+			state.acquired = true;
+		}
+		if (desc.finalLayout != vk::ImageLayout::eUndefined && state.layout != desc.finalLayout) {
+			pass.post.srcStages |= state.writeStages | state.readStages[pass.slot];
+			if (!pass.post.srcStages)
+				pass.post.srcStages = vk::PipelineStageFlagBits::eTopOfPipe;
+			pass.post.dstStages |= vk::PipelineStageFlagBits::eBottomOfPipe;
+			pass.post.images.push_back({
+				.srcAccessMask = state.writeAccess,
+				.dstAccessMask = {},
+				.oldLayout = state.layout,
+				.newLayout = desc.finalLayout,
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.image = desc.image,
+				.subresourceRange = desc.range
+			});
+			state.layout = desc.finalLayout;
+			stats.barriers++;
+		}
+		if (desc.release)
+			pass.signals.push_back(desc.release);
+	}
+
+	// A pass that waits on anything starts a new submission so the passes before it aren't held up
+	for (PassId id = 0; id < passCount; id++) {
+		auto& pass = passes[id];
+		const bool waits = !pass.waits.empty() || !pass.dependencies.empty();
+		if (batches.empty() || batches.back().slot != pass.slot || waits)
+			batches.push_back({.slot = pass.slot, .first = id, .end = id});
+		batches.back().end = id + 1;
+		pass.batch = static_cast<uint32_t>(batches.size() - 1);
+	}
+}
+
+vkr::CommandBuffer VRenderGraph::takeCommandBuffer(Slot& slot) {
+	if (!*slot.pool)
+		slot.pool = vDev.createCommandPool(slot.family);
+	if (!slot.recorded.empty()) {
+		VDevice::Ticket ticket{};
+		if (slot.family == vDev.graphicsIndex)
+			ticket.graphics = slot.recorded.front().second;
+		else
+			ticket.transfer = slot.recorded.front().second;
+		if (vDev.reached(ticket)) {
+			auto cmd = std::move(slot.recorded.front().first);
+			slot.recorded.pop_front();
+			cmd.reset();
+			return cmd;
+		}
+	}
+	return vDev.createCommandBuffer(slot.pool);
+}
+
+VDevice::Ticket VRenderGraph::execute(const vk::Fence fence) {
+	assert(passCount > 0);
+	finish();
+	static constexpr vk::CommandBufferBeginInfo beginInfo{
+		.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit
+	};
+	VDevice::Ticket frameTicket{};
+	for (size_t b = 0; b < batches.size(); b++) {
+		auto& batch = batches[b];
+		auto& slot = slots[batch.slot];
+		auto cmd = takeCommandBuffer(slot);
+		cmd.begin(beginInfo);
+		waits.clear();
+		waitStages.clear();
+		waitValues.clear();
+		signals.clear();
+		const auto addWait = [&](const vk::Semaphore semaphore, const vk::PipelineStageFlags stage, const uint64_t value) {
+			for (size_t i = 0; i < waits.size(); i++) {
+				if (waits[i] == semaphore) {
+					waitStages[i] |= stage;
+					waitValues[i] = std::max(waitValues[i], value);
+					return;
+				}
+			}
+			waits.push_back(semaphore);
+			waitStages.push_back(stage);
+			waitValues.push_back(value);
+		};
+		for (PassId id = batch.first; id < batch.end; id++) {
+			const auto& pass = passes[id];
+			pass.pre.record(cmd);
+			if (pass.record)
+				pass.record(cmd);
+			pass.post.record(cmd);
+			for (const auto& [semaphore, stage] : pass.waits)
+				addWait(semaphore, stage, 0);
+			for (const auto& [producer, stage] : pass.dependencies) {
+				const auto& from = batches[passes[producer].batch];
+				addWait(vDev.getTimeline(slots[from.slot].family), stage, from.value);
+			}
+			signals.insert(signals.end(), pass.signals.begin(), pass.signals.end());
+		}
+		// The stages are graphics ones, a transfer only queue couldn't wait on them
+		if (slot.family == vDev.graphicsIndex && externalStages) {
+			if (external.graphics > 0)
+				addWait(vDev.getTimeline(vDev.graphicsIndex), externalStages, external.graphics);
+			if (external.transfer > 0)
+				addWait(vDev.getTimeline(vDev.transferIndex), externalStages, external.transfer);
+		}
+		cmd.end();
+		const vk::SubmitInfo submit{
+			.waitSemaphoreCount = static_cast<uint32_t>(waits.size()),
+			.pWaitSemaphores = waits.data(),
+			.pWaitDstStageMask = waitStages.data(),
+			.commandBufferCount = 1,
+			.pCommandBuffers = &*cmd,
+			.signalSemaphoreCount = static_cast<uint32_t>(signals.size()),
+			.pSignalSemaphores = signals.data()
+		};
+		const bool lastBatch = b + 1 == batches.size();
+		const auto ticket = vDev.submit(slot.family, submit, lastBatch ? fence : vk::Fence{}, waitValues);
+		batch.value = slot.family == vDev.graphicsIndex ? ticket.graphics : ticket.transfer;
+		slot.recorded.emplace_back(std::move(cmd), batch.value);
+		frameTicket = frameTicket.merge(ticket);
+		stats.semaphoreWaits += waits.size();
+	}
+	stats.passes += passCount;
+	stats.submits += batches.size();
+	lastTicket = lastTicket.merge(frameTicket);
+	return frameTicket;
+}
@@ -0,0 +1,110 @@
+#include <algorithm>
+#include "mland/vresidency.h"
+#include "mland/vtexture_pool.h"
+
+using namespace mland;
+
+VResidency::VResidency(VDevice& vDev) : vDev(vDev) {
+	if (!vDev.hasExtension(vk::EXTMemoryBudgetExtensionName))
+		MINFO << vDev.name << " No VK_EXT_memory_budget, estimating the memory budget" << endl;
+}
+
+void VResidency::track(Resident* resident) {
+	std::lock_guard lock(mutex);
+	residents.insert(resident);
+}
+
+void VResidency::untrack(Resident* resident) {
+	std::lock_guard lock(mutex);
+	residents.erase(resident);
+}
+
+std::pair<vk::DeviceSize, vk::DeviceSize> VResidency::deviceLocalBudget() const {
+	vk::DeviceSize budget = 0;
+	vk::DeviceSize usage = 0;
+	for (const auto& heap : vDev.getMemoryBudget()) {
+		if (!heap.deviceLocal)
+			continue;
+		budget += heap.budget;
+		usage += heap.usage;
+	}
+	return {budget, usage};
+}
+
+bool VResidency::canPromote(const vk::DeviceSize bytes) const {
+	const auto [budget, usage] = deviceLocalBudget();
+	return (usage + bytes) * 100 < budget * LOW_WATERMARK;
+}
+
+uint32_t VResidency::update() {
+	const auto now = clock::now();
+	// Every display of the device calls this, one of them gets the interval
+	{
+		std::lock_guard lock(mutex);
+		if (now - lastUpdate < UPDATE_INTERVAL)
+			return 0;
+		lastUpdate = now;
+	}
+	auto [budget, usage] = deviceLocalBudget();
+	{
+		std::lock_guard lock(mutex);
+		stats.budget = budget;
+		stats.usage = usage;
+	}
+	if (usage * 100 < budget * HIGH_WATERMARK)
+		return 0;
+	const auto target = budget / 100 * LOW_WATERMARK;
+	MDEBUG << vDev.name << " Device local usage " << usage / (1024 * 1024) << "MiB of "
+		<< budget / (1024 * 1024) << "MiB" << endl;
+
+	// Cached textures are the cheapest thing to give up
+	const auto cached = vDev.getTexturePool().getStats().cachedBytes;
+	vDev.getTexturePool().clear();
+	usage -= std::min(usage, cached - vDev.getTexturePool().getStats().cachedBytes);
+	// Blocks only count against the budget while they exist
+	vDev.getAllocator().trim();
+	if (usage <= target)
+		return 0;
+
+	vec<std::pair<clock::time_point, Resident*>> candidates;
+	{
+		std::lock_guard lock(mutex);
+		for (auto* resident : residents) {
+			const auto visible = resident->lastVisible();
+			if (visible == clock::time_point::max() || now - visible < MIN_HIDDEN)
+				continue;
+			if (resident->residentBytes() == 0)
+				continue;
+			candidates.emplace_back(visible, resident);
+		}
+	}
+	std::ranges::sort(candidates, {}, &std::pair<clock::time_point, Resident*>::first);
+
+	uint32_t evicted = 0;
+	vk::DeviceSize evictedBytes = 0;
+	for (const auto& resident : candidates | std::views::values) {
+		if (usage <= target)
+			break;
+		const auto bytes = resident->residentBytes();
+		if (!resident->evict())
+			continue;
+		// The budget only catches up once the GPU lets go of the memory
+		usage -= std::min(usage, bytes);
+		evictedBytes += bytes;
+		evicted++;
+	}
+	if (evicted != 0)
+		MINFO << vDev.name << " Evicted " << evicted << " hidden textures (" << evictedBytes / (1024 * 1024)
+			<< "MiB) from device local memory" << endl;
+	else if (usage > target)
+		MWARN << vDev.name << " Over the memory budget with nothing left to evict" << endl;
+	std::lock_guard lock(mutex);
+	stats.evictions += evicted;
+	stats.evictedBytes += evictedBytes;
+	return evicted;
+}
+
+VResidency::Stats VResidency::getStats() const {
+	std::lock_guard lock(mutex);
+	return stats;
+}
@@ -0,0 +1,992 @@
+#include <bit>
+#include <cstring>
+#include <unistd.h>
+
+#include "mland/vsurface.h"
+#include "mland/vtexture_pool.h"
+#include "mland/vtexture_table.h"
+#include "mland/vdmabuf.h"
+
+using namespace mland;
+
+namespace {
+constexpr std::array FULL_CROP{0.0f, 0.0f, 1.0f, 1.0f};
+
+vk::Rect2D offset(const vk::Rect2D& rect, const vk::Offset2D& by) {
+	return {{rect.offset.x + by.x, rect.offset.y + by.y}, rect.extent};
+}
+
+// Empty if they don't overlap
+vk::Rect2D intersect(const vk::Rect2D& a, const vk::Rect2D& b) {
+	const auto x1 = std::max<int64_t>(a.offset.x, b.offset.x);
+	const auto y1 = std::max<int64_t>(a.offset.y, b.offset.y);
+	const auto x2 = std::min<int64_t>(int64_t{a.offset.x} + a.extent.width, int64_t{b.offset.x} + b.extent.width);
+	const auto y2 = std::min<int64_t>(int64_t{a.offset.y} + a.extent.height, int64_t{b.offset.y} + b.extent.height);
+	if (x1 >= x2 || y1 >= y2)
+		return {};
+	return {{static_cast<int32_t>(x1), static_cast<int32_t>(y1)},
+		{static_cast<uint32_t>(x2 - x1), static_cast<uint32_t>(y2 - y1)}};
+}
+}
+
+// Scene
+
+void Scene::clear() {
+	surfaces.clear();
+	geometry.clear();
+	crop.clear();
+	transform.clear();
+	opaque.clear();
+	flags.clear();
+	serial.clear();
+	contents.clear();
+	dmabufs.clear();
+	generations.clear();
+}
+
+// VSurfaceHost
+
+VSurface VSurfaceHost::create() {
+	uint32_t index;
+	if (!freeIndices.empty()) {
+		index = freeIndices.back();
+		freeIndices.pop_back();
+	} else {
+		index = generation.size32();
+		generation.push_back(0);
+		geometry.emplace_back();
+		crop.emplace_back();
+		transform.push_back(0);
+		opaque.emplace_back();
+		flags.push_back(0);
+		serial.push_back(0);
+		contents.emplace_back();
+		dmabufs.emplace_back();
+		trees.emplace_back();
+	}
+	geometry[index] = vk::Rect2D{};
+	crop[index] = FULL_CROP;
+	transform[index] = 0;
+	opaque[index] = vk::Rect2D{};
+	flags[index] = 0;
+	serial[index] = 0;
+	order.push_back(index);
+	trees[index].assign(1, index);
+	return {index, generation[index]};
+}
+
+void VSurfaceHost::destroy(const VSurface surface) {
+	if (!valid(surface))
+		return;
+	// Stale handles stop matching from here on, render threads compare generations too
+	generation[surface.idx]++;
+	contents[surface.idx].reset();
+	dmabufs[surface.idx].reset();
+	std::erase(order, surface.idx);
+	trees[surface.idx].clear();
+	freeIndices.push_back(surface.idx);
+}
+
+bool VSurfaceHost::valid(const VSurface surface) const {
+	return surface.idx < generation.size() && generation[surface.idx] == surface.gen;
+}
+
+void VSurfaceHost::setOffset(const VSurface surface, const vk::Offset2D& offset) {
+	if (valid(surface))
+		geometry[surface.idx].offset = offset;
+}
+
+void VSurfaceHost::setSize(const VSurface surface, const vk::Extent2D& size) {
+	if (valid(surface))
+		geometry[surface.idx].extent = size;
+}
+
+void VSurfaceHost::setCrop(const VSurface surface, const std::array<float, 4>& crop) {
+	if (valid(surface))
+		this->crop[surface.idx] = crop;
+}
+
+void VSurfaceHost::setTransform(const VSurface surface, const uint32_t transform) {
+	if (valid(surface))
+		this->transform[surface.idx] = transform;
+}
+
+void VSurfaceHost::setOpaque(const VSurface surface, const vk::Rect2D& opaque) {
+	if (valid(surface))
+		this->opaque[surface.idx] = opaque;
+}
+
+void VSurfaceHost::setMapped(const VSurface surface, const bool mapped) {
+	if (!valid(surface))
+		return;
+	if (mapped)
+		flags[surface.idx] |= eMapped;
+	else
+		flags[surface.idx] &= ~eMapped;
+}
+
+void VSurfaceHost::setAlpha(const VSurface surface, const bool alpha) {
+	if (!valid(surface))
+		return;
+	if (alpha)
+		flags[surface.idx] |= Scene::eAlpha;
+	else
+		flags[surface.idx] &= ~Scene::eAlpha;
+}
+
+void VSurfaceHost::contentChanged(const VSurface surface) {
+	if (valid(surface))
+		serial[surface.idx]++;
+}
+
+void VSurfaceHost::setContents(const VSurface surface, s_ptr<const ShmContents> contents) {
+	if (valid(surface))
+		this->contents[surface.idx] = std::move(contents);
+}
+
+void VSurfaceHost::setDmabuf(const VSurface surface, s_ptr<const DmabufAttributes> dmabuf) {
+	if (valid(surface))
+		dmabufs[surface.idx] = std::move(dmabuf);
+}
+
+uint64_t VSurfaceHost::getSerial(const VSurface surface) const {
+	return valid(surface) ? serial[surface.idx] : 0;
+}
+
+void VSurfaceHost::raise(const VSurface surface) {
+	if (!valid(surface))
+		return;
+	std::erase(order, surface.idx);
+	order.push_back(surface.idx);
+}
+
+void VSurfaceHost::setToplevel(const VSurface surface, const bool toplevel) {
+	if (!valid(surface))
+		return;
+	std::erase(order, surface.idx);
+	if (toplevel) {
+		order.push_back(surface.idx);
+		trees[surface.idx].assign(1, surface.idx);
+	} else {
+		trees[surface.idx].clear();
+	}
+}
+
+void VSurfaceHost::setTree(const VSurface root, const std::span<const VSurface> tree) {
+	if (!valid(root))
+		return;
+	auto& flattened = trees[root.idx];
+	flattened.clear();
+	for (const auto surface : tree)
+		if (valid(surface))
+			flattened.push_back(surface.idx);
+}
+
+opt<uint32_t> VSurfaceHost::publish(SnapshotExchange<Scene>& exchange) const {
+	auto* scene = exchange.beginWrite();
+	if (scene == nullptr)
+		return std::nullopt;
+	// The slot keeps its capacity, so a steady scene doesn't allocate
+	scene->clear();
+	for (const auto root : order) {
+		for (const auto index : trees[root]) {
+			if (!(flags[index] & eMapped))
+				continue;
+			const auto& rect = geometry[index];
+			const auto& inner = opaque[index];
+			auto sceneFlags = flags[index] & ~eMapped;
+			if (!(sceneFlags & Scene::eAlpha) || (inner.offset == vk::Offset2D{} && inner.extent == rect.extent))
+				sceneFlags |= Scene::eOpaque;
+			scene->surfaces.push_back({index, generation[index]});
+			scene->geometry.push_back(rect);
+			scene->crop.push_back(crop[index]);
+			scene->transform.push_back(transform[index]);
+			// The opaque region may reach past the surface, or be left over from a bigger buffer
+			scene->opaque.push_back(sceneFlags & Scene::eOpaque ? rect : intersect(offset(inner, rect.offset), rect));
+			scene->flags.push_back(sceneFlags);
+			scene->serial.push_back(serial[index]);
+			scene->contents.push_back(contents[index]);
+			scene->dmabufs.push_back(dmabufs[index]);
+		}
+	}
+	scene->generations.assign(generation.begin(), generation.end());
+	exchange.publish();
+	return scene->size();
+}
+
+// VSurfaceDevice
+
+VSurfaceDevice::VSurfaceDevice(VDevice& vDev) : vDev(vDev) {
+	constexpr auto needed = vk::FormatFeatureFlagBits::eSampledImage | vk::FormatFeatureFlagBits::eTransferDst;
+	uint32_t converted = 0;
+	for (const auto& info : ShmFormat::all()) {
+		if (info.conversion == ShmFormat::Conversion::eNone || (info.native != vk::Format::eUndefined &&
+			(vDev.pDev.getFormatProperties(info.native).optimalTilingFeatures & needed) == needed)) {
+			shmUploads.push_back({&info, info.native, nullptr, info.bytes});
+			continue;
+		}
+		// B8G8R8A8 sampling is mandatory, so everything has somewhere to go
+		shmUploads.push_back({&info, vk::Format::eB8G8R8A8Unorm, ShmFormat::converter(info), 4});
+		converted++;
+	}
+	if (converted != 0)
+		MDEBUG << vDev.name << " Converts " << converted << " wl_shm formats with the " << ShmFormat::kernels()
+			<< " kernels" << endl;
+
+	if (!vDev.hasExtension(vk::EXTExternalMemoryHostExtensionName))
+		return;
+	const auto props = vDev.pDev.getProperties2<vk::PhysicalDeviceProperties2,
+		vk::PhysicalDeviceExternalMemoryHostPropertiesEXT>().get<vk::PhysicalDeviceExternalMemoryHostPropertiesEXT>();
+	// Pools are mmapped and start on a page, aligning a buffer down any further could leave the mapping
+	const auto page = static_cast<vk::DeviceSize>(sysconf(_SC_PAGESIZE));
+	if (props.minImportedHostPointerAlignment <= page)
+		importAlignment = props.minImportedHostPointerAlignment;
+	else
+		MINFO << vDev.name << " Host pointer imports need " << props.minImportedHostPointerAlignment
+			<< " byte alignment, wl_shm uploads go through staging" << endl;
+}
+
+VSurfaceDevice::~VSurfaceDevice() {
+	retireImports(true);
+	// Nothing samples the dmabufs anymore once the device is idle
+	vDev.wait(vDev.lastSubmitted());
+	unpinReleased(true);
+	for (const auto& attributes : handingBack)
+		attributes->unpin();
+	for (const auto& [id, import] : dmabufs)
+		if (import.pinned)
+			import.attributes->unpin();
+	ShmContents::removeCopier(copier);
+	for (uint32_t i = 0; i < textures.size32(); i++)
+		drop(i);
+	for (auto& residence : residences)
+		vDev.getResidency().untrack(&residence);
+}
+
+void VSurfaceDevice::sync(const Scene& scene, const uint64_t version) {
+	std::lock_guard lock(mutex);
+	retireImports(false);
+	// Displays pin scenes on their own, one still on an older version must not drop what another
+	// one already uploaded for surfaces it doesn't know about yet
+	const bool newest = version >= newestScene;
+	newestScene = std::max(newestScene, version);
+	for (const auto& surface : scene.surfaces) {
+		const auto index = surface.index();
+		// A recycled index belongs to a different surface now
+		if (index < textures.size() && generation[index] < surface.generation())
+			drop(index);
+	}
+	// Surfaces the scene leaves out are only hidden, e.g. under an unmapped parent, and their
+	// contents may be retired already. Only destroying them moves the generation on
+	if (newest)
+		for (uint32_t i = 0; i < textures.size32() && i < scene.generations.size(); i++)
+			if (generation[i] != scene.generations[i])
+				drop(i);
+	// A hidden surface never picks up the buffer that replaced its dmabuf, it would hold the old one
+	// back from the client until shown again
+	if (newest)
+		for (uint32_t i = 0; i < showing.size32(); i++)
+			if (const auto it = dmabufs.find(showing[i]); it != dmabufs.end() && it->second.attributes->retired() &&
+				std::ranges::none_of(scene.surfaces, [&](const VSurface surface) { return surface.index() == i; }))
+				drop(i);
+	unpinReleased(false);
+	evictImports();
+}
+
+bool VSurfaceDevice::behind(const VSurface surface, const uint64_t serial) const {
+	const auto index = surface.index();
+	if (index >= generation.size())
+		return false;
+	return generation[index] > surface.generation() ||
+		(generation[index] == surface.generation() && this->serial[index] > serial);
+}
+
+VTexture* VSurfaceDevice::getTexture(const VSurface surface) const {
+	const auto index = surface.index();
+	if (index >= textures.size() || generation[index] != surface.generation())
+		return nullptr;
+	if (showing[index] != 0)
+		return dmabufs.at(showing[index]).texture.get();
+	return textures[index].get();
+}
+
+uint64_t VSurfaceDevice::getSerial(const VSurface surface) const {
+	const auto index = surface.index();
+	if (index >= textures.size() || generation[index] != surface.generation())
+		return 0;
+	return serial[index];
+}
+
+void VSurfaceDevice::setTexture(const VSurface surface, u_ptr<VTexture>&& texture, const uint64_t serial) {
+	const auto index = surface.index();
+	grow(index);
+	drop(index);
+	generation[index] = surface.generation();
+	slots[index] = vDev.getTextureTable().add(*texture);
+	textures[index] = std::move(texture);
+	this->serial[index] = serial;
+	settle(index);
+}
+
+uint32_t VSurfaceDevice::getSlot(const VSurface surface) const {
+	const auto index = surface.index();
+	if (index >= textures.size() || generation[index] != surface.generation())
+		return VTextureTable::NO_SLOT;
+	if (showing[index] != 0)
+		return dmabufs.at(showing[index]).slot;
+	return slots[index];
+}
+
+opt<VSurfaceDevice::Ycbcr> VSurfaceDevice::getYcbcr(const VSurface surface) const {
+	const auto index = surface.index();
+	if (index >= textures.size() || generation[index] != surface.generation() || showing[index] == 0)
+		return std::nullopt;
+	const auto& import = dmabufs.at(showing[index]);
+	if (import.texture == nullptr || import.conversion == VDmabufImporter::NO_CONVERSION)
+		return std::nullopt;
+	return Ycbcr{import.conversion, *import.texture->ycbcr};
+}
+
+void VSurfaceDevice::grow(const uint32_t index) {
+	if (index < textures.size())
+		return;
+	generation.resize(index + 1, 0);
+	textures.resize(index + 1);
+	serial.resize(index + 1, 0);
+	slots.resize(index + 1, VTextureTable::NO_SLOT);
+	showing.resize(index + 1, 0);
+	uploadStats.resize(index + 1);
+	while (residences.size() <= index)
+		vDev.getResidency().track(&residences.emplace_back(*this, static_cast<uint32_t>(residences.size())));
+}
+
+void VSurfaceDevice::markVisible(const VSurface surface, const VResidency::clock::time_point time) {
+	const auto index = surface.index();
+	if (index < residences.size() && generation[index] == surface.generation())
+		residences[index].visible.store(time, std::memory_order_relaxed);
+}
+
+bool VSurfaceDevice::evict(const uint32_t index) {
+	std::lock_guard lock(mutex);
+	const auto& texture = textures[index];
+	if (texture == nullptr || !deviceLocal(*texture))
+		return false;
+	// On UMA and resizable BAR devices the first host visible type is device local as well
+	constexpr auto local = vk::MemoryPropertyFlagBits::eDeviceLocal;
+	if (!vDev.getAllocator().findMemoryType(~0u, vk::MemoryPropertyFlagBits::eHostVisible, {}, local).has_value())
+		return false;
+	return migrate(index, vk::MemoryPropertyFlagBits::eHostVisible, local);
+}
+
+bool VSurfaceDevice::migrate(const uint32_t index, const vk::MemoryPropertyFlags memory,
+	const vk::MemoryPropertyFlags excluded) {
+	// A frame between beginFrame and endFrame may have picked the slot without a ticket covering it yet
+	if (!recording.empty())
+		return false;
+	auto& texture = textures[index];
+	// Behind the uploads into it, which run on the same queue
+	auto moved = vDev.migrateTexture(*texture, memory, lastUpload, excluded);
+	if (!moved.has_value())
+		return false;
+	auto& [copy, ticket] = moved.value();
+	// Frames in flight may still sample the old one
+	const auto lastUse = vDev.lastSubmitted();
+	vDev.getTextureTable().remove(slots[index], lastUse);
+	vDev.getTexturePool().release(std::move(texture), lastUse.merge(ticket));
+	slots[index] = vDev.getTextureTable().add(*copy);
+	texture = std::move(copy);
+	lastUpload = lastUpload.merge(ticket);
+	settle(index);
+	return true;
+}
+
+void VSurfaceDevice::settle(const uint32_t index) {
+	const auto& texture = textures[index];
+	residences[index].bytes.store(texture != nullptr && deviceLocal(*texture) ? texture->memory.getSize() : 0,
+		std::memory_order_relaxed);
+}
+
+bool VSurfaceDevice::deviceLocal(const VTexture& texture) const {
+	return static_cast<bool>(vDev.getAllocator().getFlags(texture.memory) & vk::MemoryPropertyFlagBits::eDeviceLocal);
+}
+
+void VSurfaceDevice::showDmabuf(const VSurface surface, const s_ptr<const DmabufAttributes>& dmabuf,
+	const uint64_t serial) {
+	const auto index = surface.index();
+	grow(index);
+	// Already showing this commit, or a display still on an older scene
+	if (showing[index] != 0 && generation[index] == surface.generation() && serial <= this->serial[index])
+		return;
+
+	auto [it, inserted] = dmabufs.try_emplace(dmabuf->id);
+	auto& import = it->second;
+	// Replaced by a newer commit in the meantime and maybe back with the client, a later scene shows
+	// that one
+	if (!import.pinned && !dmabuf->pin()) {
+		if (inserted)
+			dmabufs.erase(it);
+		return;
+	}
+	import.pinned = true;
+	if (textures[index] != nullptr)
+		drop(index);
+	generation[index] = surface.generation();
+	if (inserted) {
+		import.attributes = dmabuf;
+		auto* importer = vDev.getDmabuf();
+		if (auto texture = importer != nullptr ? importer->import(*dmabuf) : std::nullopt; texture.has_value()) {
+			import.conversion = importer->find(dmabuf->format, dmabuf->modifier)->conversion;
+			if (import.conversion == VDmabufImporter::NO_CONVERSION)
+				import.slot = vDev.getTextureTable().add(*texture.value());
+			import.texture = std::move(texture.value());
+		}
+	}
+	// Hands the previous buffer back unless another surface still shows it, once no frame that
+	// picked it is left
+	if (const auto previous = showing[index]; previous != 0 && previous != dmabuf->id &&
+		std::ranges::count(showing, previous) == 1)
+		replaced.push_back({previous, frames, vDev.lastSubmitted()});
+	// The client may have rendered into it since we last had it, even if it is the same buffer
+	acquireImport(import);
+	showing[index] = dmabuf->id;
+	this->serial[index] = serial;
+}
+
+void VSurfaceDevice::acquireImport(Import& import) {
+	// One barrier per image and batch, barriers in one command aren't ordered against each other
+	if (import.texture == nullptr || import.queued == uploadCount)
+		return;
+	import.queued = uploadCount;
+	// Committed is not rendered, the client may still have writes queued on it
+	if (auto fence = vDev.getDmabuf()->importFence(*import.attributes); fence.has_value())
+		acquireFences.push_back(std::move(fence.value()));
+	if (import.acquired) {
+		// Still ours, handing it back and taking it again would only cost a barrier command more
+		acquires.push_back({
+			.srcAccessMask = vk::AccessFlagBits::eMemoryWrite,
+			.dstAccessMask = vk::AccessFlagBits::eShaderRead,
+			.oldLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+			.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.image = import.texture->image,
+			.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1}
+		});
+		return;
+	}
+	const auto foreign = vDev.getDmabuf()->getForeignFamily();
+	acquires.push_back({
+		.srcAccessMask = {},
+		.dstAccessMask = vk::AccessFlagBits::eShaderRead,
+		// Never written by us, drivers keep dmabuf contents across the first transition from it
+		.oldLayout = import.transitioned ? vk::ImageLayout::eGeneral : vk::ImageLayout::ePreinitialized,
+		.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+		.srcQueueFamilyIndex = foreign,
+		.dstQueueFamilyIndex = vDev.graphicsIndex,
+		.image = import.texture->image,
+		.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1}
+	});
+	import.acquired = true;
+	import.transitioned = true;
+}
+
+void VSurfaceDevice::releaseImport(Import& import) {
+	if (import.texture == nullptr || !import.acquired)
+		return;
+	releases.push_back({
+		.srcAccessMask = {},
+		.dstAccessMask = {},
+		.oldLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+		.newLayout = vk::ImageLayout::eGeneral,
+		.srcQueueFamilyIndex = vDev.graphicsIndex,
+		.dstQueueFamilyIndex = vDev.getDmabuf()->getForeignFamily(),
+		.image = import.texture->image,
+		.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1}
+	});
+	import.acquired = false;
+}
+
+void VSurfaceDevice::releaseReplaced() {
+	std::erase_if(replaced, [this](const Replaced& entry) {
+		const auto it = dmabufs.find(entry.id);
+		// Evicted, or shown again and still ours
+		if (it == dmabufs.end() || std::ranges::find(showing, entry.id) != showing.end())
+			return true;
+		if (std::ranges::any_of(recording, [&](const uint64_t frame) { return frame <= entry.after; }) ||
+			!vDev.reached(entry.ticket))
+			return false;
+		auto& import = it->second;
+		releaseImport(import);
+		if (import.pinned) {
+			handingBack.push_back(import.attributes);
+			import.pinned = false;
+		}
+		return true;
+	});
+}
+
+void VSurfaceDevice::unpinReleased(const bool wait) {
+	while (!unpinning.empty()) {
+		const auto& [attributes, ticket] = unpinning.front();
+		if (wait)
+			vDev.wait(ticket);
+		else if (!vDev.reached(ticket))
+			return;
+		attributes->unpin();
+		unpinning.pop_front();
+	}
+}
+
+uint64_t VSurfaceDevice::beginFrame() {
+	recording.push_back(++frames);
+	return frames;
+}
+
+void VSurfaceDevice::endFrame(const uint64_t frame, const VDevice::Ticket& ticket) {
+	std::lock_guard lock(mutex);
+	std::erase(recording, frame);
+	unpinReleased(false);
+	for (auto& entry : replaced)
+		if (frame <= entry.after)
+			entry.ticket = entry.ticket.merge(ticket);
+	for (auto& entry : retired)
+		if (frame <= entry.after)
+			entry.ticket = entry.ticket.merge(ticket);
+	freeRetired();
+}
+
+void VSurfaceDevice::retire(u_ptr<VTexture>&& texture, const uint32_t slot) {
+	retired.push_back({std::move(texture), slot, frames, vDev.lastSubmitted()});
+	freeRetired();
+}
+
+void VSurfaceDevice::freeRetired() {
+	while (!retired.empty()) {
+		auto& entry = retired.front();
+		if (std::ranges::any_of(recording, [&](const uint64_t frame) { return frame <= entry.after; }))
+			return;
+		vDev.getTextureTable().remove(entry.slot, entry.ticket);
+		vDev.getTexturePool().release(std::move(entry.texture), entry.ticket);
+		retired.pop_front();
+	}
+}
+
+void VSurfaceDevice::evictImports() {
+	while (!graveyard.empty() && vDev.reached(graveyard.front().second))
+		graveyard.pop_front();
+	while (!consumedFences.empty() && vDev.reached(consumedFences.front().second))
+		consumedFences.pop_front();
+	for (auto it = dmabufs.begin(); it != dmabufs.end();) {
+		auto& import = it->second;
+		// Replaced ones wait for the frames that may have picked them, see releaseReplaced
+		if (!import.attributes->destroyed.load(std::memory_order_acquire) ||
+			std::ranges::find(showing, it->first) != showing.end() ||
+			std::ranges::find(replaced, it->first, &Replaced::id) != replaced.end()) {
+			++it;
+			continue;
+		}
+		if (import.texture != nullptr) {
+			const auto lastUse = vDev.lastSubmitted();
+			vDev.getTextureTable().remove(import.slot, lastUse);
+			graveyard.emplace_back(std::move(import.texture), lastUse);
+		}
+		// The wl_buffer is gone, there is nothing to release
+		if (import.pinned)
+			import.attributes->unpin();
+		it = dmabufs.erase(it);
+	}
+}
+
+const VSurfaceDevice::ShmUpload* VSurfaceDevice::findUpload(const uint32_t shmFormat) const {
+	const auto it = std::ranges::find(shmUploads, shmFormat, [](const ShmUpload& upload) { return upload.info->shm; });
+	return it != shmUploads.end() ? &*it : nullptr;
+}
+
+VDevice::Ticket VSurfaceDevice::upload(const Scene& scene) {
+	std::lock_guard lock(mutex);
+	if (!copierClaimed) {
+		copier = ShmContents::addCopier();
+		copierClaimed = true;
+		if (copier == ShmContents::NO_COPIER)
+			MWARN << vDev.name << " Out of wl_shm copiers, buffers may be released before this device copied them" << endl;
+	}
+	retireImports(false);
+	uploadCount++;
+	releaseReplaced();
+	freeRetired();
+	// Textures VResidency moved out come back once they are shown again and fit the budget
+	const auto now = VResidency::clock::now();
+	for (uint32_t index = 0; index < textures.size32(); index++) {
+		const auto& texture = textures[index];
+		if (texture != nullptr && !deviceLocal(*texture) &&
+			now - residences[index].lastVisible() < VResidency::MIN_HIDDEN &&
+			vDev.getResidency().canPromote(texture->memory.getSize()))
+			migrate(index, vk::MemoryPropertyFlagBits::eDeviceLocal);
+	}
+	pending.clear();
+	boxes.clear();
+	importing.clear();
+	vk::DeviceSize bytes = 0;
+	// Imports nothing copied from are unpinned by the next call
+	const auto keepImports = [&](const VDevice::Ticket& ticket) {
+		for (auto& import : importing) {
+			import.ticket = ticket;
+			imports.push_back(std::move(import));
+		}
+		importing.clear();
+	};
+	for (uint32_t i = 0; i < scene.size(); i++) {
+		// A display still on an older scene, another one already uploaded something newer
+		if (behind(scene.surfaces[i], scene.serial[i]))
+			continue;
+		if (const auto& dmabuf = scene.dmabufs[i]) {
+			showDmabuf(scene.surfaces[i], dmabuf, scene.serial[i]);
+			continue;
+		}
+		const auto* contents = scene.contents[i].get();
+		if (contents == nullptr)
+			continue;
+		const auto* upload = findUpload(contents->format);
+		// Never read here, so not worth holding the buffer for
+		if (upload == nullptr) {
+			contents->copied(copier);
+			continue;
+		}
+		const auto format = upload->format;
+		const auto surface = scene.surfaces[i];
+		// Back from a dmabuf, the copies only ever go to textures the surface owns
+		if (surface.index() < showing.size() && showing[surface.index()] != 0)
+			drop(surface.index());
+		const auto* texture = getTexture(surface);
+		const auto current = getSerial(surface);
+		if (texture != nullptr && current == contents->serial)
+			continue;
+		// Frames other displays are recording may have picked the texture and aren't submitted yet,
+		// so the copies can't be ordered after them. A new texture leaves theirs alone
+		const bool fresh = texture == nullptr || texture->info.format != format || texture->info.extent !=
+			vk::Extent2D{static_cast<uint32_t>(contents->width), static_cast<uint32_t>(contents->height)} ||
+			!recording.empty();
+		const bool full = fresh || !contents->damageSince(current, damage);
+		if (full)
+			damage.reset({0, 0, contents->width, contents->height});
+		// Committed without damage, the texture is already up to date
+		if (damage.empty()) {
+			serial[surface.index()] = contents->serial;
+			contents->copied(copier);
+			continue;
+		}
+		// Every box starts four byte aligned in staging
+		vk::DeviceSize surfaceBytes = 0;
+		for (const auto& box : damage.boxes())
+			surfaceBytes += box.area() * upload->texelBytes + STAGING_ALIGNMENT - 1;
+		// The copies read the client rows in place, which needs them aligned to a texel
+		auto import = NO_IMPORT;
+		if (importAlignment != 0 && surfaceBytes >= MIN_IMPORT && upload->convert == nullptr &&
+			upload->info->bytes == BYTES_PER_PIXEL && contents->stride % BYTES_PER_PIXEL == 0 &&
+			reinterpret_cast<uintptr_t>(contents->data) % BYTES_PER_PIXEL == 0) {
+			// Retired by a newer commit in the meantime, a later frame picks that one up
+			if (!contents->pin())
+				continue;
+			const auto extents = damage.extents();
+			if (auto host = importHost(*contents, extents.y1, extents.y2); host.contents != nullptr) {
+				import = importing.size32();
+				importing.push_back(std::move(host));
+			} else {
+				contents->unpin();
+			}
+		}
+		if (import == NO_IMPORT)
+			bytes += surfaceBytes;
+		// A terminal changing one line moves that line and nothing else
+		const auto first = boxes.size32();
+		for (const auto& box : damage.boxes())
+			boxes.push_back(box);
+		pending.push_back({upload, i, first, boxes.size32() - first, fresh, full, import});
+	}
+	if (!releases.empty() || !acquires.empty()) {
+		vec<vk::Semaphore> fences{};
+		for (const auto& fence : acquireFences)
+			fences.push_back(*fence);
+		// Behind every frame that sampled the released images, in queue order. An image handed back
+		// and taken again in the same batch needs the release ordered before the acquire
+		const auto ticket = vDev.oneShot(vDev.graphicsIndex, [&](const vkr::CommandBuffer& cmd) {
+			for (const auto* ownership : {&releases, &acquires})
+				if (!ownership->empty())
+					cmd.pipelineBarrier(vk::PipelineStageFlagBits::eFragmentShader,
+						vk::PipelineStageFlagBits::eFragmentShader, {}, {}, {}, *ownership);
+		}, {}, fences);
+		lastUpload = lastUpload.merge(ticket);
+		for (auto& fence : acquireFences)
+			consumedFences.emplace_back(std::move(fence), ticket);
+		acquireFences.clear();
+		releases.clear();
+		acquires.clear();
+	}
+	// The client may write the images again once the release barriers ran
+	for (auto& attributes : handingBack)
+		unpinning.emplace_back(std::move(attributes), lastUpload);
+	handingBack.clear();
+	if (pending.empty())
+		return lastUpload;
+
+	u_ptr<VBuffer> buffer{};
+	if (bytes > 0) {
+		buffer = acquireStaging(bytes);
+		if (!buffer) {
+			MERROR << vDev.name << " Failed to create a " << bytes << " byte staging buffer" << endl;
+			keepImports({});
+			return lastUpload;
+		}
+	}
+	auto* const mapped = buffer ? static_cast<uint8_t*>(buffer->getMapped()) : nullptr;
+	vk::DeviceSize offset = 0;
+	bool overwrites = false;
+	copies.clear();
+	targets.clear();
+	for (const auto& upload : pending) {
+		const auto& contents = *scene.contents[upload.sceneIndex];
+		const auto surface = scene.surfaces[upload.sceneIndex];
+		const auto* import = upload.import != NO_IMPORT ? &importing[upload.import] : nullptr;
+		// Retired by a newer commit in the meantime, a later frame picks that one up
+		if (import == nullptr && !contents.beginRead())
+			continue;
+		if (upload.fresh) {
+			auto texture = vDev.getTexturePool().acquire({
+				.format = upload.format->format,
+				.extent = {static_cast<uint32_t>(contents.width), static_cast<uint32_t>(contents.height)},
+				// Source of VResidency moving it out of device local memory and back
+				.usage = vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferDst |
+					vk::ImageUsageFlagBits::eTransferSrc,
+				.shared = true
+			});
+			if (!texture.has_value()) {
+				if (import == nullptr)
+					contents.endRead();
+				MERROR << vDev.name << " Failed to create a texture for surface " << surface.index() << endl;
+				continue;
+			}
+			setTexture(surface, std::move(texture.value()), contents.serial);
+		} else {
+			serial[surface.index()] = contents.serial;
+			overwrites = true;
+		}
+		targets.push_back({import != nullptr ? *import->buffer : *buffer->buffer, getTexture(surface)->image,
+			upload.fresh, copies.size32(), upload.boxCount});
+
+		const auto& format = *upload.format;
+		vk::DeviceSize surfaceBytes = 0;
+		for (uint32_t b = upload.firstBox; b < upload.firstBox + upload.boxCount; b++) {
+			const auto& box = boxes[b];
+			const auto rowBytes = static_cast<size_t>(box.width()) * format.texelBytes;
+			const auto* src = contents.data + static_cast<size_t>(box.y1) * contents.stride +
+				static_cast<size_t>(box.x1) * format.info->bytes;
+			surfaceBytes += rowBytes * box.height();
+			if (import != nullptr) {
+				copies.push_back({
+					.bufferOffset = static_cast<vk::DeviceSize>(src - import->base),
+					.bufferRowLength = static_cast<uint32_t>(contents.stride) / BYTES_PER_PIXEL,
+					.imageSubresource = {vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+					.imageOffset = {box.x1, box.y1, 0},
+					.imageExtent = {static_cast<uint32_t>(box.width()), static_cast<uint32_t>(box.height()), 1}
+				});
+				continue;
+			}
+			// Two byte texels leave rows off a four byte boundary, transfer only queues want one
+			offset = (offset + STAGING_ALIGNMENT - 1) & ~vk::DeviceSize{STAGING_ALIGNMENT - 1};
+			copies.push_back({
+				.bufferOffset = offset,
+				.imageSubresource = {vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+				.imageOffset = {box.x1, box.y1, 0},
+				.imageExtent = {static_cast<uint32_t>(box.width()), static_cast<uint32_t>(box.height()), 1}
+			});
+			for (auto y = box.y1; y < box.y2; y++) {
+				if (format.convert != nullptr)
+					format.convert(src, mapped + offset, static_cast<uint32_t>(box.width()));
+				else
+					std::memcpy(mapped + offset, src, rowBytes);
+				offset += rowBytes;
+				src += contents.stride;
+			}
+		}
+		// Everything is in staging, the client can have the buffer back before the GPU even starts
+		if (import == nullptr) {
+			contents.endRead();
+			contents.copied(copier);
+		}
+		for (auto* stats : {&uploadStats[surface.index()], &totals}) {
+			stats->uploads++;
+			stats->fullUploads += upload.full;
+			stats->hostImports += import != nullptr;
+			stats->bytes += surfaceBytes;
+		}
+	}
+	if (targets.empty()) {
+		if (buffer)
+			staging.emplace_back(std::move(buffer), VDevice::Ticket{});
+		keepImports({});
+		return lastUpload;
+	}
+
+	const auto record = [&](const vkr::CommandBuffer& cmd) {
+		barriers.clear();
+		for (const auto& target : targets)
+			barriers.push_back({
+				.dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+				.oldLayout = target.fresh ? vk::ImageLayout::eUndefined : vk::ImageLayout::eShaderReadOnlyOptimal,
+				.newLayout = vk::ImageLayout::eTransferDstOptimal,
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.image = target.image,
+				.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1}
+			});
+		cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {},
+			{}, {}, barriers);
+		for (const auto& target : targets)
+			cmd.copyBufferToImage(target.source, target.image, vk::ImageLayout::eTransferDstOptimal,
+				std::span(copies).subspan(target.firstCopy, target.copyCount));
+		// Made visible to the fragment shaders by the timeline wait of the frames sampling them
+		for (auto& barrier : barriers) {
+			barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+			barrier.dstAccessMask = {};
+			barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+			barrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+		}
+		cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {},
+			{}, {}, barriers);
+	};
+	// Frames in flight on other displays may still sample the textures being overwritten, none of
+	// them is still recording, see fresh
+	const VDevice::Ticket after{.graphics = overwrites ? vDev.lastSubmitted().graphics : 0};
+	const auto ticket = vDev.oneShot(vDev.transferIndex, record, after);
+	if (buffer)
+		staging.emplace_back(std::move(buffer), ticket);
+	keepImports(ticket);
+	lastUpload = lastUpload.merge(ticket);
+	return lastUpload;
+}
+
+VSurfaceDevice::UploadStats VSurfaceDevice::getUploadStats(const VSurface surface) const {
+	std::lock_guard lock(mutex);
+	const auto index = surface.index();
+	if (index >= textures.size() || generation[index] != surface.generation())
+		return {};
+	return uploadStats[index];
+}
+
+VSurfaceDevice::UploadStats VSurfaceDevice::getUploadTotals() const {
+	std::lock_guard lock(mutex);
+	return totals;
+}
+
+u_ptr<VBuffer> VSurfaceDevice::acquireStaging(const vk::DeviceSize size) {
+	for (auto it = staging.begin(); it != staging.end(); ++it) {
+		if (!vDev.reached(it->second))
+			continue;
+		if (it->first->size >= size) {
+			auto buffer = std::move(it->first);
+			staging.erase(it);
+			return buffer;
+		}
+	}
+	// Idle buffers that are too small only get in the way
+	while (staging.size() >= MAX_STAGING && vDev.reached(staging.front().second))
+		staging.pop_front();
+	auto res = vDev.createBuffer(std::max(MIN_STAGING, std::bit_ceil(size)), vk::BufferUsageFlagBits::eTransferSrc,
+		vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+	if (!res.has_value())
+		return nullptr;
+	return std::move(res.value());
+}
+
+VSurfaceDevice::HostImport VSurfaceDevice::importHost(const ShmContents& contents, const int32_t first,
+	const int32_t last) const {
+	HostImport import{};
+	const auto start = reinterpret_cast<uintptr_t>(contents.data + static_cast<size_t>(first) * contents.stride);
+	const auto end = reinterpret_cast<uintptr_t>(contents.data + static_cast<size_t>(last - 1) * contents.stride) +
+		static_cast<size_t>(contents.width) * BYTES_PER_PIXEL;
+	// Still inside the pool mapping, which starts and ends on a page
+	const auto alignedStart = start & ~(importAlignment - 1);
+	const auto size = (end - alignedStart + importAlignment - 1) & ~(importAlignment - 1);
+	auto* const pointer = reinterpret_cast<void*>(alignedStart);
+
+	constexpr auto handleType = vk::ExternalMemoryHandleTypeFlagBits::eHostAllocationEXT;
+	const auto hostProps = vDev.dev.getMemoryHostPointerPropertiesEXT(handleType, pointer);
+	if (hostProps.memoryTypeBits == 0)
+		return import;
+	const vk::ExternalMemoryBufferCreateInfo externalInfo{
+		.handleTypes = handleType
+	};
+	const vk::BufferCreateInfo bufferInfo{
+		.pNext = &externalInfo,
+		.size = size,
+		.usage = vk::BufferUsageFlagBits::eTransferSrc,
+		.sharingMode = vk::SharingMode::eExclusive
+	};
+	auto bufferRes = vDev.dev.createBuffer(bufferInfo);
+	if (!bufferRes.has_value()) {
+		MWARN << vDev.name << " Failed to create a buffer for imported memory: " << to_str(bufferRes.error()) << endl;
+		return import;
+	}
+	const auto reqs = bufferRes->getMemoryRequirements();
+	const auto types = hostProps.memoryTypeBits & reqs.memoryTypeBits;
+	if (types == 0 || reqs.size > size)
+		return import;
+	const vk::ImportMemoryHostPointerInfoEXT importInfo{
+		.handleType = handleType,
+		.pHostPointer = pointer
+	};
+	const vk::MemoryAllocateInfo allocInfo{
+		.pNext = &importInfo,
+		.allocationSize = size,
+		.memoryTypeIndex = static_cast<uint32_t>(std::countr_zero(types))
+	};
+	// Not through the allocator, imports are never suballocated and only live for one copy
+	auto memoryRes = vDev.dev.allocateMemory(allocInfo);
+	if (!memoryRes.has_value()) {
+		MDEBUG << vDev.name << " Failed to import " << size << " bytes of client memory: "
+			<< to_str(memoryRes.error()) << endl;
+		return import;
+	}
+	bufferRes->bindMemory(*memoryRes.value(), 0);
+	import.memory = std::move(memoryRes.value());
+	import.buffer = std::move(bufferRes.value());
+	import.base = reinterpret_cast<const uint8_t*>(alignedStart);
+	import.contents = &contents;
+	return import;
+}
+
+void VSurfaceDevice::retireImports(const bool wait) {
+	while (!imports.empty()) {
+		const auto& import = imports.front();
+		if (wait)
+			vDev.wait(import.ticket);
+		else if (!vDev.reached(import.ticket))
+			break;
+		const auto* contents = import.contents;
+		// The imported memory has to be gone before the pool can be unmapped
+		imports.pop_front();
+		contents->copied(copier);
+		contents->unpin();
+	}
+}
+
+void VSurfaceDevice::drop(const uint32_t index) {
+	// The import stays cached for whoever shows the buffer next, the client gets it back
+	if (const auto previous = showing[index]; previous != 0) {
+		if (std::ranges::count(showing, previous) == 1)
+			replaced.push_back({previous, frames, vDev.lastSubmitted()});
+		showing[index] = 0;
+		serial[index] = 0;
+	}
+	if (textures[index] == nullptr)
+		return;
+	// Frames in flight or still being recorded may sample it
+	retire(std::move(textures[index]), slots[index]);
+	slots[index] = VTextureTable::NO_SLOT;
+	serial[index] = 0;
+	if (const auto& stats = uploadStats[index]; stats.uploads > 0)
+		MDEBUG << vDev.name << " Surface " << index << " took " << stats.uploads << " uploads (" << stats.fullUploads
+			<< " full, " << stats.hostImports << " imported) and " << stats.bytes << " bytes" << endl;
+	uploadStats[index] = {};
+	settle(index);
+}
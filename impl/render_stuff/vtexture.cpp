@@ -0,0 +1,176 @@
+#include "mland/vdevice.h"
+#include "mland/vtexture.h"
+#include "mland/vbuffer.h"
+#include "mland/vtexture_pool.h"
+
+using namespace mland;
+
+opt<u_ptr<VTexture>> VDevice::createTexture(const VTexture::Info& info) {
+	const std::array families{graphicsIndex, transferIndex};
+	const bool concurrent = info.shared && graphicsIndex != transferIndex;
+	const vk::ImageCreateInfo imageInfo{
+		.imageType = vk::ImageType::e2D,
+		.format = info.format,
+		.extent = {
+			.width = info.extent.width,
+			.height = info.extent.height,
+			.depth = 1
+		},
+		.mipLevels = 1,
+		.arrayLayers = 1,
+		.samples = vk::SampleCountFlagBits::e1,
+		.tiling = info.tiling,
+		.usage = info.usage,
+		.sharingMode = concurrent ? vk::SharingMode::eConcurrent : vk::SharingMode::eExclusive,
+		.queueFamilyIndexCount = concurrent ? static_cast<uint32_t>(families.size()) : 0,
+		.pQueueFamilyIndices = concurrent ? families.data() : nullptr,
+		.initialLayout = vk::ImageLayout::eUndefined
+	};
+	auto imageRes = dev.createImage(imageInfo);
+	if (!imageRes.has_value()) {
+		MERROR << name << " Failed to create image: " << to_str(imageRes.error()) << endl;
+		return std::nullopt;
+	}
+	auto texture = u_ptr<VTexture>(new VTexture());
+	texture->info = info;
+	texture->image = std::move(imageRes.value());
+	auto memory = allocator->allocate(texture->image, info.memory, {}, info.tiling == vk::ImageTiling::eLinear,
+		info.excludedMemory);
+	if (!memory.has_value()) {
+		MERROR << name << " Failed to allocate memory for " << info.extent.width << "x" << info.extent.height
+			<< " image" << endl;
+		return std::nullopt;
+	}
+	texture->memory = std::move(memory.value());
+
+	constexpr auto viewUsage = vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eStorage |
+		vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eDepthStencilAttachment;
+	if (!(info.usage & viewUsage))
+		return texture;
+	const vk::ImageViewCreateInfo viewInfo{
+		.image = texture->image,
+		.viewType = vk::ImageViewType::e2D,
+		.format = info.format,
+		.components = {},
+		.subresourceRange = {
+			.aspectMask = info.aspect,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		}
+	};
+	auto viewRes = dev.createImageView(viewInfo);
+	if (!viewRes.has_value()) {
+		MERROR << name << " Failed to create image view: " << to_str(viewRes.error()) << endl;
+		return std::nullopt;
+	}
+	texture->view = std::move(viewRes.value());
+	return texture;
+}
+
+opt<u_ptr<VBuffer>> VDevice::createBuffer(const vk::DeviceSize size, const vk::BufferUsageFlags usage,
+	const vk::MemoryPropertyFlags memory) {
+	const vk::BufferCreateInfo bufferInfo{
+		.size = size,
+		.usage = usage,
+		.sharingMode = vk::SharingMode::eExclusive
+	};
+	auto bufferRes = dev.createBuffer(bufferInfo);
+	if (!bufferRes.has_value()) {
+		MERROR << name << " Failed to create buffer: " << to_str(bufferRes.error()) << endl;
+		return std::nullopt;
+	}
+	auto buffer = u_ptr<VBuffer>(new VBuffer());
+	buffer->size = size;
+	buffer->buffer = std::move(bufferRes.value());
+	auto alloc = allocator->allocate(buffer->buffer, memory);
+	if (!alloc.has_value()) {
+		MERROR << name << " Failed to allocate memory for " << size << " byte buffer" << endl;
+		return std::nullopt;
+	}
+	buffer->memory = std::move(alloc.value());
+	return buffer;
+}
+
+opt<std::pair<u_ptr<VTexture>, VDevice::Ticket>> VDevice::migrateTexture(const VTexture& src,
+	const vk::MemoryPropertyFlags memory, const Ticket& after, const vk::MemoryPropertyFlags excluded) {
+	if (!(src.info.usage & vk::ImageUsageFlagBits::eTransferSrc)) {
+		MWARN << name << " Can't migrate a texture without transfer src usage" << endl;
+		return std::nullopt;
+	}
+	auto info = src.info;
+	info.memory = memory;
+	info.excludedMemory = excluded;
+	info.usage |= vk::ImageUsageFlagBits::eTransferDst;
+	auto dst = texturePool->acquire(info);
+	if (!dst.has_value())
+		return std::nullopt;
+	const auto& dstTexture = *dst.value();
+
+	const auto ticket = oneShot(transferIndex, [&](const vkr::CommandBuffer& cmd) {
+		const vk::ImageSubresourceRange range{
+			.aspectMask = src.info.aspect,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		};
+		const std::array before{
+			vk::ImageMemoryBarrier{
+				.srcAccessMask = {},
+				.dstAccessMask = vk::AccessFlagBits::eTransferRead,
+				.oldLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+				.newLayout = vk::ImageLayout::eTransferSrcOptimal,
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.image = src.image,
+				.subresourceRange = range
+			},
+			vk::ImageMemoryBarrier{
+				.srcAccessMask = {},
+				.dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+				.oldLayout = vk::ImageLayout::eUndefined,
+				.newLayout = vk::ImageLayout::eTransferDstOptimal,
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.image = dstTexture.image,
+				.subresourceRange = range
+			}
+		};
+		cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {},
+			{}, {}, before);
+		const vk::ImageSubresourceLayers layers{
+			.aspectMask = src.info.aspect,
+			.mipLevel = 0,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		};
+		const vk::ImageCopy copy{
+			.srcSubresource = layers,
+			.srcOffset = {},
+			.dstSubresource = layers,
+			.dstOffset = {},
+			.extent = {
+				.width = src.info.extent.width,
+				.height = src.info.extent.height,
+				.depth = 1
+			}
+		};
+		cmd.copyImage(src.image, vk::ImageLayout::eTransferSrcOptimal, dstTexture.image,
+			vk::ImageLayout::eTransferDstOptimal, copy);
+		// Both end up back in the layout sampled textures live in
+		std::array afterCopy = before;
+		afterCopy[0].srcAccessMask = {};
+		afterCopy[0].dstAccessMask = {};
+		afterCopy[0].oldLayout = vk::ImageLayout::eTransferSrcOptimal;
+		afterCopy[0].newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+		afterCopy[1].srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+		afterCopy[1].dstAccessMask = {};
+		afterCopy[1].oldLayout = vk::ImageLayout::eTransferDstOptimal;
+		afterCopy[1].newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+		cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {},
+			{}, {}, afterCopy);
+	}, after);
+	return std::make_pair(std::move(dst.value()), ticket);
+}
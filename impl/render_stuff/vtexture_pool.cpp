@@ -0,0 +1,122 @@
+#include "mland/vtexture_pool.h"
+
+using namespace mland;
+
+VTexturePool::Key::Key(const VTexture::Info& info) :
+format(info.format),
+extent(info.extent),
+usage(info.usage),
+aspect(info.aspect),
+tiling(info.tiling),
+memory(info.memory),
+excludedMemory(info.excludedMemory),
+shared(info.shared) {}
+
+size_t VTexturePool::KeyHash::operator()(const Key& key) const noexcept {
+	uint64_t h = static_cast<uint64_t>(key.format);
+	const auto mix = [&h](const uint64_t v) {
+		h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+	};
+	mix(static_cast<uint64_t>(key.extent.width) << 32 | key.extent.height);
+	mix(static_cast<uint32_t>(key.usage));
+	mix(static_cast<uint32_t>(key.aspect));
+	mix(static_cast<uint64_t>(key.tiling));
+	mix(static_cast<uint32_t>(key.memory));
+	mix(static_cast<uint32_t>(key.excludedMemory));
+	mix(key.shared);
+	return h;
+}
+
+VTexturePool::VTexturePool(VDevice& vDev, const vk::DeviceSize budget) : vDev(vDev), budget(budget) {
+	MDEBUG << vDev.name << " Created texture pool with a " << budget / (1024 * 1024) << "MiB budget" << endl;
+}
+
+VTexturePool::~VTexturePool() {
+	MDEBUG << vDev.name << " Destroying texture pool: " << stats.hits << " hits, " << stats.misses << " misses, "
+		<< stats.evictions << " evictions" << endl;
+	buckets.clear();
+	lru.clear();
+}
+
+opt<u_ptr<VTexture>> VTexturePool::acquire(const VTexture::Info& info) {
+	{
+		std::lock_guard lock(mutex);
+		if (const auto bucket = buckets.find(Key(info)); bucket != buckets.end()) {
+			auto& entries = bucket->second;
+			// Newest last, but those are the most likely to still be in flight
+			for (auto it = entries.begin(); it != entries.end(); ++it) {
+				if (!vDev.reached((*it)->lastUse))
+					continue;
+				auto texture = std::move((*it)->texture);
+				const auto entry = *it;
+				entries.erase(it);
+				if (entries.empty())
+					buckets.erase(bucket);
+				stats.cachedBytes -= texture->memory.getSize();
+				stats.cachedCount--;
+				stats.hits++;
+				lru.erase(entry);
+				return texture;
+			}
+		}
+		stats.misses++;
+	}
+	return vDev.createTexture(info);
+}
+
+void VTexturePool::release(u_ptr<VTexture>&& texture, const VDevice::Ticket& lastUse) {
+	if (!texture)
+		return;
+	std::lock_guard lock(mutex);
+	const Key key(texture->info);
+	stats.cachedBytes += texture->memory.getSize();
+	stats.cachedCount++;
+	lru.push_front({std::move(texture), lastUse, key});
+	buckets[key].push_back(lru.begin());
+	evict();
+}
+
+void VTexturePool::setBudget(const vk::DeviceSize budget) {
+	std::lock_guard lock(mutex);
+	this->budget = budget;
+	evict();
+}
+
+void VTexturePool::clear() {
+	std::lock_guard lock(mutex);
+	for (auto it = lru.begin(); it != lru.end();) {
+		const auto next = std::next(it);
+		if (vDev.reached(it->lastUse))
+			erase(it);
+		it = next;
+	}
+}
+
+VTexturePool::Stats VTexturePool::getStats() const {
+	std::lock_guard lock(mutex);
+	return stats;
+}
+
+// Textures the device might still be reading are skipped, the pool can go over budget until they are done
+void VTexturePool::evict() {
+	auto it = lru.end();
+	while (stats.cachedBytes > budget && it != lru.begin()) {
+		--it;
+		if (!vDev.reached(it->lastUse))
+			continue;
+		const auto victim = it;
+		++it;
+		erase(victim);
+		stats.evictions++;
+	}
+}
+
+void VTexturePool::erase(const Lru::iterator it) {
+	auto& entries = buckets.at(it->key);
+	std::erase(entries, it);
+	if (entries.empty())
+		buckets.erase(it->key);
+	stats.cachedBytes -= it->texture->memory.getSize();
+	stats.cachedCount--;
+	lru.erase(it);
+}
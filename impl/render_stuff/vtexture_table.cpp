@@ -0,0 +1,162 @@
+#include "mland/vtexture_table.h"
+
+using namespace mland;
+
+bool VTextureTable::supported(const vk::PhysicalDeviceVulkan12Features& features) {
+	return features.descriptorIndexing &&
+		features.shaderSampledImageArrayNonUniformIndexing &&
+		features.descriptorBindingSampledImageUpdateAfterBind &&
+		features.descriptorBindingUpdateUnusedWhilePending &&
+		features.descriptorBindingPartiallyBound &&
+		features.runtimeDescriptorArray;
+}
+
+void VTextureTable::enable(vk::PhysicalDeviceVulkan12Features& features) {
+	features.descriptorIndexing = vk::True;
+	features.shaderSampledImageArrayNonUniformIndexing = vk::True;
+	features.descriptorBindingSampledImageUpdateAfterBind = vk::True;
+	features.descriptorBindingUpdateUnusedWhilePending = vk::True;
+	features.descriptorBindingPartiallyBound = vk::True;
+	features.runtimeDescriptorArray = vk::True;
+}
+
+VTextureTable::VTextureTable(VDevice& vDev) : vDev(vDev) {
+	const auto props = vDev.pDev.getProperties2<vk::PhysicalDeviceProperties2,
+		vk::PhysicalDeviceVulkan12Properties>().get<vk::PhysicalDeviceVulkan12Properties>();
+	capacity = std::min({MAX_SLOTS, props.maxDescriptorSetUpdateAfterBindSampledImages,
+		props.maxPerStageDescriptorUpdateAfterBindSampledImages});
+
+	// Surfaces are mostly drawn 1:1, filtering only matters once they are scaled
+	constexpr vk::SamplerCreateInfo samplerInfo{
+		.magFilter = vk::Filter::eLinear,
+		.minFilter = vk::Filter::eLinear,
+		.mipmapMode = vk::SamplerMipmapMode::eNearest,
+		.addressModeU = vk::SamplerAddressMode::eClampToEdge,
+		.addressModeV = vk::SamplerAddressMode::eClampToEdge,
+		.addressModeW = vk::SamplerAddressMode::eClampToEdge,
+		.maxLod = 0.0f
+	};
+	auto samplerRes = vDev.dev.createSampler(samplerInfo);
+	if (!samplerRes.has_value()) {
+		MERROR << vDev.name << " Failed to create surface sampler: " << to_str(samplerRes.error()) << endl;
+		return;
+	}
+	sampler = std::move(samplerRes.value());
+
+	const std::array bindings{
+		vk::DescriptorSetLayoutBinding{
+			.binding = SAMPLER_BINDING,
+			.descriptorType = vk::DescriptorType::eSampler,
+			.descriptorCount = 1,
+			.stageFlags = vk::ShaderStageFlagBits::eFragment,
+			.pImmutableSamplers = &*sampler
+		},
+		vk::DescriptorSetLayoutBinding{
+			.binding = TEXTURES_BINDING,
+			.descriptorType = vk::DescriptorType::eSampledImage,
+			.descriptorCount = capacity,
+			.stageFlags = vk::ShaderStageFlagBits::eFragment
+		}
+	};
+	constexpr std::array<vk::DescriptorBindingFlags, 2> bindingFlags{
+		vk::DescriptorBindingFlags{},
+		vk::DescriptorBindingFlagBits::eUpdateAfterBind |
+			vk::DescriptorBindingFlagBits::eUpdateUnusedWhilePending |
+			vk::DescriptorBindingFlagBits::ePartiallyBound
+	};
+	const vk::DescriptorSetLayoutBindingFlagsCreateInfo flagsInfo{
+		.bindingCount = bindingFlags.size(),
+		.pBindingFlags = bindingFlags.data()
+	};
+	const vk::DescriptorSetLayoutCreateInfo layoutInfo{
+		.pNext = &flagsInfo,
+		.flags = vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPool,
+		.bindingCount = bindings.size(),
+		.pBindings = bindings.data()
+	};
+	auto layoutRes = vDev.dev.createDescriptorSetLayout(layoutInfo);
+	if (!layoutRes.has_value()) {
+		MERROR << vDev.name << " Failed to create texture table layout: " << to_str(layoutRes.error()) << endl;
+		return;
+	}
+	layout = std::move(layoutRes.value());
+
+	const std::array poolSizes{
+		vk::DescriptorPoolSize{.type = vk::DescriptorType::eSampler, .descriptorCount = 1},
+		vk::DescriptorPoolSize{.type = vk::DescriptorType::eSampledImage, .descriptorCount = capacity}
+	};
+	const vk::DescriptorPoolCreateInfo poolInfo{
+		.flags = vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind |
+			vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+		.maxSets = 1,
+		.poolSizeCount = poolSizes.size(),
+		.pPoolSizes = poolSizes.data()
+	};
+	auto poolRes = vDev.dev.createDescriptorPool(poolInfo);
+	if (!poolRes.has_value()) {
+		MERROR << vDev.name << " Failed to create texture table pool: " << to_str(poolRes.error()) << endl;
+		return;
+	}
+	pool = std::move(poolRes.value());
+
+	const vk::DescriptorSetAllocateInfo allocInfo{
+		.descriptorPool = pool,
+		.descriptorSetCount = 1,
+		.pSetLayouts = &*layout
+	};
+	auto setRes = vDev.dev.allocateDescriptorSets(allocInfo);
+	if (!setRes.has_value()) {
+		MERROR << vDev.name << " Failed to allocate texture table: " << to_str(setRes.error()) << endl;
+		return;
+	}
+	set = std::move(setRes.value().front());
+	const_cast<bool&>(good) = true;
+	MDEBUG << vDev.name << " Created texture table with " << capacity << " slots" << endl;
+}
+
+VTextureTable::~VTextureTable() {
+	set.clear();
+	pool.clear();
+	layout.clear();
+	sampler.clear();
+}
+
+uint32_t VTextureTable::add(const VTexture& texture) {
+	std::lock_guard lock(mutex);
+	while (!retired.empty() && vDev.reached(retired.front().second)) {
+		freeSlots.push_back(retired.front().first);
+		retired.pop_front();
+	}
+	uint32_t slot;
+	if (!freeSlots.empty()) {
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+	} else if (nextSlot < capacity) {
+		slot = nextSlot++;
+	} else {
+		MWARN << vDev.name << " Texture table is full" << endl;
+		return NO_SLOT;
+	}
+	const vk::DescriptorImageInfo imageInfo{
+		.imageView = texture.view,
+		.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal
+	};
+	const vk::WriteDescriptorSet write{
+		.dstSet = set,
+		.dstBinding = TEXTURES_BINDING,
+		.dstArrayElement = slot,
+		.descriptorCount = 1,
+		.descriptorType = vk::DescriptorType::eSampledImage,
+		.pImageInfo = &imageInfo
+	};
+	vDev.dev.updateDescriptorSets(write, {});
+	return slot;
+}
+
+void VTextureTable::remove(const uint32_t slot, const VDevice::Ticket& lastUse) {
+	if (slot == NO_SLOT)
+		return;
+	std::lock_guard lock(mutex);
+	// Left as it is, partially bound slots may hold stale descriptors as long as nobody reads them
+	retired.emplace_back(slot, lastUse);
+}
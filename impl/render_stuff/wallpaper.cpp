@@ -0,0 +1,372 @@
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mland/wallpaper.h"
+#include "mland/globals.h"
+
+using namespace mland;
+namespace fs = std::filesystem;
+
+namespace {
+// 8 bit RGBA, straight out of the decoder
+struct Decoded {
+	uint32_t width{0};
+	uint32_t height{0};
+	vec<uint8_t> rgba{};
+};
+
+constexpr uint32_t readBE32(const uint8_t* p) {
+	return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+		static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+// Binary PPM, 8 or 16 bits per channel
+opt<Decoded> decodePpm(const std::span<const uint8_t> bytes) {
+	size_t pos = 2;
+	const auto nextInt = [&]() -> opt<uint32_t> {
+		while (pos < bytes.size()) {
+			if (bytes[pos] == '#') {
+				while (pos < bytes.size() && bytes[pos] != '\n')
+					pos++;
+			} else if (std::isspace(static_cast<unsigned char>(bytes[pos]))) {
+				pos++;
+			} else {
+				break;
+			}
+		}
+		if (pos >= bytes.size() || !std::isdigit(static_cast<unsigned char>(bytes[pos])))
+			return std::nullopt;
+		uint32_t value = 0;
+		while (pos < bytes.size() && std::isdigit(static_cast<unsigned char>(bytes[pos])))
+			value = value * 10 + (bytes[pos++] - '0');
+		return value;
+	};
+	const auto width = nextInt();
+	const auto height = nextInt();
+	const auto maxVal = nextInt();
+	if (!width || !height || !maxVal || *maxVal == 0 || *maxVal > 65535)
+		return std::nullopt;
+	pos++; // Single whitespace before the raster
+	const size_t channelBytes = *maxVal < 256 ? 1 : 2;
+	const size_t pixels = static_cast<size_t>(*width) * *height;
+	if (pos + pixels * 3 * channelBytes > bytes.size())
+		return std::nullopt;
+	Decoded ret{*width, *height, vec<uint8_t>(pixels * 4)};
+	const uint8_t* src = bytes.data() + pos;
+	for (size_t i = 0; i < pixels; i++) {
+		for (size_t c = 0; c < 3; c++) {
+			const uint32_t v = channelBytes == 1 ? src[0] : static_cast<uint32_t>(src[0]) << 8 | src[1];
+			ret.rgba[i * 4 + c] = static_cast<uint8_t>(v * 255 / *maxVal);
+			src += channelBytes;
+		}
+		ret.rgba[i * 4 + 3] = 255;
+	}
+	return ret;
+}
+
+// 16 bit big endian RGBA
+opt<Decoded> decodeFarbfeld(const std::span<const uint8_t> bytes) {
+	if (bytes.size() < 16)
+		return std::nullopt;
+	const auto width = readBE32(bytes.data() + 8);
+	const auto height = readBE32(bytes.data() + 12);
+	const size_t pixels = static_cast<size_t>(width) * height;
+	if (16 + pixels * 8 > bytes.size())
+		return std::nullopt;
+	Decoded ret{width, height, vec<uint8_t>(pixels * 4)};
+	const uint8_t* src = bytes.data() + 16;
+	// The high byte of each channel is the 8 bit value
+	for (size_t i = 0; i < pixels * 4; i++)
+		ret.rgba[i] = src[i * 2];
+	return ret;
+}
+
+opt<Decoded> decode(const std::span<const uint8_t> bytes) {
+	if (bytes.size() > 2 && bytes[0] == 'P' && bytes[1] == '6')
+		return decodePpm(bytes);
+	if (bytes.size() > 8 && std::memcmp(bytes.data(), "farbfeld", 8) == 0)
+		return decodeFarbfeld(bytes);
+	return std::nullopt;
+}
+
+// Writes one RGBA8 pixel in the given format, returns false for formats we can't write
+bool storePixel(const vk::Format format, const uint8_t* rgba, uint8_t* dst) {
+	switch (format) {
+	case vk::Format::eB8G8R8A8Unorm:
+	case vk::Format::eB8G8R8A8Srgb:
+		dst[0] = rgba[2];
+		dst[1] = rgba[1];
+		dst[2] = rgba[0];
+		dst[3] = rgba[3];
+		return true;
+	case vk::Format::eR8G8B8A8Unorm:
+	case vk::Format::eR8G8B8A8Srgb:
+	case vk::Format::eA8B8G8R8UnormPack32:
+	case vk::Format::eA8B8G8R8SrgbPack32:
+		std::memcpy(dst, rgba, 4);
+		return true;
+	case vk::Format::eA2R10G10B10UnormPack32:
+	case vk::Format::eA2B10G10R10UnormPack32: {
+		const auto to10 = [](const uint8_t v) { return static_cast<uint32_t>(v) * 1023 / 255; };
+		const bool bgr = format == vk::Format::eA2R10G10B10UnormPack32;
+		const uint32_t packed = (static_cast<uint32_t>(rgba[3]) * 3 / 255) << 30 |
+			to10(bgr ? rgba[0] : rgba[2]) << 20 | to10(rgba[1]) << 10 | to10(bgr ? rgba[2] : rgba[0]);
+		std::memcpy(dst, &packed, 4);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+}
+
+Wallpaper::Mapping::Mapping(Mapping&& other) noexcept :
+data(std::exchange(other.data, nullptr)), size(std::exchange(other.size, 0)) {}
+
+Wallpaper::Mapping::~Mapping() {
+	if (data != nullptr)
+		munmap(const_cast<uint8_t*>(data), size);
+}
+
+opt<Wallpaper::Mapping> Wallpaper::Mapping::open(const str& path) {
+	const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return std::nullopt;
+	struct stat statBuf{};
+	if (fstat(fd, &statBuf) != 0 || statBuf.st_size == 0) {
+		close(fd);
+		return std::nullopt;
+	}
+	const auto size = static_cast<size_t>(statBuf.st_size);
+	void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps the file alive on its own
+	close(fd);
+	if (data == MAP_FAILED)
+		return std::nullopt;
+	return Mapping(static_cast<const uint8_t*>(data), size);
+}
+
+// FNV-1a over 64 bit words, only has to tell wallpapers apart
+uint64_t Wallpaper::hash(const std::span<const uint8_t> bytes) {
+	uint64_t h = 0xcbf29ce484222325ull;
+	size_t i = 0;
+	for (; i + 8 <= bytes.size(); i += 8) {
+		uint64_t word;
+		std::memcpy(&word, bytes.data() + i, 8);
+		h = (h ^ word) * 0x100000001b3ull;
+	}
+	for (; i < bytes.size(); i++)
+		h = (h ^ bytes[i]) * 0x100000001b3ull;
+	return h ^ bytes.size();
+}
+
+str Wallpaper::cachePath(const uint64_t sourceHash, const vk::Extent2D extent, const vk::Format format) {
+	fs::path dir;
+	if (const auto xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+		dir = xdg;
+	else if (const auto home = std::getenv("HOME"); home && *home)
+		dir = fs::path(home) / ".cache";
+	else
+		dir = "/tmp";
+	dir /= "mephland";
+	std::array<char, 17> hex{};
+	std::snprintf(hex.data(), hex.size(), "%016llx", static_cast<unsigned long long>(sourceHash));
+	const auto file = str("wallpaper-") + hex.data() + '-' + std::to_string(extent.width) + 'x' +
+		std::to_string(extent.height) + '-' + std::to_string(static_cast<uint32_t>(format)) + ".bin";
+	return (dir / file).string();
+}
+
+// Scales the source to cover the output (cropping the overflow evenly) and stores it in format
+bool Wallpaper::buildCache(const std::span<const uint8_t> source, const str& cache, const uint64_t sourceHash,
+	const vk::Extent2D extent, const vk::Format format) {
+	const auto decoded = decode(source);
+	if (!decoded.has_value() || decoded->width == 0 || decoded->height == 0) {
+		MERROR << "Unsupported wallpaper format, use binary PPM or farbfeld" << endl;
+		return false;
+	}
+	MINFO << "Converting " << decoded->width << "x" << decoded->height << " wallpaper to "
+		<< extent.width << "x" << extent.height << " " << to_str(format) << endl;
+	const Header header{
+		.magic = MAGIC,
+		.sourceHash = sourceHash,
+		.width = extent.width,
+		.height = extent.height,
+		.format = static_cast<uint32_t>(format),
+		.rowPitch = extent.width * 4
+	};
+	vec<uint8_t> out(sizeof(Header) + static_cast<size_t>(header.rowPitch) * extent.height);
+	std::memcpy(out.data(), &header, sizeof(Header));
+	uint8_t* pixels = out.data() + sizeof(Header);
+
+	const auto& src = decoded.value();
+	const double scale = std::max(static_cast<double>(extent.width) / src.width,
+		static_cast<double>(extent.height) / src.height);
+	const double offX = (src.width - extent.width / scale) / 2;
+	const double offY = (src.height - extent.height / scale) / 2;
+	const auto texel = [&src](const int64_t x, const int64_t y) {
+		const auto cx = std::clamp<int64_t>(x, 0, src.width - 1);
+		const auto cy = std::clamp<int64_t>(y, 0, src.height - 1);
+		return src.rgba.data() + (cy * src.width + cx) * 4;
+	};
+	for (uint32_t y = 0; y < extent.height; y++) {
+		const double sy = (y + 0.5) / scale + offY - 0.5;
+		const auto y0 = static_cast<int64_t>(std::floor(sy));
+		const double fy = sy - y0;
+		for (uint32_t x = 0; x < extent.width; x++) {
+			const double sx = (x + 0.5) / scale + offX - 0.5;
+			const auto x0 = static_cast<int64_t>(std::floor(sx));
+			const double fx = sx - x0;
+			const uint8_t* p00 = texel(x0, y0);
+			const uint8_t* p10 = texel(x0 + 1, y0);
+			const uint8_t* p01 = texel(x0, y0 + 1);
+			const uint8_t* p11 = texel(x0 + 1, y0 + 1);
+			std::array<uint8_t, 4> rgba{};
+			for (size_t c = 0; c < 4; c++) {
+				const double top = p00[c] + (p10[c] - p00[c]) * fx;
+				const double bottom = p01[c] + (p11[c] - p01[c]) * fx;
+				rgba[c] = static_cast<uint8_t>(std::lround(top + (bottom - top) * fy));
+			}
+			if (!storePixel(format, rgba.data(), pixels + y * header.rowPitch + x * 4)) {
+				MWARN << "Can't convert the wallpaper to " << to_str(format) << endl;
+				return false;
+			}
+		}
+	}
+
+	// Written to a temporary first so a display loading at the same time never sees half a file
+	std::error_code ec;
+	fs::create_directories(fs::path(static_cast<const std::string&>(cache)).parent_path(), ec);
+	const auto tmp = cache + ".tmp" + std::to_string(getpid()) + '-' + std::to_string(gettid());
+	const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		MWARN << "Failed to create wallpaper cache " << tmp << endl;
+		return false;
+	}
+	size_t written = 0;
+	while (written < out.size()) {
+		const auto res = write(fd, out.data() + written, out.size() - written);
+		if (res <= 0)
+			break;
+		written += res;
+	}
+	close(fd);
+	if (written != out.size() || rename(tmp.c_str(), cache.c_str()) != 0) {
+		MWARN << "Failed to write wallpaper cache " << cache << endl;
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+opt<u_ptr<VTexture>> Wallpaper::upload(VDevice& vDev, const Header& header, const uint8_t* pixels) {
+	const vk::DeviceSize size = static_cast<vk::DeviceSize>(header.rowPitch) * header.height;
+	auto staging = vDev.createBuffer(size, vk::BufferUsageFlagBits::eTransferSrc,
+		vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+	if (!staging.has_value())
+		return std::nullopt;
+	// The only copy the CPU does
+	std::memcpy(staging.value()->getMapped(), pixels, size);
+
+	const vk::Extent2D extent{header.width, header.height};
+	auto texture = vDev.createTexture({
+		.format = static_cast<vk::Format>(header.format),
+		.extent = extent,
+		.usage = vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eTransferDst,
+		.shared = true
+	});
+	if (!texture.has_value())
+		return std::nullopt;
+	const auto& image = texture.value()->image;
+	const auto& buffer = staging.value()->buffer;
+	const auto ticket = vDev.oneShot(vDev.transferIndex, [&](const vkr::CommandBuffer& cmd) {
+		constexpr vk::ImageSubresourceRange range{
+			.aspectMask = vk::ImageAspectFlagBits::eColor,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		};
+		vk::ImageMemoryBarrier barrier{
+			.srcAccessMask = {},
+			.dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+			.oldLayout = vk::ImageLayout::eUndefined,
+			.newLayout = vk::ImageLayout::eTransferDstOptimal,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.image = image,
+			.subresourceRange = range
+		};
+		cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {},
+			{}, {}, barrier);
+		const vk::BufferImageCopy copy{
+			.bufferOffset = 0,
+			.bufferRowLength = header.rowPitch / 4,
+			.bufferImageHeight = header.height,
+			.imageSubresource = {
+				.aspectMask = vk::ImageAspectFlagBits::eColor,
+				.mipLevel = 0,
+				.baseArrayLayer = 0,
+				.layerCount = 1
+			},
+			.imageOffset = {},
+			.imageExtent = {
+				.width = header.width,
+				.height = header.height,
+				.depth = 1
+			}
+		};
+		cmd.copyBufferToImage(buffer, image, vk::ImageLayout::eTransferDstOptimal, copy);
+		barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+		barrier.dstAccessMask = {};
+		barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+		barrier.newLayout = vk::ImageLayout::eTransferSrcOptimal;
+		cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {},
+			{}, {}, barrier);
+	});
+	// Only happens on startup and hotplug, the staging buffer has to outlive the copy anyway
+	if (!vDev.wait(ticket))
+		return std::nullopt;
+	return texture;
+}
+
+opt<u_ptr<VTexture>> Wallpaper::load(VDevice& vDev, const vk::Extent2D extent, const vk::Format format) {
+	const auto& path = globals::wallpaperPath;
+	if (path.empty())
+		return std::nullopt;
+	const auto source = Mapping::open(path);
+	if (!source.has_value()) {
+		MWARN << "Failed to open wallpaper " << path << endl;
+		return std::nullopt;
+	}
+	const auto sourceHash = hash(source->bytes());
+	const auto cache = cachePath(sourceHash, extent, format);
+
+	for (bool built = false;; built = true) {
+		if (const auto mapping = Mapping::open(cache); mapping.has_value()) {
+			const auto bytes = mapping->bytes();
+			Header header{};
+			if (bytes.size() >= sizeof(Header))
+				std::memcpy(&header, bytes.data(), sizeof(Header));
+			const bool valid = bytes.size() >= sizeof(Header) &&
+				header.magic == MAGIC &&
+				header.sourceHash == sourceHash &&
+				header.width == extent.width &&
+				header.height == extent.height &&
+				header.format == static_cast<uint32_t>(format) &&
+				bytes.size() >= sizeof(Header) + static_cast<size_t>(header.rowPitch) * header.height;
+			if (valid) {
+				MDEBUG << "Loading wallpaper from " << cache << endl;
+				return upload(vDev, header, bytes.data() + sizeof(Header));
+			}
+			MWARN << "Ignoring invalid wallpaper cache " << cache << endl;
+		}
+		if (built || !buildCache(source->bytes(), cache, sourceHash, extent, format))
+			return std::nullopt;
+	}
+}
@@ -0,0 +1,297 @@
+#include <array>
+#include <cstring>
+#include <wayland-server-protocol.h>
+
+#include "mland/shm_format.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MLAND_SHM_X86
+#endif
+
+using namespace mland;
+
+namespace {
+using Conversion = ShmFormat::Conversion;
+
+// Little endian, so a format's bits read right to left are its bytes in memory
+constexpr std::array<ShmFormat::Info, 11> FORMATS{{
+	{WL_SHM_FORMAT_ARGB8888, 4, true, vk::Format::eB8G8R8A8Unorm, Conversion::eNone},
+	{WL_SHM_FORMAT_XRGB8888, 4, false, vk::Format::eB8G8R8A8Unorm, Conversion::eNone},
+	{WL_SHM_FORMAT_ABGR8888, 4, true, vk::Format::eR8G8B8A8Unorm, Conversion::eNone},
+	{WL_SHM_FORMAT_XBGR8888, 4, false, vk::Format::eR8G8B8A8Unorm, Conversion::eNone},
+	{WL_SHM_FORMAT_RGB565, 2, false, vk::Format::eR5G6B5UnormPack16, Conversion::eRgb565},
+	// Three byte texels can't be copied on a transfer queue that wants four byte aligned offsets
+	{WL_SHM_FORMAT_RGB888, 3, false, vk::Format::eUndefined, Conversion::eRgb888},
+	{WL_SHM_FORMAT_BGR888, 3, false, vk::Format::eUndefined, Conversion::eBgr888},
+	{WL_SHM_FORMAT_ARGB2101010, 4, true, vk::Format::eA2R10G10B10UnormPack32, Conversion::eArgb2101010},
+	{WL_SHM_FORMAT_XRGB2101010, 4, false, vk::Format::eA2R10G10B10UnormPack32, Conversion::eXrgb2101010},
+	{WL_SHM_FORMAT_ABGR2101010, 4, true, vk::Format::eA2B10G10R10UnormPack32, Conversion::eAbgr2101010},
+	{WL_SHM_FORMAT_XBGR2101010, 4, false, vk::Format::eA2B10G10R10UnormPack32, Conversion::eXbgr2101010}
+}};
+
+struct Kernels {
+	cstr name;
+	ShmFormat::Convert rgb888;
+	ShmFormat::Convert bgr888;
+	ShmFormat::Convert rgb565;
+	ShmFormat::Convert argb2101010;
+	ShmFormat::Convert xrgb2101010;
+	ShmFormat::Convert abgr2101010;
+	ShmFormat::Convert xbgr2101010;
+};
+
+constexpr uint32_t OPAQUE = 0xFF000000;
+
+// RGB888 is B, G, R in memory and BGR888 R, G, B
+template <bool Swap>
+void rgb888Scalar(const uint8_t* src, uint8_t* dst, const uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 3, dst += 4) {
+		dst[0] = src[Swap ? 2 : 0];
+		dst[1] = src[1];
+		dst[2] = src[Swap ? 0 : 2];
+		dst[3] = 0xFF;
+	}
+}
+
+// Replicates the top bits into the bottom so full intensity stays full
+void rgb565Scalar(const uint8_t* src, uint8_t* dst, const uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 2, dst += 4) {
+		uint16_t pixel;
+		std::memcpy(&pixel, src, sizeof(pixel));
+		const uint32_t r = pixel >> 11;
+		const uint32_t g = (pixel >> 5) & 0x3F;
+		const uint32_t b = pixel & 0x1F;
+		const uint32_t out = (b << 3 | b >> 2) | (g << 2 | g >> 4) << 8 | (r << 3 | r >> 2) << 16 | OPAQUE;
+		std::memcpy(dst, &out, sizeof(out));
+	}
+}
+
+// Keeps the top 8 of every 10 bits. Swap is for ABGR, which has red in the low bits
+template <bool Swap, bool Alpha>
+void rgb2101010Scalar(const uint8_t* src, uint8_t* dst, const uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 4, dst += 4) {
+		uint32_t pixel;
+		std::memcpy(&pixel, src, sizeof(pixel));
+		const uint32_t low = (pixel >> 2) & 0xFF;
+		const uint32_t g = (pixel >> 12) & 0xFF;
+		const uint32_t high = (pixel >> 22) & 0xFF;
+		const uint32_t a = Alpha ? (pixel >> 30) * 0x55 << 24 : OPAQUE;
+		const uint32_t out = (Swap ? high : low) | g << 8 | (Swap ? low : high) << 16 | a;
+		std::memcpy(dst, &out, sizeof(out));
+	}
+}
+
+constexpr Kernels SCALAR{"scalar", rgb888Scalar<false>, rgb888Scalar<true>, rgb565Scalar,
+	rgb2101010Scalar<false, true>, rgb2101010Scalar<false, false>, rgb2101010Scalar<true, true>,
+	rgb2101010Scalar<true, false>};
+
+#ifdef MLAND_SHM_X86
+// Every kernel leaves the tail that doesn't fill a register to the scalar one
+
+// Spreads four 3 byte pixels over four 4 byte lanes, -1 zeroes the alpha byte for the or
+template <bool Swap>
+__attribute__((target("ssse3")))
+__m128i rgb888Shuffle() {
+	return Swap ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+		: _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+}
+
+// Loads 16 bytes for 12, so it stops while two more pixels are left in the row
+template <bool Swap>
+__attribute__((target("ssse3")))
+void rgb888Ssse3(const uint8_t* src, uint8_t* dst, const uint32_t width) {
+	const auto shuffle = rgb888Shuffle<Swap>();
+	const auto alpha = _mm_set1_epi32(static_cast<int32_t>(OPAQUE));
+	uint32_t x = 0;
+	for (; x + 6 <= width; x += 4) {
+		const auto in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 3));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), _mm_or_si128(_mm_shuffle_epi8(in, shuffle), alpha));
+	}
+	rgb888Scalar<Swap>(src + x * 3, dst + x * 4, width - x);
+}
+
+__attribute__((target("ssse3")))
+__m128i expand565Sse(const __m128i pixels) {
+	const auto r = _mm_srli_epi32(pixels, 11);
+	const auto g = _mm_and_si128(_mm_srli_epi32(pixels, 5), _mm_set1_epi32(0x3F));
+	const auto b = _mm_and_si128(pixels, _mm_set1_epi32(0x1F));
+	const auto r8 = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+	const auto g8 = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+	const auto b8 = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+	return _mm_or_si128(_mm_or_si128(b8, _mm_slli_epi32(g8, 8)),
+		_mm_or_si128(_mm_slli_epi32(r8, 16), _mm_set1_epi32(static_cast<int32_t>(OPAQUE))));
+}
+
+__attribute__((target("ssse3")))
+void rgb565Ssse3(const uint8_t* src, uint8_t* dst, const uint32_t width) {
+	const auto zero = _mm_setzero_si128();
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		const auto in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 2));
+		auto* out = reinterpret_cast<__m128i*>(dst + x * 4);
+		_mm_storeu_si128(out, expand565Sse(_mm_unpacklo_epi16(in, zero)));
+		_mm_storeu_si128(out + 1, expand565Sse(_mm_unpackhi_epi16(in, zero)));
+	}
+	rgb565Scalar(src + x * 2, dst + x * 4, width - x);
+}
+
+template <bool Swap, bool Alpha>
+__attribute__((target("ssse3")))
+void rgb2101010Ssse3(const uint8_t* src, uint8_t* dst, const uint32_t width) {
+	const auto mask = _mm_set1_epi32(0xFF);
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		const auto in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+		const auto low = _mm_and_si128(_mm_srli_epi32(in, 2), mask);
+		const auto g = _mm_and_si128(_mm_srli_epi32(in, 12), mask);
+		const auto high = _mm_and_si128(_mm_srli_epi32(in, 22), mask);
+		auto a = _mm_set1_epi32(static_cast<int32_t>(OPAQUE));
+		if constexpr (Alpha) {
+			// Two bits times 0x55, without SSE4.1 multiplies
+			const auto a2 = _mm_srli_epi32(in, 30);
+			const auto a4 = _mm_or_si128(a2, _mm_slli_epi32(a2, 2));
+			a = _mm_slli_epi32(_mm_or_si128(a4, _mm_slli_epi32(a4, 4)), 24);
+		}
+		const auto out = _mm_or_si128(_mm_or_si128(Swap ? high : low, _mm_slli_epi32(g, 8)),
+			_mm_or_si128(_mm_slli_epi32(Swap ? low : high, 16), a));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), out);
+	}
+	rgb2101010Scalar<Swap, Alpha>(src + x * 4, dst + x * 4, width - x);
+}
+
+constexpr Kernels SSSE3{"ssse3", rgb888Ssse3<false>, rgb888Ssse3<true>, rgb565Ssse3,
+	rgb2101010Ssse3<false, true>, rgb2101010Ssse3<false, false>, rgb2101010Ssse3<true, true>,
+	rgb2101010Ssse3<true, false>};
+
+// The shuffle stays within 128 bit lanes, so each lane gets its own 12 bytes. The second load
+// ends 28 bytes in, which needs two pixels past the eight
+template <bool Swap>
+__attribute__((target("avx2")))
+void rgb888Avx2(const uint8_t* src, uint8_t* dst, const uint32_t width) {
+	const auto shuffle = _mm256_broadcastsi128_si256(rgb888Shuffle<Swap>());
+	const auto alpha = _mm256_set1_epi32(static_cast<int32_t>(OPAQUE));
+	uint32_t x = 0;
+	for (; x + 10 <= width; x += 8) {
+		const auto* in = src + x * 3;
+		const auto both = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in))),
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 12)), 1);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * 4),
+			_mm256_or_si256(_mm256_shuffle_epi8(both, shuffle), alpha));
+	}
+	rgb888Ssse3<Swap>(src + x * 3, dst + x * 4, width - x);
+}
+
+__attribute__((target("avx2")))
+void rgb565Avx2(const uint8_t* src, uint8_t* dst, const uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		const auto pixels = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 2)));
+		const auto r = _mm256_srli_epi32(pixels, 11);
+		const auto g = _mm256_and_si256(_mm256_srli_epi32(pixels, 5), _mm256_set1_epi32(0x3F));
+		const auto b = _mm256_and_si256(pixels, _mm256_set1_epi32(0x1F));
+		const auto r8 = _mm256_or_si256(_mm256_slli_epi32(r, 3), _mm256_srli_epi32(r, 2));
+		const auto g8 = _mm256_or_si256(_mm256_slli_epi32(g, 2), _mm256_srli_epi32(g, 4));
+		const auto b8 = _mm256_or_si256(_mm256_slli_epi32(b, 3), _mm256_srli_epi32(b, 2));
+		const auto out = _mm256_or_si256(_mm256_or_si256(b8, _mm256_slli_epi32(g8, 8)),
+			_mm256_or_si256(_mm256_slli_epi32(r8, 16), _mm256_set1_epi32(static_cast<int32_t>(OPAQUE))));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * 4), out);
+	}
+	rgb565Scalar(src + x * 2, dst + x * 4, width - x);
+}
+
+template <bool Swap, bool Alpha>
+__attribute__((target("avx2")))
+void rgb2101010Avx2(const uint8_t* src, uint8_t* dst, const uint32_t width) {
+	const auto mask = _mm256_set1_epi32(0xFF);
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		const auto in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x * 4));
+		const auto low = _mm256_and_si256(_mm256_srli_epi32(in, 2), mask);
+		const auto g = _mm256_and_si256(_mm256_srli_epi32(in, 12), mask);
+		const auto high = _mm256_and_si256(_mm256_srli_epi32(in, 22), mask);
+		auto a = _mm256_set1_epi32(static_cast<int32_t>(OPAQUE));
+		if constexpr (Alpha)
+			a = _mm256_slli_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(in, 30), _mm256_set1_epi32(0x55)), 24);
+		const auto out = _mm256_or_si256(_mm256_or_si256(Swap ? high : low, _mm256_slli_epi32(g, 8)),
+			_mm256_or_si256(_mm256_slli_epi32(Swap ? low : high, 16), a));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * 4), out);
+	}
+	rgb2101010Ssse3<Swap, Alpha>(src + x * 4, dst + x * 4, width - x);
+}
+
+constexpr Kernels AVX2{"avx2", rgb888Avx2<false>, rgb888Avx2<true>, rgb565Avx2,
+	rgb2101010Avx2<false, true>, rgb2101010Avx2<false, false>, rgb2101010Avx2<true, true>,
+	rgb2101010Avx2<true, false>};
+#endif
+
+// Slowest first
+vec<const Kernels*> supportedKernels() {
+	vec<const Kernels*> ret{&SCALAR};
+#ifdef MLAND_SHM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3"))
+		ret.push_back(&SSSE3);
+	if (__builtin_cpu_supports("avx2"))
+		ret.push_back(&AVX2);
+#endif
+	return ret;
+}
+
+const Kernels*& current() {
+	static const Kernels* picked = supportedKernels().back();
+	return picked;
+}
+
+const Kernels& active() {
+	return *current();
+}
+}
+
+std::span<const ShmFormat::Info> ShmFormat::all() {
+	return FORMATS;
+}
+
+const ShmFormat::Info* ShmFormat::find(const uint32_t shm) {
+	for (const auto& info : FORMATS)
+		if (info.shm == shm)
+			return &info;
+	return nullptr;
+}
+
+ShmFormat::Convert ShmFormat::converter(const Info& info) {
+	const auto& kernels = active();
+	switch (info.conversion) {
+	case Conversion::eRgb888:
+		return kernels.rgb888;
+	case Conversion::eBgr888:
+		return kernels.bgr888;
+	case Conversion::eRgb565:
+		return kernels.rgb565;
+	case Conversion::eArgb2101010:
+		return kernels.argb2101010;
+	case Conversion::eXrgb2101010:
+		return kernels.xrgb2101010;
+	case Conversion::eAbgr2101010:
+		return kernels.abgr2101010;
+	case Conversion::eXbgr2101010:
+		return kernels.xbgr2101010;
+	default:
+		return nullptr;
+	}
+}
+
+cstr ShmFormat::kernels() {
+	return active().name;
+}
+
+bool ShmFormat::useKernels(const std::string_view name) {
+	for (const auto* kernels : supportedKernels()) {
+		if (kernels->name != name)
+			continue;
+		current() = kernels;
+		return true;
+	}
+	return false;
+}
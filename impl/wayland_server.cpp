@@ -1,4 +1,7 @@
+#include <wayland-server-protocol.h>
+
 #include "mland/wayland_server.h"
+#include "mland/shm_format.h"
 
 using namespace mland;
 
@@ -28,6 +31,16 @@ WLServer::WLServer() {
 		MERROR << "Failed to create Wayland display" << endl;
 		throw std::runtime_error("WLServer Error");
 	}
+	// ARGB8888 and XRGB8888 are always advertised
+	if (wl_display_init_shm(display_) != 0) {
+		MERROR << "Failed to initialize wl_shm" << endl;
+		throw std::runtime_error("WLServer Error");
+	}
+	// Devices that can't sample the rest convert them while uploading
+	for (const auto& format : ShmFormat::all())
+		if (format.shm != WL_SHM_FORMAT_ARGB8888 && format.shm != WL_SHM_FORMAT_XRGB8888 &&
+			wl_display_add_shm_format(display_, format.shm) == nullptr)
+			MWARN << "Failed to advertise wl_shm format " << format.shm << endl;
 	socket_ = wl_display_add_socket_auto(display_);
 	if (!socket_) {
 		MERROR << "Failed to create Wayland socket" << endl;
@@ -134,10 +134,19 @@ using VDevice = Backend::VDevice;
 using VInstance = Backend::VInstance;
 struct VShader;
 struct VTexture;
+struct VBuffer;
+class VAllocator;
+class VAllocation;
+class VTexturePool;
+class VResidency;
+class VRenderGraph;
 
 class VSurface;
 class VSurfaceHost;
 class VSurfaceDevice;
+class VTextureTable;
+class VDmabufImporter;
+class DmabufAttributes;
 
 class Controller;
 class WLServer;
@@ -0,0 +1,63 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <wayland-server-core.h>
+
+#include "common.h"
+
+namespace mland {
+
+// Planes of a client dmabuf as zwp_linux_buffer_params_v1 described them, one per wl_buffer. The
+// renderer imports it once per device and keeps the image until the wl_buffer is destroyed, so a
+// client cycling through a few buffers never imports twice
+class DmabufAttributes {
+public:
+	MCLASS(DmabufAttributes);
+	static constexpr uint32_t MAX_PLANES = 4;
+
+	struct Plane {
+		int fd{-1};
+		uint32_t offset{0};
+		uint32_t stride{0};
+	};
+
+	// Null unless buffer was created through zwp_linux_dmabuf_v1
+	static s_ptr<const DmabufAttributes> get(wl_resource* buffer);
+
+	DmabufAttributes() = default;
+	DmabufAttributes(const DmabufAttributes&) = delete;
+	DmabufAttributes(DmabufAttributes&&) = delete;
+	// Closes the plane fds, any thread may drop the last reference
+	~DmabufAttributes();
+
+	// Any thread. Devices pin the buffer from the first frame that may sample it until those frames
+	// are done with it. Fails once retired, the scene still showing it is outdated then
+	bool pin() const;
+	void unpin() const;
+	// Wayland thread. Retired when a commit replaces it, the wl_buffer goes back to the client
+	// once nothing pins it anymore, see Compositor::releaseRetired
+	void retire() const;
+	// Attached again before it went back
+	void unretire() const;
+	bool retired() const { return access.load(std::memory_order_relaxed) & RETIRED; }
+	bool pinned() const { return access.load(std::memory_order_acquire) & ~RETIRED; }
+
+	// Unique for the life of the process, device caches key their imports on it
+	uint64_t id{0};
+	int32_t width{0};
+	int32_t height{0};
+	// DRM fourcc
+	uint32_t format{0};
+	uint64_t modifier{0};
+	uint32_t planeCount{0};
+	std::array<Plane, MAX_PLANES> planes{};
+	// Set on the Wayland thread once the wl_buffer is gone, nothing will show it again
+	std::atomic<bool> destroyed{false};
+
+private:
+	static constexpr uint32_t RETIRED = 1u << 31;
+	// Pins and the retired bit
+	mutable std::atomic<uint32_t> access{0};
+};
+
+}
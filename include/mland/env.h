@@ -39,4 +39,20 @@ constexpr auto USE_VALIDATION_LAYERS = "MLAND_VALIDATION_LAYERS";
  */
 constexpr auto MAX_WINDOWS = "MLAND_SDL_MAX_WINDOWS";
 
+/**
+ * The environment variable that specifies how many MiB of released textures each device keeps
+ * around for reuse
+ * @note Type: int
+ * @note Default: 256
+ */
+constexpr auto TEXTURE_CACHE_MB = "MLAND_TEXTURE_CACHE_MB";
+
+/**
+ * The environment variable that specifies the wallpaper image, binary PPM (P6) or farbfeld
+ * @note The converted image is cached in $XDG_CACHE_HOME/mephland
+ * @note Type: string
+ * @note Default: [no wallpaper]
+ */
+constexpr auto WALLPAPER = "MLAND_WALLPAPER";
+
 }
@@ -2,6 +2,7 @@
 #include <atomic>
 #include <cstdint>
 #include <ostream>
+#include <string>
 
 namespace mland {
 struct MState;
@@ -10,6 +11,16 @@ struct MState;
 namespace mland::globals {
 // Doesn't need initialization
 extern std::atomic<uint32_t> bufferCount;
+extern std::atomic<uint64_t> textureCacheBudget;
+// One bit per device copying wl_shm contents, see ShmContents::addCopier
+extern std::atomic<uint64_t> shmCopiers;
+// eventfd render threads poke when wl_shm contents or dmabufs may be releasable, -1 until the
+// compositor listens
+extern std::atomic<int> shmCopiedFd;
+// eventfd render threads poke after appending to MState::presented, -1 until the compositor listens
+extern std::atomic<int> presentedFd;
+// Set once at startup, empty if there is no wallpaper
+extern std::string wallpaperPath;
 extern MState CompositorState;
 extern std::ostream debug;
 extern std::ostream info;
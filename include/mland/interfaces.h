@@ -9,5 +9,12 @@ class WLInterface;
 // Part of the core wayland protocol
 class Output;
 class Compositor;
+class Subcompositor;
+class Subsurface;
+
+// Protocols from wayland-protocols
+class LinuxDmabuf;
+class Viewporter;
+class Presentation;
 
 }
\ No newline at end of file
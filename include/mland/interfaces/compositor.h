@@ -1,25 +1,120 @@
 #pragma once
 #include "wl_interface.h"
+#include "surface.h"
 #include "../common.h"
+#include "../slab.h"
+#include "../vsurface.h"
 namespace mland::interfaces {
 
 class Compositor final : public WLInterface {
 public:
 	MCLASS(Compositor);
-	~Compositor() override = default;
+	~Compositor() override;
 private:
-	static constexpr struct wl_compositor_interface WLCompositorImplementation {
+	static void createSurface(wl_client* client, wl_resource* resource, uint32_t id);
+	static void createRegion(wl_client* client, wl_resource* resource, uint32_t id);
 
+	static constexpr struct wl_compositor_interface WLCompositorImplementation {
+		.create_surface = createSurface,
+		.create_region = createRegion
 	};
 
 	friend Controller;
+	friend Surface;
+	friend Region;
+	friend class Subcompositor;
 	Compositor(wl_display* wlDisplay);
 	Compositor(const Compositor&) = delete;
 	Compositor(Compositor&&) = delete;
+
+	static Compositor& from(wl_resource* resource);
+	static void destroySurface(wl_resource* resource);
+	static void destroyRegion(wl_resource* resource);
+	// Surfaces no display showed lately, occluded or on displays that stopped presenting, get their
+	// frame callbacks at THROTTLED_INTERVAL so their clients don't draw frames nobody sees
+	static int frameTimer(void* data);
+	// Render threads poke presentedFd for every frame they put on screen
+	static int onPresented(int fd, uint32_t mask, void* data);
+	// Answers the frames whose vblank has passed, the timer fires for predicted ones
+	static int firePresented(void* data);
+	// Rebuilds the scene snapshot once the event loop has dispatched everything pending
+	void schedulePublish();
+	// Mirrors what a commit changed into the scene store
+	void updateScene(Surface& surface, uint32_t changed);
+	// Queues the toplevel tree of the surface for flattening, orphaned subsurfaces have none
+	void treeChanged(Surface& surface);
+	// Hands the scene store the subsurfaces of a toplevel in drawing order and places them
+	void flatten(Surface& root);
+	void flattenInto(Surface& surface, vk::Offset2D origin);
+	// Hands the contents of a commit to the renderer and retires the previous ones
+	void updateContents(Surface& surface);
+	void retire(s_ptr<ShmContents>&& contents);
+	// A commit replaced the buffer. Dmabufs go back once no device pins them, anything else right away
+	void retireBuffer(wl_resource* buffer);
+	// Attached again, a dmabuf still waiting for its release stays with us
+	void keepBuffer(wl_resource* buffer);
+	// Releases the buffers of retired contents and dmabufs nobody reads anymore
+	void releaseRetired();
+	// Releases the buffers of current contents every device has copied
+	void releaseCopied();
+	// Render threads poke shmCopied after copying contents or unpinning a retired dmabuf
+	static int onShmCopied(int fd, uint32_t mask, void* data);
+	static void publishScene(void* data);
+
+	// Frame callbacks answered per client, the rates go to the debug log
+	struct CallbackStats {
+		Compositor* compositor;
+		wl_client* client;
+		wl_listener destroyed{};
+		std::chrono::steady_clock::time_point since{};
+		// By presenting displays and by the throttle
+		uint64_t presented{0};
+		uint64_t throttled{0};
+		// At the last log, for the rates since
+		uint64_t loggedPresented{0};
+		uint64_t loggedThrottled{0};
+	};
+	CallbackStats& getCallbackStats(wl_client* client);
+	static void onClientDestroyed(wl_listener* listener, void* data);
+	void logCallbackRates(std::chrono::steady_clock::time_point now);
+
+	// Surfaces, their double buffered state and regions come out of arenas so creating
+	// and committing doesn't touch the heap once the pools are warm
+	SlabPool<Surface> surfaces{};
+	SlabPool<SurfaceState> states{};
+	SlabPool<Region> regions{};
+	wl_list surfaceList{};
+	wl_list regionList{};
+	wl_list subsurfaceList{};
+	wl_event_source* timer{nullptr};
+	wl_event_source* publishIdle{nullptr};
+	wl_event_source* shmCopiedSource{nullptr};
+	int shmCopied{-1};
+	wl_event_source* presentedSource{nullptr};
+	wl_event_source* presentTimer{nullptr};
+	int presentedFd{-1};
+	// Reported frames waiting for their vblank, in the order the displays reported them
+	vec<Presented> presented{};
+	std::chrono::steady_clock::time_point nextThrottled{};
+	std::chrono::steady_clock::time_point statsLogged{};
+	map<wl_client*, CallbackStats> callbackStats{};
+	wl_event_loop* loop{nullptr};
+	bool sceneDirty{false};
+	// Hot per surface fields the snapshot is built from, without walking the surfaces
+	VSurfaceHost scene{};
+	// By scene index, reports only carry handles
+	vec<Surface*> handles{};
+	vec<s_ptr<ShmContents>> retired{};
+	vec<std::pair<wl_resource*, s_ptr<const DmabufAttributes>>> retiredDmabufs{};
+	// Toplevels whose flattened tree is stale, flattened once per publish however often they commit
+	vec<Surface*> dirtyTrees{};
+	// Scratch for updateContents and flatten
+	BandedRegion bufferDamage{};
+	vec<VSurface> flattened{};
 protected:
 	void bind(wl_client* client, uint32_t version, uint32_t id) override;
 	void destroy(wl_resource* resource) override;
 
 };
 
-}
\ No newline at end of file
+}
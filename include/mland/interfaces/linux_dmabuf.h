@@ -0,0 +1,104 @@
+#pragma once
+#include <sys/types.h>
+#include <wayland-server-core.h>
+#include <linux-dmabuf-unstable-v1-server-protocol.h>
+
+#include "wl_interface.h"
+#include "../common.h"
+#include "../dmabuf_attributes.h"
+
+namespace mland::interfaces {
+
+// zwp_linux_dmabuf_v1, advertises what the devices can import and wraps client dmabufs in
+// wl_buffers carrying DmabufAttributes
+class LinuxDmabuf final : public WLInterface {
+public:
+	MCLASS(LinuxDmabuf);
+	struct Format {
+		uint32_t fourcc;
+		uint64_t modifier;
+		// Memory planes a buffer of the format with the modifier has
+		uint32_t planes;
+	};
+	// Formats and modifiers one device can sample, the first tranche is the main device
+	struct Tranche {
+		// Render node, 0 if the device doesn't tell
+		dev_t device{0};
+		vec<Format> formats{};
+	};
+	~LinuxDmabuf() override;
+
+private:
+	// One zwp_linux_buffer_params_v1
+	struct Params {
+		LinuxDmabuf* parent;
+		wl_resource* resource;
+		u_ptr<DmabufAttributes> attributes;
+		bool used{false};
+		wl_list link{};
+	};
+	// Entry of the format table clients mmap, layout fixed by the protocol
+	struct TableEntry {
+		uint32_t format;
+		uint32_t padding;
+		uint64_t modifier;
+	};
+
+	static void destroyDmabuf(wl_client* client, wl_resource* resource);
+	static void createParams(wl_client* client, wl_resource* resource, uint32_t id);
+	static void getDefaultFeedback(wl_client* client, wl_resource* resource, uint32_t id);
+	static void getSurfaceFeedback(wl_client* client, wl_resource* resource, uint32_t id, wl_resource* surface);
+
+	static constexpr struct zwp_linux_dmabuf_v1_interface WLDmabufImplementation {
+		.destroy = destroyDmabuf,
+		.create_params = createParams,
+		.get_default_feedback = getDefaultFeedback,
+		.get_surface_feedback = getSurfaceFeedback
+	};
+
+	static void destroyParams(wl_client* client, wl_resource* resource);
+	static void addPlane(wl_client* client, wl_resource* resource, int32_t fd, uint32_t planeIdx, uint32_t offset,
+		uint32_t stride, uint32_t modifierHi, uint32_t modifierLo);
+	static void create(wl_client* client, wl_resource* resource, int32_t width, int32_t height, uint32_t format,
+		uint32_t flags);
+	static void createImmed(wl_client* client, wl_resource* resource, uint32_t bufferId, int32_t width,
+		int32_t height, uint32_t format, uint32_t flags);
+
+	static constexpr struct zwp_linux_buffer_params_v1_interface WLParamsImplementation {
+		.destroy = destroyParams,
+		.add = addPlane,
+		.create = create,
+		.create_immed = createImmed
+	};
+
+	friend Controller;
+	LinuxDmabuf(wl_display* wlDisplay, vec<Tranche>&& tranches);
+	LinuxDmabuf(const LinuxDmabuf&) = delete;
+	LinuxDmabuf(LinuxDmabuf&&) = delete;
+
+	static LinuxDmabuf& from(wl_resource* resource);
+	static Params* paramsFrom(wl_resource* resource);
+	static void onParamsDestroy(wl_resource* resource);
+	// Checks the planes and wraps them in a wl_buffer with the given id, null and an error posted
+	// or failed sent if they don't describe something we can import
+	static wl_resource* createBuffer(wl_client* client, Params& params, uint32_t bufferId, int32_t width,
+		int32_t height, uint32_t format, uint32_t flags);
+	void createFeedback(wl_client* client, wl_resource* resource, uint32_t id) const;
+	bool supported(uint32_t format, uint64_t modifier) const;
+	// Whether a device taking the format with the modifier expects that many planes
+	bool matchesPlanes(uint32_t format, uint64_t modifier, uint32_t planes) const;
+	// Writes the sealed format table every feedback hands out
+	bool createTable();
+
+	vec<Tranche> tranches{};
+	vec<TableEntry> table{};
+	int tableFd{-1};
+	// Per tranche, where its formats are in the table
+	vec<vec<uint16_t>> tableIndices{};
+	wl_list paramsList{};
+
+protected:
+	void bind(wl_client* client, uint32_t version, uint32_t id) override;
+};
+
+}
@@ -11,6 +11,9 @@ class Output final : WLInterface {
 public:
 	MCLASS(Output);
 	~Output() override = default;
+
+	// wl_output the client bound for this display, null if it didn't
+	wl_resource* getResource(wl_client* client) const;
 private:
 	static void release(wl_client* client, wl_resource* resource);
 
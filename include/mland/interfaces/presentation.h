@@ -0,0 +1,36 @@
+#pragma once
+#include <wayland-server-core.h>
+#include <presentation-time-server-protocol.h>
+
+#include "wl_interface.h"
+#include "surface.h"
+#include "../common.h"
+
+namespace mland::interfaces {
+
+// wp_presentation. Feedback is double buffered like frame callbacks and answered by the display
+// that first shows the content update, see Compositor::onPresented
+class Presentation final : public WLInterface {
+public:
+	MCLASS(Presentation);
+	~Presentation() override = default;
+
+private:
+	static void destroyPresentation(wl_client* client, wl_resource* resource);
+	static void feedback(wl_client* client, wl_resource* resource, wl_resource* surface, uint32_t callback);
+
+	static constexpr struct wp_presentation_interface WLPresentationImplementation {
+		.destroy = destroyPresentation,
+		.feedback = feedback
+	};
+
+	friend Controller;
+	explicit Presentation(wl_display* wlDisplay);
+	Presentation(const Presentation&) = delete;
+	Presentation(Presentation&&) = delete;
+
+protected:
+	void bind(wl_client* client, uint32_t version, uint32_t id) override;
+};
+
+}
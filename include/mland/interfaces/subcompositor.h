@@ -0,0 +1,92 @@
+#pragma once
+#include <wayland-server-core.h>
+#include <wayland-server-protocol.h>
+
+#include "wl_interface.h"
+#include "surface.h"
+#include "../common.h"
+
+namespace mland::interfaces {
+
+// wl_subsurface, the role tying a surface to its parent. Owned by its resource, either surface
+// may go first and leaves the pointer to it null
+class Subsurface {
+public:
+	MCLASS(Subsurface);
+
+	// Set itself or below a synchronized one, commits are cached until the parent applies them
+	bool synchronized() const;
+
+private:
+	friend class Subcompositor;
+	friend class Surface;
+	friend class Compositor;
+	Subsurface(Compositor* compositor, Surface* surface, Surface* parent, wl_resource* resource,
+		SurfaceState* cached) :
+	compositor(compositor), surface(surface), parent(parent), resource(resource), cached(cached) {}
+
+	Compositor* compositor;
+	Surface* surface;
+	Surface* parent;
+	wl_resource* resource;
+	// Relative to the parent, the pending position lands when the parent state is applied
+	int32_t x{0};
+	int32_t y{0};
+	int32_t pendingX{0};
+	int32_t pendingY{0};
+	bool sync{true};
+	// What synchronized commits applied to, from the compositor state pool
+	SurfaceState* cached;
+	bool hasCache{false};
+	wl_list link{};
+};
+
+// wl_subcompositor. The compositor keeps each toplevel tree flattened in the scene store, so only a
+// commit inside a tree walks it again
+class Subcompositor final : public WLInterface {
+public:
+	MCLASS(Subcompositor);
+	~Subcompositor() override = default;
+
+private:
+	static void destroySubcompositor(wl_client* client, wl_resource* resource);
+	static void getSubsurface(wl_client* client, wl_resource* resource, uint32_t id, wl_resource* surface,
+		wl_resource* parent);
+
+	static constexpr struct wl_subcompositor_interface WLSubcompositorImplementation {
+		.destroy = destroySubcompositor,
+		.get_subsurface = getSubsurface
+	};
+
+	static void destroySubsurface(wl_client* client, wl_resource* resource);
+	static void setPosition(wl_client* client, wl_resource* resource, int32_t x, int32_t y);
+	static void placeAbove(wl_client* client, wl_resource* resource, wl_resource* sibling);
+	static void placeBelow(wl_client* client, wl_resource* resource, wl_resource* sibling);
+	static void setSync(wl_client* client, wl_resource* resource);
+	static void setDesync(wl_client* client, wl_resource* resource);
+
+	static constexpr struct wl_subsurface_interface WLSubsurfaceImplementation {
+		.destroy = destroySubsurface,
+		.set_position = setPosition,
+		.place_above = placeAbove,
+		.place_below = placeBelow,
+		.set_sync = setSync,
+		.set_desync = setDesync
+	};
+
+	friend Controller;
+	explicit Subcompositor(wl_display* wlDisplay);
+	Subcompositor(const Subcompositor&) = delete;
+	Subcompositor(Subcompositor&&) = delete;
+
+	static Subsurface* from(wl_resource* resource);
+	// Moves the surface right above or below sibling in the pending stack of the parent
+	static void place(wl_resource* resource, wl_resource* sibling, bool above);
+	// Unmaps the surface and hands it back as a toplevel
+	static void onSubsurfaceDestroy(wl_resource* resource);
+
+protected:
+	void bind(wl_client* client, uint32_t version, uint32_t id) override;
+};
+
+}
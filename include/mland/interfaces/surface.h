@@ -0,0 +1,194 @@
+#pragma once
+#include <array>
+#include <deque>
+#include <wayland-server-core.h>
+#include <wayland-server-protocol.h>
+
+#include "mland/common.h"
+#include "mland/region.h"
+#include "mland/shm_contents.h"
+#include "mland/dmabuf_attributes.h"
+#include "mland/slab.h"
+#include "mland/vsurface.h"
+#include "mland/mstate.h"
+
+namespace mland::interfaces {
+
+// wl_region
+class Region {
+public:
+	MCLASS(Region);
+
+	constexpr const BandedRegion& get() const { return region; }
+
+private:
+	friend class Compositor;
+	template <class, size_t> friend class mland::SlabPool;
+	Region(Compositor* compositor, wl_resource* resource) : compositor(compositor), resource(resource) {}
+
+	static void destroy(wl_client* client, wl_resource* resource);
+	static void add(wl_client* client, wl_resource* resource, int32_t x, int32_t y, int32_t width, int32_t height);
+	static void subtract(wl_client* client, wl_resource* resource, int32_t x, int32_t y, int32_t width, int32_t height);
+
+	static constexpr struct wl_region_interface WLRegionImplementation {
+		.destroy = destroy,
+		.add = add,
+		.subtract = subtract
+	};
+
+	Compositor* compositor;
+	wl_resource* resource;
+	BandedRegion region{};
+	wl_list link{};
+};
+
+// Everything wl_surface double buffers, one copy is pending and one current
+struct SurfaceState {
+	enum Changed : uint32_t {
+		eBuffer = 1 << 0,
+		eDamage = 1 << 1,
+		eScale = 1 << 2,
+		eTransform = 1 << 3,
+		eOpaque = 1 << 4,
+		eInput = 1 << 5,
+		eOffset = 1 << 6,
+		eFrame = 1 << 7,
+		eViewport = 1 << 8,
+		ePresentation = 1 << 9
+	};
+	// Past this many boxes damage collapses into its bounding box, too much damage only costs
+	// bandwidth
+	static constexpr uint32_t MAX_DAMAGE = 64;
+
+	uint32_t changed{0};
+	// Attached wl_buffer, cleared by the listener if the client destroys it first
+	wl_resource* buffer{nullptr};
+	wl_listener bufferDestroy{};
+	int32_t dx{0};
+	int32_t dy{0};
+	int32_t scale{1};
+	wl_output_transform transform{WL_OUTPUT_TRANSFORM_NORMAL};
+	// Surface and buffer coordinates
+	BandedRegion damage{};
+	BandedRegion bufferDamage{};
+	BandedRegion opaque{};
+	BandedRegion input{};
+	bool infiniteInput{true};
+	wl_list frameCallbacks{};
+	// wp_presentation_feedback, discarded if the state goes away before it is applied
+	wl_list feedback{};
+	// wp_viewport, -1 when unset. The source is in buffer coordinates after transform and scale,
+	// the destination is the surface size
+	std::array<double, 4> source{-1.0, -1.0, -1.0, -1.0};
+	int32_t destinationWidth{-1};
+	int32_t destinationHeight{-1};
+
+	SurfaceState();
+	~SurfaceState();
+	SurfaceState(const SurfaceState&) = delete;
+	void setBuffer(wl_resource* newBuffer);
+	static void onBufferDestroy(wl_listener* listener, void* data);
+
+	constexpr bool hasSource() const { return source[2] >= 0.0; }
+	constexpr bool hasDestination() const { return destinationWidth >= 0; }
+	// Buffer size after transform and scale, 0 without a buffer we know
+	std::pair<int32_t, int32_t> bufferSize() const;
+	// Part of the buffer the surface shows, after transform and scale
+	std::array<double, 4> viewportSource() const;
+	// What the buffer is scaled to, the viewport destination if there is one
+	std::pair<int32_t, int32_t> surfaceSize() const;
+};
+
+class Surface {
+public:
+	MCLASS(Surface);
+
+	constexpr const SurfaceState& getCurrent() const { return *current; }
+	constexpr wl_resource* getResource() const { return resource; }
+	constexpr VSurface getHandle() const { return handle; }
+	// Sends done to every callback that was committed and drops them, returns how many there were.
+	// Presentation feedback waits for a display
+	uint32_t frameDone(uint32_t msec);
+	// A display showed the contents with this serial, answers the callbacks and feedback of every
+	// content update up to it. Returns the frame callbacks answered
+	uint32_t presented(const Presented& frame, uint64_t serial);
+
+private:
+	friend class Compositor;
+	friend class Viewporter;
+	friend class Subcompositor;
+	friend class Subsurface;
+	friend class Presentation;
+	template <class, size_t> friend class mland::SlabPool;
+	Surface(Compositor* compositor, wl_resource* resource, SurfaceState* pending, SurfaceState* current);
+
+	static void destroy(wl_client* client, wl_resource* resource);
+	static void attach(wl_client* client, wl_resource* resource, wl_resource* buffer, int32_t x, int32_t y);
+	static void damage(wl_client* client, wl_resource* resource, int32_t x, int32_t y, int32_t width, int32_t height);
+	static void frame(wl_client* client, wl_resource* resource, uint32_t callback);
+	static void setOpaqueRegion(wl_client* client, wl_resource* resource, wl_resource* region);
+	static void setInputRegion(wl_client* client, wl_resource* resource, wl_resource* region);
+	static void commit(wl_client* client, wl_resource* resource);
+	static void setBufferTransform(wl_client* client, wl_resource* resource, int32_t transform);
+	static void setBufferScale(wl_client* client, wl_resource* resource, int32_t scale);
+	static void damageBuffer(wl_client* client, wl_resource* resource, int32_t x, int32_t y, int32_t width, int32_t height);
+	static void offset(wl_client* client, wl_resource* resource, int32_t x, int32_t y);
+
+	static constexpr struct wl_surface_interface WLSurfaceImplementation {
+		.destroy = destroy,
+		.attach = attach,
+		.damage = damage,
+		.frame = frame,
+		.set_opaque_region = setOpaqueRegion,
+		.set_input_region = setInputRegion,
+		.commit = commit,
+		.set_buffer_transform = setBufferTransform,
+		.set_buffer_scale = setBufferScale,
+		.damage_buffer = damageBuffer,
+		.offset = offset
+	};
+
+	static Surface* from(wl_resource* resource);
+	// Moves what from carries into to, a buffer to replaces without showing it goes back to the client
+	static void apply(SurfaceState& from, SurfaceState& to);
+	// Makes state current, then whatever the synchronized subsurfaces cached for it
+	void applyState(SurfaceState& state);
+	// The surface is gone, nothing it committed is going to be shown
+	void discardPresentations();
+	// What wp_viewport can only check once the state is applied, false and an error posted if the
+	// client broke it
+	bool checkViewport() const;
+
+	Compositor* compositor;
+	wl_resource* resource;
+	// Slot in the scene store, the renderer only ever sees this
+	VSurface handle{};
+	// What the last commit of a wl_shm buffer handed to the renderer
+	s_ptr<ShmContents> contents{};
+	SurfaceState* pending;
+	SurfaceState* current;
+	// wp_viewport of the surface, null without one
+	wl_resource* viewport{nullptr};
+	// wl_subsurface role, null for toplevels
+	Subsurface* subsurface{nullptr};
+	// The surface and its subsurfaces, bottom to top. place_above and place_below change the pending
+	// order, it lands when the state is applied
+	vec<Surface*> stack{};
+	vec<Surface*> pendingStack{};
+	bool stackChanged{false};
+	// Queued for Compositor::flatten with the next publish
+	bool treeDirty{false};
+	// Applied content updates with frame callbacks or wp_presentation feedback waiting for a display to
+	// show them, oldest first. The deque never moves them, the resource links point at the list heads
+	struct ContentUpdate {
+		uint64_t serial;
+		wl_list callbacks;
+		wl_list feedback;
+	};
+	std::deque<ContentUpdate> presentations{};
+	// Last time a display showed the surface
+	std::chrono::steady_clock::time_point lastPresented{};
+	wl_list link{};
+};
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <wayland-server-core.h>
+#include <viewporter-server-protocol.h>
+
+#include "wl_interface.h"
+#include "surface.h"
+#include "../common.h"
+
+namespace mland::interfaces {
+
+// wp_viewporter, crops and scales surfaces. The crop goes into the scene and the draw samples it
+// straight out of the buffer, so scaling costs nothing beyond the sampler filtering it
+class Viewporter final : public WLInterface {
+public:
+	MCLASS(Viewporter);
+	~Viewporter() override = default;
+
+private:
+	static void destroyViewporter(wl_client* client, wl_resource* resource);
+	static void getViewport(wl_client* client, wl_resource* resource, uint32_t id, wl_resource* surface);
+
+	static constexpr struct wp_viewporter_interface WLViewporterImplementation {
+		.destroy = destroyViewporter,
+		.get_viewport = getViewport
+	};
+
+	static void destroyViewport(wl_client* client, wl_resource* resource);
+	static void setSource(wl_client* client, wl_resource* resource, wl_fixed_t x, wl_fixed_t y, wl_fixed_t width,
+		wl_fixed_t height);
+	static void setDestination(wl_client* client, wl_resource* resource, int32_t width, int32_t height);
+
+	static constexpr struct wp_viewport_interface WLViewportImplementation {
+		.destroy = destroyViewport,
+		.set_source = setSource,
+		.set_destination = setDestination
+	};
+
+	friend Controller;
+	explicit Viewporter(wl_display* wlDisplay);
+	Viewporter(const Viewporter&) = delete;
+	Viewporter(Viewporter&&) = delete;
+
+	// Null and no_surface posted once the surface is gone
+	static Surface* surfaceFrom(wl_resource* viewport);
+	// Drops the crop and scale with the next commit
+	static void onViewportDestroy(wl_resource* resource);
+
+protected:
+	void bind(wl_client* client, uint32_t version, uint32_t id) override;
+};
+
+}
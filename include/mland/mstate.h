@@ -1,9 +1,40 @@
 #pragma once
 #include <atomic>
+#include <chrono>
+#include <mutex>
+#include "common.h"
+#include "snapshot.h"
+#include "vsurface.h"
 
 namespace mland {
+// A frame a display put on screen, reported to the Wayland thread for frame callbacks and wp_presentation
+struct Presented {
+	enum Kind : uint32_t {
+		// Bits of wp_presentation_feedback.kind
+		eVsync = 1 << 0,
+		eHwClock = 1 << 1,
+		eHwCompletion = 1 << 2
+	};
+	// Only compared and looked up on the Wayland thread, displays outlive the event loop
+	const interfaces::Output* output{nullptr};
+	// CLOCK_MONOTONIC like steady_clock, a predicted vblank when the display can't wait for presents
+	std::chrono::steady_clock::time_point time{};
+	// 0 if the refresh rate is unknown
+	std::chrono::nanoseconds refresh{0};
+	// Vblanks since the display started, counted from the timestamps
+	uint64_t sequence{0};
+	uint32_t kind{0};
+	// Every surface the frame showed and the serial of the contents it showed
+	vec<std::pair<VSurface, uint64_t>> surfaces{};
+};
+
 // Represents the state of the compositor
 struct MState {
 	std::atomic<uint32_t> windowCount{0};
+	// Published once per event loop iteration, displays pin it at frame start
+	SnapshotExchange<Scene> scene{};
+	// Appended by render threads, which then poke globals::presentedFd
+	std::mutex presentedMutex{};
+	vec<Presented> presented{};
 };
 }
@@ -0,0 +1,104 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+#include <span>
+#include "common.h"
+
+namespace mland {
+
+// Half open rectangle, x2 and y2 are one past the last pixel
+struct Box {
+	int32_t x1{0};
+	int32_t y1{0};
+	int32_t x2{0};
+	int32_t y2{0};
+
+	// Saturates instead of overflowing, clients happily send INT32_MAX sized damage
+	static constexpr Box fromSize(const int32_t x, const int32_t y, const int32_t width, const int32_t height) {
+		constexpr int64_t MAX = std::numeric_limits<int32_t>::max();
+		return {x, y, static_cast<int32_t>(std::min<int64_t>(int64_t{x} + std::max(width, 0), MAX)),
+			static_cast<int32_t>(std::min<int64_t>(int64_t{y} + std::max(height, 0), MAX))};
+	}
+	constexpr bool empty() const { return x1 >= x2 || y1 >= y2; }
+	constexpr int32_t width() const { return x2 - x1; }
+	constexpr int32_t height() const { return y2 - y1; }
+	constexpr uint64_t area() const {
+		return empty() ? 0 : static_cast<uint64_t>(int64_t{x2} - x1) * static_cast<uint64_t>(int64_t{y2} - y1);
+	}
+	constexpr bool operator==(const Box&) const = default;
+};
+
+// Set of pixels as y-x banded boxes, the representation pixman and X use. Boxes are sorted by
+// y1 then x1, boxes in one band share y1 and y2 and never touch, and vertically adjacent bands
+// with the same spans are merged, so equal regions have equal boxes.
+// Finding, comparing, emitting and translating bands runs on SSE2 or AVX2 kernels picked at
+// startup when the CPU has them. Merging the spans of two bands stays scalar, each step depends
+// on the one before.
+class BandedRegion {
+public:
+	MCLASS(BandedRegion);
+
+	enum class Overlap {
+		eOut,
+		eIn,
+		ePart
+	};
+
+	BandedRegion() = default;
+	explicit BandedRegion(const Box& box) { reset(box); }
+	// Scratch space isn't worth copying
+	BandedRegion(const BandedRegion& other) : rects(other.rects), ext(other.ext) {}
+	BandedRegion(BandedRegion&&) = default;
+	BandedRegion& operator=(const BandedRegion& other);
+	BandedRegion& operator=(BandedRegion&&) = default;
+
+	void clear();
+	void reset(const Box& box);
+	constexpr bool empty() const { return rects.empty(); }
+	constexpr uint32_t size() const { return rects.size32(); }
+	constexpr std::span<const Box> boxes() const { return rects; }
+	// Bounding box, empty when the region is
+	constexpr const Box& extents() const { return ext; }
+	uint64_t area() const;
+
+	void unite(const BandedRegion& other);
+	void unite(const Box& box);
+	void intersect(const BandedRegion& other);
+	void intersect(const Box& box);
+	void subtract(const BandedRegion& other);
+	void subtract(const Box& box);
+	void translate(int32_t dx, int32_t dy);
+
+	bool contains(int32_t x, int32_t y) const;
+	// Whether box is outside, fully inside or partly inside the region
+	Overlap overlaps(const Box& box) const;
+	bool operator==(const BandedRegion& other) const;
+
+	// Names the kernels in use, for the log
+	static cstr kernels();
+	// Switches every region to the kernels called name, scalar, sse2 or avx2. False if the CPU
+	// lacks them. Not thread safe, meant for benchmarks
+	static bool useKernels(std::string_view name);
+
+private:
+	enum class Op {
+		eUnion,
+		eIntersect,
+		eSubtract
+	};
+
+	// Combines a and b into rects, either may alias this
+	void combine(std::span<const Box> a, std::span<const Box> b, Op op);
+	void mergeSpans(std::span<const Box> a, std::span<const Box> b, Op op);
+	void appendBand(std::span<const Box> band, int32_t y1, int32_t y2, size_t& prevBand);
+	void updateExtents();
+
+	vec<Box> rects{};
+	Box ext{};
+	// Output of combine, swapped with rects so both keep their capacity
+	vec<Box> scratch{};
+	// Spans of the band being merged
+	vec<Box> spans{};
+};
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <atomic>
+#include <wayland-server-core.h>
+
+#include "common.h"
+#include "region.h"
+
+namespace mland {
+
+// Pixels of one committed wl_shm buffer as the renderer sees them. Created on the Wayland thread
+// by every commit, render threads copy straight out of the client pool between beginRead and
+// endRead. Once retired no new read can start and the buffer is released after the last one ends,
+// so a client never gets a buffer back while something still reads it. GPU copies out of imported
+// client memory hold a pin instead, which only keeps the pool mapped. Contents every device has
+// copied are released without waiting for the next commit, so clients get by with two buffers
+class ShmContents {
+public:
+	MCLASS(ShmContents);
+	// Commits a device texture can fall behind and still get away with uploading the damage
+	static constexpr uint32_t HISTORY = 4;
+	static constexpr uint32_t NO_COPIER = 64;
+
+	// Any thread. Every device that uploads contents claims a copier, NO_COPIER if all are taken.
+	// A device that shows up later misses contents released before it copied them
+	static uint32_t addCopier();
+	static void removeCopier(uint32_t copier);
+
+	// Null unless buffer is a wl_shm buffer. damage is in buffer coordinates, previous is the
+	// contents of the last commit of the same surface
+	static s_ptr<ShmContents> create(wl_resource* buffer, uint64_t serial, ShmContents* previous,
+		const BandedRegion& damage);
+	ShmContents(const ShmContents&) = delete;
+	ShmContents(ShmContents&&) = delete;
+	~ShmContents();
+
+	// Any thread. beginRead fails once retired, data is only valid in between
+	bool beginRead() const;
+	void endRead() const;
+	// Any thread. Like beginRead for reads that outlive the call, data stays mapped until unpin
+	// but the wl_shm_buffer may be gone, so the pages have to be pinned some other way
+	bool pin() const;
+	void unpin() const;
+	// Any thread. The copier is done with the client memory, for imports the copy has to be
+	// finished on the GPU. The buffer goes back once every copier got here and the pins are gone
+	void copied(uint32_t copier) const;
+	// Union of the damage of every commit after serial, false if that goes further back than the
+	// history or the buffer size or format changed since
+	bool damageSince(uint64_t serial, BandedRegion& damage) const;
+
+	// Wayland thread
+	void retire();
+	// Sends the release once retired or copied everywhere, and idle. True when nothing is left to do
+	bool tryRelease();
+
+	const uint8_t* const data;
+	const uint32_t format;
+	const int32_t width;
+	const int32_t height;
+	const int32_t stride;
+	const uint64_t serial;
+
+private:
+	static constexpr uint32_t RETIRED = 1u << 31;
+	// Every read holds a pin, the ones between beginRead and endRead count as CPU reads as well
+	static constexpr uint32_t PIN = 1;
+	static constexpr uint32_t CPU_READ = 1u << 16;
+	static constexpr uint32_t CPU_MASK = RETIRED - CPU_READ;
+
+	ShmContents(wl_resource* buffer, wl_shm_buffer* shm, uint64_t serial);
+	static void onBufferDestroy(wl_listener* listener, void* data);
+	bool acquire(uint32_t count) const;
+	bool copiedEverywhere() const;
+	// Wakes the compositor to call tryRelease
+	static void notify();
+	// Drops the buffer and the pool, reads have to be over
+	void detach(bool release);
+
+	// Pins, CPU reads and the retired bit
+	mutable std::atomic<uint32_t> access{0};
+	// One bit per copier done with the client memory
+	mutable std::atomic<uint64_t> copiedBy{0};
+	wl_resource* buffer;
+	wl_shm_buffer* shm;
+	// Our reference keeps the mapping in place, pool resizes wait until it is dropped
+	wl_shm_pool* pool;
+	wl_listener bufferDestroy{};
+	// False once a later commit of the same buffer took over releasing it
+	bool owner{true};
+	// Oldest first, the last entry is this commit
+	vec<std::pair<uint64_t, BandedRegion>> history{};
+};
+
+}
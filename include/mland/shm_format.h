@@ -0,0 +1,51 @@
+#pragma once
+#include <span>
+#include "common.h"
+#include "vulk.h"
+
+namespace mland {
+
+// The wl_shm formats we take and how they get into a texture. A device that samples the matching
+// Vulkan format gets the rows copied as they are, anything else is converted to B8G8R8A8 while
+// staging. The converters run on SSSE3 or AVX2 kernels picked at startup when the CPU has them
+class ShmFormat {
+public:
+	MCLASS(ShmFormat);
+	// Converts width pixels of one row to B8G8R8A8
+	using Convert = void (*)(const uint8_t* src, uint8_t* dst, uint32_t width);
+
+	enum class Conversion {
+		eNone,
+		eRgb888,
+		eBgr888,
+		eRgb565,
+		eArgb2101010,
+		eXrgb2101010,
+		eAbgr2101010,
+		eXbgr2101010
+	};
+
+	struct Info {
+		uint32_t shm;
+		// Bytes per pixel in the client buffer
+		uint32_t bytes;
+		bool alpha;
+		// Sampled as is when the device supports it, eUndefined if it never makes sense to
+		vk::Format native;
+		// eNone if every device samples native
+		Conversion conversion;
+	};
+
+	static std::span<const Info> all();
+	// Null for formats we don't advertise
+	static const Info* find(uint32_t shm);
+	// Null for Conversion::eNone
+	static Convert converter(const Info& info);
+	// Names the kernels in use, for the log
+	static cstr kernels();
+	// Makes converter hand out the kernels called name, scalar, ssse3 or avx2. False if the CPU
+	// lacks them. Not thread safe, meant for benchmarks
+	static bool useKernels(std::string_view name);
+};
+
+}
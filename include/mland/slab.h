@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include "common.h"
+
+namespace mland {
+
+// Fixed size object arena for the Wayland thread. Objects are carved out of chunks that are never
+// returned to the heap, so once the pool has grown to the working set creating and destroying
+// objects is a free list push/pop. Not thread safe.
+template <class T, size_t CHUNK = 64>
+class SlabPool {
+public:
+	MCLASS(SlabPool);
+	SlabPool() = default;
+	SlabPool(const SlabPool&) = delete;
+	SlabPool(SlabPool&&) = delete;
+	// Every object has to be destroyed before the pool
+	~SlabPool();
+
+	template <class... Args>
+	T* create(Args&&... args);
+	void destroy(T* object);
+	// Grows the pool so the next count creates don't allocate
+	void reserve(size_t count);
+
+	constexpr size_t size() const { return live; }
+	constexpr size_t capacity() const { return chunks.size() * CHUNK; }
+
+private:
+	union Slot {
+		Slot* next;
+		alignas(T) std::byte storage[sizeof(T)];
+	};
+	using Chunk = std::array<Slot, CHUNK>;
+
+	void grow();
+
+	vec<u_ptr<Chunk>> chunks{};
+	Slot* freeList{nullptr};
+	size_t live{0};
+};
+
+}
+
+#include "templates/slab.tcc"
@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <utility>
+#include "common.h"
+
+namespace mland {
+
+// Single writer, many readers handoff of immutable versioned values. The writer fills a slot no
+// reader holds and publishes it, readers pin the latest slot with one increment and a recheck.
+// Neither side ever waits for the other: with more readers than slots - 2 the writer just skips
+// publishing until a slot frees up.
+template <class T>
+class SnapshotExchange {
+	struct Slot {
+		std::atomic<uint32_t> readers{0};
+		uint64_t version{0};
+		T value{};
+	};
+
+public:
+	MCLASS(SnapshotExchange);
+
+	// Keeps a snapshot alive, cheap to hold for a whole frame
+	class Pin {
+	public:
+		MCLASS(Pin);
+		Pin() = default;
+		Pin(Pin&& other) noexcept : slot(std::exchange(other.slot, nullptr)) {}
+		Pin& operator=(Pin&& other) noexcept;
+		Pin(const Pin&) = delete;
+		~Pin() { reset(); }
+
+		void reset();
+		constexpr const T& operator*() const { return slot->value; }
+		constexpr const T* operator->() const { return &slot->value; }
+		constexpr uint64_t version() const { return slot ? slot->version : 0; }
+		explicit constexpr operator bool() const { return slot != nullptr; }
+
+	private:
+		friend SnapshotExchange;
+		explicit Pin(Slot* slot) : slot(slot) {}
+		Slot* slot{nullptr};
+	};
+
+	explicit SnapshotExchange(uint32_t slotCount = 8);
+	SnapshotExchange(const SnapshotExchange&) = delete;
+	SnapshotExchange(SnapshotExchange&&) = delete;
+
+	// Writer side, returns the slot to fill or null if every other slot is pinned. The slot
+	// still holds whatever was written to it last, so containers keep their capacity
+	T* beginWrite();
+	// Makes the slot from beginWrite the latest, returns its version
+	uint64_t publish();
+
+	// Reader side, the pin is empty until the first publish
+	Pin acquire() const;
+	uint64_t latestVersion() const;
+
+private:
+	std::unique_ptr<Slot[]> slots;
+	const uint32_t slotCount;
+	std::atomic<uint32_t> latest{0};
+	std::atomic<uint64_t> latestVersionValue{0};
+	// Only touched by the writer
+	uint32_t writing{0};
+	uint64_t version{0};
+};
+
+}
+
+#include "templates/snapshot.tcc"
@@ -0,0 +1,51 @@
+#pragma once
+#include <cassert>
+#include <new>
+
+namespace mland {
+
+	template <class T, size_t CHUNK>
+	SlabPool<T, CHUNK>::~SlabPool() {
+		assert(live == 0);
+	}
+
+	template <class T, size_t CHUNK>
+	template <class... Args>
+	T* SlabPool<T, CHUNK>::create(Args&&... args) {
+		if (freeList == nullptr)
+			grow();
+		Slot* slot = freeList;
+		freeList = slot->next;
+		T* object = ::new (static_cast<void*>(slot->storage)) T(std::forward<Args>(args)...);
+		live++;
+		return object;
+	}
+
+	template <class T, size_t CHUNK>
+	void SlabPool<T, CHUNK>::destroy(T* object) {
+		if (object == nullptr)
+			return;
+		object->~T();
+		auto* slot = reinterpret_cast<Slot*>(object);
+		slot->next = freeList;
+		freeList = slot;
+		live--;
+	}
+
+	template <class T, size_t CHUNK>
+	void SlabPool<T, CHUNK>::reserve(const size_t count) {
+		while (capacity() < count)
+			grow();
+	}
+
+	template <class T, size_t CHUNK>
+	void SlabPool<T, CHUNK>::grow() {
+		auto chunk = u_ptr<Chunk>(new Chunk);
+		// Lowest addresses get handed out first
+		for (size_t i = CHUNK; i-- > 0;) {
+			(*chunk)[i].next = freeList;
+			freeList = &(*chunk)[i];
+		}
+		chunks.push_back(std::move(chunk));
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <cassert>
+
+namespace mland {
+
+	template <class T>
+	typename SnapshotExchange<T>::Pin& SnapshotExchange<T>::Pin::operator=(Pin&& other) noexcept {
+		if (this != &other) {
+			reset();
+			slot = std::exchange(other.slot, nullptr);
+		}
+		return *this;
+	}
+
+	template <class T>
+	void SnapshotExchange<T>::Pin::reset() {
+		if (slot != nullptr)
+			slot->readers.fetch_sub(1);
+		slot = nullptr;
+	}
+
+	template <class T>
+	SnapshotExchange<T>::SnapshotExchange(const uint32_t slotCount) :
+	slots(new Slot[slotCount]), slotCount(slotCount) {
+		assert(slotCount >= 3);
+	}
+
+	template <class T>
+	T* SnapshotExchange<T>::beginWrite() {
+		const auto current = latest.load();
+		for (uint32_t i = 1; i < slotCount; i++) {
+			const auto index = (current + i) % slotCount;
+			// A reader that pins after this check sees that the slot isn't latest and lets go
+			if (slots[index].readers.load() == 0) {
+				writing = index;
+				return &slots[index].value;
+			}
+		}
+		return nullptr;
+	}
+
+	template <class T>
+	uint64_t SnapshotExchange<T>::publish() {
+		slots[writing].version = ++version;
+		latest.store(writing);
+		latestVersionValue.store(version);
+		return version;
+	}
+
+	template <class T>
+	typename SnapshotExchange<T>::Pin SnapshotExchange<T>::acquire() const {
+		while (true) {
+			const auto index = latest.load();
+			auto& slot = slots[index];
+			slot.readers.fetch_add(1);
+			// The writer never fills the latest slot, so if it is still latest it is complete
+			if (latest.load() == index) {
+				Pin pin(&slot);
+				if (slot.version == 0)
+					pin.reset();
+				return pin;
+			}
+			slot.readers.fetch_sub(1);
+		}
+	}
+
+	template <class T>
+	uint64_t SnapshotExchange<T>::latestVersion() const {
+		return latestVersionValue.load();
+	}
+}
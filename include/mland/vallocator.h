@@ -0,0 +1,152 @@
+#pragma once
+#include <array>
+#include <mutex>
+#include "common.h"
+#include "vulk.h"
+
+namespace mland {
+
+// A range of device memory handed out by VAllocator, it goes back to the allocator when destroyed
+class VAllocation {
+public:
+	MCLASS(VAllocation);
+
+	VAllocation() = default;
+	VAllocation(VAllocation&& other) noexcept;
+	VAllocation& operator=(VAllocation&& other) noexcept;
+	VAllocation(const VAllocation&) = delete;
+	VAllocation& operator=(const VAllocation&) = delete;
+	~VAllocation();
+
+	void reset();
+
+	constexpr vk::DeviceMemory getMemory() const { return memory; }
+	constexpr vk::DeviceSize getOffset() const { return offset; }
+	constexpr vk::DeviceSize getSize() const { return size; }
+	constexpr uint32_t getMemoryType() const { return memoryType; }
+	// Null if the memory is not host visible
+	constexpr void* getMapped() const { return mapped; }
+	bool isDedicated() const;
+	explicit constexpr operator bool() const { return allocator != nullptr; }
+
+private:
+	friend class VAllocator;
+	struct Block;
+	void adopt(VAllocation&& other) noexcept;
+
+	VAllocator* allocator{nullptr};
+	Block* block{nullptr};
+	uint32_t slot{0};
+	uint32_t memoryType{0};
+	vk::DeviceMemory memory{};
+	vk::DeviceSize offset{0};
+	vk::DeviceSize size{0};
+	void* mapped{nullptr};
+};
+
+// Per device sub-allocator, small resources are packed into size class pools and big ones get
+// their own vkAllocateMemory
+class VAllocator {
+public:
+	MCLASS(VAllocator);
+
+	// Size classes go from 4KiB to 4MiB, anything bigger (swapchain sized images) is dedicated
+	static constexpr vk::DeviceSize MIN_CLASS_SIZE = 4 * 1024;
+	static constexpr uint32_t CLASS_COUNT = 11;
+	static constexpr vk::DeviceSize MAX_CLASS_SIZE = MIN_CLASS_SIZE << (CLASS_COUNT - 1);
+	static constexpr vk::DeviceSize BLOCK_SIZE = 32 * 1024 * 1024;
+
+	struct Request {
+		vk::MemoryRequirements requirements{};
+		vk::MemoryPropertyFlags required{};
+		vk::MemoryPropertyFlags preferred{};
+		// Memory types with any of these are never picked
+		vk::MemoryPropertyFlags excluded{};
+		// Buffers and linear images can't share a page with optimal images (bufferImageGranularity)
+		bool linear{false};
+		// Set when the driver prefers or requires a dedicated allocation
+		bool dedicated{false};
+		vk::Image dedicatedImage{};
+		vk::Buffer dedicatedBuffer{};
+	};
+
+	struct Stats {
+		uint64_t blockCount{0};
+		uint64_t dedicatedCount{0};
+		uint64_t allocationCount{0};
+		vk::DeviceSize blockBytes{0};
+		vk::DeviceSize dedicatedBytes{0};
+		vk::DeviceSize usedBytes{0};
+		constexpr vk::DeviceSize reservedBytes() const { return blockBytes + dedicatedBytes; }
+	};
+
+	VAllocator(const vkr::Device& dev, const vkr::PhysicalDevice& pDev, const str& name);
+	VAllocator(const VAllocator&) = delete;
+	VAllocator(VAllocator&&) = delete;
+	~VAllocator();
+
+	opt<VAllocation> allocate(const Request& request);
+	// Queries the requirements of the resource, allocates and binds it
+	opt<VAllocation> allocate(const vkr::Image& image, vk::MemoryPropertyFlags required,
+		vk::MemoryPropertyFlags preferred = {}, bool linear = false, vk::MemoryPropertyFlags excluded = {});
+	opt<VAllocation> allocate(const vkr::Buffer& buffer, vk::MemoryPropertyFlags required,
+		vk::MemoryPropertyFlags preferred = {});
+
+	// The first type of typeBits with the required and preferred flags, then with just the required ones
+	opt<uint32_t> findMemoryType(uint32_t typeBits, vk::MemoryPropertyFlags required,
+		vk::MemoryPropertyFlags preferred = {}, vk::MemoryPropertyFlags excluded = {}) const;
+	constexpr vk::MemoryPropertyFlags getFlags(const VAllocation& allocation) const {
+		return memProps.memoryTypes[allocation.getMemoryType()].propertyFlags;
+	}
+	constexpr const vk::PhysicalDeviceMemoryProperties& getMemoryProperties() const { return memProps; }
+
+	Stats getStats() const;
+	Stats getHeapStats(uint32_t heapIndex) const;
+
+	// Frees every empty block, including the one per pool freeing keeps around
+	void trim();
+
+private:
+	friend class VAllocation;
+	using Block = VAllocation::Block;
+	struct Pool {
+		vec<u_ptr<Block>> blocks{};
+	};
+
+	static constexpr uint32_t sizeClass(vk::DeviceSize size);
+	constexpr uint32_t poolIndex(uint32_t memoryType, bool linear, uint32_t sizeClass) const {
+		return (memoryType * 2 + linear) * CLASS_COUNT + sizeClass;
+	}
+
+	opt<VAllocation> allocateDedicated(const Request& request, uint32_t memoryType);
+	opt<VAllocation> allocateFromPool(const Request& request, uint32_t memoryType);
+	opt<u_ptr<Block>> createBlock(uint32_t memoryType, vk::DeviceSize size, const void* pNext);
+	void free(VAllocation& allocation);
+	void account(uint32_t memoryType, int64_t blocks, int64_t dedicated, int64_t allocations,
+		int64_t blockBytes, int64_t dedicatedBytes, int64_t usedBytes);
+
+	const vkr::Device& dev;
+	const str name;
+	vk::PhysicalDeviceMemoryProperties memProps{};
+	uint32_t maxAllocations{0};
+	vk::DeviceSize blockSize{BLOCK_SIZE};
+
+	mutable std::mutex mutex{};
+	vec<Pool> pools{};
+	map<Block*, u_ptr<Block>> dedicatedBlocks{};
+	std::array<Stats, VK_MAX_MEMORY_HEAPS> heapStats{};
+	Stats totalStats{};
+};
+
+struct VAllocation::Block {
+	vkr::DeviceMemory memory{nullptr};
+	void* mapped{nullptr};
+	uint32_t memoryType{0};
+	uint32_t pool{0};
+	vk::DeviceSize slotSize{0};
+	vk::DeviceSize size{0};
+	vec<uint32_t> freeSlots{};
+	uint32_t used{0};
+	bool dedicated{false};
+};
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "common.h"
+#include "vulk.h"
+#include "vallocator.h"
+namespace mland {
+
+struct VBuffer {
+	MCLASS(VBuffer);
+	vk::DeviceSize size{0};
+	vkr::Buffer buffer{nullptr};
+	VAllocation memory{};
+
+	// Null unless the buffer was created in host visible memory
+	constexpr void* getMapped() const { return memory.getMapped(); }
+
+	~VBuffer(){
+		buffer.clear();
+		memory.reset();
+	}
+};
+
+}
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <deque>
+#include <functional>
+#include <span>
 #include <unordered_set>
 #include "common.h"
 #include "vulk.h"
+#include "vallocator.h"
+#include "vtexture.h"
+#include "vbuffer.h"
 
 namespace mland {
 class Backend::VDevice {
@@ -13,22 +19,66 @@ protected:
 	struct Queue {
 		std::mutex mutex{};
 		vkr::Queue queue;
-		Queue(vkr::Queue&& queue) : queue(std::move(queue)) {}
+		// Signaled by every submission, the value is the number of submissions so far
+		vkr::Semaphore timeline;
+		std::atomic<uint64_t> submitted{0};
+		// One time command buffers for oneShot, recycled once their timeline value is reached
+		std::mutex poolMutex{};
+		vkr::CommandPool pool{nullptr};
+		std::deque<std::pair<vkr::CommandBuffer, uint64_t>> recorded{};
+		Queue(vkr::Queue&& queue, vkr::Semaphore&& timeline) : queue(std::move(queue)), timeline(std::move(timeline)) {}
 	};
 
 	VInstance* parent{nullptr};
 	vkr::PhysicalDevice pDev{nullptr};
 	vkr::Device dev{nullptr};
+	u_ptr<VAllocator> allocator{};
 	map<uint32_t, Queue> queues{};
+	u_ptr<VTexturePool> texturePool{};
+	u_ptr<VResidency> residency{};
+	u_ptr<VTextureTable> textureTable{};
+	u_ptr<VDmabufImporter> dmabuf{};
+	u_ptr<VSurfaceDevice> surfaces{};
+	vec<str> enabledExtensions{};
+	// VK_KHR_present_id and VK_KHR_present_wait, displays timestamp their frames as they hit the screen
+	bool presentWait{false};
+	// Set by the first call that got VK_ERROR_DEVICE_LOST or failed to read a timeline
+	mutable std::atomic<bool> lost{false};
 	vkr::ShaderModule vertShader{nullptr};
 	vkr::ShaderModule fragShader{nullptr};
+	vkr::ShaderModule ycbcrShader{nullptr};
 	friend class VInstance;
 	friend class VDisplay;
+	friend class VTextureTable;
+	friend class VSurfaceDevice;
+	friend class VDmabufImporter;
+
+	// Timeline value the queue finished, the maximum once the device is lost
+	uint64_t completed(uint32_t queueFamilyIndex) const;
+	void markLost(vk::Result res) const;
 
 	static constexpr vk::Fence nullFence{nullptr};
+	static constexpr uint32_t MAX_SIGNAL_SEMAPHORES = 8;
 public:
 	MCLASS(VDevice);
 
+	// A point on the graphics and transfer timelines, work submitted before it is done once reached
+	struct Ticket {
+		uint64_t graphics{0};
+		uint64_t transfer{0};
+		constexpr Ticket merge(const Ticket& other) const {
+			return {std::max(graphics, other.graphics), std::max(transfer, other.transfer)};
+		}
+	};
+
+	struct HeapBudget {
+		vk::DeviceSize budget{0};
+		vk::DeviceSize usage{0};
+		bool deviceLocal{false};
+	};
+
+	using Recorder = std::function<void(const vkr::CommandBuffer& cmd)>;
+
 	friend std::ostream& operator<<(std::ostream& os, const Id_t& i) { return os << static_cast<int64_t>(i); }
 
 	const Id_t id{};
@@ -38,20 +88,54 @@ public:
 	const bool good;
 	VDevice(const VDevice&) = delete;
 	VDevice(VDevice&&) = delete;
-	virtual ~VDevice() = default;
+	virtual ~VDevice();
 
 	vkr::CommandPool createCommandPool(uint32_t queueFamilyIndex);
-	vkr::CommandBuffer createCommandBuffer(const vkr::CommandPool& pool);
+	vkr::CommandBuffer createCommandBuffer(const vkr::CommandPool& pool,
+		vk::CommandBufferLevel level = vk::CommandBufferLevel::ePrimary);
 
-	void submit(uint32_t queueFamilyIndex, const vk::SubmitInfo& submitInfo, const vk::Fence& fence = nullFence);
+	// waitValues are only needed when waiting on timeline semaphores, one per wait semaphore
+	Ticket submit(uint32_t queueFamilyIndex, const vk::SubmitInfo& submitInfo, const vk::Fence& fence = nullFence,
+		std::span<const uint64_t> waitValues = {});
 	vk::Result present(uint32_t queueFamilyIndex, const vk::PresentInfoKHR& presentInfo);
 
 	void waitIdle(uint32_t queueFamilyIndex);
 
+	Ticket lastSubmitted() const;
+	// Everything counts as reached once the device is lost, see isLost
+	bool reached(const Ticket& ticket) const;
+	bool wait(const Ticket& ticket, uint64_t timeout = std::numeric_limits<uint64_t>::max()) const;
+	// Records and submits a one time command buffer that waits for after on the GPU, and for the
+	// binary semaphores, whose payloads the submission consumes
+	Ticket oneShot(uint32_t queueFamilyIndex, const Recorder& record, const Ticket& after = {},
+		std::span<const vk::Semaphore> binaryWaits = {});
+
+	// Displays stop rendering once it is, nothing submitted finishes anymore
+	bool isLost() const { return lost.load(std::memory_order_relaxed); }
+	bool hasExtension(str_view extension) const;
+	// Uses VK_EXT_memory_budget when available, otherwise 80% of each heap and our own usage
+	vec<HeapBudget> getMemoryBudget() const;
+	vk::Semaphore getTimeline(const uint32_t queueFamilyIndex) const { return *queues.at(queueFamilyIndex).timeline; }
+
 	opt<vkr::ShaderModule> createShaderModule(const VShader& shader);
 
+	// Defined in vtexture.cpp
+	opt<u_ptr<VTexture>> createTexture(const VTexture::Info& info);
+	opt<u_ptr<VBuffer>> createBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags memory);
+	constexpr VAllocator& getAllocator() const { return *allocator; }
+	constexpr VTexturePool& getTexturePool() const { return *texturePool; }
+	constexpr VResidency& getResidency() const { return *residency; }
+	constexpr VSurfaceDevice& getSurfaces() const { return *surfaces; }
+	constexpr VTextureTable& getTextureTable() const { return *textureTable; }
+	// Null unless the device can import dmabufs
+	constexpr VDmabufImporter* getDmabuf() const { return dmabuf.get(); }
+	// Copies src into a new texture living in the given memory, src has to be in eShaderReadOnlyOptimal
+	opt<std::pair<u_ptr<VTexture>, Ticket>> migrateTexture(const VTexture& src, vk::MemoryPropertyFlags memory,
+		const Ticket& after, vk::MemoryPropertyFlags excluded = {});
+
 	constexpr const vkr::ShaderModule& getVert() const { return vertShader; }
 	constexpr const vkr::ShaderModule& getFrag() const { return fragShader; }
+	constexpr const vkr::ShaderModule& getYcbcrFrag() const { return ycbcrShader; }
 
 	virtual vec<s_ptr<VDisplay>> updateMonitors() = 0;
 };
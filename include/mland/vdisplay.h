@@ -1,11 +1,17 @@
 #pragma once
 #include <condition_variable>
+#include <deque>
+#include <latch>
 #include <semaphore>
 #include <thread>
 #include <stack>
 #include "common.h"
 #include "vdevice.h"
 #include "vulk.h"
+#include "vtexture.h"
+#include "vrendergraph.h"
+#include "vdrawlist.h"
+#include "mstate.h"
 #include "interfaces/output.h"
 
 namespace mland {
@@ -70,15 +76,68 @@ protected:
 		vk::Image image;
 		vkr::ImageView view{nullptr};
 		vkr::Framebuffer framebuffer{nullptr};
-		vkr::CommandBuffer graphicsCmd;
-		vkr::CommandBuffer backgroundCmd;
 		Image(const VDisplay& us, const vk::Image& img);
 		Image(Image&&) = default;
 		~Image();
 	};
+	// Same as VTextureTable::NO_SLOT, instances without one are drawn with their flat color
+	static constexpr uint32_t NO_TEXTURE = std::numeric_limits<uint32_t>::max();
+	// One visible box of a surface, the vertex shader expands it into a quad, see vertex.vert
+	struct Instance {
+		// Normalized device coordinates, offset and size
+		std::array<float, 4> rect{};
+		// Part of the buffer the box shows, offset and size
+		std::array<float, 4> uv{};
+		std::array<float, 4> color{};
+		// 0 is the front
+		float depth{1.0f};
+		uint32_t texture{NO_TEXTURE};
+		// wl_output_transform of the buffer, which corner of uv each corner of rect samples
+		uint32_t transform{0};
+	};
+	static constexpr vk::DeviceSize MIN_INSTANCES = 64;
+	// Pipeline variants, the value is the shading mode specialization constant of fragment.frag
+	enum Variant : uint32_t {
+		// Textured, no blending, writes depth
+		eOpaque,
+		// Textured and blended, wl_shm and dmabuf contents are premultiplied
+		ePremultiplied,
+		// Textured and blended, for contents with straight alpha
+		eStraight,
+		// The instance color, no blending, writes depth
+		eSolid,
+		// Multi-planar video through ycbcr.frag, no blending, writes depth. Not in pipelines, every
+		// Y'CbCr conversion of the device has its own, see VDmabufImporter::Conversion
+		eYcbcr
+	};
+	// Variants of fragment.frag
+	static constexpr uint32_t VARIANTS = 4;
+	// Consecutive instances drawn with the same pipeline
+	struct Batch {
+		Variant variant;
+		uint32_t first;
+		uint32_t count;
+		// eYcbcr only, the conversion and the set of the one import the batch samples
+		uint32_t conversion{0};
+		vk::DescriptorSet set{};
+	};
+	// Always supported as a depth attachment, plenty of steps for stacking windows
+	static constexpr vk::Format DEPTH_FORMAT = vk::Format::eD16Unorm;
+	// Instances each recorder has to get before drawFrame records in parallel, below that waking
+	// the threads costs more than recording everything inline
+	static constexpr uint32_t PARALLEL_INSTANCES = 256;
+	static constexpr uint32_t MAX_RECORDERS = 4;
+	// Secondary command buffer with its own pool, so threads never share one. All but the first
+	// have a thread that lives as long as the display, see recorderMain
+	struct Recorder {
+		vkr::CommandPool pool{nullptr};
+		vkr::CommandBuffer cmd{nullptr};
+		// Its chunk of the frame
+		vec<Batch> batches{};
+		std::thread thread{};
+	};
 	struct SyncObjs {
 		vkr::Semaphore imageAvailable;
-		vkr::Semaphore backgroundFinished;
 		vkr::Semaphore renderFinished;
 		vkr::Fence presented;
 		SyncObjs(const VDisplay& us);
@@ -98,9 +157,50 @@ protected:
 
 	uint64_t framesRendered{0};
 	std::chrono::time_point<std::chrono::steady_clock> nextFrameTime{};
+	// Scene pinned for the frame being built, never blocks the Wayland thread
+	SnapshotExchange<Scene>::Pin scene{};
+	// Visible part of the scene, rebuilt every frame
+	VDrawList drawList{};
+	// Persistently mapped, rewritten every frame: opaque instances front to back grouped by
+	// variant, then the translucent ones back to front
+	u_ptr<VBuffer> instances{};
+	vec<Batch> batches{};
+	uint32_t instanceCount{0};
+	// Created the first time a frame has enough instances to split, reset by the next frame
+	vec<Recorder> recorders{};
+	// Wakes the recorder threads for a frame, the generation goes up once per split frame
+	std::mutex recordMutex{};
+	std::condition_variable recordCond{};
+	uint64_t recordGeneration{0};
+	uint32_t recordCount{0};
+	bool recordStop{false};
+	std::latch* recordDone{nullptr};
+	vk::CommandBufferInheritanceInfo recordInheritance{};
+	// Of VSurfaceDevice::beginFrame, 0 if the frame samples no surface
+	uint64_t surfaceFrame{0};
+	uint64_t drawnPixels{0};
+	uint64_t culledPixels{0};
+	// Surfaces the frame being built shows and the serial of the contents it samples, see reportPresented
+	vec<std::pair<VSurface, uint64_t>> shown{};
+	// VK_KHR_present_id of the last present
+	uint64_t presentId{0};
+	// Presented frames the present waiter hasn't seen on screen yet, see presentWaiterMain. The
+	// mutex also guards the vblank the next one is predicted from
+	struct PendingPresent {
+		uint64_t id;
+		vec<std::pair<VSurface, uint64_t>> shown;
+	};
+	std::mutex presentMutex{};
+	std::condition_variable presentCond{};
+	std::deque<PendingPresent> pendingPresents{};
+	bool presentBusy{false};
+	bool presentStop{false};
+	std::thread presentWaiter{};
+	uint64_t vblankSequence{0};
+	std::chrono::time_point<std::chrono::steady_clock> lastVblank{};
 	// Assets
-	vkr::Image background{nullptr};
-	vkr::Semaphore backgroundSemaphore{nullptr};
+	// Wallpaper matching extent and format, copied into every image before drawing
+	u_ptr<VTexture> background{};
 	// Rendering data
 	vec<vk::DisplayModePropertiesKHR> displayModes{};
 	vk::DisplayPropertiesKHR displayProps{};
@@ -110,21 +210,29 @@ protected:
 	vkr::DisplayModeKHR mode{nullptr};
 	vk::SurfaceKHR surface{nullptr};
 	vkr::SwapchainKHR swapchain{nullptr};
+	// Acquire, present and the present waiter's waits, the swapchain is externally synchronized
+	std::mutex swapchainMutex{};
 	vk::Rect2D displayRegion{};
 	std::mutex extentMutex{};
 	vk::Extent2D extent{};
 
 	vk::Format format{};
 	vec<Image> images{};
+	// Shared by the images, frames never overlap on the GPU
+	u_ptr<VTexture> depth{};
 	vkr::PipelineLayout pipelineLayout{nullptr};
 	vkr::RenderPass renderPass{nullptr};
-	vkr::Pipeline pipeline{nullptr};
+	// Indexed by Variant
+	std::array<vkr::Pipeline, VARIANTS> pipelines{nullptr, nullptr, nullptr, nullptr};
+	// Indexed by Y'CbCr conversion, the layouts add the set of the import to the texture table
+	vec<vkr::PipelineLayout> ycbcrLayouts{};
+	vec<vkr::Pipeline> ycbcrPipelines{};
 	// Sync objects
 	vkr::Fence renderFinishedFence{nullptr};
 	std::thread thread{};
 	vec<SyncObjs> syncObjs{};
-	vkr::CommandPool graphicsPool{nullptr};
-	vkr::CommandPool transferPool{nullptr};
+	// Derives the barriers and semaphores between the passes of a frame
+	u_ptr<VRenderGraph> graph{};
 	std::stack<uint32_t> freeSyncObjs{};
 	map<uint32_t, uint32_t> busySyncObjs{};
 
@@ -138,14 +246,19 @@ protected:
 
 	void createEverything();
 
-	void createCommandPools();
+	void createRenderGraph();
 	virtual void createSurface() = 0;
 	void createSwapchain();
 	void createSwapchain(vk::PresentModeKHR presentMode, vk::SurfaceFormatKHR);
 	void createPipelineLayout();
 	void createRenderPass();
 	void createRenderPipeline();
+	// conversion only matters for eYcbcr
+	vkr::Pipeline createPipeline(Variant variant, uint32_t conversion = 0) const;
+	void createDepthBuffer();
 	void createFrameBuffers();
+	// Returns true if the background appeared or disappeared
+	bool loadBackground();
 
 	// Defined in interfaces::Output
 	void updateOutput();
@@ -159,9 +272,32 @@ protected:
 	void cleanup();
 
 	// Within renderLoop
-	void transferBackground(const SyncObjs& sync, const Image& img);
-	void drawFrame(const SyncObjs& sync, const Image& img);
+	void buildFrame(const SyncObjs& sync, const Image& img);
+	void writeInstances();
+	Variant getVariant(uint32_t n, uint32_t slot, bool ycbcr) const;
+	void transferBackground(const vkr::CommandBuffer& cmd, const Image& img) const;
+	void drawFrame(const vkr::CommandBuffer& cmd, const Image& img);
+	uint32_t getRecorderCount() const;
+	// Records the chunk of recorder r into its secondary command buffer
+	void recordChunk(uint32_t r);
+	void recorderMain(uint32_t r, uint64_t generation);
+	void stopRecorders();
+	void recordBatches(const vkr::CommandBuffer& cmd, std::span<const Batch> range) const;
 	bool present(const SyncObjs& sync, const uint32_t& imageIndex);
+	// Hands the frame that was just presented to the Wayland thread once it is on screen
+	void reportPresented();
+	void presentWaiterMain();
+	// Waits until the present waiter is done with every frame of the swapchain
+	void drainPresents();
+	void stopPresentWaiter();
+	// Zero while the refresh rate is unknown
+	std::chrono::nanoseconds refreshPeriod() const;
+	// Next vblank after time, predicted from the last one and the refresh rate. Needs presentMutex
+	std::chrono::time_point<std::chrono::steady_clock> predictVblank(
+		std::chrono::time_point<std::chrono::steady_clock> time) const;
+	// onScreen is when the frame was seen on screen, predicted when empty
+	void postPresented(opt<std::chrono::time_point<std::chrono::steady_clock>> onScreen,
+		vec<std::pair<VSurface, uint64_t>>&& surfaces);
 
 	uint32_t getSyncObj();
 
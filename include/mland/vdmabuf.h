@@ -0,0 +1,82 @@
+#pragma once
+#include <limits>
+#include <sys/types.h>
+#include "common.h"
+#include "vulk.h"
+#include "vdevice.h"
+#include "vtexture.h"
+#include "dmabuf_attributes.h"
+
+namespace mland {
+
+// Imports client dmabufs as sampled images through VK_EXT_image_drm_format_modifier. Only exists
+// on devices with every extension that takes, see VDevice::getDmabuf. Multi-planar video formats
+// are offered when the device has samplerYcbcrConversion, they are sampled as they are and turned
+// into RGB by the sampler
+class VDmabufImporter {
+public:
+	MCLASS(VDmabufImporter);
+	static constexpr uint32_t NO_CONVERSION = std::numeric_limits<uint32_t>::max();
+	// Descriptor sets for Y'CbCr imports, more than this many at once fail to import
+	static constexpr uint32_t MAX_YCBCR = 256;
+	// A DRM format and modifier the device can sample from an imported dmabuf
+	struct Format {
+		uint32_t fourcc;
+		uint64_t modifier;
+		vk::Format format;
+		uint32_t planes;
+		// Index into getConversions, NO_CONVERSION for RGB formats
+		uint32_t conversion;
+	};
+	// How a multi-planar format is sampled. Y'CbCr samplers have to be immutable and can't be
+	// indexed dynamically, so they stay out of VTextureTable. Every format gets its own set layout
+	// and with it its own pipeline, every import a set of its own, see VTexture::ycbcr
+	struct Conversion {
+		vk::Format format{};
+		vkr::SamplerYcbcrConversion conversion{nullptr};
+		vkr::Sampler sampler{nullptr};
+		vkr::DescriptorSetLayout layout{nullptr};
+	};
+
+	static const vec<cstr>& extensions();
+	static bool supported(const VDevice& vDev);
+
+	explicit VDmabufImporter(VDevice& vDev);
+	VDmabufImporter(const VDmabufImporter&) = delete;
+	VDmabufImporter(VDmabufImporter&&) = delete;
+
+	constexpr const vec<Format>& getFormats() const { return formats; }
+	// Render node of the device, 0 without VK_EXT_physical_device_drm
+	constexpr dev_t getDevice() const { return device; }
+	// Queue family images owned by the client are in, see ownership barriers
+	constexpr uint32_t getForeignFamily() const { return foreignFamily; }
+	const Format* find(uint32_t fourcc, uint64_t modifier) const;
+	constexpr const vec<Conversion>& getConversions() const { return conversions; }
+	// The image starts out owned by the foreign family. Only VSurfaceDevice imports and drops the
+	// textures, under its mutex, which is what keeps the descriptor pool synchronized
+	opt<u_ptr<VTexture>> import(const DmabufAttributes& attributes) const;
+	// Binary semaphore signaled once the writes the client queued on the buffer are done, imported
+	// from its implicit fences. Empty without DMA_BUF_IOCTL_EXPORT_SYNC_FILE or
+	// VK_KHR_external_semaphore_fd, the acquire barrier relies on the client having waited then
+	opt<vkr::Semaphore> importFence(const DmabufAttributes& attributes) const;
+
+private:
+	void queryFormat(uint32_t fourcc, vk::Format format);
+	// Index of the new conversion, NO_CONVERSION if the driver refused
+	uint32_t createConversion(vk::Format format, vk::FormatFeatureFlags features);
+	bool createPool();
+
+	VDevice& vDev;
+	vec<Format> formats{};
+	vec<Conversion> conversions{};
+	bool ycbcr{false};
+	// Combined image sampler descriptors one Y'CbCr import takes, drivers may want one per plane
+	uint32_t ycbcrDescriptors{1};
+	vkr::DescriptorPool pool{nullptr};
+	dev_t device{0};
+	uint32_t foreignFamily{VK_QUEUE_FAMILY_EXTERNAL};
+	// Cleared by the first export the kernel doesn't know
+	mutable bool syncFiles{false};
+};
+
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "common.h"
+#include "vulk.h"
+#include "region.h"
+#include "vsurface.h"
+
+namespace mland {
+
+// What one display draws of the scene this frame. Built front to back: whatever the opaque parts
+// of the surfaces above already cover is cut away, fully covered surfaces are dropped and the
+// rest keep the boxes still visible as scissors
+class VDrawList {
+public:
+	MCLASS(VDrawList);
+	// Surfaces whose visible part splits into more boxes than this are drawn with the bounds,
+	// back to front drawing paints over the extra pixels anyway
+	static constexpr uint32_t MAX_CLIPS = 8;
+
+	struct Stats {
+		// Surfaces on this display
+		uint32_t surfaces{0};
+		uint32_t drawn{0};
+		uint32_t culled{0};
+		uint32_t clipped{0};
+		uint64_t drawnPixels{0};
+		// Pixels of surfaces on this display nobody has to sample
+		uint64_t culledPixels{0};
+	};
+
+	VDrawList() = default;
+	VDrawList(const VDrawList&) = delete;
+
+	// output is the part of the scene the display shows, boxes end up relative to its offset
+	void build(const Scene& scene, const vk::Rect2D& output);
+	void clear();
+
+	constexpr uint32_t size() const { return sceneIndex.size32(); }
+	constexpr bool empty() const { return sceneIndex.empty(); }
+	// Index into the scene arrays of the nth entry, front to back
+	constexpr uint32_t getSceneIndex(const uint32_t n) const { return sceneIndex[n]; }
+	constexpr bool isOpaque(const uint32_t n) const { return opaque[n]; }
+	// Framebuffer space bounds of the surface and the scissors it is drawn with
+	constexpr const vk::Rect2D& getBounds(const uint32_t n) const { return bounds[n]; }
+	std::span<const vk::Rect2D> getClips(uint32_t n) const;
+	// Whether opaque surfaces cover the whole output, nothing below them is visible then
+	constexpr bool coversOutput() const { return covers; }
+	constexpr const Stats& getStats() const { return stats; }
+
+private:
+	vec<uint32_t> sceneIndex{};
+	vec<bool> opaque{};
+	vec<vk::Rect2D> bounds{};
+	vec<uint32_t> firstClip{};
+	vec<uint32_t> clipCount{};
+	vec<vk::Rect2D> clips{};
+	bool covers{false};
+	Stats stats{};
+	// Opaque area of everything above the current surface and its visible part, reused every frame
+	BandedRegion covered{};
+	BandedRegion visible{};
+};
+
+}
@@ -13,6 +13,7 @@ public:
 	virtual bool deviceGood(const vkr::PhysicalDevice& pDev) = 0;
 
 	constexpr VDevice& getDevice(const VDevice::Id_t& id) { return *devices.at(id); }
+	constexpr const map<VDevice::Id_t, u_ptr<VDevice>>& getDevices() const { return devices; }
 	constexpr vkr::Instance& getInstance() { return instance; }
 	constexpr Backend* getBackend() { return backend; }
 
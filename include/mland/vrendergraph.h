@@ -0,0 +1,173 @@
+#pragma once
+#include <deque>
+#include "common.h"
+#include "vulk.h"
+#include "vdevice.h"
+
+namespace mland {
+
+// Per frame list of passes that declare which images they touch and how. The graph derives the
+// barriers, queue family transfers and semaphore waits between them, merges neighbouring passes
+// on the same queue into one submission and records everything on its own command buffers.
+// Rebuilt every frame from the owning thread, the vectors behind it are reused.
+class VRenderGraph {
+public:
+	MCLASS(VRenderGraph);
+
+	using ResourceId = uint32_t;
+	using PassId = uint32_t;
+
+	// What a pass needs from a queue, transfer passes end up on the transfer queue only when
+	// that doesn't cost an ownership transfer
+	enum class QueueType {
+		eGraphics,
+		eTransfer
+	};
+
+	struct ImageDesc {
+		vk::Image image{};
+		vk::ImageSubresourceRange range{
+			.aspectMask = vk::ImageAspectFlagBits::eColor,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1
+		};
+		vk::ImageLayout initialLayout{vk::ImageLayout::eUndefined};
+		// Left as the last pass left it when eUndefined
+		vk::ImageLayout finalLayout{vk::ImageLayout::eUndefined};
+		// Created with concurrent sharing, exclusive images are expected to be owned by the
+		// graphics queue when the frame starts
+		bool concurrent{false};
+		// Binary semaphore waited for before the first access (swapchain acquire)
+		vk::Semaphore acquire{};
+		// Binary semaphore signaled once every access is done (present)
+		vk::Semaphore release{};
+	};
+
+	struct Access {
+		ResourceId resource{0};
+		vk::PipelineStageFlags stage{};
+		vk::AccessFlags access{};
+		// eUndefined means the pass doesn't care about the contents (a render pass that clears)
+		vk::ImageLayout layout{vk::ImageLayout::eUndefined};
+		// Layout the pass leaves the image in when it transitions it itself (render pass finalLayout)
+		vk::ImageLayout finalLayout{vk::ImageLayout::eUndefined};
+	};
+
+	explicit VRenderGraph(VDevice& vDev);
+	VRenderGraph(const VRenderGraph&) = delete;
+	VRenderGraph(VRenderGraph&&) = delete;
+	~VRenderGraph();
+
+	// Drops the passes and resources of the previous frame
+	void reset();
+	ResourceId import(const ImageDesc& desc);
+	PassId addPass(cstr name, QueueType type, std::initializer_list<Access> accesses, VDevice::Recorder&& record);
+	// Graphics work of this frame waits for ticket at stage, for work submitted outside the graph
+	void waitFor(const VDevice::Ticket& ticket, vk::PipelineStageFlags stage);
+	// Records and submits every pass, fence is signaled by the last submission
+	VDevice::Ticket execute(vk::Fence fence = nullptr);
+
+	struct Stats {
+		uint64_t passes{0};
+		uint64_t submits{0};
+		uint64_t barriers{0};
+		uint64_t semaphoreWaits{0};
+	};
+	constexpr const Stats& getStats() const { return stats; }
+
+private:
+	static constexpr vk::AccessFlags WRITE_ACCESS =
+		vk::AccessFlagBits::eShaderWrite |
+		vk::AccessFlagBits::eColorAttachmentWrite |
+		vk::AccessFlagBits::eDepthStencilAttachmentWrite |
+		vk::AccessFlagBits::eTransferWrite |
+		vk::AccessFlagBits::eHostWrite |
+		vk::AccessFlagBits::eMemoryWrite;
+
+	// Barriers recorded right before or right after a pass
+	struct Barriers {
+		vk::PipelineStageFlags srcStages{};
+		vk::PipelineStageFlags dstStages{};
+		vk::MemoryBarrier memory{};
+		vec<vk::ImageMemoryBarrier> images{};
+		void clear();
+		bool empty() const;
+		void record(const vkr::CommandBuffer& cmd) const;
+	};
+
+	struct Pass {
+		cstr name{nullptr};
+		uint32_t slot{0};
+		vec<Access> accesses{};
+		VDevice::Recorder record{};
+		Barriers pre{};
+		Barriers post{};
+		// Passes on the other queue this one has to wait for, and at which stage
+		vec<std::pair<PassId, vk::PipelineStageFlags>> dependencies{};
+		vec<std::pair<vk::Semaphore, vk::PipelineStageFlags>> waits{};
+		vec<vk::Semaphore> signals{};
+		uint32_t batch{0};
+	};
+
+	// Where a resource stands while the passes are compiled in order
+	struct State {
+		vk::ImageLayout layout{};
+		uint32_t owner{VK_QUEUE_FAMILY_IGNORED};
+		int64_t lastWrite{-1};
+		vk::PipelineStageFlags writeStages{};
+		vk::AccessFlags writeAccess{};
+		// Accesses the last write was already made visible to
+		vk::PipelineStageFlags visibleStages{};
+		vk::AccessFlags visibleAccess{};
+		// Reads since the last write, per queue slot
+		std::array<int64_t, 2> lastRead{-1, -1};
+		std::array<vk::PipelineStageFlags, 2> readStages{};
+		bool acquired{false};
+	};
+
+	// Consecutive passes on one queue, one command buffer and one submission
+	struct Batch {
+		uint32_t slot{0};
+		PassId first{0};
+		PassId end{0};
+		uint64_t value{0};
+	};
+
+	struct Slot {
+		uint32_t family{0};
+		vkr::CommandPool pool{nullptr};
+		// Command buffers in flight with the timeline value that retires them
+		std::deque<std::pair<vkr::CommandBuffer, uint64_t>> recorded{};
+	};
+
+	uint32_t place(QueueType type, std::initializer_list<Access> accesses) const;
+	void compile(PassId id);
+	void finish();
+	vkr::CommandBuffer takeCommandBuffer(Slot& slot);
+
+	VDevice& vDev;
+	std::array<Slot, 2> slots{};
+	uint32_t slotCount{1};
+
+	// Only the first passCount/resourceCount entries belong to the current frame
+	vec<Pass> passes{};
+	uint32_t passCount{0};
+	vec<ImageDesc> resources{};
+	vec<State> states{};
+	uint32_t resourceCount{0};
+	vec<Batch> batches{};
+	// Scratch space for building submissions
+	vec<vk::Semaphore> waits{};
+	vec<vk::PipelineStageFlags> waitStages{};
+	vec<uint64_t> waitValues{};
+	vec<vk::Semaphore> signals{};
+	VDevice::Ticket lastTicket{};
+	// From waitFor, cleared by reset
+	VDevice::Ticket external{};
+	vk::PipelineStageFlags externalStages{};
+	Stats stats{};
+};
+
+}
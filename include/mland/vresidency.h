@@ -0,0 +1,68 @@
+#pragma once
+#include <chrono>
+#include <mutex>
+#include "common.h"
+#include "vulk.h"
+#include "vdevice.h"
+
+namespace mland {
+
+// Keeps device local usage under the memory budget by evicting the memory of things that are not
+// shown on any VDisplay
+class VResidency {
+public:
+	MCLASS(VResidency);
+	using clock = std::chrono::steady_clock;
+
+	// Implemented by the owners of evictable device local memory
+	class Resident {
+	public:
+		virtual ~Resident() = default;
+		// Device local bytes evict() would free
+		virtual vk::DeviceSize residentBytes() const = 0;
+		// Last time this was shown on any VDisplay, displays refresh it every frame they show it
+		virtual clock::time_point lastVisible() const = 0;
+		// Moves out of device local memory, either to host visible memory or by dropping the
+		// contents until they are needed again. Returns false if that isn't possible right now
+		virtual bool evict() = 0;
+	};
+
+	struct Stats {
+		uint64_t evictions{0};
+		vk::DeviceSize evictedBytes{0};
+		vk::DeviceSize budget{0};
+		vk::DeviceSize usage{0};
+	};
+
+	// Evicting starts above HIGH_WATERMARK percent of the budget and goes down to LOW_WATERMARK
+	static constexpr vk::DeviceSize HIGH_WATERMARK = 90;
+	static constexpr vk::DeviceSize LOW_WATERMARK = 75;
+	// Things hidden for less than this are probably just being switched away from for a moment
+	static constexpr std::chrono::milliseconds MIN_HIDDEN{2000};
+	static constexpr std::chrono::milliseconds UPDATE_INTERVAL{500};
+
+	VResidency(VDevice& vDev);
+	VResidency(const VResidency&) = delete;
+	VResidency(VResidency&&) = delete;
+
+	void track(Resident* resident);
+	void untrack(Resident* resident);
+
+	// Evicts hidden residents, least recently visible first, when over the budget. Called by the
+	// render threads every frame, does something once per UPDATE_INTERVAL. Returns the number of evictions
+	uint32_t update();
+	// Whether bytes can be brought back into device local memory without going over the budget
+	bool canPromote(vk::DeviceSize bytes) const;
+	Stats getStats() const;
+
+private:
+	std::pair<vk::DeviceSize, vk::DeviceSize> deviceLocalBudget() const;
+
+	VDevice& vDev;
+	mutable std::mutex mutex{};
+	set<Resident*> residents{};
+	clock::time_point lastUpdate{};
+	Stats stats{};
+};
+
+}
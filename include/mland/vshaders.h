@@ -9,4 +9,5 @@ struct VShader {
 
 extern const VShader VERT_SHADER;
 extern const VShader FRAG_SHADER;
+extern const VShader YCBCR_FRAG_SHADER;
 }
@@ -1,9 +1,395 @@
 #pragma once
+#include <array>
+#include <atomic>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <span>
 #include "common.h"
 #include "vdevice.h"
 #include "vulk.h"
 #include "vtexture.h"
+#include "vtexture_table.h"
+#include "snapshot.h"
+#include "region.h"
+#include "shm_contents.h"
+#include "shm_format.h"
+#include "dmabuf_attributes.h"
+#include "vdmabuf.h"
+#include "vresidency.h"
 
 namespace mland {
 
-}
\ No newline at end of file
+// Stable handle to a surface in the scene store, lookups with a stale handle fail
+class VSurface {
+public:
+	MCLASS(VSurface);
+	constexpr VSurface() = default;
+
+	constexpr uint32_t index() const { return idx; }
+	constexpr uint32_t generation() const { return gen; }
+	explicit constexpr operator bool() const { return idx != INVALID; }
+	constexpr bool operator==(const VSurface&) const = default;
+
+private:
+	friend VSurfaceHost;
+	static constexpr uint32_t INVALID = std::numeric_limits<uint32_t>::max();
+	constexpr VSurface(const uint32_t index, const uint32_t generation) : idx(index), gen(generation) {}
+	uint32_t idx{INVALID};
+	uint32_t gen{0};
+};
+
+// Immutable per frame view of the scene. Only mapped surfaces, back to front, one array per
+// field so culling and draw list building are linear scans over what they actually read
+struct Scene {
+	enum Flags : uint32_t {
+		// The whole surface is opaque, not just the opaque rect
+		eOpaque = 1 << 0,
+		eAlpha = 1 << 1
+	};
+
+	vec<VSurface> surfaces{};
+	// Output coordinates
+	vec<vk::Rect2D> geometry{};
+	// Part of the buffer the geometry shows, normalized offset and size in buffer space. All of it
+	// unless the client set a wp_viewport source
+	vec<std::array<float, 4>> crop{};
+	// wl_output_transform the client rendered the buffer with, the surface shows it undone
+	vec<uint32_t> transform{};
+	// Largest opaque rectangle in output coordinates, empty if there is none
+	vec<vk::Rect2D> opaque{};
+	vec<uint32_t> flags{};
+	// Bumped on every commit that changes the contents
+	vec<uint64_t> serial{};
+	// Null for surfaces without a wl_shm buffer. Only the Wayland thread drops these, render
+	// threads read them through the pinned snapshot and never keep a reference
+	vec<s_ptr<const ShmContents>> contents{};
+	// Null for surfaces without a dmabuf. These only hold fds, any thread may drop them
+	vec<s_ptr<const DmabufAttributes>> dmabufs{};
+	// Host generation of every index, live or not. Destroying a surface moves it on
+	vec<uint32_t> generations{};
+
+	constexpr uint32_t size() const { return surfaces.size32(); }
+	void clear();
+	// Where a normalized rect of the surface lies in a buffer rendered with the transform, offset
+	// and size both ways
+	static constexpr std::array<float, 4> toBuffer(const std::array<float, 4>& rect, const uint32_t transform) {
+		const auto [x, y, w, h] = rect;
+		switch (transform) {
+		case 1: return {y, 1.0f - x - w, h, w};
+		case 2: return {1.0f - x - w, 1.0f - y - h, w, h};
+		case 3: return {1.0f - y - h, x, h, w};
+		case 4: return {1.0f - x - w, y, w, h};
+		case 5: return {y, x, h, w};
+		case 6: return {x, 1.0f - y - h, w, h};
+		case 7: return {1.0f - y - h, 1.0f - x - w, h, w};
+		default: return rect;
+		}
+	}
+};
+
+// Wayland thread side of the scene. Fields live in parallel arrays indexed by the handle, holes
+// are recycled through a free list and z order is a separate index list
+class VSurfaceHost {
+public:
+	MCLASS(VSurfaceHost);
+	VSurfaceHost() = default;
+	VSurfaceHost(const VSurfaceHost&) = delete;
+	VSurfaceHost(VSurfaceHost&&) = delete;
+
+	// New surfaces go on top, as toplevels
+	VSurface create();
+	void destroy(VSurface surface);
+	bool valid(VSurface surface) const;
+
+	void setOffset(VSurface surface, const vk::Offset2D& offset);
+	void setSize(VSurface surface, const vk::Extent2D& size);
+	void setCrop(VSurface surface, const std::array<float, 4>& crop);
+	// wl_output_transform of the buffer
+	void setTransform(VSurface surface, uint32_t transform);
+	// Relative to the surface geometry
+	void setOpaque(VSurface surface, const vk::Rect2D& opaque);
+	void setMapped(VSurface surface, bool mapped);
+	void setAlpha(VSurface surface, bool alpha);
+	void contentChanged(VSurface surface);
+	void setContents(VSurface surface, s_ptr<const ShmContents> contents);
+	void setDmabuf(VSurface surface, s_ptr<const DmabufAttributes> dmabuf);
+	void raise(VSurface surface);
+	// Only toplevels are in the z order, subsurfaces are drawn through the tree of theirs. Back on
+	// top when it turns into one again
+	void setToplevel(VSurface surface, bool toplevel);
+	// The toplevel and its subsurfaces back to front, kept until the next call for the same tree so
+	// publishing never walks the subsurfaces
+	void setTree(VSurface root, std::span<const VSurface> tree);
+	uint64_t getSerial(VSurface surface) const;
+
+	// Fills a snapshot slot and returns how many surfaces it holds, nothing if every slot was pinned
+	opt<uint32_t> publish(SnapshotExchange<Scene>& exchange) const;
+
+private:
+	enum HostFlags : uint32_t {
+		eMapped = 1 << 16
+	};
+
+	vec<uint32_t> generation{};
+	vec<vk::Rect2D> geometry{};
+	vec<std::array<float, 4>> crop{};
+	vec<uint32_t> transform{};
+	vec<vk::Rect2D> opaque{};
+	vec<uint32_t> flags{};
+	vec<uint64_t> serial{};
+	vec<s_ptr<const ShmContents>> contents{};
+	vec<s_ptr<const DmabufAttributes>> dmabufs{};
+	vec<uint32_t> freeIndices{};
+	// Toplevels back to front
+	vec<uint32_t> order{};
+	// Flattened tree of each toplevel, empty for subsurfaces
+	vec<vec<uint32_t>> trees{};
+};
+
+// Per device GPU state of the scene surfaces, indexed like the host arrays. Shared by the
+// displays of the device
+class VSurfaceDevice {
+public:
+	MCLASS(VSurfaceDevice);
+	explicit VSurfaceDevice(VDevice& vDev);
+	VSurfaceDevice(const VSurfaceDevice&) = delete;
+	VSurfaceDevice(VSurfaceDevice&&) = delete;
+	~VSurfaceDevice();
+
+	// Drops the textures of destroyed surfaces. Hidden ones keep theirs, their wl_shm buffers may
+	// already be back with the client. Only the newest version seen
+	// drops anything, displays can be a scene apart
+	void sync(const Scene& scene, uint64_t version);
+	// Null if the surface has no texture on this device yet
+	VTexture* getTexture(VSurface surface) const;
+	// Serial of the contents the texture holds
+	uint64_t getSerial(VSurface surface) const;
+	void setTexture(VSurface surface, u_ptr<VTexture>&& texture, uint64_t serial);
+	// Slot of the texture in the device texture table, VTextureTable::NO_SLOT without one
+	uint32_t getSlot(VSurface surface) const;
+	// Multi-planar imports are sampled through their own set instead of the texture table
+	struct Ycbcr {
+		// Index into VDmabufImporter::getConversions
+		uint32_t conversion;
+		vk::DescriptorSet set;
+	};
+	// Nothing unless the surface shows such an import
+	opt<Ycbcr> getYcbcr(VSurface surface) const;
+
+	struct UploadStats {
+		uint64_t uploads{0};
+		// Uploads that copied the whole buffer instead of the damage
+		uint64_t fullUploads{0};
+		// Uploads the GPU copied straight out of the client pool, without staging
+		uint64_t hostImports{0};
+		uint64_t bytes{0};
+	};
+	// Copies what changed in the wl_shm contents of the scene into the textures on the transfer
+	// queue, large damage straight from the client pool when VK_EXT_external_memory_host allows it.
+	// Formats the device can't sample are converted while staging, see ShmFormat. Contents are
+	// marked copied once the client memory isn't needed, right after staging or when the timeline
+	// passes the copies out of an import. Newly committed dmabufs are imported or taken from the
+	// cache and acquired from the client on the graphics queue. Sampling any of them has to wait
+	// for the returned ticket
+	VDevice::Ticket upload(const Scene& scene);
+	UploadStats getUploadStats(VSurface surface) const;
+	UploadStats getUploadTotals() const;
+
+	std::mutex& getMutex() const { return mutex; }
+	// Displays call beginFrame under getMutex once they picked what the frame samples, and endFrame
+	// with its ticket once it is submitted. Replaced dmabufs go back to the client only after every
+	// frame that may have picked them
+	uint64_t beginFrame();
+	void endFrame(uint64_t frame, const VDevice::Ticket& ticket);
+	// Displays stamp every surface their draw list shows, under getMutex. Textures hidden for a while
+	// are what VResidency moves out of device local memory
+	void markVisible(VSurface surface, VResidency::clock::time_point time);
+
+private:
+	// Staging memory is reused once the copies out of it are done
+	static constexpr vk::DeviceSize MIN_STAGING = 1 << 20;
+	static constexpr uint32_t MAX_STAGING = 4;
+	static constexpr uint32_t STAGING_ALIGNMENT = 4;
+	// Host imports only take formats of this size that need no conversion, so every copy offset
+	// out of them stays four byte aligned
+	static constexpr uint32_t BYTES_PER_PIXEL = 4;
+	// Importing pins every page of the range, below this copying the rows is cheaper
+	static constexpr vk::DeviceSize MIN_IMPORT = 256 << 10;
+	// How one wl_shm format gets into a texture on this device
+	struct ShmUpload {
+		const ShmFormat::Info* info;
+		vk::Format format;
+		// Null when the rows are copied as they are
+		ShmFormat::Convert convert;
+		uint32_t texelBytes;
+	};
+	// A surface upload planned before the staging buffer is known
+	struct PendingUpload {
+		const ShmUpload* format;
+		uint32_t sceneIndex;
+		uint32_t firstBox;
+		uint32_t boxCount;
+		// Needs a new texture, nothing to keep
+		bool fresh;
+		bool full;
+		// Index into importing, NO_IMPORT when the rows go through staging
+		uint32_t import;
+	};
+	static constexpr uint32_t NO_IMPORT = std::numeric_limits<uint32_t>::max();
+	// Client pages imported as host memory, pinned until the copies out of them are done
+	struct HostImport {
+		vkr::DeviceMemory memory{nullptr};
+		vkr::Buffer buffer{nullptr};
+		// Where the buffer starts in the client pool
+		const uint8_t* base{nullptr};
+		const ShmContents* contents{nullptr};
+		VDevice::Ticket ticket{};
+	};
+	// A dmabuf imported on this device, shared by every surface showing the same wl_buffer
+	struct Import {
+		// Null if the import failed, the surface is drawn without contents then
+		u_ptr<VTexture> texture{};
+		uint32_t slot{VTextureTable::NO_SLOT};
+		uint32_t conversion{VDmabufImporter::NO_CONVERSION};
+		s_ptr<const DmabufAttributes> attributes{};
+		// Owned by the graphics family, otherwise by the client
+		bool acquired{false};
+		// Acquired at least once, the layout is only known after that
+		bool transitioned{false};
+		// Upload that last queued a barrier for the image
+		uint64_t queued{0};
+		// Holds a pin on the attributes from the first frame showing it until it is handed back
+		bool pinned{false};
+	};
+	// A dmabuf no surface shows anymore, still owned by us
+	struct Replaced {
+		uint64_t id;
+		// Frames up to this one may have picked it before it was replaced
+		uint64_t after;
+		// Covers those frames once they ended
+		VDevice::Ticket ticket;
+	};
+	// A texture and texture table slot no surface uses anymore
+	struct Retired {
+		u_ptr<VTexture> texture;
+		uint32_t slot;
+		// Frames up to this one may have picked it before it was dropped
+		uint64_t after;
+		// Covers those frames once they ended
+		VDevice::Ticket ticket;
+	};
+	// The texture of one surface as VResidency sees it. Written under our mutex, read by the residency
+	// without it
+	class Residence : public VResidency::Resident {
+	public:
+		Residence(VSurfaceDevice& owner, const uint32_t index) : owner(owner), index(index) {}
+		vk::DeviceSize residentBytes() const override { return bytes.load(std::memory_order_relaxed); }
+		VResidency::clock::time_point lastVisible() const override { return visible.load(std::memory_order_relaxed); }
+		// Moves the texture to host visible memory, it keeps taking uploads and being sampled there
+		bool evict() override { return owner.evict(index); }
+
+		VSurfaceDevice& owner;
+		const uint32_t index;
+		// Device local bytes of the texture, 0 without one or once evicted
+		std::atomic<vk::DeviceSize> bytes{0};
+		std::atomic<VResidency::clock::time_point> visible{};
+	};
+	// Image an upload writes and its range of copies
+	struct UploadTarget {
+		vk::Buffer source;
+		vk::Image image;
+		bool fresh;
+		uint32_t firstCopy;
+		uint32_t copyCount;
+	};
+
+	// Null for formats we don't take
+	const ShmUpload* findUpload(uint32_t shmFormat) const;
+	// The device already holds a later surface at the index, or later contents of this one
+	bool behind(VSurface surface, uint64_t serial) const;
+	void grow(uint32_t index);
+	void drop(uint32_t index);
+	bool evict(uint32_t index);
+	// Copies the texture into memory and swaps it in, frames sample the copy once lastUpload passes it
+	bool migrate(uint32_t index, vk::MemoryPropertyFlags memory, vk::MemoryPropertyFlags excluded = {});
+	// Where the allocator put the texture, its info only holds what was asked for
+	bool deviceLocal(const VTexture& texture) const;
+	// Refreshes what the residence of the index reports
+	void settle(uint32_t index);
+	// Points the surface at the import of the dmabuf, importing it the first time it shows up
+	void showDmabuf(VSurface surface, const s_ptr<const DmabufAttributes>& dmabuf, uint64_t serial);
+	// Queues the ownership barriers handing the image between the client and us
+	void acquireImport(Import& import);
+	void releaseImport(Import& import);
+	// Hands back replaced imports no frame samples anymore
+	void releaseReplaced();
+	// Lets the compositor release dmabufs whose release barriers ran, or all of them after waiting
+	void unpinReleased(bool wait);
+	// Frees the texture and slot behind every frame that may have picked them, see freeRetired
+	void retire(u_ptr<VTexture>&& texture, uint32_t slot);
+	// Hands retired textures to the pool once the frames that may sample them were submitted
+	void freeRetired();
+	// Destroys imports whose wl_buffer is gone once no surface shows them
+	void evictImports();
+	u_ptr<VBuffer> acquireStaging(vk::DeviceSize size);
+	// Rows first to last of contents, which has to be pinned. Null buffer if the driver refused
+	HostImport importHost(const ShmContents& contents, int32_t first, int32_t last) const;
+	// Marks the contents of finished imports copied and unpins them, or all of them after waiting
+	void retireImports(bool wait);
+
+	VDevice& vDev;
+	mutable std::mutex mutex{};
+	// Claimed by the first upload, devices without displays don't hold buffers back
+	uint32_t copier{ShmContents::NO_COPIER};
+	bool copierClaimed{false};
+	// Version of the newest scene any display synced with
+	uint64_t newestScene{0};
+	vec<ShmUpload> shmUploads{};
+	vec<uint32_t> generation{};
+	vec<u_ptr<VTexture>> textures{};
+	vec<uint64_t> serial{};
+	vec<uint32_t> slots{};
+	// Import the surface shows instead of its own texture, 0 for none
+	vec<uint64_t> showing{};
+	vec<UploadStats> uploadStats{};
+	// Indexed like the rest, never moves what is tracked
+	std::deque<Residence> residences{};
+	UploadStats totals{};
+	std::deque<std::pair<u_ptr<VBuffer>, VDevice::Ticket>> staging{};
+	VDevice::Ticket lastUpload{};
+	// 0 without VK_EXT_external_memory_host or if the pages of a pool can't be imported on their own
+	vk::DeviceSize importAlignment{0};
+	std::deque<HostImport> imports{};
+	// By DmabufAttributes::id
+	map<uint64_t, Import> dmabufs{};
+	// Evicted imports frames may still sample
+	std::deque<std::pair<u_ptr<VTexture>, VDevice::Ticket>> graveyard{};
+	std::deque<Replaced> replaced{};
+	// Released by this upload, their pins go once the release barriers ran
+	vec<s_ptr<const DmabufAttributes>> handingBack{};
+	std::deque<std::pair<s_ptr<const DmabufAttributes>, VDevice::Ticket>> unpinning{};
+	// Oldest first, so after only goes up
+	std::deque<Retired> retired{};
+	// Frames between beginFrame and endFrame
+	vec<uint64_t> recording{};
+	uint64_t frames{0};
+	uint64_t uploadCount{0};
+	// Scratch for upload
+	BandedRegion damage{};
+	vec<PendingUpload> pending{};
+	vec<HostImport> importing{};
+	vec<Box> boxes{};
+	vec<vk::BufferImageCopy> copies{};
+	vec<UploadTarget> targets{};
+	vec<vk::ImageMemoryBarrier> barriers{};
+	// Ownership barriers, recorded as two commands so releases come first
+	vec<vk::ImageMemoryBarrier> releases{};
+	vec<vk::ImageMemoryBarrier> acquires{};
+	// Implicit fences of the acquired dmabufs, the acquires wait for them
+	vec<vkr::Semaphore> acquireFences{};
+	// Waited on by submitted acquires, destroyed once those are done
+	std::deque<std::pair<vkr::Semaphore, VDevice::Ticket>> consumedFences{};
+};
+
+}
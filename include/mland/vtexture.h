@@ -1,17 +1,40 @@
 #pragma once
 #include "common.h"
 #include "vulk.h"
+#include "vallocator.h"
 namespace mland {
 
 struct VTexture {
 	MCLASS(VTexture);
-	vkr::DeviceMemory memory;
-	vkr::Image image;
+	struct Info {
+		vk::Format format{};
+		vk::Extent2D extent{};
+		vk::ImageUsageFlags usage{};
+		vk::ImageAspectFlags aspect{vk::ImageAspectFlagBits::eColor};
+		vk::ImageTiling tiling{vk::ImageTiling::eOptimal};
+		vk::MemoryPropertyFlags memory{vk::MemoryPropertyFlagBits::eDeviceLocal};
+		// Memory types with any of these are never picked, the allocator takes the first match of memory
+		vk::MemoryPropertyFlags excludedMemory{};
+		// Accessed from both the graphics and the transfer queue
+		bool shared{false};
+	};
+	Info info{};
+	vkr::Image image{nullptr};
+	vkr::ImageView view{nullptr};
+	VAllocation memory{};
+	// Set instead of memory for images on client memory, e.g. imported dmabufs
+	vkr::DeviceMemory imported{nullptr};
+	// Imports of multi-planar formats are sampled through this instead of the texture table, see
+	// VDmabufImporter::Conversion
+	vkr::DescriptorSet ycbcr{nullptr};
 
 	~VTexture(){
+		ycbcr.clear();
+		view.clear();
 		image.clear();
-		memory.clear();
+		imported.clear();
+		memory.reset();
 	}
 };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include "common.h"
+#include "vulk.h"
+#include "vdevice.h"
+#include "vtexture.h"
+
+namespace mland {
+
+// Per device cache of released textures, clients recreate same sized buffers all the time so
+// most acquires can be served without touching the allocator or the driver
+class VTexturePool {
+public:
+	MCLASS(VTexturePool);
+
+	struct Stats {
+		uint64_t hits{0};
+		uint64_t misses{0};
+		uint64_t evictions{0};
+		uint64_t cachedCount{0};
+		vk::DeviceSize cachedBytes{0};
+	};
+
+	VTexturePool(VDevice& vDev, vk::DeviceSize budget);
+	VTexturePool(const VTexturePool&) = delete;
+	VTexturePool(VTexturePool&&) = delete;
+	~VTexturePool();
+
+	// Returns an idle cached texture with the exact same info or creates a new one
+	opt<u_ptr<VTexture>> acquire(const VTexture::Info& info);
+	// The texture becomes reusable once the device reaches lastUse
+	void release(u_ptr<VTexture>&& texture, const VDevice::Ticket& lastUse);
+
+	void setBudget(vk::DeviceSize budget);
+	// Drops every cached texture the device is done with
+	void clear();
+	Stats getStats() const;
+
+private:
+	struct Key {
+		vk::Format format;
+		vk::Extent2D extent;
+		vk::ImageUsageFlags usage;
+		vk::ImageAspectFlags aspect;
+		vk::ImageTiling tiling;
+		vk::MemoryPropertyFlags memory;
+		vk::MemoryPropertyFlags excludedMemory;
+		bool shared;
+		Key(const VTexture::Info& info);
+		bool operator==(const Key& other) const = default;
+	};
+	struct KeyHash {
+		size_t operator()(const Key& key) const noexcept;
+	};
+	struct Entry {
+		u_ptr<VTexture> texture;
+		VDevice::Ticket lastUse;
+		Key key;
+	};
+	using Lru = std::list<Entry>;
+
+	void evict();
+	void erase(Lru::iterator it);
+
+	VDevice& vDev;
+	vk::DeviceSize budget;
+	mutable std::mutex mutex{};
+	// Most recently released first
+	Lru lru{};
+	std::unordered_map<Key, vec<Lru::iterator>, KeyHash> buckets{};
+	Stats stats{};
+};
+
+}
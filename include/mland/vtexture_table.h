@@ -0,0 +1,58 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include "common.h"
+#include "vulk.h"
+#include "vdevice.h"
+#include "vtexture.h"
+
+namespace mland {
+
+// One descriptor set per device holding every surface texture, indexed by the shaders with the
+// slot the texture got when it was added. The set is bound once per pass and written with
+// update after bind, so windows coming and going never touch the pool or rebind anything
+class VTextureTable {
+public:
+	MCLASS(VTextureTable);
+	static constexpr uint32_t NO_SLOT = std::numeric_limits<uint32_t>::max();
+	static constexpr uint32_t MAX_SLOTS = 4096;
+	// Bindings in the set, see fragment.frag
+	static constexpr uint32_t SAMPLER_BINDING = 0;
+	static constexpr uint32_t TEXTURES_BINDING = 1;
+
+	// Vulkan 1.2 features the table needs, chained into device creation
+	static bool supported(const vk::PhysicalDeviceVulkan12Features& features);
+	static void enable(vk::PhysicalDeviceVulkan12Features& features);
+
+	explicit VTextureTable(VDevice& vDev);
+	VTextureTable(const VTextureTable&) = delete;
+	VTextureTable(VTextureTable&&) = delete;
+	~VTextureTable();
+
+	// texture has to stay alive and in eShaderReadOnlyOptimal until the slot is removed
+	uint32_t add(const VTexture& texture);
+	// The slot is reused once the device reaches lastUse
+	void remove(uint32_t slot, const VDevice::Ticket& lastUse);
+
+	constexpr const vkr::DescriptorSetLayout& getLayout() const { return layout; }
+	constexpr vk::DescriptorSet getSet() const { return *set; }
+	constexpr uint32_t getCapacity() const { return capacity; }
+
+	const bool good{false};
+
+private:
+	VDevice& vDev;
+	uint32_t capacity{0};
+	vkr::Sampler sampler{nullptr};
+	vkr::DescriptorSetLayout layout{nullptr};
+	vkr::DescriptorPool pool{nullptr};
+	vkr::DescriptorSet set{nullptr};
+
+	std::mutex mutex{};
+	vec<uint32_t> freeSlots{};
+	// Removed slots the GPU may still read
+	std::deque<std::pair<uint32_t, VDevice::Ticket>> retired{};
+	uint32_t nextSlot{0};
+};
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <span>
+#include "common.h"
+#include "vulk.h"
+#include "vdevice.h"
+
+namespace mland {
+
+// The wallpaper is decoded once per source file and output size into a GPU ready cache file,
+// every later load maps that file and uploads it as is
+class Wallpaper {
+public:
+	MCLASS(Wallpaper);
+	Wallpaper() = delete;
+
+	// Returns a texture in eTransferSrcOptimal with exactly extent and format, or nothing if no
+	// wallpaper is configured or it can't be loaded
+	static opt<u_ptr<VTexture>> load(VDevice& vDev, vk::Extent2D extent, vk::Format format);
+
+private:
+	struct Header {
+		std::array<char, 8> magic;
+		uint64_t sourceHash;
+		uint32_t width;
+		uint32_t height;
+		uint32_t format;
+		uint32_t rowPitch;
+	};
+	static constexpr std::array<char, 8> MAGIC{'M', 'L', 'W', 'A', 'L', 'L', '0', '1'};
+
+	// Read only file mapping
+	class Mapping {
+	public:
+		MCLASS(Mapping);
+		static opt<Mapping> open(const str& path);
+		Mapping(Mapping&& other) noexcept;
+		Mapping(const Mapping&) = delete;
+		~Mapping();
+		constexpr std::span<const uint8_t> bytes() const { return {data, size}; }
+	private:
+		Mapping(const uint8_t* data, size_t size) : data(data), size(size) {}
+		const uint8_t* data{nullptr};
+		size_t size{0};
+	};
+
+	static uint64_t hash(std::span<const uint8_t> bytes);
+	static str cachePath(uint64_t sourceHash, vk::Extent2D extent, vk::Format format);
+	static bool buildCache(std::span<const uint8_t> source, const str& cache, uint64_t sourceHash,
+		vk::Extent2D extent, vk::Format format);
+	static opt<u_ptr<VTexture>> upload(VDevice& vDev, const Header& header, const uint8_t* pixels);
+};
+}
@@ -1,9 +1,31 @@
 #version 450
+#extension GL_EXT_nonuniform_qualifier : require
 
-layout(location = 0) in vec3 fragColor;
+layout(location = 0) in vec4 fragColor;
+layout(location = 1) in vec2 fragUv;
+layout(location = 2) flat in uint fragTexture;
 
 layout(location = 0) out vec4 outColor;
 
+// VTextureTable, every surface texture of the device indexed by its slot
+layout(set = 0, binding = 0) uniform sampler surfaceSampler;
+layout(set = 0, binding = 1) uniform texture2D textures[];
+
+// VDisplay::Variant, each pipeline is built with its own
+const uint OPAQUE = 0;
+const uint PREMULTIPLIED = 1;
+const uint STRAIGHT = 2;
+const uint SOLID = 3;
+layout(constant_id = 0) const uint MODE = OPAQUE;
+
 void main() {
-	outColor = vec4(fragColor, 1.0);
+	if (MODE == SOLID) {
+		outColor = fragColor;
+		return;
+	}
+	vec4 color = texture(sampler2D(textures[nonuniformEXT(fragTexture)], surfaceSampler), fragUv);
+	// Formats without alpha leave garbage in it
+	if (MODE == OPAQUE)
+		color.a = 1.0;
+	outColor = color;
 }
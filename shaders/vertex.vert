@@ -1,31 +1,48 @@
 #version 450
-/*
-layout(constant_id = 0) const float WINDOW_COUNT_INVERSE = 0;
-layout(location = 0) in vec3 pos;
-layout(location = 1) in vec4 color;
-layout(location = 0) out vec4 fragColor;
 
-void main() {
-	gl_Position = vec4(pos.x, pos.y, pos.z * WINDOW_COUNT_INVERSE, 1.0);
-	fragColor = color;
-}
-*/
-layout(location = 0) out vec3 fragColor;
+// Matches VDisplay::Instance
+// Normalized device coordinates, offset and size
+layout(location = 0) in vec4 rect;
+// Part of the buffer this box shows
+layout(location = 1) in vec4 uv;
+layout(location = 2) in vec4 color;
+// Smaller is closer, every surface has its own
+layout(location = 3) in float depth;
+layout(location = 4) in uint textureIndex;
+// wl_output_transform of the buffer
+layout(location = 5) in uint transform;
 
-vec2 positions[3] = vec2[](
-vec2(0.0, -0.5),
-vec2(0.5, 0.5),
-vec2(-0.5, 0.5)
-);
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec2 fragUv;
+layout(location = 2) flat out uint fragTexture;
 
-vec3 colors[3] = vec3[](
-vec3(1.0, 0.0, 0.0),
-vec3(0.0, 1.0, 0.0),
-vec3(0.0, 0.0, 1.0)
+vec2 corners[6] = vec2[](
+vec2(0.0, 0.0),
+vec2(1.0, 0.0),
+vec2(0.0, 1.0),
+vec2(0.0, 1.0),
+vec2(1.0, 0.0),
+vec2(1.0, 1.0)
 );
 
-void main() {
-	gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-	fragColor = colors[gl_VertexIndex];
+// Where a corner of the box lies in uv, see Scene::toBuffer
+vec2 toBuffer(vec2 corner) {
+	switch (transform) {
+	case 1u: return vec2(corner.y, 1.0 - corner.x);
+	case 2u: return 1.0 - corner;
+	case 3u: return vec2(1.0 - corner.y, corner.x);
+	case 4u: return vec2(1.0 - corner.x, corner.y);
+	case 5u: return corner.yx;
+	case 6u: return vec2(corner.x, 1.0 - corner.y);
+	case 7u: return 1.0 - corner.yx;
+	default: return corner;
+	}
 }
 
+void main() {
+	vec2 corner = corners[gl_VertexIndex];
+	gl_Position = vec4(rect.xy + corner * rect.zw, depth, 1.0);
+	fragColor = color;
+	fragUv = uv.xy + toBuffer(corner) * uv.zw;
+	fragTexture = textureIndex;
+}
@@ -0,0 +1,15 @@
+#version 450
+
+layout(location = 0) in vec4 fragColor;
+layout(location = 1) in vec2 fragUv;
+layout(location = 2) flat in uint fragTexture;
+
+layout(location = 0) out vec4 outColor;
+
+// VDmabufImporter::Conversion, the immutable sampler turns the planes into RGB while sampling.
+// Y'CbCr samplers can't be indexed dynamically, so every import brings its own set
+layout(set = 1, binding = 0) uniform sampler2D frame;
+
+void main() {
+	outColor = vec4(texture(frame, fragUv).rgb, 1.0);
+}